@@ -19,6 +19,11 @@ C3dglBitmap::C3dglBitmap(std::string fname, unsigned format)
 }
 
 bool C3dglBitmap::load(std::string fname, unsigned format)
+{
+	return load(fname, format, IL_UNSIGNED_BYTE);
+}
+
+bool C3dglBitmap::load(std::string fname, unsigned format, unsigned type)
 {
 	// initialise IL
 	static bool bIlInitialised = false;
@@ -39,7 +44,10 @@ bool C3dglBitmap::load(std::string fname, unsigned format)
 	ilOriginFunc(IL_ORIGIN_LOWER_LEFT); 
 	if (ilLoadImage((ILstring)fname.c_str()))
 	{
-		ilConvertImage(format, IL_UNSIGNED_BYTE); 
+		// 0 keeps the format or the type of the image as loaded
+		if (format == 0) format = ilGetInteger(IL_IMAGE_FORMAT);
+		if (type == 0) type = ilGetInteger(IL_IMAGE_TYPE);
+		ilConvertImage(format, type); 
 		logSuccess(string("loaded from: ") + fname);
 		return true;
 	}
@@ -97,3 +105,33 @@ void *C3dglBitmap::getBits()
 	}
 	return ilGetData();
 }
+
+unsigned C3dglBitmap::getFormat()
+{
+	if (c_pBound != this)
+	{
+		ilBindImage(m_idImage);
+		c_pBound = this;
+	}
+	return ilGetInteger(IL_IMAGE_FORMAT);
+}
+
+unsigned C3dglBitmap::getType()
+{
+	if (c_pBound != this)
+	{
+		ilBindImage(m_idImage);
+		c_pBound = this;
+	}
+	return ilGetInteger(IL_IMAGE_TYPE);
+}
+
+int C3dglBitmap::getBytesPerPixel()
+{
+	if (c_pBound != this)
+	{
+		ilBindImage(m_idImage);
+		c_pBound = this;
+	}
+	return ilGetInteger(IL_IMAGE_BYTES_PER_PIXEL);
+}
@@ -0,0 +1,355 @@
+#include <sstream>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+#include "../include/glee.h"
+#include "../include/3dglCPUParticles.h"
+#include "../include/3dglTerrain.h"
+#include "../include/3dglThreadPool.h"
+#include <Windows.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define TERRAIN_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace _3dgl;
+
+// random number in [0, 1) - the attribute i of a new particle, as in particles.vert
+static unsigned hashRandom(unsigned a)
+{
+	a ^= a >> 16; a *= 0x7feb352d;
+	a ^= a >> 15; a *= 0x846ca68b;
+	a ^= a >> 16;
+	return a;
+}
+
+static float random(unsigned h, unsigned i)
+{
+	return (hashRandom(h + i) >> 8) / 16777216.0f;
+}
+
+void C3dglCPUParticles::SOA::resize(unsigned n)
+{
+	px.resize(n); py.resize(n); pz.resize(n);
+	vx.resize(n); vy.resize(n); vz.resize(n);
+	age.resize(n); lifetime.resize(n);
+}
+
+C3dglCPUParticles::C3dglCPUParticles()
+{
+	m_gravity[0] = m_gravity[1] = m_gravity[2] = 0;
+	m_wind[0] = m_wind[1] = m_wind[2] = 0;
+	m_fDrag = 0;
+	m_pTerrain = NULL;
+	m_collision = C3dglParticles::COLLISION_NONE;
+	m_nSeed = 1;
+	m_pThreadPool = NULL;
+	m_iCurrent = 0;
+	m_nCapacity = m_nLive = 0;
+	m_fEmitDebt = 0;
+	m_nEmitted = 0;
+	for (int i = 0; i < 9; i++)
+		m_basis[i] = 0;
+	m_buffer = 0;
+	m_bUploaded = false;
+	m_fUpdateTime = 0;
+	m_nUpdated = 0;
+	m_nThreads = 1;
+}
+
+C3dglCPUParticles::~C3dglCPUParticles()
+{
+	destroy();
+}
+
+C3dglThreadPool *C3dglCPUParticles::getThreadPool()
+{
+	return m_pThreadPool ? m_pThreadPool : C3dglThreadPool::getDefault();
+}
+
+bool C3dglCPUParticles::create(const EMITTER &emitter)
+{
+	destroy();
+	m_emitter = emitter;
+
+	m_nCapacity = (unsigned)ceil(emitter.fRate * max(emitter.fMinLifetime, emitter.fMaxLifetime) * 1.1f) + 64;
+	m_soa[0].resize(m_nCapacity);
+	m_soa[1].resize(m_nCapacity);
+
+	m_iCurrent = 0;
+	m_nLive = 0;
+	m_fEmitDebt = 0;
+	m_nEmitted = 0;
+	m_bUploaded = false;
+
+	std::ostringstream info;
+	info << "created for " << m_nCapacity << " particles (" << 2 * m_nCapacity * sizeof(PARTICLE) / 1024 << " kB of arrays)";
+	return logSuccess(info.str());
+}
+
+void C3dglCPUParticles::destroy()
+{
+	if (m_buffer)
+		glDeleteBuffers(1, &m_buffer);
+	m_buffer = 0;
+	m_bUploaded = false;
+	m_soa[0] = SOA();
+	m_soa[1] = SOA();
+	m_nCapacity = m_nLive = 0;
+}
+
+// a new particle - the n-th emitted: born at a random moment within the time step (see particles.vert)
+void C3dglCPUParticles::emit(unsigned i, float &fTime)
+{
+	SOA &s = m_soa[m_iCurrent];
+	unsigned h = hashRandom(m_nEmitted + (i - m_nLive) + m_nSeed);
+
+	s.px[i] = m_emitter.pos[0] + m_emitter.size[0] * random(h, 0);
+	s.py[i] = m_emitter.pos[1] + m_emitter.size[1] * random(h, 1);
+	s.pz[i] = m_emitter.pos[2] + m_emitter.size[2] * random(h, 2);
+
+	// the direction within the cone: theta from the axis, phi around it
+	float theta = m_emitter.fSpread * random(h, 3);
+	float phi = 6.2831853f * random(h, 4);
+	float a = cos(theta), b = sin(theta) * cos(phi), c = sin(theta) * sin(phi);
+	float fSpeed = m_emitter.fMinSpeed + (m_emitter.fMaxSpeed - m_emitter.fMinSpeed) * random(h, 5);
+	s.vx[i] = (a * m_basis[0] + b * m_basis[3] + c * m_basis[6]) * fSpeed;
+	s.vy[i] = (a * m_basis[1] + b * m_basis[4] + c * m_basis[7]) * fSpeed;
+	s.vz[i] = (a * m_basis[2] + b * m_basis[5] + c * m_basis[8]) * fSpeed;
+
+	s.age[i] = 0;
+	s.lifetime[i] = m_emitter.fMinLifetime + (m_emitter.fMaxLifetime - m_emitter.fMinLifetime) * random(h, 6);
+	fTime *= random(h, 7);
+}
+
+void C3dglCPUParticles::integrate(unsigned i, float fTime)
+{
+	SOA &s = m_soa[m_iCurrent];
+	s.vx[i] += (m_gravity[0] + (m_wind[0] - s.vx[i]) * m_fDrag) * fTime;
+	s.vy[i] += (m_gravity[1] + (m_wind[1] - s.vy[i]) * m_fDrag) * fTime;
+	s.vz[i] += (m_gravity[2] + (m_wind[2] - s.vz[i]) * m_fDrag) * fTime;
+	s.px[i] += s.vx[i] * fTime;
+	s.py[i] += s.vy[i] * fTime;
+	s.pz[i] += s.vz[i] * fTime;
+	s.age[i] += fTime;
+}
+
+// the particles [i0, i1): those below m_nLive are moved, the others are emitted first;
+// then the collisions, and the live particles are packed at i0
+unsigned C3dglCPUParticles::simulateRange(unsigned i0, unsigned i1, float fTime)
+{
+	SOA &s = m_soa[m_iCurrent];
+	unsigned iNew = min(i1, max(i0, m_nLive));
+	unsigned i = i0;
+
+#ifdef TERRAIN_SSE2
+	__m128 dt = _mm_set1_ps(fTime), drag = _mm_set1_ps(m_fDrag);
+	__m128 gravity[3], wind[3];
+	float *pos[3] = { &s.px[0], &s.py[0], &s.pz[0] };
+	float *vel[3] = { &s.vx[0], &s.vy[0], &s.vz[0] };
+	for (int k = 0; k < 3; k++)
+	{
+		gravity[k] = _mm_set1_ps(m_gravity[k]);
+		wind[k] = _mm_set1_ps(m_wind[k]);
+	}
+	for ( ; i + 4 <= iNew; i += 4)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			__m128 v = _mm_loadu_ps(vel[k] + i);
+			v = _mm_add_ps(v, _mm_mul_ps(_mm_add_ps(gravity[k], _mm_mul_ps(_mm_sub_ps(wind[k], v), drag)), dt));
+			_mm_storeu_ps(vel[k] + i, v);
+			_mm_storeu_ps(pos[k] + i, _mm_add_ps(_mm_loadu_ps(pos[k] + i), _mm_mul_ps(v, dt)));
+		}
+		_mm_storeu_ps(&s.age[i], _mm_add_ps(_mm_loadu_ps(&s.age[i]), dt));
+	}
+#endif
+	for ( ; i < iNew; i++)
+		integrate(i, fTime);
+	for ( ; i < i1; i++)
+	{
+		float dt = fTime;
+		emit(i, dt);
+		integrate(i, dt);
+	}
+
+	// collisions and packing, in blocks: the terrain heights of a block are read at once
+	C3dglParticles::COLLISION collision = m_pTerrain ? m_collision : C3dglParticles::COLLISION_NONE;
+	float heights[256];
+	unsigned j = i0;
+	for (unsigned iBlock = i0; iBlock < i1; iBlock += 256)
+	{
+		unsigned iEnd = min(i1, iBlock + 256);
+		if (collision != C3dglParticles::COLLISION_NONE)
+			m_pTerrain->getInterpolatedHeights(&s.px[iBlock], &s.pz[iBlock], heights, iEnd - iBlock);
+		for (i = iBlock; i < iEnd; i++)
+		{
+			if (collision != C3dglParticles::COLLISION_NONE && s.py[i] < heights[i - iBlock])
+			{
+				float h = heights[i - iBlock];
+				if (collision == C3dglParticles::COLLISION_KILL)
+					s.age[i] = s.lifetime[i];
+				else if (collision == C3dglParticles::COLLISION_STICK)
+				{
+					s.py[i] = h;
+					s.vx[i] = s.vy[i] = s.vz[i] = 0;
+				}
+				else
+				{
+					s.py[i] = h;
+					s.vy[i] = max(s.vy[i], 0.0f);
+				}
+			}
+			if (s.age[i] >= s.lifetime[i])
+				continue;
+			if (j != i)
+			{
+				s.px[j] = s.px[i]; s.py[j] = s.py[i]; s.pz[j] = s.pz[i];
+				s.vx[j] = s.vx[i]; s.vy[j] = s.vy[i]; s.vz[j] = s.vz[i];
+				s.age[j] = s.age[i]; s.lifetime[j] = s.lifetime[i];
+			}
+			j++;
+		}
+	}
+	return j - i0;
+}
+
+void C3dglCPUParticles::update(float fTime)
+{
+	if (m_nCapacity == 0)
+		return;
+
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
+
+	// the particles due to be born, limited by the free space (as in C3dglParticles::update)
+	m_fEmitDebt += max(m_emitter.fRate, 0.0f) * fTime;
+	unsigned nEmit = (unsigned)m_fEmitDebt;
+	m_fEmitDebt -= nEmit;
+	nEmit = min(nEmit, m_nCapacity - m_nLive);
+	unsigned n = m_nLive + nEmit;
+
+	// the emission cone
+	float *w = m_basis, *u = m_basis + 3, *v = m_basis + 6;
+	float fLen = sqrt(m_emitter.dir[0] * m_emitter.dir[0] + m_emitter.dir[1] * m_emitter.dir[1] + m_emitter.dir[2] * m_emitter.dir[2]);
+	for (int k = 0; k < 3; k++)
+		w[k] = fLen > 0 ? m_emitter.dir[k] / fLen : (k == 1 ? 1.0f : 0.0f);
+	float a[3] = { 0, 0, 0 };
+	a[fabs(w[1]) < 0.99f ? 1 : 0] = 1;
+	u[0] = a[1] * w[2] - a[2] * w[1]; u[1] = a[2] * w[0] - a[0] * w[2]; u[2] = a[0] * w[1] - a[1] * w[0];
+	fLen = sqrt(u[0] * u[0] + u[1] * u[1] + u[2] * u[2]);
+	u[0] /= fLen; u[1] /= fLen; u[2] /= fLen;
+	v[0] = w[1] * u[2] - w[2] * u[1]; v[1] = w[2] * u[0] - w[0] * u[2]; v[2] = w[0] * u[1] - w[1] * u[0];
+
+	// move, emit and collide, each range of CPU_PARTICLES_GRAIN packed in place
+	// (the thread pool may hand out several ranges at once - when there is a single thread)
+	C3dglThreadPool *pPool = getThreadPool();
+	unsigned nRanges = (n + CPU_PARTICLES_GRAIN - 1) / CPU_PARTICLES_GRAIN;
+	m_rangeLive.resize(nRanges);
+	m_rangeOffset.resize(nRanges);
+	pPool->parallelForStealing(n, [this, fTime](int i0, int i1, int)
+	{
+		for (unsigned i = i0; i < (unsigned)i1; i += CPU_PARTICLES_GRAIN)
+			m_rangeLive[i / CPU_PARTICLES_GRAIN] = simulateRange(i, min((unsigned)i1, i + CPU_PARTICLES_GRAIN), fTime);
+	}, CPU_PARTICLES_GRAIN);
+
+	unsigned nLive = 0;
+	for (unsigned r = 0; r < nRanges; r++)
+	{
+		m_rangeOffset[r] = nLive;
+		nLive += m_rangeLive[r];
+	}
+
+	// join the ranges into the other arrays - unless no particle died
+	if (nLive < n)
+	{
+		SOA &src = m_soa[m_iCurrent], &dst = m_soa[1 - m_iCurrent];
+		pPool->parallelForStealing(n, [&](int i0, int i1, int)
+		{
+			for (unsigned i = i0; i < (unsigned)i1; i += CPU_PARTICLES_GRAIN)
+			{
+				unsigned r = i / CPU_PARTICLES_GRAIN, j = m_rangeOffset[r], nCount = m_rangeLive[r];
+				std::copy(&src.px[i], &src.px[i] + nCount, &dst.px[j]);
+				std::copy(&src.py[i], &src.py[i] + nCount, &dst.py[j]);
+				std::copy(&src.pz[i], &src.pz[i] + nCount, &dst.pz[j]);
+				std::copy(&src.vx[i], &src.vx[i] + nCount, &dst.vx[j]);
+				std::copy(&src.vy[i], &src.vy[i] + nCount, &dst.vy[j]);
+				std::copy(&src.vz[i], &src.vz[i] + nCount, &dst.vz[j]);
+				std::copy(&src.age[i], &src.age[i] + nCount, &dst.age[j]);
+				std::copy(&src.lifetime[i], &src.lifetime[i] + nCount, &dst.lifetime[j]);
+			}
+		}, CPU_PARTICLES_GRAIN);
+		m_iCurrent = 1 - m_iCurrent;
+	}
+
+	m_nEmitted += nEmit;
+	m_nLive = nLive;
+	m_bUploaded = false;
+
+	QueryPerformanceCounter(&t1);
+	m_fUpdateTime = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)freq.QuadPart;
+	m_nUpdated = n;
+	m_nThreads = pPool->getThreadCount();
+}
+
+// the live particles into the vertex buffer, interleaved as C3dglParticles::PARTICLE
+void C3dglCPUParticles::upload()
+{
+	if (m_buffer == 0)
+		glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+
+	// orphan the storage (the GPU may still be drawing the last frame from it) and fill a fresh one
+	glBufferData(GL_ARRAY_BUFFER, m_nCapacity * sizeof(PARTICLE), NULL, GL_STREAM_DRAW);
+	PARTICLE *p = (PARTICLE*)glMapBufferRange(GL_ARRAY_BUFFER, 0, m_nLive * sizeof(PARTICLE), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (p == NULL)
+		return;
+	const SOA &s = m_soa[m_iCurrent];
+	getThreadPool()->parallelFor(m_nLive, [&](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+		{
+			p[i].pos[0] = s.px[i]; p[i].pos[1] = s.py[i]; p[i].pos[2] = s.pz[i];
+			p[i].vel[0] = s.vx[i]; p[i].vel[1] = s.vy[i]; p[i].vel[2] = s.vz[i];
+			p[i].fAge = s.age[i]; p[i].fLifetime = s.lifetime[i];
+		}
+	}, CPU_PARTICLES_GRAIN * 4);
+	m_bUploaded = glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE;	// false if the storage was lost meanwhile - try again next time
+}
+
+void C3dglCPUParticles::render(unsigned indexBuffer)
+{
+	if (m_nLive == 0)
+		return;
+	if (m_bUploaded)
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+	else
+		upload();
+	if (!m_bUploaded)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
+	// the vertex attributes 0 - 3, as in C3dglParticles::render
+	for (GLuint i = 0; i < 4; i++)
+		glEnableVertexAttribArray(i);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, pos));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, vel));
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, fAge));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, fLifetime));
+	if (indexBuffer)
+	{
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+		glDrawElements(GL_POINTS, m_nLive, GL_UNSIGNED_INT, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	else
+		glDrawArrays(GL_POINTS, 0, m_nLive);
+	for (GLuint i = 0; i < 4; i++)
+		glDisableVertexAttribArray(i);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -136,4 +136,43 @@ bool gluInvertMatrix(const float m[16], float invOut[16])
         invOut[i] = inv[i] * det;
 
     return true;
-}
\ No newline at end of file
+}
+
+// multiplies two column-major 4x4 matrices: out = a * b
+void multMatrix(const float a[16], const float b[16], float out[16])
+{
+	for (int c = 0; c < 4; c++)
+		for (int r = 0; r < 4; r++)
+			out[c * 4 + r] = a[r] * b[c * 4] + a[4 + r] * b[c * 4 + 1] + a[8 + r] * b[c * 4 + 2] + a[12 + r] * b[c * 4 + 3];
+}
+
+// extracts six frustum planes (left, right, bottom, top, near, far) from the combined projection * modelview matrix
+// planes are in the model coordinates, with normals pointing inside the frustum
+void extractFrustum(const float m[16], float planes[6][4])
+{
+	for (int i = 0; i < 4; i++)
+	{
+		planes[0][i] = m[i * 4 + 3] + m[i * 4 + 0];
+		planes[1][i] = m[i * 4 + 3] - m[i * 4 + 0];
+		planes[2][i] = m[i * 4 + 3] + m[i * 4 + 1];
+		planes[3][i] = m[i * 4 + 3] - m[i * 4 + 1];
+		planes[4][i] = m[i * 4 + 3] + m[i * 4 + 2];
+		planes[5][i] = m[i * 4 + 3] - m[i * 4 + 2];
+	}
+}
+
+// returns false if the axis aligned box lies entirely outside of any of the frustum planes
+bool isBoxInFrustum(const float planes[6][4], float minX, float minY, float minZ, float maxX, float maxY, float maxZ)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		const float *p = planes[i];
+		// test the box corner furthest along the plane normal
+		float x = p[0] > 0 ? maxX : minX;
+		float y = p[1] > 0 ? maxY : minY;
+		float z = p[2] > 0 ? maxZ : minZ;
+		if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0)
+			return false;
+	}
+	return true;
+}
@@ -318,6 +318,31 @@ void C3dglModel::MESH::render()
 	glBindVertexArray(0);
 }
 
+void C3dglModel::MESH::renderInstanced(unsigned attribInstance, unsigned idInstanceBuffer, unsigned nInstances)
+{
+	glBindVertexArray(m_idVAO);
+
+	// a mat4 attribute takes four consecutive locations, one column each, advancing once per instance
+	glBindBuffer(GL_ARRAY_BUFFER, idInstanceBuffer);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		glEnableVertexAttribArray(attribInstance + i);
+		glVertexAttribPointer(attribInstance + i, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (const GLvoid*)(i * 4 * sizeof(float)));
+		glVertexAttribDivisor(attribInstance + i, 1);
+	}
+
+	glDrawElementsInstancedARB(GL_TRIANGLES, m_indexSize, GL_UNSIGNED_INT, 0, nInstances);
+
+	// the VAO is left as it was, for the non-instanced rendering
+	for (unsigned i = 0; i < 4; i++)
+	{
+		glVertexAttribDivisor(attribInstance + i, 0);
+		glDisableVertexAttribArray(attribInstance + i);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
 C3dglModel::MATERIAL *C3dglModel::MESH::createNewMaterial()
 {
 	C3dglModel::MATERIAL mat(m_pOwner);
@@ -547,6 +572,53 @@ void C3dglModel::render(unsigned iNode)
 	glPopMatrix();
 }
 
+unsigned C3dglModel::renderInstanced(unsigned idInstanceBuffer, unsigned nInstances)
+{
+	// instancing requires a shading program with the aInstance attribute
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	if (!m_pScene || !m_pScene->mRootNode || !pProgram || nInstances == 0)
+		return 0;
+	GLuint attribInstance = pProgram->GetAttribLocation("aInstance");
+	if (attribInstance == (GLuint)-1)
+		return 0;
+
+	// the model-view matrix is the view; the instance and the node transforms are applied by the vertex shader
+	float modelviewMatrix[16];
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelviewMatrix);
+	pProgram->SendStdUniform(C3dglProgram::UNI_MODELVIEW, modelviewMatrix);
+	pProgram->SendUniform("instancing", 1);
+
+	unsigned nDrawCalls = renderNodeInstanced(m_pScene->mRootNode, aiMatrix4x4(), attribInstance, idInstanceBuffer, nInstances);
+
+	pProgram->SendUniform("instancing", 0);
+	return nDrawCalls;
+}
+
+unsigned C3dglModel::renderNodeInstanced(aiNode *pNode, const aiMatrix4x4 &parent, unsigned attribInstance, unsigned idInstanceBuffer, unsigned nInstances)
+{
+	// update transform
+	aiMatrix4x4 m = parent * pNode->mTransformation;
+	aiMatrix4x4 t = m;
+	aiTransposeMatrix4(&t);
+	C3dglProgram::GetCurrentProgram()->SendUniform("matrixNode", (float*)&t);
+
+	unsigned nDrawCalls = 0;
+	for (unsigned iMesh : vector<unsigned>(pNode->mMeshes, pNode->mMeshes + pNode->mNumMeshes))
+	{
+		MESH *pMesh = &m_meshes[iMesh];
+		MATERIAL *pMaterial = pMesh->getMaterial();
+		if (pMaterial) pMaterial->bind();
+		pMesh->renderInstanced(attribInstance, idInstanceBuffer, nInstances);
+		nDrawCalls++;
+	}
+
+	// draw all children
+	for (aiNode *p : vector<aiNode*>(pNode->mChildren, pNode->mChildren + pNode->mNumChildren))
+		nDrawCalls += renderNodeInstanced(p, m, attribInstance, idInstanceBuffer, nInstances);
+
+	return nDrawCalls;
+}
+
 void C3dglModel::getNodeTransform(aiNode *pNode, float pMatrix[16], bool bRecursive)
 {
 	aiMatrix4x4 m1, m2;
@@ -0,0 +1,552 @@
+#include <sstream>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstdlib>
+
+#include "../include/3dglNavGrid.h"
+#include "../include/3dglThreadPool.h"
+#include <Windows.h>
+
+using std::vector;
+using namespace _3dgl;
+
+// the grid search costs are integers, in fifths of the grid spacing: 5 for the orthogonal steps, 7 for the diagonal ones
+#define NAV_STRAIGHT	5
+#define NAV_DIAGONAL	7
+#define NAV_BUCKETS		16		// more than the largest increase of f in a single step (NAV_DIAGONAL * 2)
+
+// the 8 neighbours: the first four are orthogonal
+static const int neighbourX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+static const int neighbourZ[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+static const int neighbourOpposite[8] = { 1, 0, 3, 2, 7, 6, 5, 4 };
+static const int neighbourIndex[3][3] = { { 7, 1, 6 }, { 3, -1, 2 }, { 5, 0, 4 } };	// [dx + 1][dz + 1]
+
+// the shortest distance on an empty 8-connected grid, in the grid search costs
+static int octile(int dx, int dz)
+{
+	dx = abs(dx);
+	dz = abs(dz);
+	return dx > dz ? NAV_STRAIGHT * dx + (NAV_DIAGONAL - NAV_STRAIGHT) * dz : NAV_STRAIGHT * dz + (NAV_DIAGONAL - NAV_STRAIGHT) * dx;
+}
+
+typedef std::pair<float, int> HEAP_ITEM;	// (f, index), in a min-heap
+
+// Working memory of a query.
+// The grid search works within the block of a single cluster (see C3dglNavGrid::m_cells); the arrays are indexed like
+// the block, and valid only where stamped with the current search number, so that they are never cleared.
+// The open grid points are kept in buckets by f (the costs are integers), the last one in first out.
+struct C3dglNavGrid::SEARCH
+{
+	// grid search
+	int x0, z0, nStride;
+	const unsigned char *cells;		// the block of the cluster
+	vector<int> g;
+	vector<int> parent;
+	vector<unsigned> open, closed, target;
+	unsigned nStamp;
+	vector<int> buckets[NAV_BUCKETS];
+	vector<std::pair<int, int> > targets;	// Dijkstra only: the grid points to reach - the search stops when all of them are reached
+	vector<unsigned char> moves;
+
+	// abstract search: the nodes, then the start and the goal
+	vector<float> ag;
+	vector<int> aparent, aedge;		// the previous node and the edge from it (-1 for the start and the goal links)
+	vector<unsigned> aopen, aclosed;
+	unsigned nAStamp;
+	vector<std::pair<int, float> > startLinks, goalLinks;	// the nodes reachable from the start (or the goal) within its cluster, and their costs
+	vector<int> apath;				// the nodes of the path found, the goal included
+	vector<HEAP_ITEM> heap;
+
+	SEARCH(int nClusterSize, int nNodes) : nStride(nClusterSize + 2), cells(NULL), g(nStride * nStride), parent(g.size()), open(g.size(), 0), closed(g.size(), 0), target(g.size(), 0), nStamp(0),
+		ag(nNodes + 2), aparent(nNodes + 2), aedge(nNodes + 2), aopen(nNodes + 2, 0), aclosed(nNodes + 2, 0), nAStamp(0)	{ }
+
+	int index(int x, int z)			{ return (x - x0 + 1) * nStride + z - z0 + 1; }
+	float getCost(int x, int z)		{ int i = index(x, z); return closed[i] == nStamp ? (float)g[i] / NAV_STRAIGHT : -1; }	// the cost found by the last grid search, -1 if not reached
+
+	void push(float f, int i)		{ heap.push_back(HEAP_ITEM(f, i)); std::push_heap(heap.begin(), heap.end(), std::greater<HEAP_ITEM>()); }
+	int pop()						{ std::pop_heap(heap.begin(), heap.end(), std::greater<HEAP_ITEM>()); int i = heap.back().second; heap.pop_back(); return i; }
+};
+
+C3dglNavGrid::C3dglNavGrid()
+{
+	m_pTerrain = NULL;
+	m_nSizeX = m_nSizeZ = 0;
+	m_nClusterSize = 0;
+	m_nClustersX = m_nClustersZ = 0;
+}
+
+C3dglNavGrid::~C3dglNavGrid()
+{
+	destroy();
+}
+
+void C3dglNavGrid::destroy()
+{
+	m_pTerrain = NULL;
+	m_nSizeX = m_nSizeZ = 0;
+	m_cells.clear();
+	m_clusterNodes.clear();
+	m_nodes.clear();
+	m_edgeStart.clear();
+	m_edges.clear();
+	m_moves.clear();
+}
+
+bool C3dglNavGrid::build(C3dglTerrain *pTerrain, float fMaxSlope, float fWaterLevel, int nClusterSize)
+{
+	destroy();
+	if (!pTerrain || pTerrain->getSizeX() < 2 || pTerrain->getSizeZ() < 2)
+		return logError("cannot build the navigation grid before the terrain is loaded");
+
+	m_pTerrain = pTerrain;
+	m_nSizeX = pTerrain->getSizeX();
+	m_nSizeZ = pTerrain->getSizeZ();
+	m_nClusterSize = max(nClusterSize, 2);
+	m_nClustersX = (m_nSizeX + m_nClusterSize - 1) / m_nClusterSize;
+	m_nClustersZ = (m_nSizeZ + m_nClusterSize - 1) / m_nClusterSize;
+	C3dglThreadPool *pPool = pTerrain->getThreadPool();
+
+	// walkability: above the water, and the slope (central differences, one sided at the edges) not too steep
+	int nStride = m_nClusterSize + 2;
+	m_cells.assign((size_t)m_nClustersX * m_nClustersZ * nStride * nStride, 0);
+	pPool->parallelFor(m_nSizeX, [this, pTerrain, fMaxSlope, fWaterLevel](int x0, int x1)
+	{
+		int hx = m_nSizeX/2, hz = m_nSizeZ/2;
+		for (int x = x0; x < x1; x++)
+		{
+			int xa = max(x - 1, 0), xb = min(x + 1, m_nSizeX - 1);
+			for (int z = 0; z < m_nSizeZ; z++)
+			{
+				unsigned char &cell = m_cells[getCell(getCluster(x, z), x, z)];
+				cell = CELL_INSIDE;
+				if (pTerrain->getHeight(x - hx, z - hz) < fWaterLevel)
+					continue;
+				int za = max(z - 1, 0), zb = min(z + 1, m_nSizeZ - 1);
+				float dx = (pTerrain->getHeight(xb - hx, z - hz) - pTerrain->getHeight(xa - hx, z - hz)) / (xb - xa);
+				float dz = (pTerrain->getHeight(x - hx, zb - hz) - pTerrain->getHeight(x - hx, za - hz)) / (zb - za);
+				if (dx * dx + dz * dz <= fMaxSlope * fMaxSlope)
+					cell |= CELL_WALKABLE;
+			}
+		}
+	}, 16);
+
+	// the borders of the blocks: copies of the neighbouring clusters
+	pPool->parallelFor(m_nClustersX * m_nClustersZ, [this](int c0, int c1)
+	{
+		for (int c = c0; c < c1; c++)
+		{
+			int x0 = c / m_nClustersZ * m_nClusterSize, z0 = c % m_nClustersZ * m_nClusterSize;
+			for (int x = x0 - 1; x <= x0 + m_nClusterSize; x++)
+				for (int z = z0 - 1; z <= z0 + m_nClusterSize; z++)
+					if (x < x0 || x == x0 + m_nClusterSize || z < z0 || z == z0 + m_nClusterSize)
+						m_cells[getCell(c, x, z)] = walkable(x, z) ? CELL_WALKABLE : 0;
+		}
+	}, 16);
+
+	// the abstract nodes and the edges across the cluster borders
+	m_clusterNodes.resize(m_nClustersX * m_nClustersZ);
+	vector<std::pair<int, EDGE> > edges;		// (from, edge)
+	std::map<int, int> nodeIndex;				// x * m_nSizeZ + z => node
+	for (int cx = 0; cx < m_nClustersX; cx++)
+		for (int cz = 0; cz < m_nClustersZ; cz++)
+		{
+			if (cx + 1 < m_nClustersX) addEntrances(cx, cz, true, edges, nodeIndex);
+			if (cz + 1 < m_nClustersZ) addEntrances(cx, cz, false, edges, nodeIndex);
+		}
+
+	// the edges within the clusters: the paths between their nodes, found in parallel - one search from each node
+	// finds the paths to the next nodes of the cluster, the opposite edges share them
+	vector<vector<std::pair<int, EDGE> > > intra(m_clusterNodes.size());
+	vector<vector<unsigned char> > moves(m_clusterNodes.size());
+	pPool->parallelFor(m_clusterNodes.size(), [this, &intra, &moves](int c0, int c1)
+	{
+		SEARCH s(m_nClusterSize, 0);
+		for (int c = c0; c < c1; c++)
+		{
+			vector<int> &nodes = m_clusterNodes[c];
+			for (unsigned a = 0; a + 1 < nodes.size(); a++)
+			{
+				int i = nodes[a];
+				s.targets.clear();
+				for (unsigned b = a + 1; b < nodes.size(); b++)
+					s.targets.push_back(std::make_pair(m_nodes[nodes[b]].x, m_nodes[nodes[b]].z));
+				gridSearch(s, c, m_nodes[i].x, m_nodes[i].z, -1, -1);
+				for (unsigned b = a + 1; b < nodes.size(); b++)
+				{
+					int j = nodes[b];
+					float fCost = s.getCost(m_nodes[j].x, m_nodes[j].z);
+					if (fCost < 0)
+						continue;
+					int iPath = moves[c].size();
+					gridMoves(s, m_nodes[j].x, m_nodes[j].z, moves[c]);
+					int nSteps = moves[c].size() - iPath;
+					EDGE ij = { j, fCost, iPath, nSteps, false }, ji = { i, fCost, iPath, nSteps, true };
+					intra[c].push_back(std::make_pair(i, ij));
+					intra[c].push_back(std::make_pair(j, ji));
+				}
+			}
+			s.targets.clear();
+		}
+	}, 1);
+	for (unsigned c = 0; c < intra.size(); c++)
+	{
+		for (auto &e : intra[c])
+			e.second.iPath += m_moves.size();
+		edges.insert(edges.end(), intra[c].begin(), intra[c].end());
+		m_moves.insert(m_moves.end(), moves[c].begin(), moves[c].end());
+	}
+
+	// compressed adjacency lists
+	m_edgeStart.assign(m_nodes.size() + 1, 0);
+	for (auto &e : edges)
+		m_edgeStart[e.first + 1]++;
+	for (unsigned i = 0; i < m_nodes.size(); i++)
+		m_edgeStart[i + 1] += m_edgeStart[i];
+	m_edges.resize(edges.size());
+	vector<int> next(m_edgeStart.begin(), m_edgeStart.end() - 1);
+	for (auto &e : edges)
+		m_edges[next[e.first]++] = e.second;
+
+	// connected components - the queries between different components fail without a search
+	int nComponents = 0;
+	vector<int> stack;
+	for (unsigned i = 0; i < m_nodes.size(); i++)
+	{
+		if (m_nodes[i].iComponent >= 0)
+			continue;
+		m_nodes[i].iComponent = nComponents;
+		stack.push_back(i);
+		while (!stack.empty())
+		{
+			int j = stack.back();
+			stack.pop_back();
+			for (int k = m_edgeStart[j]; k < m_edgeStart[j + 1]; k++)
+				if (m_nodes[m_edges[k].iNode].iComponent < 0)
+				{
+					m_nodes[m_edges[k].iNode].iComponent = nComponents;
+					stack.push_back(m_edges[k].iNode);
+				}
+		}
+		nComponents++;
+	}
+
+	size_t nWalkable = std::count(m_cells.begin(), m_cells.end(), CELL_WALKABLE | CELL_INSIDE);
+	std::ostringstream info;
+	info << "navigation grid: " << m_nSizeX << " x " << m_nSizeZ << ", " << nWalkable * 100 / ((size_t)m_nSizeX * m_nSizeZ) << "% walkable, "
+		<< m_nClustersX << " x " << m_nClustersZ << " clusters, " << m_nodes.size() << " nodes, " << m_edges.size() << " edges, " << nComponents << " components";
+	return logSuccess(info.str());
+}
+
+int C3dglNavGrid::addNode(int x, int z, std::map<int, int> &nodeIndex)
+{
+	auto it = nodeIndex.find(x * m_nSizeZ + z);
+	if (it != nodeIndex.end())
+		return it->second;
+	NODE node = { x, z, getCluster(x, z), -1 };
+	m_nodes.push_back(node);
+	m_clusterNodes[node.iCluster].push_back(m_nodes.size() - 1);
+	nodeIndex[x * m_nSizeZ + z] = m_nodes.size() - 1;
+	return m_nodes.size() - 1;
+}
+
+// the border between the cluster (cx, cz) and the next one along x (or z): each run of the grid points
+// walkable on both sides gets a crossing in its middle, or two for long runs, a quarter from either end
+void C3dglNavGrid::addEntrances(int cx, int cz, bool bAlongX, vector<std::pair<int, EDGE> > &edges, std::map<int, int> &nodeIndex)
+{
+	int C = m_nClusterSize;
+	int t0 = (bAlongX ? cz : cx) * C, t1 = min(t0 + C, bAlongX ? m_nSizeZ : m_nSizeX);
+	int border = ((bAlongX ? cx : cz) + 1) * C - 1;		// the last row (or column) of the cluster
+	int dx = bAlongX ? 1 : 0, dz = 1 - dx;
+
+	for (int t = t0; t < t1; )
+	{
+		// the next run
+		int x = bAlongX ? border : t, z = bAlongX ? t : border;
+		if (!walkable(x, z) || !walkable(x + dx, z + dz))
+		{
+			t++;
+			continue;
+		}
+		int r0 = t;
+		while (t < t1 && walkable(bAlongX ? border : t, bAlongX ? t : border) && walkable((bAlongX ? border : t) + dx, (bAlongX ? t : border) + dz))
+			t++;
+		int r1 = t - 1;
+
+		int crossings[2] = { (r0 + r1) / 2, 0 }, nCrossings = 1;
+		if (r1 - r0 >= 16)
+		{
+			crossings[0] = r0 + (r1 - r0) / 4;
+			crossings[1] = r1 - (r1 - r0) / 4;
+			nCrossings = 2;
+		}
+		for (int i = 0; i < nCrossings; i++)
+		{
+			int xa = bAlongX ? border : crossings[i], za = bAlongX ? crossings[i] : border;
+			int ia = addNode(xa, za, nodeIndex), ib = addNode(xa + dx, za + dz, nodeIndex);
+			EDGE ab = { ib, 1, -1, 1, false }, ba = { ia, 1, -1, 1, false };
+			edges.push_back(std::make_pair(ia, ab));
+			edges.push_back(std::make_pair(ib, ba));
+		}
+	}
+}
+
+// A* from (sx, sz) to (gx, gz) within the cluster, 8-connected, no corner cutting; returns the cost, -1 if not found.
+// With gx < 0, searches the whole cluster (Dijkstra), or until all of SEARCH::targets are reached - the costs are then read with SEARCH::getCost.
+float C3dglNavGrid::gridSearch(SEARCH &s, int iCluster, int sx, int sz, int gx, int gz)
+{
+	s.x0 = iCluster / m_nClustersZ * m_nClusterSize;
+	s.z0 = iCluster % m_nClustersZ * m_nClusterSize;
+	s.cells = &m_cells[(size_t)iCluster * s.nStride * s.nStride];
+	s.nStamp++;
+
+	int offsets[8];
+	for (int k = 0; k < 8; k++)
+		offsets[k] = neighbourX[k] * s.nStride + neighbourZ[k];
+	const int nInside = CELL_WALKABLE | CELL_INSIDE;
+	bool bGoal = gx >= 0;
+	int iGoal = bGoal ? s.index(gx, gz) : -1;
+	int nTargets = bGoal ? 0 : s.targets.size();
+	for (auto &t : s.targets)
+		s.target[s.index(t.first, t.second)] = s.nStamp;
+
+	int i = s.index(sx, sz);
+	s.g[i] = 0;
+	s.parent[i] = -1;
+	s.open[i] = s.nStamp;
+	int f = bGoal ? octile(gx - sx, gz - sz) : 0;
+	s.buckets[f % NAV_BUCKETS].push_back(i);
+	int nQueued = 1;
+	while (nQueued)
+	{
+		vector<int> &bucket = s.buckets[f % NAV_BUCKETS];
+		if (bucket.empty())
+		{
+			f++;
+			continue;
+		}
+		i = bucket.back();
+		bucket.pop_back();
+		nQueued--;
+		if (s.closed[i] == s.nStamp)
+			continue;
+		s.closed[i] = s.nStamp;
+		if (i == iGoal || (nTargets && s.target[i] == s.nStamp && --nTargets == 0))
+		{
+			for (vector<int> &b : s.buckets)
+				b.clear();
+			return bGoal ? (float)s.g[i] / NAV_STRAIGHT : 0.0f;
+		}
+
+		int x = s.x0 + i / s.nStride - 1, z = s.z0 + i % s.nStride - 1;
+		for (int k = 0; k < 8; k++)
+		{
+			int j = i + offsets[k];
+			if ((s.cells[j] & nInside) != nInside || s.closed[j] == s.nStamp)
+				continue;
+			if (k >= 4 && !(s.cells[i + offsets[k] - neighbourZ[k]] & s.cells[i + neighbourZ[k]] & CELL_WALKABLE))
+				continue;
+			int g = s.g[i] + (k < 4 ? NAV_STRAIGHT : NAV_DIAGONAL);
+			if (s.open[j] != s.nStamp || g < s.g[j])
+			{
+				s.open[j] = s.nStamp;
+				s.g[j] = g;
+				s.parent[j] = i;
+				s.buckets[(g + (bGoal ? octile(gx - x - neighbourX[k], gz - z - neighbourZ[k]) : 0)) % NAV_BUCKETS].push_back(j);
+				nQueued++;
+			}
+		}
+	}
+	return bGoal ? -1.0f : 0.0f;
+}
+
+// appends the moves of the path found by the last grid search
+void C3dglNavGrid::gridMoves(SEARCH &s, int gx, int gz, vector<unsigned char> &moves)
+{
+	size_t nFirst = moves.size();
+	for (int i = s.index(gx, gz); s.parent[i] >= 0; i = s.parent[i])
+	{
+		int j = s.parent[i];
+		moves.push_back((unsigned char)neighbourIndex[i / s.nStride - j / s.nStride + 1][i % s.nStride - j % s.nStride + 1]);
+	}
+	std::reverse(moves.begin() + nFirst, moves.end());
+}
+
+// appends the grid points of a path starting at (x, z), without (x, z), as x * m_nSizeZ + z
+void C3dglNavGrid::appendPath(int x, int z, const unsigned char *pMoves, int nSteps, bool bReversed, vector<int> &points)
+{
+	for (int n = 0; n < nSteps; n++)
+	{
+		int k = bReversed ? neighbourOpposite[pMoves[nSteps - 1 - n]] : pMoves[n];
+		x += neighbourX[k];
+		z += neighbourZ[k];
+		points.push_back(x * m_nSizeZ + z);
+	}
+}
+
+bool C3dglNavGrid::findPath(SEARCH &s, const QUERY &query, vector<float> &path)
+{
+	path.clear();
+	int sx = (int)floor(query.x0 + 0.5f) + m_nSizeX/2, sz = (int)floor(query.z0 + 0.5f) + m_nSizeZ/2;
+	int gx = (int)floor(query.x1 + 0.5f) + m_nSizeX/2, gz = (int)floor(query.z1 + 0.5f) + m_nSizeZ/2;
+	if (!walkable(sx, sz) || !walkable(gx, gz))
+		return false;
+
+	vector<int> points(1, sx * m_nSizeZ + sz);
+	int sc = getCluster(sx, sz), gc = getCluster(gx, gz);
+	if (sc == gc && gridSearch(s, sc, sx, sz, gx, gz) >= 0)
+	{
+		s.moves.clear();
+		gridMoves(s, gx, gz, s.moves);
+		appendPath(sx, sz, s.moves.data(), s.moves.size(), false, points);
+	}
+	else
+	{
+		// the start and the goal are linked to the nodes of their clusters
+		s.targets.clear();
+		for (int i : m_clusterNodes[sc])
+			s.targets.push_back(std::make_pair(m_nodes[i].x, m_nodes[i].z));
+		s.startLinks.clear();
+		gridSearch(s, sc, sx, sz, -1, -1);
+		for (int i : m_clusterNodes[sc])
+		{
+			float fCost = s.getCost(m_nodes[i].x, m_nodes[i].z);
+			if (fCost >= 0)
+				s.startLinks.push_back(std::make_pair(i, fCost));
+		}
+		s.targets.clear();
+		for (int i : m_clusterNodes[gc])
+			s.targets.push_back(std::make_pair(m_nodes[i].x, m_nodes[i].z));
+		s.goalLinks.clear();
+		gridSearch(s, gc, gx, gz, -1, -1);
+		s.targets.clear();
+		for (int i : m_clusterNodes[gc])
+		{
+			float fCost = s.getCost(m_nodes[i].x, m_nodes[i].z);
+			if (fCost >= 0)
+				s.goalLinks.push_back(std::make_pair(i, fCost));
+		}
+
+		// no search unless both are linked to the same component
+		bool bConnected = false;
+		for (auto &a : s.startLinks)
+			for (auto &b : s.goalLinks)
+				bConnected = bConnected || m_nodes[a.first].iComponent == m_nodes[b.first].iComponent;
+		if (!bConnected)
+			return false;
+
+		// A* over the abstract graph - the heuristic is inflated a little, so that the ties are broken towards the goal
+		const float fWeight = 1.001f / NAV_STRAIGHT;
+		int iStart = m_nodes.size(), iGoal = iStart + 1;
+		s.nAStamp++;
+		s.heap.clear();
+		auto relax = [&](int j, float g, int iParent, int iEdge)
+		{
+			if (s.aclosed[j] == s.nAStamp || (s.aopen[j] == s.nAStamp && g >= s.ag[j]))
+				return;
+			s.aopen[j] = s.nAStamp;
+			s.ag[j] = g;
+			s.aparent[j] = iParent;
+			s.aedge[j] = iEdge;
+			s.push(g + (j == iGoal ? 0 : fWeight * octile(gx - m_nodes[j].x, gz - m_nodes[j].z)), j);
+		};
+		s.aclosed[iStart] = s.nAStamp;
+		for (auto &l : s.startLinks)
+			relax(l.first, l.second, iStart, -1);
+		while (!s.heap.empty())
+		{
+			int i = s.pop();
+			if (s.aclosed[i] == s.nAStamp)
+				continue;
+			s.aclosed[i] = s.nAStamp;
+			if (i == iGoal)
+				break;
+			if (m_nodes[i].iCluster == gc)
+				for (auto &l : s.goalLinks)
+					if (l.first == i)
+						relax(iGoal, s.ag[i] + l.second, i, -1);
+			for (int k = m_edgeStart[i]; k < m_edgeStart[i + 1]; k++)
+				relax(m_edges[k].iNode, s.ag[i] + m_edges[k].fCost, i, k);
+		}
+		if (s.aclosed[iGoal] != s.nAStamp)
+			return false;
+
+		// refinement: the stored paths of the edges, and the paths from the start and to the goal found again within their clusters
+		s.apath.clear();
+		for (int i = iGoal; i != iStart; i = s.aparent[i])
+			s.apath.push_back(i);
+		std::reverse(s.apath.begin(), s.apath.end());
+		int px = sx, pz = sz;
+		for (int i : s.apath)
+		{
+			int tx = i == iGoal ? gx : m_nodes[i].x, tz = i == iGoal ? gz : m_nodes[i].z;
+			if (s.aedge[i] >= 0)
+			{
+				EDGE &e = m_edges[s.aedge[i]];
+				if (e.iPath < 0)
+					points.push_back(tx * m_nSizeZ + tz);
+				else
+					appendPath(px, pz, &m_moves[e.iPath], e.nSteps, e.bReversed, points);
+			}
+			else if (gridSearch(s, getCluster(tx, tz), px, pz, tx, tz) >= 0)
+			{
+				s.moves.clear();
+				gridMoves(s, tx, tz, s.moves);
+				appendPath(px, pz, s.moves.data(), s.moves.size(), false, points);
+			}
+			else
+				return false;
+			px = tx;
+			pz = tz;
+		}
+	}
+
+	// the model coordinates
+	path.reserve(points.size() * 3);
+	for (int p : points)
+	{
+		int x = p / m_nSizeZ - m_nSizeX/2, z = p % m_nSizeZ - m_nSizeZ/2;
+		path.push_back((float)x);
+		path.push_back(m_pTerrain->getHeight(x, z));
+		path.push_back((float)z);
+	}
+	return true;
+}
+
+bool C3dglNavGrid::isWalkable(float x, float z)
+{
+	return walkable((int)floor(x + 0.5f) + m_nSizeX/2, (int)floor(z + 0.5f) + m_nSizeZ/2);
+}
+
+bool C3dglNavGrid::findPath(float x0, float z0, float x1, float z1, vector<float> &path)
+{
+	path.clear();
+	if (!m_pTerrain)
+		return false;
+	SEARCH s(m_nClusterSize, m_nodes.size());
+	QUERY query = { x0, z0, x1, z1 };
+	return findPath(s, query, path);
+}
+
+int C3dglNavGrid::findPaths(const QUERY *pQueries, int n, vector<vector<float> > &paths, C3dglThreadPool *pThreadPool)
+{
+	paths.assign(n, vector<float>());
+	if (!m_pTerrain)
+		return 0;
+	if (!pThreadPool)
+		pThreadPool = m_pTerrain->getThreadPool();
+
+	// each range of the queries has its own working memory
+	pThreadPool->parallelFor(n, [this, pQueries, &paths](int i0, int i1)
+	{
+		SEARCH s(m_nClusterSize, m_nodes.size());
+		for (int i = i0; i < i1; i++)
+			findPath(s, pQueries[i], paths[i]);
+	}, 16);
+
+	int nFound = 0;
+	for (auto &path : paths)
+		if (!path.empty())
+			nFound++;
+	return nFound;
+}
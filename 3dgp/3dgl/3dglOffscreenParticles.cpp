@@ -0,0 +1,221 @@
+#include "../include/glee.h"
+#include "../include/3dglOffscreenParticles.h"
+#include "../include/3dglShader.h"
+
+using namespace _3dgl;
+
+C3dglOffscreenParticles::C3dglOffscreenParticles()
+{
+	m_pDepthProgram = NULL;
+	m_pCompositeProgram = NULL;
+	m_nFactor = 2;
+	m_fNear = 0.1f;
+	m_fFar = 1000.0f;
+	m_nWidth = m_nHeight = 0;
+	m_nLowWidth = m_nLowHeight = 0;
+	m_depthTexture = 0;
+	m_colorTexture = 0;
+	m_lowDepthTexture = 0;
+	m_framebuffer = 0;
+	m_bActive = false;
+	m_prevFramebuffer = 0;
+	m_pPrevProgram = NULL;
+}
+
+C3dglOffscreenParticles::~C3dglOffscreenParticles()
+{
+	destroy();
+}
+
+bool C3dglOffscreenParticles::create(C3dglProgram *pDepthProgram, C3dglProgram *pCompositeProgram, int nFactor)
+{
+	destroy();
+	if (!pDepthProgram || !pCompositeProgram)
+		return logError("no downsampling or composition program");
+	m_pDepthProgram = pDepthProgram;
+	m_pCompositeProgram = pCompositeProgram;
+	setFactor(nFactor);
+	return logSuccess();
+}
+
+void C3dglOffscreenParticles::destroy()
+{
+	destroyTargets();
+	m_pDepthProgram = NULL;
+	m_pCompositeProgram = NULL;
+}
+
+void C3dglOffscreenParticles::destroyTargets()
+{
+	if (m_framebuffer)
+		glDeleteFramebuffers(1, &m_framebuffer);
+	if (m_depthTexture)
+		glDeleteTextures(1, &m_depthTexture);
+	if (m_colorTexture)
+		glDeleteTextures(1, &m_colorTexture);
+	if (m_lowDepthTexture)
+		glDeleteTextures(1, &m_lowDepthTexture);
+	m_framebuffer = 0;
+	m_depthTexture = m_colorTexture = m_lowDepthTexture = 0;
+	m_nWidth = m_nHeight = 0;
+	m_nLowWidth = m_nLowHeight = 0;
+}
+
+void C3dglOffscreenParticles::setFactor(int nFactor)
+{
+	nFactor = nFactor < 1 ? 1 : nFactor;
+	if (nFactor == m_nFactor)
+		return;
+	m_nFactor = nFactor;
+	destroyTargets();		// reallocated by the next begin
+}
+
+// a texture with no mipmaps, sampled with texelFetch (or bilinearly, if bLinear)
+static unsigned createTexture(GLint internalFormat, GLenum format, GLenum type, int nWidth, int nHeight, bool bLinear)
+{
+	unsigned id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, bLinear ? GL_LINEAR : GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, bLinear ? GL_LINEAR : GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, nWidth, nHeight, 0, format, type, NULL);
+	return id;
+}
+
+bool C3dglOffscreenParticles::allocate(int nWidth, int nHeight)
+{
+	destroyTargets();
+	m_nWidth = nWidth;
+	m_nHeight = nHeight;
+	m_nLowWidth = (nWidth + m_nFactor - 1) / m_nFactor;
+	m_nLowHeight = (nHeight + m_nFactor - 1) / m_nFactor;
+
+	// the textures are created on the current texture unit - the binding restored after
+	GLint prevTexture;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &prevTexture);
+	m_depthTexture = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, m_nWidth, m_nHeight, false);
+	m_colorTexture = createTexture(GL_RGBA16F, GL_RGBA, GL_FLOAT, m_nLowWidth, m_nLowHeight, false);		// 16-bit: many thin layers of smoke
+	m_lowDepthTexture = createTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, m_nLowWidth, m_nLowHeight, false);
+	glBindTexture(GL_TEXTURE_2D, prevTexture);
+
+	glGenFramebuffers(1, &m_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTexture, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, m_lowDepthTexture, 0);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_prevFramebuffer);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		destroyTargets();
+		return logError("the offscreen target is incomplete");
+	}
+	return true;
+}
+
+bool C3dglOffscreenParticles::begin()
+{
+	if (m_bActive || !m_pDepthProgram || !m_pCompositeProgram)
+		return false;
+
+	glGetIntegerv(GL_VIEWPORT, m_viewport);
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &m_prevFramebuffer);
+	if ((m_viewport[2] != m_nWidth || m_viewport[3] != m_nHeight || m_framebuffer == 0) && !allocate(m_viewport[2], m_viewport[3]))
+		return false;
+	m_pPrevProgram = C3dglProgram::GetCurrentProgram();
+
+	// the scene depth, as it is after the opaque objects
+	GLint activeTexture, prevTexture;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+	glActiveTexture(GL_TEXTURE0);
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &prevTexture);
+	glBindTexture(GL_TEXTURE_2D, m_depthTexture);
+	glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_viewport[0], m_viewport[1], m_nWidth, m_nHeight);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glViewport(0, 0, m_nLowWidth, m_nLowHeight);
+
+	// downsample the depth: the full screen triangle writes the depth only, over whatever was there
+	GLint depthFunc;
+	GLboolean depthMask, depthTest;
+	glGetIntegerv(GL_DEPTH_FUNC, &depthFunc);
+	glGetBooleanv(GL_DEPTH_WRITEMASK, &depthMask);
+	depthTest = glIsEnabled(GL_DEPTH_TEST);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_ALWAYS);
+	glDepthMask(GL_TRUE);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	m_pDepthProgram->SendUniform("depthMap", 0);
+	m_pDepthProgram->SendUniform("scale", (float)m_nWidth / m_nLowWidth, (float)m_nHeight / m_nLowHeight);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthFunc(depthFunc);
+	glDepthMask(depthMask);
+	if (!depthTest)
+		glDisable(GL_DEPTH_TEST);
+	glBindTexture(GL_TEXTURE_2D, prevTexture);
+	glActiveTexture(activeTexture);
+
+	// no particles yet: transparent
+	GLfloat clearColor[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+	glClearColor(0, 0, 0, 0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+
+	// the colours blended as usual, the alpha accumulated as the coverage - so the result is premultiplied
+	glGetIntegerv(GL_BLEND_SRC_RGB, &m_blend[0]);
+	glGetIntegerv(GL_BLEND_DST_RGB, &m_blend[1]);
+	glGetIntegerv(GL_BLEND_SRC_ALPHA, &m_blend[2]);
+	glGetIntegerv(GL_BLEND_DST_ALPHA, &m_blend[3]);
+	glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	if (m_pPrevProgram)
+		m_pPrevProgram->Use();
+	m_bActive = true;
+	return true;
+}
+
+void C3dglOffscreenParticles::end()
+{
+	if (!m_bActive)
+		return;
+	m_bActive = false;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_prevFramebuffer);
+	glViewport(m_viewport[0], m_viewport[1], m_viewport[2], m_viewport[3]);
+
+	// the premultiplied particles over the scene; the depths are compared in the shader
+	GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+	GLint activeTexture;
+	glGetIntegerv(GL_ACTIVE_TEXTURE, &activeTexture);
+	glDisable(GL_DEPTH_TEST);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	unsigned textures[3] = { m_colorTexture, m_lowDepthTexture, m_depthTexture };
+	GLint prevTextures[3];
+	for (int i = 0; i < 3; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &prevTextures[i]);
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+	}
+	m_pCompositeProgram->SendUniform("particleMap", 0);
+	m_pCompositeProgram->SendUniform("lowDepthMap", 1);
+	m_pCompositeProgram->SendUniform("depthMap", 2);
+	m_pCompositeProgram->SendUniform("clipPlanes", m_fNear, m_fFar);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	for (int i = 2; i >= 0; i--)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, prevTextures[i]);
+	}
+	glActiveTexture(activeTexture);
+	glBlendFuncSeparate(m_blend[0], m_blend[1], m_blend[2], m_blend[3]);
+	if (depthTest)
+		glEnable(GL_DEPTH_TEST);
+	if (m_pPrevProgram)
+		m_pPrevProgram->Use();
+}
@@ -0,0 +1,211 @@
+#include <cstring>
+#include <algorithm>
+
+#include "../include/glee.h"
+#include "../include/3dglParticleSort.h"
+#include "../include/3dglThreadPool.h"
+#include <Windows.h>
+
+using namespace _3dgl;
+
+// the view space depth as a key: the farthest (the most negative z) first, the float bits made to sort as unsigned
+static unsigned depthKey(const float m[16], float x, float y, float z)
+{
+	float fDepth = m[2] * x + m[6] * y + m[10] * z + m[14];
+	unsigned u;
+	memcpy(&u, &fDepth, sizeof(u));
+	return u & 0x80000000 ? ~u : u | 0x80000000;
+}
+
+C3dglParticleSort::C3dglParticleSort()
+{
+	m_pThreadPool = NULL;
+	m_nCount = 0;
+	m_nInterval = 1;
+	m_nFrames = 0;
+	m_bFullSort = false;
+	m_bSorted = false;
+	m_buffer = 0;
+	m_bUploaded = false;
+	m_fSortTime = 0;
+}
+
+C3dglParticleSort::~C3dglParticleSort()
+{
+	destroy();
+}
+
+void C3dglParticleSort::destroy()
+{
+	if (m_buffer)
+		glDeleteBuffers(1, &m_buffer);
+	m_buffer = 0;
+	m_bUploaded = false;
+	m_nCount = 0;
+}
+
+C3dglThreadPool *C3dglParticleSort::getThreadPool()
+{
+	return m_pThreadPool ? m_pThreadPool : C3dglThreadPool::getDefault();
+}
+
+void C3dglParticleSort::sort(const float *px, const float *py, const float *pz, unsigned n, const float matrixModelView[16], bool bStable)
+{
+	LARGE_INTEGER freq, t0, t1;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t0);
+
+	C3dglThreadPool *pPool = getThreadPool();
+	const float *m = matrixModelView;
+	bool bFull = !bStable || n != m_nCount || ++m_nFrames >= m_nInterval;
+	m_nCount = n;
+	m_keys.resize(n);
+	m_order.resize(n);
+
+	if (bFull)
+	{
+		pPool->parallelFor(n, [&](int i0, int i1)
+		{
+			for (int i = i0; i < i1; i++)
+			{
+				m_keys[i] = depthKey(m, px[i], py[i], pz[i]);
+				m_order[i] = i;
+			}
+		}, PARTICLE_SORT_GRAIN);
+		radixSort();
+		m_nFrames = 0;
+		m_bSorted = true;
+	}
+	else
+	{
+		// the new depths in the last order - nearly sorted, unless the view has changed a lot
+		pPool->parallelFor(n, [&](int i0, int i1)
+		{
+			for (int i = i0; i < i1; i++)
+			{
+				unsigned j = m_order[i];
+				m_keys[i] = depthKey(m, px[j], py[j], pz[j]);
+			}
+		}, PARTICLE_SORT_GRAIN);
+		m_bSorted = refine(n * 2);
+	}
+	m_bFullSort = bFull;
+	m_bUploaded = false;
+
+	QueryPerformanceCounter(&t1);
+	m_fSortTime = (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)freq.QuadPart;
+}
+
+// LSD radix sort of the pairs (m_keys[i], m_order[i]), 8 bits per pass; each range counts its digits, and
+// writes its particles after those of the same digit in the previous ranges - so the sort is stable
+void C3dglParticleSort::radixSort()
+{
+	C3dglThreadPool *pPool = getThreadPool();
+	unsigned n = m_nCount;
+	unsigned nThreads = pPool->getThreadCount();
+	unsigned nRange = max((unsigned)PARTICLE_SORT_GRAIN, (n + nThreads - 1) / nThreads);
+	unsigned nRanges = (n + nRange - 1) / nRange;
+	m_keysTmp.resize(n);
+	m_orderTmp.resize(n);
+	m_histograms.resize(nRanges * 256);
+
+	for (int nShift = 0; nShift < 32; nShift += 8)
+	{
+		// the histograms (the thread pool may hand out several ranges at once)
+		pPool->parallelFor(n, [&](int i0, int i1)
+		{
+			for (unsigned r0 = i0; r0 < (unsigned)i1; r0 += nRange)
+			{
+				unsigned *pHist = &m_histograms[r0 / nRange * 256];
+				memset(pHist, 0, 256 * sizeof(unsigned));
+				for (unsigned i = r0; i < min((unsigned)i1, r0 + nRange); i++)
+					pHist[(m_keys[i] >> nShift) & 255]++;
+			}
+		}, nRange);
+
+		// the offsets: digit by digit, range by range; a pass with a single digit changes nothing
+		unsigned nSum = 0;
+		bool bSkip = false;
+		for (unsigned d = 0; d < 256; d++)
+		{
+			unsigned nDigit = 0;
+			for (unsigned r = 0; r < nRanges; r++)
+			{
+				unsigned c = m_histograms[r * 256 + d];
+				m_histograms[r * 256 + d] = nSum;
+				nSum += c;
+				nDigit += c;
+			}
+			if (nDigit == n)
+				bSkip = true;
+		}
+		if (bSkip)
+			continue;
+
+		pPool->parallelFor(n, [&](int i0, int i1)
+		{
+			for (unsigned r0 = i0; r0 < (unsigned)i1; r0 += nRange)
+			{
+				unsigned *pOffset = &m_histograms[r0 / nRange * 256];
+				for (unsigned i = r0; i < min((unsigned)i1, r0 + nRange); i++)
+				{
+					unsigned j = pOffset[(m_keys[i] >> nShift) & 255]++;
+					m_keysTmp[j] = m_keys[i];
+					m_orderTmp[j] = m_order[i];
+				}
+			}
+		}, nRange);
+		m_keys.swap(m_keysTmp);
+		m_order.swap(m_orderTmp);
+	}
+}
+
+// insertion sort of the pairs (m_keys[i], m_order[i]) - gives up after nMaxMoves moves, leaving the rest as it was
+bool C3dglParticleSort::refine(unsigned nMaxMoves)
+{
+	unsigned nMoves = 0;
+	for (unsigned i = 1; i < m_nCount; i++)
+	{
+		unsigned key = m_keys[i], index = m_order[i];
+		unsigned j = i;
+		for ( ; j > 0 && m_keys[j - 1] > key; j--)
+		{
+			m_keys[j] = m_keys[j - 1];
+			m_order[j] = m_order[j - 1];
+		}
+		m_keys[j] = key;
+		m_order[j] = index;
+		nMoves += i - j;
+		if (nMoves > nMaxMoves)
+			return false;
+	}
+	return true;
+}
+
+void C3dglParticleSort::upload()
+{
+	if (m_buffer == 0)
+		glGenBuffers(1, &m_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_nCount * sizeof(unsigned), NULL, GL_STREAM_DRAW);		// orphan the last order
+	if (m_nCount)
+		glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, m_nCount * sizeof(unsigned), &m_order[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	m_bUploaded = true;
+}
+
+unsigned C3dglParticleSort::getIndexBuffer()
+{
+	if (!m_bUploaded)
+		upload();
+	return m_buffer;
+}
+
+void C3dglParticleSort::render()
+{
+	if (m_nCount == 0)
+		return;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, getIndexBuffer());
+	glDrawElements(GL_POINTS, m_nCount, GL_UNSIGNED_INT, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
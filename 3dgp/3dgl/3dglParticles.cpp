@@ -0,0 +1,185 @@
+#include <sstream>
+#include <cmath>
+#include <cstddef>
+
+#include "../include/glee.h"
+#include "../include/3dglParticles.h"
+#include "../include/3dglShader.h"
+#include "../include/3dglTerrain.h"
+#include <Windows.h>
+
+using namespace _3dgl;
+
+C3dglParticles::C3dglParticles()
+{
+	m_pProgram = NULL;
+	m_gravity[0] = m_gravity[1] = m_gravity[2] = 0;
+	m_wind[0] = m_wind[1] = m_wind[2] = 0;
+	m_fDrag = 0;
+	m_pTerrain = NULL;
+	m_collision = COLLISION_NONE;
+	m_nSeed = 1;
+	m_buffers[0] = m_buffers[1] = 0;
+	m_query = 0;
+	m_iCurrent = 0;
+	m_bPending = false;
+	m_nCapacity = m_nLive = 0;
+	m_fEmitDebt = 0;
+	m_nEmitted = 0;
+}
+
+C3dglParticles::~C3dglParticles()
+{
+	destroy();
+}
+
+bool C3dglParticles::create(C3dglProgram *pProgram, const EMITTER &emitter)
+{
+	destroy();
+	if (pProgram == NULL)
+		return logError("no update program");
+
+	m_pProgram = pProgram;
+	m_emitter = emitter;
+
+	// the particles alive at a time: those born within the longest lifetime, plus a margin for
+	// the particles emitted in a single update (a frame rate drop) and the rounding
+	m_nCapacity = (unsigned)ceil(emitter.fRate * max(emitter.fMinLifetime, emitter.fMaxLifetime) * 1.1f) + 64;
+
+	glGenBuffers(2, m_buffers);
+	for (int i = 0; i < 2; i++)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, m_nCapacity * sizeof(PARTICLE), NULL, GL_DYNAMIC_COPY);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glGenQueries(1, &m_query);
+
+	m_iCurrent = 0;
+	m_bPending = false;
+	m_nLive = 0;
+	m_fEmitDebt = 0;
+	m_nEmitted = 0;
+
+	std::ostringstream info;
+	info << "created for " << m_nCapacity << " particles (" << getBufferSize() / 1024 << " kB of buffers)";
+	return logSuccess(info.str());
+}
+
+void C3dglParticles::destroy()
+{
+	if (m_buffers[0])
+		glDeleteBuffers(2, m_buffers);
+	if (m_query)
+	{
+		if (m_bPending)
+		{
+			GLuint n;
+			glGetQueryObjectuiv(m_query, GL_QUERY_RESULT, &n);		// the query must not be in use
+		}
+		glDeleteQueries(1, &m_query);
+	}
+	m_buffers[0] = m_buffers[1] = 0;
+	m_query = 0;
+	m_bPending = false;
+	m_nCapacity = m_nLive = 0;
+}
+
+// the particle state as the vertex attributes 0 - 3
+void C3dglParticles::bindAttributes(unsigned buffer)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	for (GLuint i = 0; i < 4; i++)
+		glEnableVertexAttribArray(i);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, pos));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, vel));
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, fAge));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(PARTICLE), (void*)offsetof(PARTICLE, fLifetime));
+}
+
+void C3dglParticles::unbindAttributes()
+{
+	for (GLuint i = 0; i < 4; i++)
+		glDisableVertexAttribArray(i);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void C3dglParticles::update(float fTime)
+{
+	if (m_nCapacity == 0)
+		return;
+
+	// the result of the last update - by now, a frame later, normally available without waiting
+	if (m_bPending)
+	{
+		glGetQueryObjectuiv(m_query, GL_QUERY_RESULT, &m_nLive);
+		m_iCurrent = 1 - m_iCurrent;
+		m_bPending = false;
+	}
+
+	// the particles due to be born, limited by the free space
+	m_fEmitDebt += max(m_emitter.fRate, 0.0f) * fTime;
+	unsigned nEmit = (unsigned)m_fEmitDebt;
+	m_fEmitDebt -= nEmit;
+	nEmit = min(nEmit, m_nCapacity - m_nLive);
+	if (m_nLive + nEmit == 0)
+		return;
+
+	// the uniforms: the vertices past liveCount are the new particles
+	C3dglProgram *pPrevProgram = C3dglProgram::GetCurrentProgram();
+	m_pProgram->Use();
+	m_pProgram->SendUniform("deltaTime", fTime);
+	m_pProgram->SendUniform("liveCount", (GLint)m_nLive);
+	m_pProgram->SendUniform("emitIndex", (GLuint)m_nEmitted);
+	m_pProgram->SendUniform("randomSeed", (GLuint)m_nSeed);
+	m_pProgram->SendUniform("emitterPos", m_emitter.pos[0], m_emitter.pos[1], m_emitter.pos[2]);
+	m_pProgram->SendUniform("emitterSize", m_emitter.size[0], m_emitter.size[1], m_emitter.size[2]);
+	m_pProgram->SendUniform("emitterDir", m_emitter.dir[0], m_emitter.dir[1], m_emitter.dir[2]);
+	m_pProgram->SendUniform("emitterSpread", m_emitter.fSpread);
+	m_pProgram->SendUniform("emitterSpeed", m_emitter.fMinSpeed, m_emitter.fMaxSpeed);
+	m_pProgram->SendUniform("emitterLifetime", m_emitter.fMinLifetime, m_emitter.fMaxLifetime);
+	m_pProgram->SendUniform("gravity", m_gravity[0], m_gravity[1], m_gravity[2]);
+	m_pProgram->SendUniform("wind", m_wind[0], m_wind[1], m_wind[2]);
+	m_pProgram->SendUniform("drag", m_fDrag);
+
+	GLint collision = m_pTerrain ? m_collision : COLLISION_NONE;
+	m_pProgram->SendUniform("collision", collision);
+	if (collision != COLLISION_NONE)
+	{
+		glActiveTexture(GL_TEXTURE0 + PARTICLES_HEIGHT_UNIT);
+		glBindTexture(GL_TEXTURE_2D, m_pTerrain->getHeightTexture());
+		glActiveTexture(GL_TEXTURE0);
+		m_pProgram->SendUniform("heightMap", (GLint)PARTICLES_HEIGHT_UNIT);
+		m_pProgram->SendUniform("heightRange", m_pTerrain->getHeightTextureMin(), m_pTerrain->getHeightTextureScale());
+	}
+
+	// the pass: m_buffers[m_iCurrent] -> m_buffers[1 - m_iCurrent], nothing rasterised
+	glEnable(GL_RASTERIZER_DISCARD);
+	bindAttributes(m_buffers[m_iCurrent]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, m_buffers[1 - m_iCurrent]);
+
+	glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, m_query);
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, m_nLive + nEmit);
+	glEndTransformFeedback();
+	glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	unbindAttributes();
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	m_bPending = true;
+	m_nEmitted += nEmit;
+	if (pPrevProgram)
+		pPrevProgram->Use();
+}
+
+void C3dglParticles::render()
+{
+	// the buffer read by the pending update is intact until the next update
+	if (m_nLive == 0)
+		return;
+	bindAttributes(m_buffers[m_iCurrent]);
+	glDrawArrays(GL_POINTS, 0, m_nLive);
+	unbindAttributes();
+}
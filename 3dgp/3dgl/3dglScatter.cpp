@@ -0,0 +1,291 @@
+#include <sstream>
+#include <cmath>
+
+#include "../include/glee.h"
+#include "../include/3dglScatter.h"
+#include "../include/3dglBitmap.h"
+#include "../include/3dglThreadPool.h"
+#include <Windows.h>
+
+using std::vector;
+using namespace _3dgl;
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// hash based random numbers - each cell has its own sequence, so the placements do not depend
+// on the order in which the cells are processed by the thread pool
+static unsigned hashRandom(unsigned a)
+{
+	a ^= a >> 16; a *= 0x7feb352d;
+	a ^= a >> 15; a *= 0x846ca68b;
+	a ^= a >> 16;
+	return a;
+}
+
+struct RANDOM
+{
+	unsigned s;
+	RANDOM(unsigned nSeed, unsigned iCell, unsigned iType) : s(hashRandom(nSeed ^ hashRandom(iCell * 64 + iType))) { }
+	float next()					{ s = s * 1664525 + 1013904223; return (hashRandom(s) >> 8) / 16777216.0f; }	// [0, 1)
+};
+
+C3dglScatter::C3dglScatter()
+{
+	m_pTerrain = NULL;
+	m_nCellSize = 0;
+	m_nCellsX = m_nCellsZ = 0;
+	m_nSeed = 1;
+	m_nMaskWidth = m_nMaskHeight = 0;
+	m_nInstances = m_nVisibleCells = m_nDrawCalls = m_nRenderedInstances = 0;
+}
+
+C3dglScatter::~C3dglScatter()
+{
+	destroy();
+}
+
+void C3dglScatter::destroy()
+{
+	for (TYPE &type : m_types)
+		if (type.buffer)
+			glDeleteBuffers(1, &type.buffer);
+	m_types.clear();
+	m_cells.clear();
+	m_nInstances = 0;
+}
+
+int C3dglScatter::addType(C3dglModel *pModel, const RULES &rules)
+{
+	TYPE type;
+	type.pModel = pModel;
+	type.rules = rules;
+	type.buffer = 0;
+	type.nBuffered = 0;
+
+	// bounding radius: the farthest corner of the bounding box
+	aiVector3D bb[2];
+	pModel->getBB(bb);
+	type.fRadius = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		aiVector3D v(bb[i & 1].x, bb[(i >> 1) & 1].y, bb[(i >> 2) & 1].z);
+		type.fRadius = max(type.fRadius, v.Length());
+	}
+
+	m_types.push_back(type);
+	return m_types.size() - 1;
+}
+
+bool C3dglScatter::loadDensityMask(const std::string filename)
+{
+	C3dglBitmap bm;
+	if (!bm.load(filename, GL_RGBA))
+		return logError("cannot load the density mask: " + filename);
+	m_nMaskWidth = bm.getWidth();
+	m_nMaskHeight = abs(bm.getHeight());
+	const unsigned char *p = (const unsigned char*)bm.getBits();
+	m_mask.assign(p, p + m_nMaskWidth * m_nMaskHeight * 4);
+	return true;
+}
+
+float C3dglScatter::getMaskDensity(int nChannel, float x, float z)
+{
+	if (nChannel < 0 || nChannel > 3 || m_mask.empty())
+		return 1;
+
+	// terrain model coordinates to the image pixels, nearest
+	int nSizeX = m_pTerrain->getSizeX(), nSizeZ = m_pTerrain->getSizeZ();
+	int px = (int)((x + nSizeX/2) * m_nMaskWidth / nSizeX);
+	int pz = (int)((z + nSizeZ/2) * m_nMaskHeight / nSizeZ);
+	px = min(max(px, 0), m_nMaskWidth - 1);
+	pz = min(max(pz, 0), m_nMaskHeight - 1);
+	return m_mask[(pz * m_nMaskWidth + px) * 4 + nChannel] / 255.0f;
+}
+
+bool C3dglScatter::scatter(C3dglTerrain *pTerrain)
+{
+	if (!pTerrain || pTerrain->getSizeX() < 2 || pTerrain->getSizeZ() < 2)
+		return logError("cannot scatter the objects before the terrain is loaded");
+
+	// the terrain objects of the previous cells are reused, as far as they go
+	vector<int> objects;
+	if (pTerrain == m_pTerrain)
+		for (CELL &cell : m_cells)
+			objects.push_back(cell.idObject);
+
+	m_pTerrain = pTerrain;
+	m_nCellSize = max(pTerrain->getChunkSize(), 1);
+	m_nCellsX = (pTerrain->getSizeX() - 1 + m_nCellSize - 1) / m_nCellSize;
+	m_nCellsZ = (pTerrain->getSizeZ() - 1 + m_nCellSize - 1) / m_nCellSize;
+	m_cells.assign(m_nCellsX * m_nCellsZ, CELL());
+	for (TYPE &type : m_types)
+	{
+		type.nBuffered = 0;
+		type.bufferedCells.clear();
+	}
+
+	pTerrain->getThreadPool()->parallelFor(m_cells.size(), [this](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			scatterCell(i);
+	}, 1);
+
+	// cell bounds: the instance origins, extended by the bounding radius of the scaled models
+	m_nInstances = 0;
+	int minx = -pTerrain->getSizeX()/2, minz = -pTerrain->getSizeZ()/2;
+	for (unsigned i = 0; i < m_cells.size(); i++)
+	{
+		CELL &cell = m_cells[i];
+		float minXYZ[3] = { 1e30f, 1e30f, 1e30f }, maxXYZ[3] = { -1e30f, -1e30f, -1e30f };
+		for (unsigned iType = 0; iType < m_types.size(); iType++)
+		{
+			vector<float> &transforms = cell.transforms[iType];
+			for (unsigned j = 0; j < transforms.size(); j += 16)
+			{
+				float s = sqrt(transforms[j] * transforms[j] + transforms[j + 1] * transforms[j + 1] + transforms[j + 2] * transforms[j + 2]);
+				float r = m_types[iType].fRadius * s;
+				for (int k = 0; k < 3; k++)
+				{
+					minXYZ[k] = min(minXYZ[k], transforms[j + 12 + k] - r);
+					maxXYZ[k] = max(maxXYZ[k], transforms[j + 12 + k] + r);
+				}
+			}
+			m_nInstances += transforms.size() / 16;
+		}
+		if (minXYZ[0] > maxXYZ[0])
+		{
+			// an empty cell - its footprint only
+			minXYZ[0] = maxXYZ[0] = (float)(minx + (int)(i / m_nCellsZ) * m_nCellSize);
+			minXYZ[2] = maxXYZ[2] = (float)(minz + (int)(i % m_nCellsZ) * m_nCellSize);
+			minXYZ[1] = maxXYZ[1] = 0;
+		}
+
+		if (i < objects.size())
+		{
+			cell.idObject = objects[i];
+			pTerrain->setObjectBounds(cell.idObject, minXYZ, maxXYZ);
+		}
+		else
+			cell.idObject = pTerrain->addObject(minXYZ, maxXYZ);
+	}
+
+	std::ostringstream info;
+	info << "scattered " << m_nInstances << " instances of " << m_types.size() << " models in " << m_nCellsX << " x " << m_nCellsZ << " cells";
+	return logSuccess(info.str());
+}
+
+void C3dglScatter::scatterCell(int iCell)
+{
+	CELL &cell = m_cells[iCell];
+	cell.transforms.resize(m_types.size());
+
+	// cell area, in the terrain model coordinates
+	int nSizeX = m_pTerrain->getSizeX(), nSizeZ = m_pTerrain->getSizeZ();
+	int x0 = (iCell / m_nCellsZ) * m_nCellSize, z0 = (iCell % m_nCellsZ) * m_nCellSize;
+	int nx = min(m_nCellSize, nSizeX - 1 - x0), nz = min(m_nCellSize, nSizeZ - 1 - z0);
+	float fx = (float)(x0 - nSizeX/2), fz = (float)(z0 - nSizeZ/2);
+
+	vector<float> xs, zs, heights, normals, slopes;
+	for (unsigned iType = 0; iType < m_types.size(); iType++)
+	{
+		RULES &rules = m_types[iType].rules;
+		RANDOM rnd(m_nSeed, iCell, iType);
+
+		// candidates: the expected number for the density, rounded up or down at random
+		float fExpected = rules.fDensity * nx * nz / 100;
+		int n = (int)(fExpected + rnd.next());
+		if (n <= 0)
+			continue;
+		xs.resize(n); zs.resize(n); heights.resize(n); normals.resize(n * 3); slopes.resize(n);
+		for (int i = 0; i < n; i++)
+		{
+			xs[i] = fx + rnd.next() * nx;
+			zs[i] = fz + rnd.next() * nz;
+		}
+		m_pTerrain->getInterpolatedNormals(&xs[0], &zs[0], &heights[0], &normals[0], &slopes[0], n);
+
+		vector<float> &transforms = cell.transforms[iType];
+		for (int i = 0; i < n; i++)
+		{
+			// the random values are drawn for every candidate, accepted or not - the sequence stays the same
+			float fMask = rnd.next(), fScale = rnd.next(), fYaw = rnd.next() * 2 * (float)M_PI;
+			if (heights[i] < rules.fMinHeight || heights[i] > rules.fMaxHeight || slopes[i] > rules.fMaxSlope)
+				continue;
+			if (fMask >= getMaskDensity(rules.nMaskChannel, xs[i], zs[i]))
+				continue;
+			float s = rules.fMinScale + fScale * (rules.fMaxScale - rules.fMinScale);
+
+			// alignment: the rotation of the y axis onto the normal (the identity if not aligned)
+			float a[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };		// column-major
+			if (rules.bAlign)
+			{
+				float nX = normals[i * 3], nY = normals[i * 3 + 1], nZ = normals[i * 3 + 2];
+				float k = 1 / (1 + nY);
+				a[0] = 1 - nX * nX * k;	a[3] = nX;	a[6] = -nX * nZ * k;
+				a[1] = -nX;				a[4] = nY;	a[7] = -nZ;
+				a[2] = -nX * nZ * k;	a[5] = nZ;	a[8] = 1 - nZ * nZ * k;
+			}
+
+			// transform = translation * alignment * yaw * scale
+			float c = cos(fYaw) * s, sn = sin(fYaw) * s;
+			float m[16];
+			for (int r = 0; r < 3; r++)
+			{
+				m[0 + r] = a[r] * c - a[6 + r] * sn;		// alignment * (cos, 0, -sin)
+				m[4 + r] = a[3 + r] * s;					// alignment * (0, 1, 0)
+				m[8 + r] = a[r] * sn + a[6 + r] * c;		// alignment * (sin, 0, cos)
+			}
+			m[3] = m[7] = m[11] = 0;
+			m[12] = xs[i] - m[4] * rules.fSink;
+			m[13] = heights[i] - m[5] * rules.fSink;
+			m[14] = zs[i] - m[6] * rules.fSink;
+			m[15] = 1;
+			transforms.insert(transforms.end(), m, m + 16);
+		}
+	}
+}
+
+void C3dglScatter::render()
+{
+	m_nVisibleCells = m_nDrawCalls = m_nRenderedInstances = 0;
+	if (!m_pTerrain)
+		return;
+
+	vector<int> visible;
+	for (unsigned i = 0; i < m_cells.size(); i++)
+		if (m_pTerrain->isObjectVisible(m_cells[i].idObject))
+			visible.push_back(i);
+	m_nVisibleCells = visible.size();
+
+	vector<float> transforms;
+	for (unsigned iType = 0; iType < m_types.size(); iType++)
+	{
+		TYPE &type = m_types[iType];
+		vector<int> cells;
+		for (int i : visible)
+			if (iType < m_cells[i].transforms.size() && !m_cells[i].transforms[iType].empty())
+				cells.push_back(i);
+
+		// the visible instances are gathered into the buffer only when the visible cells change
+		if (cells != type.bufferedCells)
+		{
+			transforms.clear();
+			for (int i : cells)
+				transforms.insert(transforms.end(), m_cells[i].transforms[iType].begin(), m_cells[i].transforms[iType].end());
+			if (type.buffer == 0)
+				glGenBuffers(1, &type.buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, type.buffer);
+			glBufferData(GL_ARRAY_BUFFER, transforms.size() * sizeof(float), transforms.empty() ? NULL : &transforms[0], GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			type.nBuffered = transforms.size() / 16;
+			type.bufferedCells.swap(cells);
+		}
+
+		if (type.nBuffered == 0)
+			continue;
+		m_nDrawCalls += type.pModel->renderInstanced(type.buffer, type.nBuffered);
+		m_nRenderedInstances += type.nBuffered;
+	}
+}
@@ -67,7 +67,7 @@ std::string C3dglShader::getName()
 	//case GL_COMPUTE_SHADER: return "Compute Shader";
 	//case GL_TESS_CONTROL_SHADER: return "Tesselation Control Shader";
 	//case GL_TESS_EVALUATION_SHADER: return "Tesselation Evaluation Shader";
-	//case GL_GEOMETRY_SHADER: return "Geometry Shader";
+	case GL_GEOMETRY_SHADER: return "Geometry Shader";
 	default: return "Shader";
 	}
 }
@@ -100,10 +100,28 @@ bool C3dglProgram::Attach(C3dglShader &shader)
 	return logSuccess("has successfully attached a " + shader.getName());
 }
 
-bool C3dglProgram::Link(std::string std_attrib_names, std::string std_uni_names)
+bool C3dglProgram::Link(std::string std_attrib_names, std::string std_uni_names, std::string feedback_varyings)
 {
 	if (m_id == 0) return logError("not created.");
 
+	// transform feedback varyings - must be set before linking
+	if (!feedback_varyings.empty())
+	{
+		vector<string> names;
+		vector<const GLchar*> pNames;
+		feedback_varyings += ";";
+		int vstart = 0, vend = 0;
+		while ((vend = feedback_varyings.find(";", vstart)) != string::npos)
+		{
+			if (vend > vstart) names.push_back(feedback_varyings.substr(vstart, vend - vstart));
+			vstart = vend + 1;
+		}
+		for (unsigned i = 0; i < names.size(); i++)
+			pNames.push_back(names[i].c_str());
+		if (!pNames.empty())
+			glTransformFeedbackVaryings(m_id, pNames.size(), &pNames[0], GL_INTERLEAVED_ATTRIBS);
+	}
+
 	// link
 	glLinkProgram(m_id);
 
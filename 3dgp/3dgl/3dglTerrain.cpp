@@ -1,11 +1,21 @@
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
 
 #include <Windows.h>
 #include "../include/glee.h"
 #include "../include/3dglShader.h"
 #include "../include/3dglTerrain.h"
 #include "../include/3dglBitmap.h"
+#include "../include/3dglMatInverse.h"
+#include "../include/3dglThreadPool.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define TERRAIN_SSE2
+#include <emmintrin.h>
+#endif
 
 using std::vector;
 using namespace _3dgl;
@@ -13,6 +23,47 @@ using namespace _3dgl;
 C3dglTerrain::C3dglTerrain()
 {
     m_nSizeX = m_nSizeZ = m_vertexBuffer = m_normalBuffer = m_texCoordBuffer = m_indexBuffer = 0;
+	m_morphBuffer = m_compactBuffer = 0;
+	m_bCompact = false;
+	m_bDisplacement = false;
+	m_bQuantisedHeights = false;
+	m_heightLayout = LAYOUT_LINEAR;
+	m_nHeightTilesZ = 0;
+	m_heightTexture = m_patchBuffer = m_linesBuffer = 0;
+	m_fDecimation = 0;
+	m_nDecimatedTriangles = 0;
+	m_normalMap = 0;
+	m_lightMap = 0;
+	m_sunDir[0] = m_sunDir[2] = 0;
+	m_sunDir[1] = 1;
+	m_nSunRow = -1;
+	m_nLightMapRows = 64;
+	m_fMinHeight = 0;
+	m_fHeightScale = 1;
+	m_vao = 0;
+	m_pVaoProgram = NULL;
+	m_locCompactOffset = m_locCompactSizeZ = m_locDisplacementOrigin = (unsigned)-1;
+	m_nSentSizeZ = -1;
+	m_nChunkSize = 32;
+	m_nChunksX = m_nChunksZ = 0;
+	m_nLodLevels = 1;
+	m_fChunkDiagonal = 0;
+	m_fPixelError = 2.0f;
+	m_nVisibleChunks = m_nRenderedTriangles = 0;
+	m_nHorizonCulledChunks = m_nVisibleObjects = m_nCulledObjects = 0;
+	m_bHorizonCulling = false;
+	m_fOccluderRange = 0;
+	m_indexOrder = ORDER_ROWS;
+	m_b16BitIndices = m_bPrimitiveRestart = false;
+	m_fACMR = 0;
+	m_nVertices = 0;
+	m_pThreadPool = NULL;
+	m_bMeshCache = false;
+}
+
+C3dglThreadPool *C3dglTerrain::getThreadPool()
+{
+	return m_pThreadPool ? m_pThreadPool : C3dglThreadPool::getDefault();
 }
 
 float C3dglTerrain::getHeight(int x, int z)
@@ -21,7 +72,7 @@ float C3dglTerrain::getHeight(int x, int z)
 	z += m_nSizeZ/2;
 	if (x < 0 || x >= m_nSizeX) return 0;
 	if (z < 0 || z >= m_nSizeZ) return 0;
-	return m_heights[x * m_nSizeZ + z];
+	return height(x, z);
 }
 
 	// compute the area of a triangle using Heron's formula
@@ -76,25 +127,619 @@ float C3dglTerrain::getInterpolatedHeight(float fx, float fz)
 	return m_heights[z * m_nSizeX + x];
 }
 
+// Batch queries
+// The grid cell containing the point is split into two triangles, the same way as the mesh is:
+// (0,0)-(0,1)-(1,0) if u + v < 1, (0,1)-(1,1)-(1,0) otherwise. In each triangle the height is
+// a plane, so the barycentric interpolation reduces to h = h0 + u * dh/dx + v * dh/dz.
+// The SSE2 version processes 4 points at a time; only the fetches of the corner heights are scalar.
+
+void C3dglTerrain::getInterpolatedHeights(const float *xs, const float *zs, float *out, size_t n)
+{
+	sampleSurface(xs, zs, n, out, NULL, NULL);
+}
+
+void C3dglTerrain::getInterpolatedNormals(const float *xs, const float *zs, float *heights, float *normals, float *slopes, size_t n)
+{
+	sampleSurface(xs, zs, n, heights, normals, slopes);
+}
+
+void C3dglTerrain::sampleSurface(const float *xs, const float *zs, size_t n, float *heights, float *normals, float *slopes)
+{
+	size_t i = 0;
+
+#ifdef TERRAIN_SSE2
+	__m128 offsetX = _mm_set1_ps((float)(m_nSizeX/2)), offsetZ = _mm_set1_ps((float)(m_nSizeZ/2));
+	__m128 one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+	for ( ; i + 4 <= n; i += 4)
+	{
+		// floor and fraction, in height map coordinates
+		__m128 fx = _mm_add_ps(_mm_loadu_ps(xs + i), offsetX);
+		__m128 fz = _mm_add_ps(_mm_loadu_ps(zs + i), offsetZ);
+		__m128i ix = _mm_cvttps_epi32(fx), iz = _mm_cvttps_epi32(fz);
+		__m128 flx = _mm_cvtepi32_ps(ix), flz = _mm_cvtepi32_ps(iz);
+		__m128 maskX = _mm_cmpgt_ps(flx, fx), maskZ = _mm_cmpgt_ps(flz, fz);	// truncated towards zero - negative values
+		ix = _mm_add_epi32(ix, _mm_castps_si128(maskX));
+		iz = _mm_add_epi32(iz, _mm_castps_si128(maskZ));
+		__m128 u = _mm_sub_ps(fx, _mm_sub_ps(flx, _mm_and_ps(maskX, one)));
+		__m128 v = _mm_sub_ps(fz, _mm_sub_ps(flz, _mm_and_ps(maskZ, one)));
+
+		// corner heights
+		int x[4], z[4];
+		float h00[4], h01[4], h10[4], h11[4];
+		_mm_storeu_si128((__m128i*)x, ix);
+		_mm_storeu_si128((__m128i*)z, iz);
+		for (int k = 0; k < 4; k++)
+		{
+			h00[k] = fetchHeight(x[k], z[k]);
+			h01[k] = fetchHeight(x[k], z[k] + 1);
+			h10[k] = fetchHeight(x[k] + 1, z[k]);
+			h11[k] = fetchHeight(x[k] + 1, z[k] + 1);
+		}
+		__m128 c00 = _mm_loadu_ps(h00), c01 = _mm_loadu_ps(h01), c10 = _mm_loadu_ps(h10), c11 = _mm_loadu_ps(h11);
+
+		// select the triangle: lower (u + v < 1) or upper
+		__m128 lower = _mm_cmplt_ps(_mm_add_ps(u, v), one);
+		#define SELECT(a, b)	_mm_or_ps(_mm_and_ps(lower, a), _mm_andnot_ps(lower, b))
+		__m128 dx = SELECT(_mm_sub_ps(c10, c00), _mm_sub_ps(c11, c01));
+		__m128 dz = SELECT(_mm_sub_ps(c01, c00), _mm_sub_ps(c11, c10));
+		__m128 h0 = SELECT(c00, c11);
+		u = SELECT(u, _mm_sub_ps(u, one));
+		v = SELECT(v, _mm_sub_ps(v, one));
+		#undef SELECT
+		_mm_storeu_ps(heights + i, _mm_add_ps(h0, _mm_add_ps(_mm_mul_ps(u, dx), _mm_mul_ps(v, dz))));
+
+		if (normals || slopes)
+		{
+			__m128 g2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dz, dz));
+			if (slopes)
+				_mm_storeu_ps(slopes + i, _mm_sqrt_ps(g2));
+			if (normals)
+			{
+				__m128 r = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(g2, one)));
+				float nx[4], ny[4], nz[4];
+				_mm_storeu_ps(nx, _mm_sub_ps(zero, _mm_mul_ps(dx, r)));
+				_mm_storeu_ps(ny, r);
+				_mm_storeu_ps(nz, _mm_sub_ps(zero, _mm_mul_ps(dz, r)));
+				for (int k = 0; k < 4; k++)
+				{
+					normals[(i + k) * 3] = nx[k];
+					normals[(i + k) * 3 + 1] = ny[k];
+					normals[(i + k) * 3 + 2] = nz[k];
+				}
+			}
+		}
+	}
+#endif
+
+	// scalar version - for the remaining points
+	for ( ; i < n; i++)
+	{
+		float fx = xs[i] + m_nSizeX/2;
+		float fz = zs[i] + m_nSizeZ/2;
+		int x = (int)floor(fx);
+		int z = (int)floor(fz);
+		float u = fx - x, v = fz - z;
+		float h00 = fetchHeight(x, z);
+		float h01 = fetchHeight(x, z + 1);
+		float h10 = fetchHeight(x + 1, z);
+		float h11 = fetchHeight(x + 1, z + 1);
+		float dx, dz;
+		if (u + v < 1)
+		{
+			dx = h10 - h00; dz = h01 - h00;
+			heights[i] = h00 + u * dx + v * dz;
+		}
+		else
+		{
+			dx = h11 - h01; dz = h11 - h10;
+			heights[i] = h11 + (u - 1) * dx + (v - 1) * dz;
+		}
+		float g2 = dx * dx + dz * dz;
+		if (slopes)
+			slopes[i] = sqrt(g2);
+		if (normals)
+		{
+			float m = sqrt(g2 + 1);
+			normals[i * 3] = -dx / m;
+			normals[i * 3 + 1] = 1 / m;
+			normals[i * 3 + 2] = -dz / m;
+		}
+	}
+}
+
+// Ray Casting
+// The min/max pyramid: level k >= 1 holds the height ranges of the blocks of 2^k x 2^k cells; the ranges of the
+// single cells (level 0) are found from their corners on the fly. A ray descends the pyramid from the top, skipping
+// the blocks it passes above or below, and visits the children front to back - so the first hit found is the nearest.
+// Within a cell, the ray is intersected with the two triangles of the mesh.
+
+// the range of the ray parameter within the box [x0, x1] x [z0, z1] (grid coordinates) is intersected with [tMin, tMax]
+// returns false if the ray misses the box
+static inline bool clipRay(const float o[3], const float d[3], const float inv[3], float x0, float x1, float z0, float z1, float &tMin, float &tMax)
+{
+	if (d[0] == 0)
+	{
+		if (o[0] < x0 || o[0] > x1) return false;
+	}
+	else
+	{
+		float t0 = (x0 - o[0]) * inv[0], t1 = (x1 - o[0]) * inv[0];
+		tMin = max(tMin, min(t0, t1));
+		tMax = min(tMax, max(t0, t1));
+	}
+	if (d[2] == 0)
+	{
+		if (o[2] < z0 || o[2] > z1) return false;
+	}
+	else
+	{
+		float t0 = (z0 - o[2]) * inv[2], t1 = (z1 - o[2]) * inv[2];
+		tMin = max(tMin, min(t0, t1));
+		tMax = min(tMax, max(t0, t1));
+	}
+	return tMin <= tMax;
+}
+
+void C3dglTerrain::buildRayPyramid()
+{
+	m_rayPyramid.clear();
+	int nCellsX = m_nSizeX - 1, nCellsZ = m_nSizeZ - 1;
+	for (int k = 1; getPyramidSize(nCellsX, k - 1) > 1 || getPyramidSize(nCellsZ, k - 1) > 1; k++)	// up to a single block
+		m_rayPyramid.push_back(vector<RANGE>(getPyramidSize(nCellsX, k) * getPyramidSize(nCellsZ, k)));
+	updateRayPyramid(0, 0, nCellsX - 1, nCellsZ - 1);
+}
+
+// recalculates the blocks containing the cells [cx0..cx1] x [cz0..cz1], level by level
+void C3dglTerrain::updateRayPyramid(int cx0, int cz0, int cx1, int cz1)
+{
+	int nCellsX = m_nSizeX - 1, nCellsZ = m_nSizeZ - 1;
+	for (int k = 1; k <= (int)m_rayPyramid.size(); k++)
+	{
+		int nz = getPyramidSize(nCellsZ, k);
+		int i0 = cx0 >> k, j0 = cz0 >> k, j1 = cz1 >> k;
+		getThreadPool()->parallelFor((cx1 >> k) - i0 + 1, [this, k, nz, i0, j0, j1, nCellsX, nCellsZ](int n0, int n1)
+		{
+			vector<RANGE> &level = m_rayPyramid[k - 1];
+			for (int i = i0 + n0; i < i0 + n1; i++)
+				for (int j = j0; j <= j1; j++)
+				{
+					RANGE r = { 1e30f, -1e30f };
+					if (k == 1)
+					{
+						// the grid points of the 2 x 2 cells
+						for (int x = 2 * i; x <= min(2 * i + 2, m_nSizeX - 1); x++)
+							for (int z = 2 * j; z <= min(2 * j + 2, m_nSizeZ - 1); z++)
+							{
+								float h = height(x, z);
+								r.minY = min(r.minY, h);
+								r.maxY = max(r.maxY, h);
+							}
+					}
+					else
+					{
+						// the children
+						vector<RANGE> &children = m_rayPyramid[k - 2];
+						int nzChildren = getPyramidSize(nCellsZ, k - 1);
+						for (int x = 2 * i; x < min(2 * i + 2, getPyramidSize(nCellsX, k - 1)); x++)
+							for (int z = 2 * j; z < min(2 * j + 2, nzChildren); z++)
+							{
+								r.minY = min(r.minY, children[x * nzChildren + z].minY);
+								r.maxY = max(r.maxY, children[x * nzChildren + z].maxY);
+							}
+					}
+					level[i * nz + j] = r;
+				}
+		});
+	}
+}
+
+// intersects the ray with the cell (x, z) between tMin and tMax; the ray is above the surface unless it hits it
+bool C3dglTerrain::intersectCell(const float o[3], const float d[3], int x, int z, float tMin, float tMax, float &t)
+{
+	float h00 = height(x, z), h01 = height(x, z + 1), h10 = height(x + 1, z), h11 = height(x + 1, z + 1);
+
+	// the part of the ray in each triangle: split where it crosses the diagonal (u + v = 1)
+	float ts[3] = { tMin, tMax, tMax };
+	int n = 2;
+	float s0 = o[0] - x + o[2] - z - 1, s1 = d[0] + d[2];
+	if (s1 != 0 && -s0 / s1 > tMin && -s0 / s1 < tMax)
+	{
+		ts[1] = -s0 / s1;
+		n = 3;
+	}
+
+	for (int p = 0; p < n - 1; p++)
+	{
+		// the triangle plane h = h0 + (u - u0) * dx + (v - v0) * dz, like in sampleSurface
+		float tm = (ts[p] + ts[p + 1]) / 2;
+		float u = o[0] + d[0] * tm - x, v = o[2] + d[2] * tm - z;
+		float hBase, dx, dz, u0, v0;
+		if (u + v < 1)
+		{
+			hBase = h00; dx = h10 - h00; dz = h01 - h00; u0 = 0; v0 = 0;
+		}
+		else
+		{
+			hBase = h11; dx = h11 - h01; dz = h11 - h10; u0 = 1; v0 = 1;
+		}
+
+		// the height of the ray above the plane - linear in t
+		float f0 = o[1] - hBase - (o[0] - x - u0) * dx - (o[2] - z - v0) * dz;
+		float f1 = d[1] - d[0] * dx - d[2] * dz;
+		float fa = f0 + f1 * ts[p], fb = f0 + f1 * ts[p + 1];
+		if (fa <= 0)
+		{
+			t = ts[p];
+			return true;
+		}
+		if (fb <= 0)
+		{
+			t = ts[p] + (ts[p + 1] - ts[p]) * fa / (fa - fb);
+			return true;
+		}
+	}
+	return false;
+}
+
+float C3dglTerrain::rayCast(const float origin[3], const float dir[3], float maxDist)
+{
+	float len = sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+	if (len == 0 || m_nSizeX < 2 || m_nSizeZ < 2)
+		return -1;
+
+	// the ray in the grid coordinates
+	float o[3] = { origin[0] + m_nSizeX/2, origin[1], origin[2] + m_nSizeZ/2 };
+	float d[3] = { dir[0] / len, dir[1] / len, dir[2] / len };
+	float inv[3] = { d[0] != 0 ? 1 / d[0] : 0, 0, d[2] != 0 ? 1 / d[2] : 0 };
+	int nCellsX = m_nSizeX - 1, nCellsZ = m_nSizeZ - 1;
+
+	struct RAY_NODE
+	{
+		int k, i, j;					// k < 0: a block the ray is entirely below - a hit at tMin
+		float tMin, tMax;
+	};
+	RAY_NODE stack[4 * 32];
+	int nStack = 0;
+
+	RAY_NODE root = { (int)m_rayPyramid.size(), 0, 0, 0, maxDist };
+	if (!clipRay(o, d, inv, 0, (float)nCellsX, 0, (float)nCellsZ, root.tMin, root.tMax))
+		return -1;
+	stack[nStack++] = root;
+
+	while (nStack)
+	{
+		RAY_NODE node = stack[--nStack];
+		if (node.k < 0)
+			return node.tMin;
+		if (node.k == 0)
+		{
+			float t;
+			if (intersectCell(o, d, node.i, node.j, node.tMin, node.tMax, t))
+				return t;
+			continue;
+		}
+
+		// the children the ray passes through, within their height ranges
+		RAY_NODE children[4];
+		int nChildren = 0;
+		int k = node.k - 1;
+		int nx = getPyramidSize(nCellsX, k), nz = getPyramidSize(nCellsZ, k);
+		for (int i = 2 * node.i; i < min(2 * node.i + 2, nx); i++)
+			for (int j = 2 * node.j; j < min(2 * node.j + 2, nz); j++)
+			{
+				RAY_NODE child = { k, i, j, node.tMin, node.tMax };
+				if (!clipRay(o, d, inv, (float)(i << k), (float)min((i + 1) << k, nCellsX), (float)(j << k), (float)min((j + 1) << k, nCellsZ), child.tMin, child.tMax))
+					continue;
+
+				RANGE r;
+				if (k == 0)
+				{
+					float h00 = height(i, j), h01 = height(i, j + 1), h10 = height(i + 1, j), h11 = height(i + 1, j + 1);
+					r.minY = min(min(h00, h01), min(h10, h11));
+					r.maxY = max(max(h00, h01), max(h10, h11));
+				}
+				else
+					r = m_rayPyramid[k - 1][i * nz + j];
+				float ya = o[1] + d[1] * child.tMin, yb = o[1] + d[1] * child.tMax;
+				if (min(ya, yb) > r.maxY)
+					continue;
+				if (max(ya, yb) < r.minY)
+					child.k = -1;		// under the surface all the way through (e.g. the origin below the surface)
+
+				// keep the children sorted front to back
+				int n = nChildren++;
+				while (n > 0 && children[n - 1].tMin > child.tMin)
+				{
+					children[n] = children[n - 1];
+					n--;
+				}
+				children[n] = child;
+			}
+
+		// the nearest child on the top of the stack
+		while (nChildren)
+			stack[nStack++] = children[--nChildren];
+	}
+	return -1;
+}
+
+void C3dglTerrain::rayCastMany(const float *origins, const float *dirs, float maxDist, float *out, size_t n)
+{
+	getThreadPool()->parallelFor((int)n, [this, origins, dirs, maxDist, out](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			out[i] = rayCast(origins + i * 3, dirs + i * 3, maxDist);
+	}, 64);
+}
+
+bool C3dglTerrain::isLineOfSight(const float from[3], const float to[3])
+{
+	float dir[3] = { to[0] - from[0], to[1] - from[1], to[2] - from[2] };
+	return rayCast(from, dir, sqrt(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2])) < 0;
+}
+
+unsigned short C3dglTerrain::quantiseHeight(float h)
+{
+	float q = (h - m_fMinHeight) / m_fHeightScale * 65535.0f + 0.5f;
+	return (unsigned short)max(0.0f, min(65535.0f, q));
+}
+
+// octahedral encoding: the vector is projected onto the octahedron |x| + |y| + |z| = 1, the lower half is folded over the upper one
+void C3dglTerrain::octEncode(float x, float y, float z, signed char out[2])
+{
+	float l = fabs(x) + fabs(y) + fabs(z);
+	float u = x / l, v = z / l;
+	if (y < 0)
+	{
+		float u0 = u;
+		u = (1 - fabs(v)) * (u0 >= 0 ? 1 : -1);
+		v = (1 - fabs(u0)) * (v >= 0 ? 1 : -1);
+	}
+	out[0] = (signed char)floor(u * 127 + 0.5f);
+	out[1] = (signed char)floor(v * 127 + 0.5f);
+}
+
+// Vertex cache optimisation
+
+#define RESTART_INDEX			0xFFFFFFFF	// primitive restart index (truncated to 0xFFFF for 16-bit indices)
+#define TERRAIN_VERTEX_CACHE	32			// post-transform cache size assumed by the optimisation and the ACMR report
+
+// simulates a FIFO post-transform vertex cache for a single draw call; adds the cache misses and the triangles drawn
+static void simulateVertexCache(const unsigned *indices, unsigned nIndices, bool bStrip, unsigned &nMisses, unsigned &nTriangles)
+{
+	unsigned cache[TERRAIN_VERTEX_CACHE];
+	unsigned nCached = 0, iNext = 0;
+	unsigned nStrip = 0;
+	for (unsigned i = 0; i < nIndices; i++)
+	{
+		unsigned index = indices[i];
+		if (index == RESTART_INDEX)
+		{
+			nStrip = 0;
+			continue;
+		}
+
+		if (std::find(cache, cache + nCached, index) == cache + nCached)
+		{
+			nMisses++;
+			cache[iNext] = index;
+			iNext = (iNext + 1) % TERRAIN_VERTEX_CACHE;
+			if (nCached < TERRAIN_VERTEX_CACHE) nCached++;
+		}
+
+		if (!bStrip)
+		{
+			if (i % 3 == 2) nTriangles++;
+		}
+		else if (++nStrip >= 3 && index != indices[i - 1] && index != indices[i - 2] && indices[i - 1] != indices[i - 2])
+			nTriangles++;		// degenerate triangles are not counted
+	}
+}
+
+// vertex score for the Forsyth optimisation: recently used vertices and vertices with few triangles left score higher
+static float vertexScore(int nCachePos, int nRemaining)
+{
+	static float cacheScores[TERRAIN_VERTEX_CACHE], valenceScores[16];
+	static bool bInitialised = false;
+	if (!bInitialised)
+	{
+		for (int i = 0; i < TERRAIN_VERTEX_CACHE; i++)
+			cacheScores[i] = (i < 3) ? 0.75f : pow(1.0f - (float)(i - 3) / (TERRAIN_VERTEX_CACHE - 3), 1.5f);
+		for (int i = 1; i < 16; i++)
+			valenceScores[i] = 2.0f / sqrt((float)i);
+		bInitialised = true;
+	}
+
+	if (nRemaining == 0) return -1;
+	float score = (nCachePos >= 0) ? cacheScores[nCachePos] : 0;
+	return score + (nRemaining < 16 ? valenceScores[nRemaining] : 2.0f / sqrt((float)nRemaining));
+}
+
+// Tom Forsyth's linear-speed vertex cache optimisation of a triangle list (in place)
+// Triangles are emitted greedily, always the one with the highest score among those using the cached vertices.
+static void optimiseVertexCache(unsigned *indices, unsigned nIndices)
+{
+	unsigned nTriangles = nIndices / 3;
+
+	// local vertex numbers
+	vector<unsigned> vertices(indices, indices + nIndices);
+	std::sort(vertices.begin(), vertices.end());
+	vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+	unsigned nVertices = vertices.size();
+	vector<int> local(nIndices);
+	for (unsigned i = 0; i < nIndices; i++)
+		local[i] = std::lower_bound(vertices.begin(), vertices.end(), indices[i]) - vertices.begin();
+
+	// triangles using each vertex: adjacency[adjFirst[v] .. adjFirst[v] + nRemaining[v]) - not yet emitted
+	vector<int> nRemaining(nVertices, 0), adjFirst(nVertices + 1, 0), adjacency(nIndices);
+	for (unsigned i = 0; i < nIndices; i++)
+		nRemaining[local[i]]++;
+	for (unsigned v = 0; v < nVertices; v++)
+		adjFirst[v + 1] = adjFirst[v] + nRemaining[v];
+	vector<int> fill(adjFirst.begin(), adjFirst.end() - 1);
+	for (unsigned i = 0; i < nIndices; i++)
+		adjacency[fill[local[i]]++] = i / 3;
+
+	// initial scores
+	vector<int> cachePos(nVertices, -1);
+	vector<float> vScore(nVertices), tScore(nTriangles);
+	vector<bool> emitted(nTriangles, false);
+	for (unsigned v = 0; v < nVertices; v++)
+		vScore[v] = vertexScore(-1, nRemaining[v]);
+	for (unsigned t = 0; t < nTriangles; t++)
+		tScore[t] = vScore[local[t * 3]] + vScore[local[t * 3 + 1]] + vScore[local[t * 3 + 2]];
+
+	vector<unsigned> out;
+	out.reserve(nIndices);
+	vector<int> cache, newCache;
+	int iBest = -1;
+	for (unsigned n = 0; n < nTriangles; n++)
+	{
+		if (iBest < 0)
+		{
+			// no candidates among the cached vertices - take the best of all the remaining triangles
+			float fBest = -1;
+			for (unsigned t = 0; t < nTriangles; t++)
+				if (!emitted[t] && tScore[t] > fBest)
+				{
+					fBest = tScore[t];
+					iBest = t;
+				}
+		}
+
+		// emit the triangle
+		emitted[iBest] = true;
+		newCache.clear();
+		for (int k = 0; k < 3; k++)
+		{
+			int v = local[iBest * 3 + k];
+			out.push_back(indices[iBest * 3 + k]);
+			int *p = &adjacency[adjFirst[v]];
+			int *pEnd = p + nRemaining[v];
+			std::swap(*std::find(p, pEnd, iBest), pEnd[-1]);
+			nRemaining[v]--;
+			newCache.push_back(v);
+		}
+
+		// the vertices of the triangle move to the front of the cache
+		for (int v : cache)
+			if (v != newCache[0] && v != newCache[1] && v != newCache[2])
+				newCache.push_back(v);
+		for (unsigned i = 0; i < newCache.size(); i++)
+		{
+			int v = newCache[i];
+			cachePos[v] = (i < TERRAIN_VERTEX_CACHE) ? (int)i : -1;
+			vScore[v] = vertexScore(cachePos[v], nRemaining[v]);
+		}
+		cache.assign(newCache.begin(), newCache.begin() + min(newCache.size(), (size_t)TERRAIN_VERTEX_CACHE));
+
+		// update the triangle scores and find the next candidate
+		iBest = -1;
+		float fBest = -1;
+		for (int v : newCache)
+			for (int i = adjFirst[v]; i < adjFirst[v] + nRemaining[v]; i++)
+			{
+				int t = adjacency[i];
+				tScore[t] = vScore[local[t * 3]] + vScore[local[t * 3 + 1]] + vScore[local[t * 3 + 2]];
+				if (cachePos[v] >= 0 && tScore[t] > fBest)
+				{
+					fBest = tScore[t];
+					iBest = t;
+				}
+			}
+	}
+
+	std::copy(out.begin(), out.end(), indices);
+}
+
+// Reads a channel of the bitmap (pBits points to the channel of the first pixel, nStride channels per pixel)
+// and passes its values to fn(x, z, v), (x, z) being the grid point of the height map (bitmap rows run along x, bottom-up).
+// Each band of 64 columns is processed row by row, so that the bitmap is read sequentially.
+template <class T, class F> static void decodeBitmap(C3dglThreadPool *pPool, const T *pBits, int nStride, int nSizeX, int nSizeZ, F fn)
+{
+	pPool->parallelFor(nSizeX, [=](int i0, int i1)
+	{
+		for (int j = 0; j < nSizeZ; j++)
+			for (int i = i0; i < i1; i++)
+				fn(i, nSizeZ - 1 - j, pBits[((size_t)i + (size_t)j * nSizeX) * nStride]);
+	}, 64);
+}
+
 bool C3dglTerrain::loadHeightmap(const std::string filename, float scaleHeight)
 {
+	// the mesh cache - if valid, the bitmap is not even decoded
+	std::string cacheFile = filename + ".meshcache";
+	CACHE_HEADER key;
+	bool bCache = m_bMeshCache && makeCacheKey(filename, scaleHeight, key);
+	if (bCache && loadMeshCache(cacheFile, key))
+		return true;
+
+	// the bitmap is decoded in its own format, not expanded to RGBA: the heights come from the single channel
+	// of grey scale images or the red channel of colour images, 8 or 16 bits per channel
 	C3dglBitmap bm;
-	bm.load(filename, GL_RGBA);
+	bm.load(filename, 0, 0);
+	int nChannel = -1;
+	switch (bm.getFormat())
+	{
+	case GL_LUMINANCE: case GL_LUMINANCE_ALPHA: case GL_RGB: case GL_RGBA: nChannel = 0; break;
+	case GL_BGR: case GL_BGRA: nChannel = 2; break;
+	}
+	if (nChannel < 0 || (bm.getType() != GL_UNSIGNED_BYTE && bm.getType() != GL_UNSIGNED_SHORT))
+	{
+		// anything else (palettes, floating point channels) is converted
+		bm.load(filename, GL_RGBA, GL_UNSIGNED_SHORT);
+		nChannel = 0;
+	}
+	bool b16Bit = bm.getType() == GL_UNSIGNED_SHORT;
+	int nStride = bm.getBytesPerPixel() / (b16Bit ? 2 : 1);		// channels per pixel
+	float fScale = scaleHeight / (b16Bit ? 65536.0f : 256.0f);
 
 	m_nSizeX = bm.getWidth();
 	m_nSizeZ = abs(bm.getHeight());
 
 	// Collect Height Values
-    m_heights.reserve(m_nSizeX * m_nSizeZ); //Reserve some space (faster)
-	for (int i = 0; i < m_nSizeX; i++)
-		for (int j = m_nSizeZ - 1; j >= 0; j--)
+	int nSizeX = m_nSizeX, nSizeZ = m_nSizeZ;
+	size_t n = layoutHeights();
+	if (m_bQuantisedHeights)
+	{
+		// the raw values first, then stretched over the full 16 bits
+		vector<float>().swap(m_heights);
+		m_quantisedHeights.resize(n);
+		unsigned short *pQ = n ? &m_quantisedHeights[0] : NULL;
+		auto store = [this, pQ](int x, int z, unsigned v) { pQ[heightIndex(x, z)] = (unsigned short)v; };
+		if (b16Bit)
+			decodeBitmap(getThreadPool(), (const unsigned short*)bm.getBits() + nChannel, nStride, nSizeX, nSizeZ, store);
+		else
+			decodeBitmap(getThreadPool(), (const unsigned char*)bm.getBits() + nChannel, nStride, nSizeX, nSizeZ, store);
+		fillPadding(m_quantisedHeights);
+
+		unsigned vMin = n ? *std::min_element(pQ, pQ + n) : 0;
+		unsigned vMax = n ? *std::max_element(pQ, pQ + n) : 0;
+		m_fMinHeight = vMin * fScale;
+		m_fHeightScale = vMax > vMin ? (vMax - vMin) * fScale : 1;
+		if (vMax > vMin && (vMin > 0 || vMax < 65535))
 		{
-			int index = (i + j * m_nSizeX) * 4;
-			unsigned char *pBytes = (unsigned char*)(bm.GetBits());
-			unsigned char val = pBytes[index];
-			float f = (float)val / 256.0f;
-			m_heights.push_back(f * scaleHeight);
+			float k = 65535.0f / (vMax - vMin);
+			getThreadPool()->parallelFor((int)n, [pQ, vMin, k](int i0, int i1)
+			{
+				for (int i = i0; i < i1; i++)
+					pQ[i] = (unsigned short)((pQ[i] - vMin) * k + 0.5f);
+			}, 65536);
 		}
+	}
+	else
+	{
+		vector<unsigned short>().swap(m_quantisedHeights);
+		m_heights.resize(n);
+		float *pHeights = n ? &m_heights[0] : NULL;
+		auto store = [this, pHeights, fScale](int x, int z, unsigned v) { pHeights[heightIndex(x, z)] = v * fScale; };
+		if (b16Bit)
+			decodeBitmap(getThreadPool(), (const unsigned short*)bm.getBits() + nChannel, nStride, nSizeX, nSizeZ, store);
+		else
+			decodeBitmap(getThreadPool(), (const unsigned char*)bm.getBits() + nChannel, nStride, nSizeX, nSizeZ, store);
+		fillPadding(m_heights);
+		findHeightRange(pHeights, n);
+	}
 
 //bool C3dglTerrain::loadHeightmap(const std::wstring& rawFile, float scaleHeight)
 //{
@@ -120,62 +765,31 @@ bool C3dglTerrain::loadHeightmap(const std::string filename, float scaleHeight)
 //			m_heights.push_back(f);
 //		}
 
-	// Collect Vertices, Normals and Lines (the latter - for the visualisation of normal vectors)
-    vector<float> vertices;
-    vector<float> normals;
-    vector<float> texCoords;
-	vector<float> lines;
-	int minx = -m_nSizeX/2;
-	int minz = -m_nSizeZ/2;
-	for (int x = minx; x < minx + m_nSizeX; x++)
-		for (int z = minz; z < minz + m_nSizeZ; z++)
-		{
-			vertices.push_back((float)x);
-			vertices.push_back(getHeight(x, z));
-			vertices.push_back((float)z);
-
-			int x0 = (x == minx) ? x : x - 1;
-			int x1 = (x == minx + m_nSizeX-1) ? x : x + 1;
-			int z0 = (z == minz) ? z : z - 1;
-			int z1 = (z == minz + m_nSizeZ-1) ? z : z + 1;
-
-			float dy_x = getHeight(x1, z) - getHeight(x0, z);
-			float dy_z = getHeight(x, z1) - getHeight(x, z0);
-			float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
-			normals.push_back(-dy_x / m);
-			normals.push_back(2 / m);
-			normals.push_back(-dy_z / m);
-
-			texCoords.push_back((float)x / 2.f);
-			texCoords.push_back((float)z / 2.f);
-
-			lines.push_back((float)x);
-			lines.push_back(getHeight(x, z));
-			lines.push_back((float)z);
-			lines.push_back(x - dy_x / m);
-			lines.push_back(getHeight(x, z) + 2 / m);
-			lines.push_back(z - dy_z / m);
-		}
-
-	// Prepare Vertex Buffer
-    glGenBuffers(1, &m_vertexBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * vertices.size(), &vertices[0], GL_STATIC_DRAW);
-
-	// Prepare Normal Buffer
-    glGenBuffers(1, &m_normalBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * normals.size(), &normals[0], GL_STATIC_DRAW);
-
-	// Prepare TexCoords Buffer
-	glGenBuffers(1, &m_texCoordBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * texCoords.size(), &texCoords[0], GL_STATIC_DRAW);
+	if (nSizeX < 2 || nSizeZ < 2)
+		return logError("height map too small");
+	buildMesh(nSizeX, nSizeZ, NULL);
+	uploadMesh(bCache ? &key : NULL, cacheFile);
+	return true;
+}
+
+bool C3dglTerrain::createHeightmap(int nSizeX, int nSizeZ, const float *pHeights)
+{
+	if (nSizeX < 2 || nSizeZ < 2)
+		return logError("height map too small");
+
+	buildMesh(nSizeX, nSizeZ, pHeights);
+	uploadMesh();
+	return true;
+}
+
+void C3dglTerrain::buildMesh(int nSizeX, int nSizeZ, const float *pHeights)
+{
+	C3dglThreadPool *pPool = getThreadPool();
 
-	// Prepare Vertex Buffer for Visualisation of Normal Vectors
-    glGenBuffers(1, &m_linesBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * lines.size(), &lines[0], GL_STATIC_DRAW);
+	m_nSizeX = nSizeX;
+	m_nSizeZ = nSizeZ;
+	if (pHeights)
+		storeHeights(pHeights);
 
 	// Generate Indices
 	
@@ -188,93 +802,2360 @@ bool C3dglTerrain::loadHeightmap(const std::string filename, float scaleHeight)
                 |  / |
                 | /  |
      ((z+1)*w+x)*----* ((z+1)*w+x+1)
+
+		The grid is split into chunks of m_nChunkSize x m_nChunkSize cells.
+		Indices of each chunk occupy a contiguous range of the index buffer,
+		so that each chunk can be culled and drawn separately.
+		The order of the indices within the chunk is selected with setIndexOrder.
+		If the chunks are small enough, each chunk gets its own block of vertices
+		(the vertices on the chunk borders are duplicated) and 16-bit indices,
+		relative to the first vertex of the block, are used.
+		The decimated mesh (see setDecimation) has its own triangles in each chunk instead.
+
+		The layout of all the buffers is found first, so that they can be
+		allocated once and then filled in by the thread pool:
+		indices and LOD errors chunk by chunk, vertices in bands of rows (or chunk by chunk).
     */
-    //Generate the triangle indices
-	vector<unsigned int> indices;
-	for (int z = 0; z < m_nSizeZ - 1; ++z)
-		for (int x = 0; x < m_nSizeX - 1; ++x)
+	unsigned nIndices = layoutChunks();
+	m_mesh.indices.resize(nIndices);
+	unsigned *pIndices = nIndices ? &m_mesh.indices[0] : NULL;
+	pPool->parallelFor(m_chunks.size(), [this, pIndices](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			buildChunk(m_chunks[i], pIndices);
+	}, 1);
+	std::map<int, std::vector<unsigned> >().swap(m_indexPatterns);		// no longer needed
+	if (m_fDecimation > 0)
+	{
+		vector<int> chunks(m_chunks.size());
+		for (unsigned i = 0; i < chunks.size(); i++)
+			chunks[i] = i;
+		findDiamondErrors(0, 0, m_nSizeX - 1, m_nSizeZ - 1);
+		decimateChunks(chunks);
+		gatherIndices(m_mesh.indices);
+	}
+
+	// LOD: overall errors and the quadtree
+	buildLOD();
+
+	// min/max pyramid for ray casts
+	buildRayPyramid();
+
+	// In the displacement mode, there are no vertices to build: all the chunks share a single grid patch,
+	// displaced by the vertex shader using the height texture (see uploadMesh)
+	if (m_bDisplacement)
+		return;
+
+	// Collect Vertices, Normals and Lines (the latter - for the visualisation of normal vectors)
+	// In the compact format, heights, morph targets and normals are packed into a single interleaved buffer instead
+	m_mesh.lines.resize(m_nVertices * 6);
+	if (m_bCompact)
+		m_mesh.compact.resize(m_nVertices);
+	else
+	{
+		m_mesh.vertices.resize(m_nVertices * 3);
+		m_mesh.normals.resize(m_nVertices * 3);
+		m_mesh.texCoords.resize(m_nVertices * 2);
+		m_mesh.morph.resize(m_nVertices);
+	}
+	if (m_b16BitIndices)
+		pPool->parallelFor(m_chunks.size(), [this](int i0, int i1)
 		{
-			indices.push_back(x * m_nSizeZ + z); // current point
-			indices.push_back(x * m_nSizeZ + z + 1); // next row
-			indices.push_back((x + 1) * m_nSizeZ + z); // same row, next col
+			for (int i = i0; i < i1; i++)
+			{
+				CHUNK &chunk = m_chunks[i];
+				buildVertices(chunk.x0, chunk.x0 + chunk.nx, chunk.z0, chunk.z0 + chunk.nz, chunk.iFirstVertex);
+			}
+		}, 1);
+	else
+		pPool->parallelFor(m_nSizeX, [this](int x0, int x1)
+		{
+			buildVertices(x0, x1 - 1, 0, m_nSizeZ - 1, x0 * m_nSizeZ);
+		});
+}
 
-			indices.push_back(x * m_nSizeZ + z + 1); // next row
-			indices.push_back((x + 1) * m_nSizeZ + z + 1); //next row, next col
-			indices.push_back((x + 1) * m_nSizeZ + z); // same row, next col
+// Height range - for the quantisation of the compact vertices, the height texture and the quantised heights
+void C3dglTerrain::findHeightRange(const float *pHeights, size_t n)
+{
+	m_fMinHeight = m_fHeightScale = 0;
+	if (n)
+	{
+		float fMaxHeight = m_fMinHeight = pHeights[0];
+		for (size_t i = 0; i < n; i++)
+		{
+			if (pHeights[i] < m_fMinHeight) m_fMinHeight = pHeights[i];
+			if (pHeights[i] > fMaxHeight) fMaxHeight = pHeights[i];
 		}
+		m_fHeightScale = fMaxHeight - m_fMinHeight;
+	}
+	if (m_fHeightScale <= 0) m_fHeightScale = 1;
+}
 
-	// Prepare Index Buffer
-    glGenBuffers(1, &m_indexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), &indices[0], GL_STATIC_DRAW);
+// Height layout: the linear layout is the x-major array of the height map; the tiled one is an x-major array of tiles,
+// each one an x-major array of 2^TERRAIN_TILE_BITS x 2^TERRAIN_TILE_BITS heights. Partial tiles at the edges are padded.
+size_t C3dglTerrain::layoutHeights()
+{
+	if (m_heightLayout == LAYOUT_LINEAR)
+		return (size_t)m_nSizeX * m_nSizeZ;
+	int nTile = 1 << TERRAIN_TILE_BITS;
+	m_nHeightTilesZ = (m_nSizeZ + nTile - 1) / nTile;
+	return (size_t)((m_nSizeX + nTile - 1) / nTile) * m_nHeightTilesZ * nTile * nTile;
+}
 
-    return true;
+template <class T> void C3dglTerrain::fillPadding(vector<T> &heights)
+{
+	if (m_heightLayout == LAYOUT_LINEAR || heights.empty())
+		return;
+	int nTile = 1 << TERRAIN_TILE_BITS;
+	int nPaddedX = (m_nSizeX + nTile - 1) / nTile * nTile, nPaddedZ = m_nHeightTilesZ * nTile;
+	T h = heights[heightIndex(0, 0)];
+	for (int x = 0; x < nPaddedX; x++)
+		for (int z = x < m_nSizeX ? m_nSizeZ : 0; z < nPaddedZ; z++)
+			heights[heightIndex(x, z)] = h;
 }
 
-void C3dglTerrain::render()
+// stores the heights of the whole map (x-major), as floats or quantised, in the selected layout
+void C3dglTerrain::storeHeights(const float *pHeights)
 {
-	// check if a shading program is active
-	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
-	if (pProgram)
+	size_t n = (size_t)m_nSizeX * m_nSizeZ;
+	findHeightRange(pHeights, n);
+	size_t nStored = layoutHeights();
+	int nSizeZ = m_nSizeZ;
+	if (m_bQuantisedHeights)
 	{
-		GLuint attribVertex = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX);
-		GLuint attribNormal = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL);
-		GLuint attribTexCoord = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_TEXCOORD);
+		vector<float>().swap(m_heights);
+		m_quantisedHeights.resize(nStored);
+		unsigned short *pQ = &m_quantisedHeights[0];
+		getThreadPool()->parallelFor(m_nSizeX, [this, pHeights, pQ, nSizeZ](int x0, int x1)
+		{
+			for (int x = x0; x < x1; x++)
+				for (int z = 0; z < nSizeZ; z++)
+					pQ[heightIndex(x, z)] = quantiseHeight(pHeights[(size_t)x * nSizeZ + z]);
+		}, 64);
+		fillPadding(m_quantisedHeights);
+	}
+	else if (m_heightLayout == LAYOUT_LINEAR)
+	{
+		vector<unsigned short>().swap(m_quantisedHeights);
+		m_heights.assign(pHeights, pHeights + n);
+	}
+	else
+	{
+		vector<unsigned short>().swap(m_quantisedHeights);
+		m_heights.resize(nStored);
+		float *pStored = &m_heights[0];
+		getThreadPool()->parallelFor(m_nSizeX, [this, pHeights, pStored, nSizeZ](int x0, int x1)
+		{
+			for (int x = x0; x < x1; x++)
+				for (int z = 0; z < nSizeZ; z++)
+					pStored[heightIndex(x, z)] = pHeights[(size_t)x * nSizeZ + z];
+		}, 64);
+		fillPadding(m_heights);
+	}
+}
 
-		// programmable pipeline
-		glEnableVertexAttribArray(attribVertex);
-		glEnableVertexAttribArray(attribNormal);
-		glEnableVertexAttribArray(attribTexCoord);
+// quantised heights: sets the new height range and converts the heights to it
+void C3dglTerrain::requantiseHeights(float fMinHeight, float fHeightScale)
+{
+	float fOldMin = m_fMinHeight, fOldScale = m_fHeightScale;
+	m_fMinHeight = fMinHeight;
+	m_fHeightScale = fHeightScale;
+	unsigned short *pQ = &m_quantisedHeights[0];
+	getThreadPool()->parallelFor((int)m_quantisedHeights.size(), [this, pQ, fOldMin, fOldScale](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			pQ[i] = quantiseHeight(fOldMin + fOldScale * pQ[i] * (1.0f / 65535));
+	}, 65536);
+}
 
-		//Bind the vertex array and set the vertex pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
-		glVertexAttribPointer(attribVertex, 3, GL_FLOAT, GL_FALSE, 0, 0);
+// heights at (x, z0..z1), indexed by z: directly from m_heights if linear, otherwise copied (and decoded) into buf
+const float *C3dglTerrain::getHeightRow(int x, int z0, int z1, vector<float> &buf)
+{
+	if (!m_bQuantisedHeights && m_heightLayout == LAYOUT_LINEAR)
+		return &m_heights[x * m_nSizeZ];
+	buf.resize(m_nSizeZ);
+	for (int z = z0; z <= z1; z++)
+		buf[z] = height(x, z);
+	return &buf[0];
+}
 
-		// Bind the normal array and set the normal pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
-		glVertexAttribPointer(attribNormal, 3, GL_FLOAT, GL_FALSE, 0, 0);
+// Height Texture: a single channel, 16-bit normalised texture, s along z and t along x (the layout of m_heights)
+void C3dglTerrain::uploadHeightTexture(int x0, int z0, int x1, int z1)
+{
+	// the whole map unless a rectangle (height map coordinates, inclusive) is given
+	if (x1 < 0)
+	{
+		x0 = z0 = 0;
+		x1 = m_nSizeX - 1;
+		z1 = m_nSizeZ - 1;
+	}
+	int nRow = z1 - z0 + 1;
+	vector<unsigned short> heights((x1 - x0 + 1) * nRow);
+	for (int x = x0; x <= x1; x++)
+		for (int z = z0; z <= z1; z++)
+			heights[(x - x0) * nRow + z - z0] = m_bQuantisedHeights ? m_quantisedHeights[heightIndex(x, z)] : quantiseHeight(m_heights[heightIndex(x, z)]);
 
-		// Bind the tex coord array and set the tex coord pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
-		glVertexAttribPointer(attribTexCoord, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	if (m_heightTexture == 0)
+	{
+		glGenTextures(1, &m_heightTexture);
+		glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, m_nSizeZ, m_nSizeX, 0, GL_RED, GL_UNSIGNED_SHORT, NULL);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, z0, x0, nRow, x1 - x0 + 1, GL_RED, GL_UNSIGNED_SHORT, &heights[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+unsigned C3dglTerrain::getHeightTexture()
+{
+	if (m_heightTexture == 0 && m_nSizeX > 0)
+		uploadHeightTexture();
+	return m_heightTexture;
+}
 
-		//Bind the index array and draw triangles
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-		glDrawElements(GL_TRIANGLES, (m_nSizeX - 1) * (m_nSizeZ - 1) * 6, GL_UNSIGNED_INT, 0);
+bool C3dglTerrain::setHeights(const float *pHeights)
+{
+	if (!m_bDisplacement || m_heightTexture == 0)
+		return logError("setHeights requires the displacement mode");
 
-		glDisableVertexAttribArray(attribVertex);
-		glDisableVertexAttribArray(attribNormal);
-		glDisableVertexAttribArray(attribTexCoord);
+	// only the bounds and errors of the chunks are updated - the indices and the grid patch stay the same
+	storeHeights(pHeights);
+	getThreadPool()->parallelFor(m_chunks.size(), [this](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			buildChunk(m_chunks[i], NULL);
+	}, 1);
+	buildLOD();
+	buildRayPyramid();
+	uploadHeightTexture();
+	if (m_fDecimation > 0)
+	{
+		vector<int> chunks(m_chunks.size());
+		for (unsigned i = 0; i < chunks.size(); i++)
+			chunks[i] = i;
+		findDiamondErrors(0, 0, m_nSizeX - 1, m_nSizeZ - 1);
+		decimateChunks(chunks);
+		uploadIndices();
+		uploadNormalMap();
 	}
-	else
+	if (m_lightMap)
 	{
-		// fixed pipeline rendering
-		glEnableClientState(GL_VERTEX_ARRAY);
-		glEnableClientState(GL_NORMAL_ARRAY);
-
-		//Bind the vertex array and set the vertex pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
-		glVertexPointer(3, GL_FLOAT, 0, 0);
+		REGION all = { 0, 0, m_nSizeX - 1, m_nSizeZ - 1 };
+		bakeLightRegion(all);
+		if (m_nSunRow >= 0)
+			m_nSunRow = 0;
+	}
+	return true;
+}
 
-		// Bind the normal array and set the normal pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
-		glNormalPointer(GL_FLOAT, 0, 0);
+void C3dglTerrain::uploadMesh(const CACHE_HEADER *pKey, const std::string cacheFile)
+{
+	// Report the post-transform vertex cache efficiency of the full resolution mesh
+	vector<unsigned> &indices = m_mesh.indices;
+	unsigned nMisses = 0, nTriangles = 0;
+	for (CHUNK &chunk : m_chunks)
+		simulateVertexCache(&indices[chunk.iFirst], chunk.nIndices, m_indexOrder == ORDER_STRIPS, nMisses, nTriangles);
+	m_fACMR = nTriangles ? (float)nMisses / (float)nTriangles : 0;
 
-		// Bind the tex coord array and set the tex coord pointer to point at it
-		glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
-		glTexCoordPointer(2, GL_FLOAT, 0, 0);
+	// GPU-ready buffers
+	vector<unsigned short> indices16;
+	if (m_b16BitIndices)
+		indices16.assign(indices.begin(), indices.end());
+	const void *pData[SECTION_COUNT];
+	size_t sizes[SECTION_COUNT];
+	#define SECTION(i, v)	{ pData[i] = v.empty() ? NULL : &v[0]; sizes[i] = v.size() * sizeof(v[0]); }
+	SECTION(SECTION_VERTICES, m_mesh.vertices);
+	SECTION(SECTION_NORMALS, m_mesh.normals);
+	SECTION(SECTION_TEXCOORDS, m_mesh.texCoords);
+	SECTION(SECTION_MORPH, m_mesh.morph);
+	SECTION(SECTION_COMPACT, m_mesh.compact);
+	SECTION(SECTION_LINES, m_mesh.lines);
+	if (m_b16BitIndices)
+		SECTION(SECTION_INDICES, indices16)
+	else
+		SECTION(SECTION_INDICES, indices)
+	#undef SECTION
 
-		//Bind the index array and draw triangles
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
-		glDrawElements(GL_TRIANGLES, (m_nSizeX - 1) * (m_nSizeZ - 1) * 6, GL_UNSIGNED_INT, 0);
+	if (pKey)
+		saveMeshCache(cacheFile, *pKey, pData, sizes);		// adds the CPU side sections
+	uploadBuffers(pData, sizes);
 
-		glDisableClientState(GL_VERTEX_ARRAY);
-		glDisableClientState(GL_NORMAL_ARRAY);
-	}
+	// the CPU copy is no longer needed
+	MESH().swap(m_mesh);
 }
 
-void C3dglTerrain::renderNormals()
+void C3dglTerrain::uploadBuffers(const void *pData[], const size_t sizes[])
 {
+	if (m_bDisplacement)
+	{
+		// Prepare the Height Texture
+		uploadHeightTexture();
+
+		// Prepare the Grid Patch - (x, z) positions relative to the first grid point of a chunk
+		vector<unsigned short> patch;
+		patch.reserve(m_nVertices * 2);
+		for (int i = 0; i <= m_nChunkSize; i++)
+			for (int j = 0; j <= m_nChunkSize; j++)
+			{
+				patch.push_back(i);
+				patch.push_back(j);
+			}
+		glGenBuffers(1, &m_patchBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_patchBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(GLushort) * patch.size(), &patch[0], GL_STATIC_DRAW);
+	}
+	else if (m_bCompact)
+	{
+		// Prepare the Interleaved Compact Vertex Buffer
+		glGenBuffers(1, &m_compactBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_compactBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_COMPACT], pData[SECTION_COMPACT], GL_STATIC_DRAW);
+	}
+	else
+	{
+		// Prepare Vertex Buffer
+		glGenBuffers(1, &m_vertexBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_VERTICES], pData[SECTION_VERTICES], GL_STATIC_DRAW);
+
+		// Prepare Normal Buffer
+		glGenBuffers(1, &m_normalBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_NORMALS], pData[SECTION_NORMALS], GL_STATIC_DRAW);
+
+		// Prepare TexCoords Buffer
+		glGenBuffers(1, &m_texCoordBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_TEXCOORDS], pData[SECTION_TEXCOORDS], GL_STATIC_DRAW);
+
+		// Prepare Morph Target Buffer
+		glGenBuffers(1, &m_morphBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_morphBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_MORPH], pData[SECTION_MORPH], GL_STATIC_DRAW);
+	}
+
+	// Prepare the Normal Map of the Decimated Mesh
+	if (m_fDecimation > 0)
+		uploadNormalMap();
+
+	// Prepare Vertex Buffer for Visualisation of Normal Vectors (not available in the displacement mode)
+	if (sizes[SECTION_LINES])
+	{
+		glGenBuffers(1, &m_linesBuffer);
+		glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
+		glBufferData(GL_ARRAY_BUFFER, sizes[SECTION_LINES], pData[SECTION_LINES], GL_STATIC_DRAW);
+	}
+
+	// Prepare Index Buffer
+    glGenBuffers(1, &m_indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizes[SECTION_INDICES], pData[SECTION_INDICES], GL_STATIC_DRAW);
+
+	const char *pOrderNames[] = { "rows", "strips", "optimised" };
+	std::ostringstream info;
+	info << "index order: " << pOrderNames[m_indexOrder] << (m_bPrimitiveRestart ? " (primitive restart)" : "")
+		<< ", " << (m_b16BitIndices ? 16 : 32) << "-bit indices, ACMR = " << std::setprecision(3) << m_fACMR
+		<< " (FIFO cache of " << TERRAIN_VERTEX_CACHE << "), vertex data: " << getVertexDataSize() / 1024 << " KB";
+	if (m_fDecimation > 0)
+		info << ", decimated mesh: " << m_nDecimatedTriangles << " triangles (1/" << std::setprecision(3)
+			<< (float)(m_nSizeX - 1) * (m_nSizeZ - 1) * 2 / max(m_nDecimatedTriangles, 1u) << " of the full grid)";
+	logSuccess(info.str());
+}
+
+// Mesh Cache
+// The cache file is the header followed by the sections (see CACHE_SECTION), each aligned to 16 bytes.
+// The header holds the key - the hash of the height map file and everything else the mesh depends on -
+// and the state of the terrain; the sections hold the GPU-ready buffers and the CPU side data (heights, chunks, quadtree).
+
+// FNV-1a hash of the height map file; false if the file cannot be read
+static bool hashFile(const std::string filename, unsigned long long &nHash)
+{
+	HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD nSizeHigh = 0;
+	DWORD nSize = GetFileSize(hFile, &nSizeHigh);
+	HANDLE hMapping = nSize ? CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const unsigned char *p = hMapping ? (const unsigned char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+	nHash = 14695981039346656037ULL;
+	if (p)
+		for (DWORD i = 0; i < nSize; i++)
+			nHash = (nHash ^ p[i]) * 1099511628211ULL;
+	nHash ^= nSize;
+
+	if (p) UnmapViewOfFile(p);
+	if (hMapping) CloseHandle(hMapping);
+	CloseHandle(hFile);
+	return p != NULL && nSizeHigh == 0;
+}
+
+template <class T> static void assignSection(vector<T> &v, const void *p, size_t nBytes)
+{
+	v.assign((const T*)p, (const T*)p + nBytes / sizeof(T));
+}
+
+bool C3dglTerrain::makeCacheKey(const std::string filename, float scaleHeight, CACHE_HEADER &key)
+{
+	memset(&key, 0, sizeof(key));
+	memcpy(key.magic, "3DTC", 4);
+	key.nVersion = TERRAIN_CACHE_VERSION;
+	key.nLayout = sizeof(CHUNK) | (sizeof(NODE) << 16);
+	key.fScaleHeight = scaleHeight;
+	key.nChunkSize = m_nChunkSize;
+	key.nIndexOrder = m_indexOrder;
+	key.bCompact = m_bCompact;
+	key.bDisplacement = m_bDisplacement;
+	key.bPrimitiveRestart = m_indexOrder == ORDER_STRIPS && GLEE_NV_primitive_restart;
+	key.bQuantisedHeights = m_bQuantisedHeights;
+	key.nHeightLayout = m_heightLayout;
+	key.fDecimation = m_fDecimation;
+	return hashFile(filename, key.nSourceHash);
+}
+
+void C3dglTerrain::saveMeshCache(const std::string filename, const CACHE_HEADER &key, const void *pData[], size_t sizes[])
+{
+	// the GPU buffers are already in pData - the CPU side sections are added here
+	vector<RANGE> pyramid;
+	for (vector<RANGE> &level : m_rayPyramid)
+		pyramid.insert(pyramid.end(), level.begin(), level.end());
+	#define SECTION(i, v)	{ pData[i] = v.empty() ? NULL : &v[0]; sizes[i] = v.size() * sizeof(v[0]); }
+	if (m_bQuantisedHeights)
+		SECTION(SECTION_HEIGHTS, m_quantisedHeights)
+	else
+		SECTION(SECTION_HEIGHTS, m_heights)
+	SECTION(SECTION_CHUNKS, m_chunks);
+	SECTION(SECTION_NODES, m_nodes);
+	SECTION(SECTION_PYRAMID, pyramid);
+	#undef SECTION
+
+	// the header
+	CACHE_HEADER header = key;
+	header.nSizeX = m_nSizeX;
+	header.nSizeZ = m_nSizeZ;
+	header.nChunkSizeUsed = m_nChunkSize;
+	header.nChunksX = m_nChunksX;
+	header.nChunksZ = m_nChunksZ;
+	header.nLodLevels = m_nLodLevels;
+	header.b16BitIndices = m_b16BitIndices;
+	header.nVertices = m_nVertices;
+	header.fMinHeight = m_fMinHeight;
+	header.fHeightScale = m_fHeightScale;
+	header.fChunkDiagonal = m_fChunkDiagonal;
+	header.fACMR = m_fACMR;
+	memcpy(header.lodMaxError, m_lodMaxError, sizeof(m_lodMaxError));
+	unsigned long long offset = (sizeof(CACHE_HEADER) + 15) & ~15ULL;
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		header.offsets[i] = offset;
+		header.sizes[i] = sizes[i];
+		offset = (offset + sizes[i] + 15) & ~15ULL;
+	}
+
+	// the header is written last - an incomplete file is never taken for a valid cache
+	std::ofstream file(filename.c_str(), std::ios::binary);
+	CACHE_HEADER empty;
+	memset(&empty, 0, sizeof(empty));
+	file.write((const char*)&empty, sizeof(empty));
+	for (int i = 0; i < SECTION_COUNT; i++)
+	{
+		file.seekp(header.offsets[i]);
+		if (sizes[i])
+			file.write((const char*)pData[i], sizes[i]);
+	}
+	file.seekp(offset - 1);
+	file.put(0);
+	file.seekp(0);
+	file.write((const char*)&header, sizeof(header));
+	if (!file.good())
+		logWarning("cannot write the mesh cache: " + filename);
+}
+
+bool C3dglTerrain::loadMeshCache(const std::string filename, const CACHE_HEADER &key)
+{
+	HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	DWORD nSizeHigh = 0;
+	unsigned long long nFileSize = GetFileSize(hFile, &nSizeHigh);
+	nFileSize |= (unsigned long long)nSizeHigh << 32;
+	HANDLE hMapping = nFileSize >= sizeof(CACHE_HEADER) ? CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const char *p = hMapping ? (const char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+	// the key must match, and the sections must be within the file
+	const CACHE_HEADER *pHeader = (const CACHE_HEADER*)p;
+	bool bValid = p && memcmp(pHeader, &key, offsetof(CACHE_HEADER, nSizeX)) == 0;
+	for (int i = 0; bValid && i < SECTION_COUNT; i++)
+		bValid = pHeader->offsets[i] + pHeader->sizes[i] <= nFileSize;
+
+	if (bValid)
+	{
+		// restore the state
+		m_nSizeX = pHeader->nSizeX;
+		m_nSizeZ = pHeader->nSizeZ;
+		m_nChunkSize = pHeader->nChunkSizeUsed;
+		m_nChunksX = pHeader->nChunksX;
+		m_nChunksZ = pHeader->nChunksZ;
+		m_nLodLevels = pHeader->nLodLevels;
+		m_b16BitIndices = pHeader->b16BitIndices != 0;
+		m_bPrimitiveRestart = pHeader->bPrimitiveRestart != 0;
+		m_nVertices = pHeader->nVertices;
+		m_fMinHeight = pHeader->fMinHeight;
+		m_fHeightScale = pHeader->fHeightScale;
+		m_fChunkDiagonal = pHeader->fChunkDiagonal;
+		m_fACMR = pHeader->fACMR;
+		memcpy(m_lodMaxError, pHeader->lodMaxError, sizeof(m_lodMaxError));
+
+		// the CPU side data
+		const void *pData[SECTION_COUNT];
+		size_t sizes[SECTION_COUNT];
+		for (int i = 0; i < SECTION_COUNT; i++)
+		{
+			pData[i] = p + pHeader->offsets[i];
+			sizes[i] = (size_t)pHeader->sizes[i];
+		}
+		layoutHeights();
+		if (m_bQuantisedHeights)
+			assignSection(m_quantisedHeights, pData[SECTION_HEIGHTS], sizes[SECTION_HEIGHTS]);
+		else
+			assignSection(m_heights, pData[SECTION_HEIGHTS], sizes[SECTION_HEIGHTS]);
+		assignSection(m_chunks, pData[SECTION_CHUNKS], sizes[SECTION_CHUNKS]);
+		if (m_fDecimation > 0)
+		{
+			// the triangles of each chunk - from the index buffer
+			m_chunkIndices.assign(m_chunks.size(), vector<unsigned>());
+			m_nDecimatedTriangles = 0;
+			for (unsigned i = 0; i < m_chunks.size(); i++)
+			{
+				CHUNK &chunk = m_chunks[i];
+				if (m_b16BitIndices)
+				{
+					const unsigned short *pIndices = (const unsigned short*)pData[SECTION_INDICES] + chunk.iFirst;
+					m_chunkIndices[i].assign(pIndices, pIndices + chunk.nIndices);
+				}
+				else
+				{
+					const unsigned *pIndices = (const unsigned*)pData[SECTION_INDICES] + chunk.iFirst;
+					m_chunkIndices[i].assign(pIndices, pIndices + chunk.nIndices);
+				}
+				m_nDecimatedTriangles += chunk.nIndices / 3;
+			}
+		}
+		assignSection(m_nodes, pData[SECTION_NODES], sizes[SECTION_NODES]);
+		const RANGE *pRange = (const RANGE*)pData[SECTION_PYRAMID];
+		m_rayPyramid.clear();
+		for (int k = 1; getPyramidSize(m_nSizeX - 1, k - 1) > 1 || getPyramidSize(m_nSizeZ - 1, k - 1) > 1; k++)
+		{
+			size_t n = getPyramidSize(m_nSizeX - 1, k) * getPyramidSize(m_nSizeZ - 1, k);
+			m_rayPyramid.push_back(vector<RANGE>(pRange, pRange + n));
+			pRange += n;
+		}
+
+		// the GPU buffers - uploaded straight from the mapped file
+		uploadBuffers(pData, sizes);
+	}
+
+	if (p) UnmapViewOfFile(p);
+	if (hMapping) CloseHandle(hMapping);
+	CloseHandle(hFile);
+	if (bValid)
+		logSuccess("mesh restored from the cache: " + filename);
+	return bValid;
+}
+
+unsigned C3dglTerrain::layoutChunks()
+{
+	m_indexPatterns.clear();
+	m_chunks.clear();
+	if (m_nChunkSize < 1) m_nChunkSize = 1;
+	if (m_bDisplacement && m_nChunkSize > 254)
+	{
+		logWarning("chunk size reduced to 254 - the grid patch is indexed with 16-bit indices");
+		m_nChunkSize = 254;
+	}
+	if (m_fDecimation > 0)
+	{
+		// the decimated mesh splits the chunks in halves, down to the single cells
+		int nSize = 2;
+		while (nSize * 2 <= m_nChunkSize)
+			nSize *= 2;
+		if (nSize != m_nChunkSize)
+			logWarning("chunk size set to a power of two for the decimated mesh");
+		m_nChunkSize = nSize;
+		if (m_indexOrder == ORDER_STRIPS)
+		{
+			logWarning("triangle strips not available for the decimated mesh - triangle lists used");
+			m_indexOrder = ORDER_ROWS;
+		}
+	}
+	m_nChunksX = (m_nSizeX - 2) / m_nChunkSize + 1;
+	m_nChunksZ = (m_nSizeZ - 2) / m_nChunkSize + 1;
+	m_b16BitIndices = (m_nChunkSize + 1) * (m_nChunkSize + 1) < 0xFFFF;	// 0xFFFF is reserved for the primitive restart
+	m_bPrimitiveRestart = m_indexOrder == ORDER_STRIPS && GLEE_NV_primitive_restart;
+
+	// chunks, their blocks of vertices and the ranges of indices for the full resolution
+	// in the displacement mode all the chunks share the grid patch of (m_nChunkSize + 1)^2 vertices
+	unsigned nIndices = 0;
+	m_nVertices = m_b16BitIndices ? 0 : m_nSizeX * m_nSizeZ;
+	if (m_bDisplacement)
+		m_nVertices = (m_nChunkSize + 1) * (m_nChunkSize + 1);
+	for (int cx = 0; cx < m_nSizeX - 1; cx += m_nChunkSize)
+		for (int cz = 0; cz < m_nSizeZ - 1; cz += m_nChunkSize)
+		{
+			CHUNK chunk;
+			chunk.x0 = cx;
+			chunk.z0 = cz;
+			chunk.nx = min(m_nChunkSize, m_nSizeX - 1 - cx);
+			chunk.nz = min(m_nChunkSize, m_nSizeZ - 1 - cz);
+			chunk.iFirstVertex = 0;
+			if (m_b16BitIndices && !m_bDisplacement)
+			{
+				chunk.iFirstVertex = m_nVertices;
+				m_nVertices += (chunk.nx + 1) * (chunk.nz + 1);
+			}
+			chunk.iFirst = chunk.iLodFirst[0] = nIndices;
+			chunk.nIndices = chunk.nLodIndices[0] = m_fDecimation > 0 ? 0 : countChunkIndices(chunk, 1);
+			chunk.nLevels = 1;
+			nIndices += chunk.nIndices;
+			m_chunks.push_back(chunk);
+		}
+
+	// the decimated mesh has no coarser levels - and its triangles are found later (see decimateChunks)
+	if (m_fDecimation > 0)
+		return 0;
+
+	// coarser levels (see the LOD support below)
+	for (CHUNK &chunk : m_chunks)
+		for (int L = 1; L < TERRAIN_MAX_LOD; L++)
+		{
+			int s = 1 << L;
+			if (chunk.nx % s || chunk.nz % s) break;
+			chunk.iLodFirst[L] = nIndices;
+			chunk.nLodIndices[L] = countChunkIndices(chunk, s);
+			chunk.nLevels = L + 1;
+			nIndices += chunk.nLodIndices[L];
+		}
+
+	// triangle list patterns, shared by all the chunks of the same size
+	if (m_indexOrder != ORDER_STRIPS)
+		for (CHUNK &chunk : m_chunks)
+			for (int L = 0; L < chunk.nLevels; L++)
+			{
+				int nx = chunk.nx >> L, nz = chunk.nz >> L;
+				std::vector<unsigned> &pattern = m_indexPatterns[(nx << 16) | nz];
+				if (!pattern.empty()) continue;
+
+				// vertices are numbered i * (nz + 1) + j
+				pattern.reserve(nx * nz * 6);
+				for (int j = 0; j < nz; j++)
+					for (int i = 0; i < nx; i++)
+					{
+						pattern.push_back(i * (nz + 1) + j); // current point
+						pattern.push_back(i * (nz + 1) + j + 1); // next row
+						pattern.push_back((i + 1) * (nz + 1) + j); // same row, next col
+
+						pattern.push_back(i * (nz + 1) + j + 1); // next row
+						pattern.push_back((i + 1) * (nz + 1) + j + 1); //next row, next col
+						pattern.push_back((i + 1) * (nz + 1) + j); // same row, next col
+					}
+				if (m_indexOrder == ORDER_OPTIMISED)
+					optimiseVertexCache(&pattern[0], pattern.size());
+
+				// store (i, j) pairs instead - no divisions when the pattern is applied
+				for (unsigned &index : pattern)
+					index = ((index / (nz + 1)) << 16) | (index % (nz + 1));
+			}
+
+	return nIndices;
+}
+
+unsigned C3dglTerrain::countChunkIndices(const CHUNK &chunk, int s)
+{
+	int nx = chunk.nx / s, nz = chunk.nz / s;
+	if (m_indexOrder == ORDER_STRIPS)
+		return nz * (nx + 1) * 2 + (nz - 1) * (m_bPrimitiveRestart ? 1 : 2);
+	else
+		return nx * nz * 6;
+}
+
+// Generates the indices of a chunk at the LOD step s (every s-th grid line) into pIndices.
+// The triangles are always the same as in the diagram above; only their order depends on the index order:
+// ORDER_ROWS - triangle list, row by row
+// ORDER_STRIPS - a triangle strip for each row, separated by primitive restarts or (if not supported) degenerate triangles
+// ORDER_OPTIMISED - triangle list reordered for the post-transform vertex cache
+void C3dglTerrain::buildChunkIndices(const CHUNK &chunk, int s, unsigned *pIndices)
+{
+	int nx = chunk.nx / s, nz = chunk.nz / s;
+
+	// index of the vertex (i, j) of the chunk at this level - relative to the chunk's block of vertices if 16-bit indices are used
+	unsigned iBase = m_b16BitIndices ? 0 : chunk.x0 * m_nSizeZ + chunk.z0;
+	unsigned nStrideI = s * (m_bDisplacement ? m_nChunkSize + 1 : m_b16BitIndices ? chunk.nz + 1 : m_nSizeZ);
+	#define V(i, j)		(iBase + (i) * nStrideI + (j) * s)
+
+	unsigned *p = pIndices;
+	if (m_indexOrder == ORDER_STRIPS)
+	{
+		for (int j = 0; j < nz; j++)
+		{
+			if (j > 0 && m_bPrimitiveRestart)
+				*p++ = RESTART_INDEX;
+			else if (j > 0)
+			{
+				*p = p[-1]; p++;
+				*p++ = V(0, j);
+			}
+			for (int i = 0; i <= nx; i++)
+			{
+				*p++ = V(i, j);
+				*p++ = V(i, j + 1);
+			}
+		}
+	}
+	else
+	{
+		// the pattern of (i, j) pairs is prepared by layoutChunks
+		const std::vector<unsigned> &pattern = m_indexPatterns.find((nx << 16) | nz)->second;
+		for (unsigned ij : pattern)
+			*p++ = V(ij >> 16, ij & 0xFFFF);
+	}
+
+	#undef V
+}
+
+void C3dglTerrain::buildChunk(CHUNK &chunk, unsigned *pIndices)
+{
+	// find the height range
+	chunk.minY = chunk.maxY = height(chunk.x0, chunk.z0);
+	for (int x = chunk.x0; x <= chunk.x0 + chunk.nx; x++)
+		for (int z = chunk.z0; z <= chunk.z0 + chunk.nz; z++)
+		{
+			float h = height(x, z);
+			if (h < chunk.minY) chunk.minY = h;
+			if (h > chunk.maxY) chunk.maxY = h;
+		}
+
+	chunk.lodError[0] = 0;
+	for (int L = 0; L < chunk.nLevels; L++)
+	{
+		// indices - the same pattern as for the full resolution, just with the step of s
+		int s = 1 << L;
+		if (pIndices)
+			buildChunkIndices(chunk, s, pIndices + chunk.iLodFirst[L]);
+		if (L == 0) continue;
+
+		// geometric error: max distance between the full resolution heights and the coarse surface
+		// coarse cell by coarse cell - all the grid points are inside the chunk, so no clamping is needed
+		float error = chunk.lodError[L - 1];
+		float fStep = 1.0f / s;
+		for (int X = chunk.x0; X < chunk.x0 + chunk.nx; X += s)
+			for (int Z = chunk.z0; Z < chunk.z0 + chunk.nz; Z += s)
+			{
+				float h00 = height(X, Z), h01 = height(X, Z + s), h10 = height(X + s, Z), h11 = height(X + s, Z + s);
+				for (int i = 0; i <= s; i++)
+				{
+					// the coarse surface is linear along the row - separately in each of the two triangles
+					float u = i * fStep;
+					float f = h00 + u * (h10 - h00), df = (h01 - h00) * fStep;
+					for (int j = 0; j <= s - i; j++)
+						error = max(error, fabs(f + j * df - height(X + i, Z + j)));
+					f = h11 + (1 - u) * (h01 - h11) + (h10 - h11);
+					df = (h11 - h10) * fStep;
+					for (int j = s - i + 1; j <= s; j++)
+						error = max(error, fabs(f + j * df - height(X + i, Z + j)));
+				}
+			}
+		chunk.lodError[L] = error;
+	}
+}
+
+// Decimated Mesh
+// Each chunk is triangulated as a right-triangulated irregular network: the chunk is cut along a diagonal into two
+// right triangles, and the triangles are split at the midpoints of their hypotenuses for as long as they are too far
+// from the height map samples. Every grid point but the chunk corners is the midpoint of the common hypotenuse of
+// a diamond (a pair of such triangles): the diamonds with a half-size of d are centred at odd multiples of d along
+// one axis and even along the other (the hypotenuse along the odd one), or at odd multiples along both (a diagonal
+// hypotenuse, whose direction alternates). The error of a diamond is the max vertical distance between the samples
+// and its triangles, and at least the errors of the smaller diamonds inside it - so a point is never inserted
+// without the points its triangles depend on, and there are no T-junctions, not even between the chunks: the errors
+// are found for the whole map, and the diamonds on the chunk borders belong to both chunks.
+// The partial chunks (at the far edges of a map not divisible into whole chunks) keep the full grid, and the borders
+// they share with the whole chunks are fully inserted.
+// The same triangles are built for all the vertex formats - the indices refer to the grid points as before.
+
+// finds the errors of the diamonds overlapping the region [x0..x1] x [z0..z1], from the smallest up
+// for each size: the diamonds with the hypotenuse along x and along z first, then those with the diagonal one (their children)
+void C3dglTerrain::findDiamondErrors(int x0, int z0, int x1, int z1)
+{
+	int s = m_nChunkSize;
+	m_diamondErrors.resize(m_nSizeX * m_nSizeZ);
+	for (int d = 1; d <= s / 2; d *= 2)
+		for (int type = 0; type < 3; type++)
+		{
+			// the centres within the reach of the diamonds - with the smaller diamonds inside, whose own halves
+			// reach out of the bigger ones: 2d - 1 along the axes, 3d - 1 with the diagonal hypotenuse
+			int nStep = 2 * d, nReach = (type == 2) ? 3 * d : 2 * d;
+			int xFirst = max(x0 - nReach, 0), zFirst = max(z0 - nReach, 0);
+			xFirst += (((type != 1) ? d : 0) - xFirst % nStep + nStep) % nStep;
+			zFirst += (((type != 0) ? d : 0) - zFirst % nStep + nStep) % nStep;
+			int xLast = min(x1 + nReach, m_nSizeX - 1), zLast = min(z1 + nReach, m_nSizeZ - 1);
+			if (xFirst > xLast || zFirst > zLast)
+				continue;
+			getThreadPool()->parallelFor((xLast - xFirst) / nStep + 1, [this, s, d, type, nStep, xFirst, zFirst, zLast](int i0, int i1)
+			{
+				for (int x = xFirst + i0 * nStep; x < xFirst + i1 * nStep; x += nStep)
+					for (int z = zFirst; z <= zLast; z += nStep)
+						m_diamondErrors[x * m_nSizeZ + z] = getDiamondError(x, z, d, type);
+			});
+		}
+}
+
+// true if the chunk (cx, cz) exists and is whole - triangulated by decimateChunk
+bool C3dglTerrain::isWholeChunk(int cx, int cz)
+{
+	return cx >= 0 && cz >= 0 && (cx + 1) * m_nChunkSize <= m_nSizeX - 1 && (cz + 1) * m_nChunkSize <= m_nSizeZ - 1;
+}
+
+float C3dglTerrain::getDiamondError(int x, int z, int d, int type)
+{
+	int s = m_nChunkSize;
+
+	// the borders between whole and partial chunks are always inserted
+	if (x % s == 0 && z % s != 0 && x > 0 && x < m_nSizeX - 1 && isWholeChunk(x / s - 1, z / s) != isWholeChunk(x / s, z / s))
+		return 1e30f;
+	if (z % s == 0 && x % s != 0 && z > 0 && z < m_nSizeZ - 1 && isWholeChunk(x / s, z / s - 1) != isWholeChunk(x / s, z / s))
+		return 1e30f;
+
+	// the hypotenuse (ax, az) - (bx, bz) and the apexes of the two triangles
+	int ax, az, bx, bz, apex[2][2];
+	if (type == 0)
+	{
+		ax = x - d; az = z; bx = x + d; bz = z;
+		apex[0][0] = x; apex[0][1] = z - d; apex[1][0] = x; apex[1][1] = z + d;
+	}
+	else if (type == 1)
+	{
+		ax = x; az = z - d; bx = x; bz = z + d;
+		apex[0][0] = x - d; apex[0][1] = z; apex[1][0] = x + d; apex[1][1] = z;
+	}
+	else
+	{
+		int k = (x / d + z / d) % 4 == 2 ? 1 : -1;
+		ax = x - d; az = z - k * d; bx = x + d; bz = z + k * d;
+		apex[0][0] = x + d; apex[0][1] = z - k * d; apex[1][0] = x - d; apex[1][1] = z + k * d;
+	}
+
+	// the triangles within the whole chunks - a point inside, in half units, tells the chunk
+	float e = 0;
+	for (int i = 0; i < 2; i++)
+	{
+		int px = x + apex[i][0], pz = z + apex[i][1];
+		if (px > 0 && pz > 0 && isWholeChunk(px / (2 * s), pz / (2 * s)))
+			e = max(e, getTriangleError(ax, az, bx, bz, apex[i][0], apex[i][1]));
+	}
+
+	// the smaller diamonds inside
+	#define E(x, z)		((unsigned)(x) < (unsigned)m_nSizeX && (unsigned)(z) < (unsigned)m_nSizeZ ? m_diamondErrors[(x) * m_nSizeZ + (z)] : 0)
+	if (type == 2)
+		e = max(max(E(x - d, z), E(x + d, z)), max(max(E(x, z - d), E(x, z + d)), e));
+	else if (d > 1)
+	{
+		int h = d / 2;
+		e = max(max(E(x - h, z - h), E(x - h, z + h)), max(max(E(x + h, z - h), E(x + h, z + h)), e));
+	}
+	#undef E
+	return e;
+}
+
+void C3dglTerrain::decimateChunks(const vector<int> &chunks)
+{
+	m_chunkIndices.resize(m_chunks.size());
+	getThreadPool()->parallelFor(chunks.size(), [this, &chunks](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			decimateChunk(chunks[i]);
+	}, 1);
+}
+
+void C3dglTerrain::decimateChunk(int iChunk)
+{
+	CHUNK &chunk = m_chunks[iChunk];
+	vector<unsigned> &indices = m_chunkIndices[iChunk];
+	indices.clear();
+	chunk.lodError[0] = 0;
+	int s = m_nChunkSize;
+
+	// index of the grid point (x, z) - as in buildChunkIndices
+	unsigned iBase = m_b16BitIndices ? 0 : chunk.x0 * m_nSizeZ + chunk.z0;
+	unsigned nStride = m_bDisplacement ? m_nChunkSize + 1 : m_b16BitIndices ? chunk.nz + 1 : m_nSizeZ;
+	#define V(x, z)		(iBase + ((x) - chunk.x0) * nStride + (z) - chunk.z0)
+
+	if (chunk.nx < s || chunk.nz < s)
+	{
+		// partial chunk: the full grid
+		for (int x = chunk.x0; x < chunk.x0 + chunk.nx; x++)
+			for (int z = chunk.z0; z < chunk.z0 + chunk.nz; z++)
+			{
+				unsigned cell[6] = { V(x, z), V(x, z + 1), V(x + 1, z), V(x, z + 1), V(x + 1, z + 1), V(x + 1, z) };
+				indices.insert(indices.end(), cell, cell + 6);
+			}
+	}
+	else
+	{
+		// from the two halves of the chunk, split while the error of the hypotenuse midpoint is above the bound
+		struct TRIANGLE { int ax, az, bx, bz, cx, cz; };		// hypotenuse (a, b), apex c
+		vector<TRIANGLE> stack;
+		int xc = chunk.x0 + s / 2, zc = chunk.z0 + s / 2, h = s / 2;
+		int k = (xc / h + zc / h) % 4 == 2 ? 1 : -1;
+		TRIANGLE halves[2] = { { xc - h, zc - k * h, xc + h, zc + k * h, xc + h, zc - k * h }, { xc - h, zc - k * h, xc + h, zc + k * h, xc - h, zc + k * h } };
+		stack.push_back(halves[0]);
+		stack.push_back(halves[1]);
+		while (!stack.empty())
+		{
+			TRIANGLE t = stack.back();
+			stack.pop_back();
+			bool bMidpoint = ((t.ax + t.bx) & 1) == 0 && ((t.az + t.bz) & 1) == 0;
+			int mx = (t.ax + t.bx) / 2, mz = (t.az + t.bz) / 2;
+			float e = bMidpoint ? m_diamondErrors[mx * m_nSizeZ + mz] : 0;
+			if (e > m_fDecimation)
+			{
+				TRIANGLE t1 = { t.cx, t.cz, t.ax, t.az, mx, mz }, t2 = { t.bx, t.bz, t.cx, t.cz, mx, mz };
+				stack.push_back(t1);
+				stack.push_back(t2);
+				continue;
+			}
+			chunk.lodError[0] = max(chunk.lodError[0], e);
+
+			// the same winding as the full grid
+			indices.push_back(V(t.ax, t.az));
+			if ((t.bz - t.az) * (t.cx - t.ax) - (t.bx - t.ax) * (t.cz - t.az) > 0)
+			{
+				indices.push_back(V(t.bx, t.bz));
+				indices.push_back(V(t.cx, t.cz));
+			}
+			else
+			{
+				indices.push_back(V(t.cx, t.cz));
+				indices.push_back(V(t.bx, t.bz));
+			}
+		}
+	}
+	#undef V
+
+	if (m_indexOrder == ORDER_OPTIMISED)
+		optimiseVertexCache(&indices[0], indices.size());
+}
+
+// max vertical distance between the height map samples in the triangle (a, b, c) and its plane
+float C3dglTerrain::getTriangleError(int ax, int az, int bx, int bz, int cx, int cz)
+{
+	// the plane: h = ha + gx * (x - ax) + gz * (z - az)
+	float ha = height(ax, az), hb = height(bx, bz), hc = height(cx, cz);
+	int ux = bx - ax, uz = bz - az, vx = cx - ax, vz = cz - az;
+	int det = ux * vz - uz * vx;
+	float gx = ((hb - ha) * vz - (hc - ha) * uz) / det;
+	float gz = ((hc - ha) * ux - (hb - ha) * vx) / det;
+
+	// the samples inside or on the edges: the edge functions have the sign of det, or are 0
+	float error = 0;
+	for (int x = min(ax, min(bx, cx)); x <= max(ax, max(bx, cx)); x++)
+		for (int z = min(az, min(bz, cz)); z <= max(az, max(bz, cz)); z++)
+		{
+			int w0 = ux * (z - az) - uz * (x - ax);
+			int w1 = (cx - bx) * (z - bz) - (cz - bz) * (x - bx);
+			int w2 = -vx * (z - cz) + vz * (x - cx);
+			if (det > 0 ? (w0 < 0 || w1 < 0 || w2 < 0) : (w0 > 0 || w1 > 0 || w2 > 0))
+				continue;
+			error = max(error, fabs(ha + gx * (x - ax) + gz * (z - az) - height(x, z)));
+		}
+	return error;
+}
+
+// joins the triangles of all the chunks into a single list of indices and sets the ranges of the chunks
+unsigned C3dglTerrain::gatherIndices(vector<unsigned> &indices)
+{
+	unsigned nIndices = 0;
+	for (unsigned i = 0; i < m_chunks.size(); i++)
+	{
+		CHUNK &chunk = m_chunks[i];
+		chunk.iFirst = chunk.iLodFirst[0] = nIndices;
+		chunk.nIndices = chunk.nLodIndices[0] = m_chunkIndices[i].size();
+		nIndices += chunk.nIndices;
+	}
+	m_nDecimatedTriangles = nIndices / 3;
+	indices.resize(nIndices);
+	for (unsigned i = 0; i < m_chunks.size(); i++)
+		std::copy(m_chunkIndices[i].begin(), m_chunkIndices[i].end(), indices.begin() + m_chunks[i].iFirst);
+	return nIndices;
+}
+
+// sends all the indices again - the numbers of triangles of the chunks change with the edits
+void C3dglTerrain::uploadIndices()
+{
+	vector<unsigned> indices;
+	gatherIndices(indices);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	if (m_b16BitIndices)
+	{
+		vector<unsigned short> indices16(indices.begin(), indices.end());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices16.size(), indices16.empty() ? NULL : &indices16[0], GL_STATIC_DRAW);
+	}
+	else
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Normal Map: two 8-bit channels, x and z of the normal vector (y is always positive and is found by terrain.frag),
+// s along z and t along x (the layout of the height texture); the normals are found as for the vertices
+void C3dglTerrain::uploadNormalMap(int x0, int z0, int x1, int z1)
+{
+	// the whole map unless a rectangle (height map coordinates, inclusive) is given
+	if (x1 < 0)
+	{
+		x0 = z0 = 0;
+		x1 = m_nSizeX - 1;
+		z1 = m_nSizeZ - 1;
+	}
+	int nRow = z1 - z0 + 1;
+	vector<unsigned char> normals((x1 - x0 + 1) * nRow * 2);
+	getThreadPool()->parallelFor(x1 - x0 + 1, [this, x0, z0, z1, nRow, &normals](int i0, int i1)
+	{
+		for (int x = x0 + i0; x < x0 + i1; x++)
+			for (int z = z0; z <= z1; z++)
+			{
+				float dy_x = clampedHeight(x + 1, z) - clampedHeight(x - 1, z);
+				float dy_z = clampedHeight(x, z + 1) - clampedHeight(x, z - 1);
+				float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
+				unsigned char *p = &normals[((x - x0) * nRow + z - z0) * 2];
+				p[0] = (unsigned char)(-dy_x / m * 127.5f + 128);
+				p[1] = (unsigned char)(-dy_z / m * 127.5f + 128);
+			}
+	});
+
+	if (m_normalMap == 0)
+	{
+		glGenTextures(1, &m_normalMap);
+		glBindTexture(GL_TEXTURE_2D, m_normalMap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, m_nSizeZ, m_nSizeX, 0, GL_RG, GL_UNSIGNED_BYTE, NULL);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, m_normalMap);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, z0, x0, nRow, x1 - x0 + 1, GL_RG, GL_UNSIGNED_BYTE, &normals[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Light Map: two 8-bit channels, the ambient occlusion and the sun light, s along z and t along x (as the normal map)
+// The ambient occlusion is the part of the sky visible above the horizon, averaged over 8 directions: along each one
+// the horizon is the highest elevation angle of the terrain seen from the grid point, searched at growing distances;
+// the sky visible above a horizon at the angle a is 1 - sin(a). The sun light is N.L of the normal vector (found as
+// for the vertices), or 0 if a ray cast towards the sun hits the terrain.
+// Both depend on the heights only, so they are baked once and read by terrain.frag; a new sun direction leaves
+// the ambient occlusion as it is and re-bakes the sun light row by row, over as many frames as needed.
+
+bool C3dglTerrain::bakeLightMap(const float sunDir[3])
+{
+	if (m_nSizeX < 2 || m_nSizeZ < 2)
+		return logError("cannot bake the light map before the height map is loaded");
+	float len = sqrt(sunDir[0] * sunDir[0] + sunDir[1] * sunDir[1] + sunDir[2] * sunDir[2]);
+	if (len == 0)
+		return logError("cannot bake the light map for a zero sun direction");
+	for (int i = 0; i < 3; i++)
+		m_sunDir[i] = sunDir[i] / len;
+	m_nSunRow = -1;
+
+	m_lightMapData.resize(m_nSizeX * m_nSizeZ * 2);
+	REGION all = { 0, 0, m_nSizeX - 1, m_nSizeZ - 1 };
+	bakeLightRegion(all);
+
+	unsigned nShadow = 0, nLit = 0;
+	for (unsigned i = 0; i < m_lightMapData.size(); i += 2)
+		if (m_lightMapData[i + 1] == 0)
+			nShadow++;
+		else
+			nLit++;
+	std::ostringstream info;
+	info << "light map baked: " << m_nSizeX << " x " << m_nSizeZ << ", " << nShadow * 100 / (nShadow + nLit) << "% in shade";
+	logSuccess(info.str());
+	return true;
+}
+
+void C3dglTerrain::setSunDirection(const float sunDir[3])
+{
+	float len = sqrt(sunDir[0] * sunDir[0] + sunDir[1] * sunDir[1] + sunDir[2] * sunDir[2]);
+	if (m_lightMap == 0 || len == 0)
+		return;
+	float dir[3] = { sunDir[0] / len, sunDir[1] / len, sunDir[2] / len };
+	if (m_nSunRow < 0 && dir[0] == m_sunDir[0] && dir[1] == m_sunDir[1] && dir[2] == m_sunDir[2])
+		return;
+	for (int i = 0; i < 3; i++)
+		m_newSunDir[i] = dir[i];
+	m_sunLight.resize(m_nSizeX * m_nSizeZ);
+	m_nSunRow = 0;
+}
+
+void C3dglTerrain::updateLightMap()
+{
+	if (m_nSunRow < 0)
+		return;
+
+	// the next rows of the new sun light
+	int x0 = m_nSunRow, x1 = m_nLightMapRows > 0 ? min(x0 + m_nLightMapRows, m_nSizeX) : m_nSizeX;
+	getThreadPool()->parallelFor(x1 - x0, [this, x0](int i0, int i1)
+	{
+		for (int x = x0 + i0; x < x0 + i1; x++)
+			for (int z = 0; z < m_nSizeZ; z++)
+				m_sunLight[x * m_nSizeZ + z] = getSunLight(x, z, m_newSunDir);
+	}, 1);
+	m_nSunRow = x1;
+	if (m_nSunRow < m_nSizeX)
+		return;
+
+	// complete: swap it in
+	for (unsigned i = 0; i < m_sunLight.size(); i++)
+		m_lightMapData[i * 2 + 1] = m_sunLight[i];
+	for (int i = 0; i < 3; i++)
+		m_sunDir[i] = m_newSunDir[i];
+	m_nSunRow = -1;
+	vector<unsigned char>().swap(m_sunLight);
+	uploadLightMap();
+}
+
+unsigned char C3dglTerrain::getAmbientOcclusion(int x, int z)
+{
+	// the directions and the distances searched along them (about sqrt(2) apart)
+	static const int dirs[8][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }, { 0, -1 }, { 1, -1 } };
+	static const int steps[] = { 1, 2, 3, 4, 6, 8, 11, 16, 23, 32, 45, TERRAIN_AO_RADIUS };
+
+	float h0 = height(x, z), sky = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		float fLength = (dirs[i][0] && dirs[i][1]) ? 1.41421356f : 1.0f;
+		float tanMax = 0;		// the horizon is never below the horizontal plane
+		for (int s : steps)
+		{
+			int px = x + dirs[i][0] * s, pz = z + dirs[i][1] * s;
+			if ((unsigned)px >= (unsigned)m_nSizeX || (unsigned)pz >= (unsigned)m_nSizeZ)
+				break;
+			tanMax = max(tanMax, (height(px, pz) - h0) / (s * fLength));
+		}
+		sky += 1 - tanMax / sqrt(1 + tanMax * tanMax);
+	}
+	return (unsigned char)(sky / 8 * 255 + 0.5f);
+}
+
+unsigned char C3dglTerrain::getSunLight(int x, int z, const float sun[3])
+{
+	float dy_x = clampedHeight(x + 1, z) - clampedHeight(x - 1, z);
+	float dy_z = clampedHeight(x, z + 1) - clampedHeight(x, z - 1);
+	float NdotL = (-dy_x * sun[0] + 2 * sun[1] - dy_z * sun[2]) / sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
+	if (NdotL <= 0)
+		return 0;
+	float origin[3] = { (float)(x - m_nSizeX/2), height(x, z) + TERRAIN_SHADOW_BIAS, (float)(z - m_nSizeZ/2) };
+	if (rayCast(origin, sun) >= 0)
+		return 0;
+	return (unsigned char)(NdotL * 255 + 0.5f);
+}
+
+void C3dglTerrain::bakeLightRegion(const REGION &rect)
+{
+	getThreadPool()->parallelFor(rect.x1 - rect.x0 + 1, [this, &rect](int i0, int i1)
+	{
+		for (int x = rect.x0 + i0; x < rect.x0 + i1; x++)
+			for (int z = rect.z0; z <= rect.z1; z++)
+			{
+				unsigned char *p = &m_lightMapData[(x * m_nSizeZ + z) * 2];
+				p[0] = getAmbientOcclusion(x, z);
+				p[1] = getSunLight(x, z, m_sunDir);
+			}
+	}, 1);
+	uploadLightMap(rect.x0, rect.z0, rect.x1, rect.z1);
+}
+
+int C3dglTerrain::getLightMapReach()
+{
+	// the longest shadow: the height range of the map over the tangent of the sun elevation angle
+	float minY = 1e30f, maxY = -1e30f;
+	for (CHUNK &chunk : m_chunks)
+	{
+		minY = min(minY, chunk.minY);
+		maxY = max(maxY, chunk.maxY);
+	}
+	float fHorizontal = sqrt(m_sunDir[0] * m_sunDir[0] + m_sunDir[2] * m_sunDir[2]);
+	float fShadow = (maxY - minY) * fHorizontal / max(m_sunDir[1], 1e-3f);
+	return (int)min(max(fShadow + 1, (float)TERRAIN_AO_RADIUS), (float)max(m_nSizeX, m_nSizeZ));
+}
+
+void C3dglTerrain::uploadLightMap(int x0, int z0, int x1, int z1)
+{
+	// the whole map unless a rectangle (height map coordinates, inclusive) is given
+	if (x1 < 0)
+	{
+		x0 = z0 = 0;
+		x1 = m_nSizeX - 1;
+		z1 = m_nSizeZ - 1;
+	}
+	int nRow = z1 - z0 + 1;
+	vector<unsigned char> texels((x1 - x0 + 1) * nRow * 2);
+	for (int x = x0; x <= x1; x++)
+		memcpy(&texels[(x - x0) * nRow * 2], &m_lightMapData[(x * m_nSizeZ + z0) * 2], nRow * 2);
+
+	if (m_lightMap == 0)
+	{
+		glGenTextures(1, &m_lightMap);
+		glBindTexture(GL_TEXTURE_2D, m_lightMap);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG8, m_nSizeZ, m_nSizeX, 0, GL_RG, GL_UNSIGNED_BYTE, NULL);
+	}
+	else
+		glBindTexture(GL_TEXTURE_2D, m_lightMap);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, z0, x0, nRow, x1 - x0 + 1, GL_RG, GL_UNSIGNED_BYTE, &texels[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Deformation
+// modifyHeights changes the heights at once, together with everything the CPU side queries depend on:
+// the chunk bounds and errors, the quadtree and the ray cast pyramid - only where the heights have changed.
+// The GPU buffers are updated later, by updateBuffers, once per frame: the edits are collected as a list of
+// rectangles, merged where they overlap, and only the affected vertices are rebuilt and sent with glBufferSubData.
+// Besides the edited grid points, the affected vertices are the ones around them: one grid point away (normals),
+// and up to 2^(L-2) grid points away, L being the number of LOD levels (morph targets).
+
+void C3dglTerrain::modifyHeights(int x0, int z0, int x1, int z1, std::function<float(int x, int z, float h)> fn)
+{
+	// the rectangle in height map coordinates, clipped to the map
+	int ox = m_nSizeX/2, oz = m_nSizeZ/2;
+	REGION rect = { max(min(x0, x1) + ox, 0), max(min(z0, z1) + oz, 0), min(max(x0, x1) + ox, m_nSizeX - 1), min(max(z0, z1) + oz, m_nSizeZ - 1) };
+	if (rect.x0 > rect.x1 || rect.z0 > rect.z1)
+		return;
+
+	// the new heights
+	int nRow = rect.z1 - rect.z0 + 1;
+	vector<float> heights((rect.x1 - rect.x0 + 1) * nRow);
+	float minY = 1e30f, maxY = -1e30f;
+	for (int x = rect.x0; x <= rect.x1; x++)
+		for (int z = rect.z0; z <= rect.z1; z++)
+		{
+			float h = fn(x - ox, z - oz, height(x, z));
+			heights[(x - rect.x0) * nRow + z - rect.z0] = h;
+			minY = min(minY, h);
+			maxY = max(maxY, h);
+		}
+
+	// out of the quantisation range (the compact and displacement modes, the quantised heights, the height texture): the range
+	// is widened, with some spare room for further edits; the quantised heights are converted and the vertices and the height
+	// texture sent to the GPU again - all of them, as they are read with the new range
+	bool bQuantised = m_bCompact || m_bDisplacement || m_bQuantisedHeights || m_heightTexture != 0;
+	if (bQuantised && (minY < m_fMinHeight || maxY > m_fMinHeight + m_fHeightScale))
+	{
+		float fSpare = m_fHeightScale / 4;
+		float fMinHeight = m_fMinHeight, fMaxHeight = m_fMinHeight + m_fHeightScale;
+		if (minY < fMinHeight) fMinHeight = minY - fSpare;
+		if (maxY > fMaxHeight) fMaxHeight = maxY + fSpare;
+		if (m_bQuantisedHeights)
+			requantiseHeights(fMinHeight, fMaxHeight - fMinHeight);
+		else
+		{
+			m_fMinHeight = fMinHeight;
+			m_fHeightScale = fMaxHeight - fMinHeight;
+		}
+		if (m_bCompact || m_bDisplacement || m_heightTexture)
+		{
+			m_edits.clear();
+			REGION all = { 0, 0, m_nSizeX - 1, m_nSizeZ - 1 };
+			m_edits.push_back(all);
+		}
+	}
+
+	for (int x = rect.x0; x <= rect.x1; x++)
+		for (int z = rect.z0; z <= rect.z1; z++)
+		{
+			float h = heights[(x - rect.x0) * nRow + z - rect.z0];
+			if (m_bQuantisedHeights)
+				m_quantisedHeights[heightIndex(x, z)] = quantiseHeight(h);
+			else
+				m_heights[heightIndex(x, z)] = h;
+		}
+
+	// the chunks: bounds and errors - the overall errors may only grow, so that the LOD ranges stay conservative
+	vector<int> chunks;
+	findChunks(rect, chunks);
+	for (int i : chunks)
+	{
+		CHUNK &chunk = m_chunks[i];
+		buildChunk(chunk, NULL);
+		float dy = chunk.maxY - chunk.minY;
+		m_fChunkDiagonal = max(m_fChunkDiagonal, sqrt((float)(chunk.nx * chunk.nx + chunk.nz * chunk.nz) + dy * dy));
+		for (int L = 1; L < chunk.nLevels; L++)
+			m_lodMaxError[L] = max(m_lodMaxError[L], chunk.lodError[L]);
+	}
+	if (!m_nodes.empty())
+		refitNode(0, rect);
+
+	// the ray cast pyramid: the cells around the grid points
+	updateRayPyramid(max(rect.x0 - 1, 0), max(rect.z0 - 1, 0), min(rect.x1, m_nSizeX - 2), min(rect.z1, m_nSizeZ - 2));
+
+	// the GPU update is deferred - merge with the overlapping edits
+	for (unsigned i = 0; i < m_edits.size(); )
+	{
+		REGION &edit = m_edits[i];
+		if (edit.x0 > rect.x1 + 1 || edit.x1 < rect.x0 - 1 || edit.z0 > rect.z1 + 1 || edit.z1 < rect.z0 - 1)
+		{
+			i++;
+			continue;
+		}
+		rect.x0 = min(rect.x0, edit.x0); rect.z0 = min(rect.z0, edit.z0);
+		rect.x1 = max(rect.x1, edit.x1); rect.z1 = max(rect.z1, edit.z1);
+		m_edits.erase(m_edits.begin() + i);
+		i = 0;		// the grown rectangle may now overlap the edits already passed
+	}
+	m_edits.push_back(rect);
+}
+
+// finds the chunks containing any of the grid points of the region
+void C3dglTerrain::findChunks(const REGION &rect, vector<int> &chunks)
+{
+	// the grid points on the chunk borders belong to two chunks
+	int cx0 = max((rect.x0 - 1) / m_nChunkSize, 0), cx1 = min(rect.x1 / m_nChunkSize, m_nChunksX - 1);
+	int cz0 = max((rect.z0 - 1) / m_nChunkSize, 0), cz1 = min(rect.z1 / m_nChunkSize, m_nChunksZ - 1);
+	for (int cx = cx0; cx <= cx1; cx++)
+		for (int cz = cz0; cz <= cz1; cz++)
+			chunks.push_back(cx * m_nChunksZ + cz);
+}
+
+// updates the vertical bounds of the quadtree nodes overlapping the rectangle (height map coordinates)
+void C3dglTerrain::refitNode(int iNode, const REGION &rect)
+{
+	NODE &node = m_nodes[iNode];
+	int ox = m_nSizeX/2, oz = m_nSizeZ/2;
+	if (node.minX + ox > rect.x1 || node.maxX + ox < rect.x0 || node.minZ + oz > rect.z1 || node.maxZ + oz < rect.z0)
+		return;
+	if (node.iChunk >= 0)
+	{
+		node.minY = m_chunks[node.iChunk].minY;
+		node.maxY = m_chunks[node.iChunk].maxY;
+		return;
+	}
+	node.minY = 1e10f;
+	node.maxY = -1e10f;
+	for (int i = 0; i < 4 && node.children[i] >= 0; i++)
+	{
+		refitNode(node.children[i], rect);
+		NODE &child = m_nodes[node.children[i]];
+		node.minY = min(node.minY, child.minY);
+		node.maxY = max(node.maxY, child.maxY);
+	}
+}
+
+void C3dglTerrain::updateBuffers()
+{
+	if (m_edits.empty())
+		return;
+	int nBorder = m_nLodLevels >= 3 ? 1 << (m_nLodLevels - 2) : 1;
+
+	// the decimated mesh: the normal map, the diamonds depending on the edited heights, and the triangles of the
+	// chunks they are in (up to a chunk away from the edits - see findDiamondErrors)
+	if (m_fDecimation > 0)
+	{
+		vector<int> chunks;
+		bool bAll = m_diamondErrors.empty();		// restored from the mesh cache
+		if (bAll)
+			findDiamondErrors(0, 0, m_nSizeX - 1, m_nSizeZ - 1);
+		int nReach = m_nChunkSize;
+		for (REGION &edit : m_edits)
+		{
+			uploadNormalMap(max(edit.x0 - 1, 0), max(edit.z0 - 1, 0), min(edit.x1 + 1, m_nSizeX - 1), min(edit.z1 + 1, m_nSizeZ - 1));
+			if (!bAll)
+				findDiamondErrors(edit.x0, edit.z0, edit.x1, edit.z1);
+			REGION rect = { edit.x0 - nReach, edit.z0 - nReach, edit.x1 + nReach, edit.z1 + nReach };
+			findChunks(rect, chunks);
+		}
+		std::sort(chunks.begin(), chunks.end());
+		chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+		decimateChunks(chunks);
+		uploadIndices();
+	}
+
+	// the light map: the ambient occlusion around the edits and the shadows they cast (a re-bake in progress starts again)
+	if (m_lightMap)
+	{
+		int nReach = getLightMapReach();
+		for (REGION &edit : m_edits)
+		{
+			REGION rect = { max(edit.x0 - nReach, 0), max(edit.z0 - nReach, 0), min(edit.x1 + nReach, m_nSizeX - 1), min(edit.z1 + nReach, m_nSizeZ - 1) };
+			bakeLightRegion(rect);
+		}
+		if (m_nSunRow >= 0)
+			m_nSunRow = 0;
+	}
+
+	for (REGION &edit : m_edits)
+	{
+		if (m_heightTexture)
+			uploadHeightTexture(edit.x0, edit.z0, edit.x1, edit.z1);
+		if (m_bDisplacement)
+			continue;		// only the height texture
+
+		REGION rect = { max(edit.x0 - nBorder, 0), max(edit.z0 - nBorder, 0), min(edit.x1 + nBorder, m_nSizeX - 1), min(edit.z1 + nBorder, m_nSizeZ - 1) };
+		if (m_b16BitIndices)
+		{
+			// the blocks of vertices of the chunks (the vertices on the chunk borders are in more than one block)
+			vector<int> chunks;
+			findChunks(rect, chunks);
+			for (int i : chunks)
+			{
+				CHUNK &chunk = m_chunks[i];
+				REGION block = { chunk.x0, chunk.z0, chunk.x0 + chunk.nx, chunk.z0 + chunk.nz };
+				updateVertices(rect, block, chunk.iFirstVertex);
+			}
+		}
+		else
+		{
+			REGION block = { 0, 0, m_nSizeX - 1, m_nSizeZ - 1 };
+			updateVertices(rect, block, 0);
+		}
+	}
+	m_edits.clear();
+
+	// the CPU copy is no longer needed
+	MESH().swap(m_mesh);
+}
+
+// rebuilds the vertices of the rectangle within the block of vertices starting at iFirst and sends them to the GPU, row by row
+void C3dglTerrain::updateVertices(const REGION &rect, const REGION &block, unsigned iFirst)
+{
+	int x0 = max(rect.x0, block.x0), x1 = min(rect.x1, block.x1);
+	int z0 = max(rect.z0, block.z0), z1 = min(rect.z1, block.z1);
+	if (x0 > x1 || z0 > z1)
+		return;
+
+	// build the vertices into the CPU copy of the mesh
+	unsigned nRow = z1 - z0 + 1, nVertices = (x1 - x0 + 1) * nRow;
+	m_mesh.lines.resize(nVertices * 6);
+	if (m_bCompact)
+		m_mesh.compact.resize(nVertices);
+	else
+	{
+		m_mesh.vertices.resize(nVertices * 3);
+		m_mesh.normals.resize(nVertices * 3);
+		m_mesh.texCoords.resize(nVertices * 2);
+		m_mesh.morph.resize(nVertices);
+	}
+	buildVertices(x0, x1, z0, z1, 0);
+
+	// whole rows of the block are contiguous in the buffers
+	unsigned nBlockRow = block.z1 - block.z0 + 1;
+	int nRows = (nRow == nBlockRow) ? 1 : x1 - x0 + 1;
+	unsigned nCount = (nRow == nBlockRow) ? nVertices : nRow;
+	for (int i = 0; i < nRows; i++)
+	{
+		unsigned iSrc = i * nRow;
+		unsigned iDst = iFirst + (x0 + i - block.x0) * nBlockRow + (z0 - block.z0);
+		if (m_bCompact)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, m_compactBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(COMPACT_VERTEX) * iDst, sizeof(COMPACT_VERTEX) * nCount, &m_mesh.compact[iSrc]);
+		}
+		else
+		{
+			// the texture coordinates do not change
+			glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * iDst, sizeof(GLfloat) * 3 * nCount, &m_mesh.vertices[iSrc * 3]);
+			glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * iDst, sizeof(GLfloat) * 3 * nCount, &m_mesh.normals[iSrc * 3]);
+			glBindBuffer(GL_ARRAY_BUFFER, m_morphBuffer);
+			glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * iDst, sizeof(GLfloat) * nCount, &m_mesh.morph[iSrc]);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 6 * iDst, sizeof(GLfloat) * 6 * nCount, &m_mesh.lines[iSrc * 6]);
+	}
+}
+
+// LOD (level of detail) support
+// Each chunk has a number of index patterns, level L using every 2^L-th grid line.
+// When a vertex is about to disappear at the next (coarser) level, it is gradually
+// moved (geomorphed) towards the coarse surface by the vertex shader, so that
+// transitions between the levels do not pop and adjacent chunks do not crack.
+// The morph target is stored as an additional vertex attribute (aMorphHeight).
+
+void C3dglTerrain::buildLOD()
+{
+	// the available levels and their max errors
+	m_nLodLevels = 1;
+	m_fChunkDiagonal = 0;
+	for (int i = 0; i < TERRAIN_MAX_LOD; i++)
+		m_lodMaxError[i] = 0;
+	for (CHUNK &chunk : m_chunks)
+	{
+		float dy = chunk.maxY - chunk.minY;
+		m_fChunkDiagonal = max(m_fChunkDiagonal, sqrt((float)(chunk.nx * chunk.nx + chunk.nz * chunk.nz) + dy * dy));
+		for (int L = 1; L < chunk.nLevels; L++)
+			m_lodMaxError[L] = max(m_lodMaxError[L], chunk.lodError[L]);
+		m_nLodLevels = max(m_nLodLevels, chunk.nLevels);
+	}
+
+	// build the quadtree
+	m_nodes.clear();
+	m_nodes.reserve(m_chunks.size() * 2);
+	buildNode(0, 0, m_nChunksX, m_nChunksZ);
+}
+
+// morph target: the height of the surface at the level the vertex disappears from
+float C3dglTerrain::getMorphHeight(int x, int z)
+{
+	// the vertex belongs to levels 0..rank
+	int rank = 0;
+	while (rank < m_nLodLevels - 1 && x % (2 << rank) == 0 && z % (2 << rank) == 0)
+		rank++;
+
+	int s = 1 << rank;
+	bool bOddX = (x % (2 * s)) != 0;
+	bool bOddZ = (z % (2 * s)) != 0;
+	if (bOddX && bOddZ)
+		return (clampedHeight(x - s, z + s) + clampedHeight(x + s, z - s)) / 2;		// centre of a coarse cell - on its diagonal
+	else if (bOddX)
+		return (clampedHeight(x - s, z) + clampedHeight(x + s, z)) / 2;				// on a coarse edge along x
+	else if (bOddZ)
+		return (clampedHeight(x, z - s) + clampedHeight(x, z + s)) / 2;				// on a coarse edge along z
+	else
+		return clampedHeight(x, z);													// present at all levels
+}
+
+// writes all the vertex data for the grid point (x, z) with the normal vector n, at the position i of the buffers
+void C3dglTerrain::writeVertex(unsigned i, int x, int z, float nx, float ny, float nz)
+{
+	float h = height(x, z);
+	float fx = (float)(x - m_nSizeX/2);
+	float fz = (float)(z - m_nSizeZ/2);
+	if (m_bCompact)
+	{
+		COMPACT_VERTEX &v = m_mesh.compact[i];
+		v.height = quantiseHeight(h);
+		v.morph = quantiseHeight(getMorphHeight(x, z));
+		octEncode(nx, ny, nz, v.normal);
+		v.pad[0] = v.pad[1] = 0;
+	}
+	else
+	{
+		float *p = &m_mesh.vertices[i * 3];
+		p[0] = fx; p[1] = h; p[2] = fz;
+		p = &m_mesh.normals[i * 3];
+		p[0] = nx; p[1] = ny; p[2] = nz;
+		p = &m_mesh.texCoords[i * 2];
+		p[0] = fx / 2.f; p[1] = fz / 2.f;
+		m_mesh.morph[i] = getMorphHeight(x, z);
+	}
+
+	float *p = &m_mesh.lines[i * 6];
+	p[0] = fx; p[1] = h; p[2] = fz;
+	p[3] = fx + nx; p[4] = h + ny; p[5] = fz + nz;
+}
+
+// Builds the vertices of the grid points [x0..x1] x [z0..z1] into the buffers, starting at the vertex iFirst, x-major.
+// Normals are found with central differences (one-sided at the edges), 4 vertices at a time with SSE2.
+void C3dglTerrain::buildVertices(int x0, int x1, int z0, int z1, unsigned iFirst)
+{
+	unsigned nRow = z1 - z0 + 1;
+	int zMin = max(z0 - 1, 0), zMax = min(z1 + 1, m_nSizeZ - 1);		// the heights read
+	vector<float> buf[3];
+	for (int x = x0; x <= x1; x++)
+	{
+		const float *h = getHeightRow(x, zMin, zMax, buf[0]);
+		const float *hPrev = getHeightRow(max(x - 1, 0), zMin, zMax, buf[1]);
+		const float *hNext = getHeightRow(min(x + 1, m_nSizeX - 1), zMin, zMax, buf[2]);
+		unsigned i = iFirst + (x - x0) * nRow - z0;		// i + z is the position of the vertex (x, z)
+
+		int z = z0;
+#ifdef TERRAIN_SSE2
+		// the central part of the row, where both z - 1 and z + 4 exist
+		int zStart = max(z0, 1);
+		for ( ; z < zStart; z++)
+			writeNormal(i + z, x, z, h, hPrev, hNext);
+		__m128 two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+		for ( ; z + 3 <= z1 && z + 4 < m_nSizeZ; z += 4)
+		{
+			__m128 dy_x = _mm_sub_ps(_mm_loadu_ps(hNext + z), _mm_loadu_ps(hPrev + z));
+			__m128 dy_z = _mm_sub_ps(_mm_loadu_ps(h + z + 1), _mm_loadu_ps(h + z - 1));
+			__m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dy_x, dy_x), four), _mm_mul_ps(dy_z, dy_z)));
+			__m128 r = _mm_div_ps(one, m);
+			float nx[4], ny[4], nz[4];
+			_mm_storeu_ps(nx, _mm_sub_ps(zero, _mm_mul_ps(dy_x, r)));
+			_mm_storeu_ps(ny, _mm_mul_ps(two, r));
+			_mm_storeu_ps(nz, _mm_sub_ps(zero, _mm_mul_ps(dy_z, r)));
+			for (int k = 0; k < 4; k++)
+				writeVertex(i + z + k, x, z + k, nx[k], ny[k], nz[k]);
+		}
+#endif
+		for ( ; z <= z1; z++)
+			writeNormal(i + z, x, z, h, hPrev, hNext);
+	}
+}
+
+// scalar version of the above, for a single vertex
+void C3dglTerrain::writeNormal(unsigned i, int x, int z, const float *h, const float *hPrev, const float *hNext)
+{
+	float dy_x = hNext[z] - hPrev[z];
+	float dy_z = h[min(z + 1, m_nSizeZ - 1)] - h[max(z - 1, 0)];
+	float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
+	writeVertex(i, x, z, -dy_x / m, 2 / m, -dy_z / m);
+}
+
+int C3dglTerrain::buildNode(int cx0, int cz0, int cx1, int cz1)
+{
+	int iNode = m_nodes.size();
+	m_nodes.push_back(NODE());
+	NODE node;
+	node.iChunk = -1;
+	node.children[0] = node.children[1] = node.children[2] = node.children[3] = -1;
+
+	if (cx1 - cx0 == 1 && cz1 - cz0 == 1)
+	{
+		// leaf node
+		CHUNK &chunk = m_chunks[cx0 * m_nChunksZ + cz0];
+		node.iChunk = cx0 * m_nChunksZ + cz0;
+		node.minX = (float)(chunk.x0 - m_nSizeX/2);
+		node.maxX = (float)(chunk.x0 + chunk.nx - m_nSizeX/2);
+		node.minZ = (float)(chunk.z0 - m_nSizeZ/2);
+		node.maxZ = (float)(chunk.z0 + chunk.nz - m_nSizeZ/2);
+		node.minY = chunk.minY;
+		node.maxY = chunk.maxY;
+	}
+	else
+	{
+		// split in halves along both axes (unless already 1 chunk wide)
+		int cxm = (cx1 - cx0 > 1) ? (cx0 + cx1) / 2 : cx1;
+		int czm = (cz1 - cz0 > 1) ? (cz0 + cz1) / 2 : cz1;
+		int n = 0;
+		node.minX = node.minY = node.minZ = 1e10f;
+		node.maxX = node.maxY = node.maxZ = -1e10f;
+		int rects[4][4] = { { cx0, cz0, cxm, czm }, { cxm, cz0, cx1, czm }, { cx0, czm, cxm, cz1 }, { cxm, czm, cx1, cz1 } };
+		for (int i = 0; i < 4; i++)
+		{
+			if (rects[i][0] >= rects[i][2] || rects[i][1] >= rects[i][3]) continue;
+			int iChild = buildNode(rects[i][0], rects[i][1], rects[i][2], rects[i][3]);
+			node.children[n++] = iChild;
+			NODE &child = m_nodes[iChild];
+			node.minX = min(node.minX, child.minX); node.maxX = max(node.maxX, child.maxX);
+			node.minY = min(node.minY, child.minY); node.maxY = max(node.maxY, child.maxY);
+			node.minZ = min(node.minZ, child.minZ); node.maxZ = max(node.maxZ, child.maxZ);
+		}
+	}
+
+	m_nodes[iNode] = node;
+	return iNode;
+}
+
+// the chunks in the view frustum, with the frustum planes and the eye position in the model coordinates
+void C3dglTerrain::cullChunks(vector<int> &chunks, float planes[6][4], float eye[3])
+{
+	// collect the current transformation
+	float matrixProjection[16], matrixModelView[16], matrix[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, matrixProjection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrixModelView);
+	multMatrix(matrixProjection, matrixModelView, matrix);
+	extractFrustum(matrix, planes);
+
+	// eye position in the model coordinates
+	gluInvertMatrix(matrixModelView, matrix);
+	eye[0] = matrix[12]; eye[1] = matrix[13]; eye[2] = matrix[14];
+
+	int minx = -m_nSizeX/2;
+	int minz = -m_nSizeZ/2;
+	for (unsigned i = 0; i < m_chunks.size(); i++)
+	{
+		CHUNK &chunk = m_chunks[i];
+		if (isBoxInFrustum(planes, (float)(minx + chunk.x0), chunk.minY, (float)(minz + chunk.z0),
+			(float)(minx + chunk.x0 + chunk.nx), chunk.maxY, (float)(minz + chunk.z0 + chunk.nz)))
+			chunks.push_back(i);
+	}
+}
+
+void C3dglTerrain::setVertexPointers(C3dglProgram *pProgram, int iChunk)
+{
+	// the grid patch is shared by all the chunks - only its position changes
+	if (m_bDisplacement)
+	{
+		if (iChunk >= 0)
+			pProgram->SendUniform(m_locDisplacementOrigin, (GLint)m_chunks[iChunk].x0, (GLint)m_chunks[iChunk].z0);
+		return;
+	}
+
+	// the block of vertices: the whole height map or a single chunk (with 16-bit indices)
+	unsigned iBase = 0;
+	int x0 = 0, z0 = 0, nSizeZ = m_nSizeZ;
+	if (iChunk >= 0)
+	{
+		CHUNK &chunk = m_chunks[iChunk];
+		iBase = chunk.iFirstVertex;
+		x0 = chunk.x0;
+		z0 = chunk.z0;
+		nSizeZ = chunk.nz + 1;
+	}
+
+	if (!pProgram)
+	{
+		// fixed pipeline
+		glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+		glVertexPointer(3, GL_FLOAT, 0, (const GLvoid*)(sizeof(GLfloat) * 3 * iBase));
+		glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+		glNormalPointer(GL_FLOAT, 0, (const GLvoid*)(sizeof(GLfloat) * 3 * iBase));
+		glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+		glTexCoordPointer(2, GL_FLOAT, 0, (const GLvoid*)(sizeof(GLfloat) * 2 * iBase));
+		return;
+	}
+
+	GLuint attribVertex = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX);
+	GLuint attribNormal = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL);
+
+	if (m_bCompact)
+	{
+		// The compact vertices are fed through the standard attributes:
+		// aVertex.xy = normalised height and morph target height, aNormal.xy = octahedral encoded normal.
+		// (the buffer is bound by bindVertices)
+		glVertexAttribPointer(attribVertex, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(COMPACT_VERTEX), (const GLvoid*)(sizeof(COMPACT_VERTEX) * iBase + offsetof(COMPACT_VERTEX, height)));
+		glVertexAttribPointer(attribNormal, 2, GL_BYTE, GL_TRUE, sizeof(COMPACT_VERTEX), (const GLvoid*)(sizeof(COMPACT_VERTEX) * iBase + offsetof(COMPACT_VERTEX, normal)));
+		if (nSizeZ != m_nSentSizeZ)
+			pProgram->SendUniform(m_locCompactSizeZ, (GLint)nSizeZ);
+		m_nSentSizeZ = nSizeZ;
+		pProgram->SendUniform(m_locCompactOffset, (GLfloat)(m_nSizeX/2 - x0), (GLfloat)(m_nSizeZ/2 - z0));
+		return;
+	}
+
+	GLuint attribTexCoord = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_TEXCOORD);
+	GLuint attribMorph = pProgram->GetAttribLocation("aMorphHeight");
+
+	//Bind the vertex array and set the vertex pointer to point at it
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertexBuffer);
+	glVertexAttribPointer(attribVertex, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)(sizeof(GLfloat) * 3 * iBase));
+
+	// Bind the normal array and set the normal pointer to point at it
+	glBindBuffer(GL_ARRAY_BUFFER, m_normalBuffer);
+	glVertexAttribPointer(attribNormal, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)(sizeof(GLfloat) * 3 * iBase));
+
+	// Bind the tex coord array and set the tex coord pointer to point at it
+	glBindBuffer(GL_ARRAY_BUFFER, m_texCoordBuffer);
+	glVertexAttribPointer(attribTexCoord, 2, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)(sizeof(GLfloat) * 2 * iBase));
+
+	// Bind the morph target array (used by LOD rendering only)
+	if (attribMorph != (GLuint)-1)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, m_morphBuffer);
+		glVertexAttribPointer(attribMorph, 1, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)(sizeof(GLfloat) * iBase));
+	}
+}
+
+void C3dglTerrain::bindVertices(C3dglProgram *pProgram)
+{
+	if (!pProgram)
+	{
+		// fixed pipeline
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+	}
+	else if (m_bDisplacement)
+	{
+		// The grid patch provides (x, z) relative to the chunk origin, the heights come from the height texture
+		GLuint attribVertex = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX);
+		glEnableVertexAttribArray(attribVertex);
+		glBindBuffer(GL_ARRAY_BUFFER, m_patchBuffer);
+		glVertexAttribPointer(attribVertex, 2, GL_UNSIGNED_SHORT, GL_FALSE, 0, 0);
+
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_DISPLACEMENT_UNIT);
+		glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+		glActiveTexture(GL_TEXTURE0);
+
+		pProgram->SendUniform("displacement", (GLint)1);
+		pProgram->SendUniform("displacementMap", (GLint)TERRAIN_DISPLACEMENT_UNIT);
+		pProgram->SendUniform("displacementHeight", m_fMinHeight, m_fHeightScale);
+		m_locDisplacementOrigin = pProgram->GetUniformLocation("displacementOrigin");
+	}
+	else if (m_bCompact)
+	{
+		// The vertex array object is built once and rebuilt only if a different program is used.
+		if (m_vao && m_pVaoProgram != pProgram)
+		{
+			glDeleteVertexArrays(1, &m_vao);
+			m_vao = 0;
+		}
+		if (m_vao == 0)
+		{
+			glGenVertexArrays(1, &m_vao);
+			glBindVertexArray(m_vao);
+			glEnableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX));
+			glEnableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL));
+			m_pVaoProgram = pProgram;
+		}
+		else
+			glBindVertexArray(m_vao);
+		glBindBuffer(GL_ARRAY_BUFFER, m_compactBuffer);
+
+		pProgram->SendUniform("compactVertices", (GLint)1);
+		pProgram->SendUniform("compactHeight", m_fMinHeight, m_fHeightScale);
+		m_locCompactOffset = pProgram->GetUniformLocation("compactOffset");
+		m_locCompactSizeZ = pProgram->GetUniformLocation("compactSizeZ");
+		m_nSentSizeZ = -1;
+	}
+	else
+	{
+		GLuint attribMorph = pProgram->GetAttribLocation("aMorphHeight");
+		glEnableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX));
+		glEnableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL));
+		glEnableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_TEXCOORD));
+		if (attribMorph != (GLuint)-1) glEnableVertexAttribArray(attribMorph);
+	}
+
+	// the normal map of the decimated mesh - for the per pixel normals
+	if (pProgram && m_normalMap)
+	{
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_NORMAL_MAP_UNIT);
+		glBindTexture(GL_TEXTURE_2D, m_normalMap);
+		glActiveTexture(GL_TEXTURE0);
+		pProgram->SendUniform("normalMapping", (GLint)1);
+		pProgram->SendUniform("normalMap", (GLint)TERRAIN_NORMAL_MAP_UNIT);
+	}
+
+	// the light map - instead of the directional light
+	if (pProgram && m_lightMap)
+	{
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_LIGHT_MAP_UNIT);
+		glBindTexture(GL_TEXTURE_2D, m_lightMap);
+		glActiveTexture(GL_TEXTURE0);
+		pProgram->SendUniform("lightMapping", (GLint)1);
+		pProgram->SendUniform("lightMap", (GLint)TERRAIN_LIGHT_MAP_UNIT);
+	}
+	if (pProgram && (m_normalMap || m_lightMap))
+		pProgram->SendUniform("gridOffset", (GLfloat)(m_nSizeX/2), (GLfloat)(m_nSizeZ/2));
+
+	// with 16-bit indices the vertex pointers are set for each chunk separately
+	if (!m_b16BitIndices)
+		setVertexPointers(pProgram, -1);
+
+	//Bind the index array
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+
+	if (m_bPrimitiveRestart)
+	{
+		glEnableClientState(GL_PRIMITIVE_RESTART_NV);
+		glPrimitiveRestartIndexNV(m_b16BitIndices ? 0xFFFF : RESTART_INDEX);
+	}
+}
+
+void C3dglTerrain::unbindVertices(C3dglProgram *pProgram)
+{
+	if (m_bPrimitiveRestart)
+		glDisableClientState(GL_PRIMITIVE_RESTART_NV);
+
+	if (pProgram && m_normalMap)
+	{
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_NORMAL_MAP_UNIT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		pProgram->SendUniform("normalMapping", (GLint)0);
+	}
+	if (pProgram && m_lightMap)
+	{
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_LIGHT_MAP_UNIT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		pProgram->SendUniform("lightMapping", (GLint)0);
+	}
+
+	if (!pProgram)
+	{
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_NORMAL_ARRAY);
+	}
+	else if (m_bDisplacement)
+	{
+		glDisableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX));
+		glActiveTexture(GL_TEXTURE0 + TERRAIN_DISPLACEMENT_UNIT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glActiveTexture(GL_TEXTURE0);
+		pProgram->SendUniform("displacement", (GLint)0);
+	}
+	else if (m_bCompact)
+	{
+		glBindVertexArray(0);
+		pProgram->SendUniform("compactVertices", (GLint)0);
+	}
+	else
+	{
+		GLuint attribMorph = pProgram->GetAttribLocation("aMorphHeight");
+		glDisableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX));
+		glDisableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL));
+		glDisableVertexAttribArray(pProgram->GetStdAttribLocation(C3dglProgram::ATTR_TEXCOORD));
+		if (attribMorph != (GLuint)-1) glDisableVertexAttribArray(attribMorph);
+	}
+}
+
+void C3dglTerrain::drawChunks(C3dglProgram *pProgram, const vector<int> &chunks, int L)
+{
+	GLenum mode = (m_indexOrder == ORDER_STRIPS) ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+
+	for (int i : chunks)
+	{
+		m_nVisibleChunks++;
+		m_nRenderedTriangles += m_fDecimation > 0 ? m_chunks[i].nIndices / 3 : (m_chunks[i].nx >> L) * (m_chunks[i].nz >> L) * 2;
+	}
+
+	if (m_b16BitIndices)
+	{
+		// each chunk has its own block of vertices - the vertex pointers are moved to the block before it is drawn;
+		// that is all the per chunk state: the uniform locations are found once by bindVertices
+		for (int i : chunks)
+		{
+			CHUNK &chunk = m_chunks[i];
+			setVertexPointers(pProgram, i);
+			glDrawElements(mode, chunk.nLodIndices[L], GL_UNSIGNED_SHORT, (const GLvoid*)(sizeof(GLushort) * chunk.iLodFirst[L]));
+		}
+		return;
+	}
+
+	// chunks with adjacent index ranges are merged into a single draw (triangle lists only)
+	vector<int> counts;
+	vector<const void*> offsets;
+	unsigned iEnd = 0xFFFFFFFF;
+	for (int i : chunks)
+	{
+		CHUNK &chunk = m_chunks[i];
+		if (chunk.iLodFirst[L] == iEnd && mode == GL_TRIANGLES)
+			counts.back() += chunk.nLodIndices[L];
+		else
+		{
+			counts.push_back(chunk.nLodIndices[L]);
+			offsets.push_back((const void*)(sizeof(GLuint) * chunk.iLodFirst[L]));
+		}
+		iEnd = chunk.iLodFirst[L] + chunk.nLodIndices[L];
+	}
+	if (!counts.empty())
+		glMultiDrawElements(mode, &counts[0], GL_UNSIGNED_INT, (const GLvoid**)&offsets[0], counts.size());
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////
+// Horizon culling
+// The horizon is the highest elevation angle of the terrain already rasterised, as seen from the eye in each
+// direction (azimuth column). The chunks in the view frustum are processed front to back: a chunk (or an object)
+// is hidden if its top is below the horizon over its whole azimuth span. The visible chunks become occluders,
+// but only once they are entirely nearer than the next item tested - so the horizon never hides anything
+// in front of the terrain that raised it. All the distances are horizontal, the elevations are stored as tangents.
+
+// azimuth of the direction (dx, dz) in horizon columns: [0, TERRAIN_HORIZON_SIZE)
+static float getAzimuth(float dx, float dz)
+{
+	return (atan2(dz, dx) + 3.14159265f) * (TERRAIN_HORIZON_SIZE / (2 * 3.14159265f));
+}
+
+// azimuth of the direction (dx, dz), unwrapped to be within half a turn from ref
+static float getAzimuth(float dx, float dz, float ref)
+{
+	float a = getAzimuth(dx, dz);
+	if (a - ref > TERRAIN_HORIZON_SIZE / 2) a -= TERRAIN_HORIZON_SIZE;
+	else if (ref - a > TERRAIN_HORIZON_SIZE / 2) a += TERRAIN_HORIZON_SIZE;
+	return a;
+}
+
+// horizontal distances from the eye to the nearest and the farthest point of a rectangle
+static void getDistances(const float eye[3], float minX, float minZ, float maxX, float maxZ, float &dMin, float &dMax)
+{
+	float dx = max(max(minX - eye[0], eye[0] - maxX), 0.0f);
+	float dz = max(max(minZ - eye[2], eye[2] - maxZ), 0.0f);
+	dMin = sqrt(dx * dx + dz * dz);
+	dx = max(fabs(minX - eye[0]), fabs(maxX - eye[0]));
+	dz = max(fabs(minZ - eye[2]), fabs(maxZ - eye[2]));
+	dMax = sqrt(dx * dx + dz * dz);
+}
+
+int C3dglTerrain::addObject(const float minXYZ[3], const float maxXYZ[3])
+{
+	m_objects.push_back(OBJECT());
+	setObjectBounds(m_objects.size() - 1, minXYZ, maxXYZ);
+	m_objects.back().bVisible = true;
+	return m_objects.size() - 1;
+}
+
+void C3dglTerrain::setObjectBounds(int id, const float minXYZ[3], const float maxXYZ[3])
+{
+	if (id < 0 || id >= (int)m_objects.size()) return;
+	OBJECT &obj = m_objects[id];
+	obj.minX = minXYZ[0]; obj.minY = minXYZ[1]; obj.minZ = minXYZ[2];
+	obj.maxX = maxXYZ[0]; obj.maxY = maxXYZ[1]; obj.maxZ = maxXYZ[2];
+}
+
+void C3dglTerrain::cullHorizon(const float planes[6][4], const float eye[3], vector<int> chunks[], int nLevels)
+{
+	int minx = -m_nSizeX/2;
+	int minz = -m_nSizeZ/2;
+	m_nHorizonCulledChunks = m_nVisibleObjects = m_nCulledObjects = 0;
+
+	// the terrain hides what is behind it only if the eye is above it (and over the map - there are no side walls)
+	bool bCull = m_bHorizonCulling
+		&& eye[0] >= minx && eye[0] <= minx + m_nSizeX - 1 && eye[2] >= minz && eye[2] <= minz + m_nSizeZ - 1
+		&& eye[1] > getInterpolatedHeight(eye[0], eye[2]);
+
+	// collect the chunks and the objects in the view frustum
+	vector<HORIZON_ITEM> items;
+	HORIZON_ITEM entry;
+	if (bCull)
+		for (int L = 0; L < nLevels; L++)
+			for (int i : chunks[L])
+			{
+				CHUNK &chunk = m_chunks[i];
+				entry.iChunk = i;
+				entry.L = L;
+				entry.iObject = -1;
+				getDistances(eye, (float)(minx + chunk.x0), (float)(minz + chunk.z0), (float)(minx + chunk.x0 + chunk.nx), (float)(minz + chunk.z0 + chunk.nz), entry.dMin, entry.dMax);
+				items.push_back(entry);
+			}
+	for (unsigned i = 0; i < m_objects.size(); i++)
+	{
+		OBJECT &obj = m_objects[i];
+		obj.bVisible = isBoxInFrustum(planes, obj.minX, obj.minY, obj.minZ, obj.maxX, obj.maxY, obj.maxZ);
+		if (!obj.bVisible)
+			m_nCulledObjects++;
+		else if (!bCull)
+			m_nVisibleObjects++;
+		else
+		{
+			entry.iChunk = entry.L = -1;
+			entry.iObject = i;
+			getDistances(eye, obj.minX, obj.minZ, obj.maxX, obj.maxZ, entry.dMin, entry.dMax);
+			items.push_back(entry);
+		}
+	}
+	if (!bCull)
+		return;
+
+	std::sort(items.begin(), items.end());
+	m_horizon.assign(TERRAIN_HORIZON_SIZE, -1e30f);
+
+	// visible chunks waiting to be rasterised: a heap ordered by the far distance, the nearest on top
+	vector<int> occluders;
+	auto farther = [&items](int a, int b) { return items[a].dMax > items[b].dMax; };
+	vector<bool> hidden(m_chunks.size(), false);
+
+	for (unsigned i = 0; i < items.size(); i++)
+	{
+		HORIZON_ITEM &item = items[i];
+
+		// rasterise the occluders entirely in front of the item
+		while (!occluders.empty() && items[occluders.front()].dMax <= item.dMin)
+		{
+			HORIZON_ITEM &occluder = items[occluders.front()];
+			CHUNK &chunk = m_chunks[occluder.iChunk];
+
+			// LOD: the rendered surface (morphing towards the next level) may be lower than the height map
+			float fBias = 0;
+			if (nLevels > 1)
+				fBias = max(chunk.lodError[occluder.L], chunk.lodError[min(occluder.L + 1, chunk.nLevels - 1)]);
+			rasteriseChunk(eye, chunk, fBias);
+
+			std::pop_heap(occluders.begin(), occluders.end(), farther);
+			occluders.pop_back();
+		}
+
+		if (item.iChunk >= 0)
+		{
+			CHUNK &chunk = m_chunks[item.iChunk];
+			if (isHidden(eye, (float)(minx + chunk.x0), (float)(minz + chunk.z0), (float)(minx + chunk.x0 + chunk.nx), (float)(minz + chunk.z0 + chunk.nz),
+				chunk.maxY, item.dMin, item.dMax))
+			{
+				hidden[item.iChunk] = true;
+				m_nHorizonCulledChunks++;
+			}
+			else if (m_fOccluderRange <= 0 || item.dMin < m_fOccluderRange)
+			{
+				occluders.push_back(i);
+				std::push_heap(occluders.begin(), occluders.end(), farther);
+			}
+		}
+		else
+		{
+			OBJECT &obj = m_objects[item.iObject];
+			if (isHidden(eye, obj.minX, obj.minZ, obj.maxX, obj.maxZ, obj.maxY, item.dMin, item.dMax))
+			{
+				obj.bVisible = false;
+				m_nCulledObjects++;
+			}
+			else
+				m_nVisibleObjects++;
+		}
+	}
+
+	// remove the hidden chunks, keeping the order (adjacent index ranges are merged by drawChunks)
+	if (m_nHorizonCulledChunks)
+		for (int L = 0; L < nLevels; L++)
+			chunks[L].erase(std::remove_if(chunks[L].begin(), chunks[L].end(), [&hidden](int i) { return hidden[i]; }), chunks[L].end());
+}
+
+bool C3dglTerrain::isHidden(const float eye[3], float minX, float minZ, float maxX, float maxZ, float maxY, float dMin, float dMax)
+{
+	// the eye above the footprint - always visible
+	if (dMin <= 0)
+		return false;
+
+	// the highest elevation of the top of the box
+	float e = (maxY - eye[1]) / (maxY > eye[1] ? dMin : dMax);
+
+	// azimuth span of the footprint (less than half a turn as the eye is outside)
+	float ref = getAzimuth((minX + maxX) * 0.5f - eye[0], (minZ + maxZ) * 0.5f - eye[2]);
+	float a = ref, b = ref;
+	float xs[2] = { minX, maxX }, zs[2] = { minZ, maxZ };
+	for (int i = 0; i < 4; i++)
+	{
+		float c = getAzimuth(xs[i & 1] - eye[0], zs[i >> 1] - eye[2], ref);
+		a = min(a, c);
+		b = max(b, c);
+	}
+
+	// hidden if the horizon is higher in all the columns touched
+	for (int c = (int)floor(a); c < (int)ceil(b); c++)
+		if (m_horizon[c & (TERRAIN_HORIZON_SIZE - 1)] <= e)
+			return false;
+	return true;
+}
+
+void C3dglTerrain::rasteriseChunk(const float eye[3], const CHUNK &chunk, float fBias)
+{
+	// The chunk is rasterised as a set of grid lines (the rendered surface is linear between the grid points along them),
+	// about 8 in each direction, each split into stretches of up to s cells. The lowest elevation of a stretch is
+	// written to all the columns it touches; the horizon is raised to the lowest of them in the columns entirely
+	// covered by the line, as only there the line is certain to be in the way.
+	int minx = -m_nSizeX/2;
+	int minz = -m_nSizeZ/2;
+	int s = max(1, (max(chunk.nx, chunk.nz) + 7) / 8);
+
+	struct STRETCH { float a, b, e; };
+	vector<STRETCH> stretches;
+	vector<float> columns;
+
+	for (int dir = 0; dir < 2; dir++)
+	{
+		// dir 0: lines of constant x, along z; dir 1: lines of constant z, along x
+		int nAcross = dir == 0 ? chunk.nx : chunk.nz;
+		int nAlong = dir == 0 ? chunk.nz : chunk.nx;
+		for (int i = 0; i <= nAcross; i = (i < nAcross && i + s > nAcross) ? nAcross : i + s)
+		{
+			int x0 = chunk.x0 + (dir == 0 ? i : 0), z0 = chunk.z0 + (dir == 0 ? 0 : i);
+			int dx = dir == 0 ? 0 : 1, dz = 1 - dx;
+
+			// the line in the eye coordinates
+			float px = minx + x0 - eye[0], pz = minz + z0 - eye[2];
+			float ref = getAzimuth(px, pz);
+			bool bThroughEye = false;
+			stretches.clear();
+			for (int j0 = 0; j0 < nAlong; j0 += s)
+			{
+				int j1 = min(j0 + s, nAlong);
+				float ax = px + dx * j0, az = pz + dz * j0;
+				float bx = px + dx * j1, bz = pz + dz * j1;
+
+				// the lowest point of the stretch
+				float y = 1e30f;
+				for (int j = j0; j <= j1; j++)
+					y = min(y, height(x0 + dx * j, z0 + dz * j));
+				y -= fBias + eye[1];
+
+				// the lowest elevation: from the farthest end if above the eye, from the nearest point otherwise
+				float d;
+				if (y >= 0)
+					d = max(sqrt(ax * ax + az * az), sqrt(bx * bx + bz * bz));
+				else
+				{
+					float t = max(0.0f, min(1.0f, -(ax * (bx - ax) + az * (bz - az)) / (float)((j1 - j0) * (j1 - j0))));
+					float cx = ax + (bx - ax) * t, cz = az + (bz - az) * t;
+					d = sqrt(cx * cx + cz * cz);
+				}
+				if (d < 1e-3f)
+				{
+					bThroughEye = true;
+					break;
+				}
+
+				STRETCH stretch;
+				float ua = getAzimuth(ax, az, ref), ub = getAzimuth(bx, bz, ref);
+				stretch.a = min(ua, ub);
+				stretch.b = max(ua, ub);
+				stretch.e = y / d;
+				stretches.push_back(stretch);
+			}
+			if (bThroughEye || stretches.empty())
+				continue;
+
+			// the span of the whole line
+			float a = stretches[0].a, b = stretches[0].b;
+			for (STRETCH &stretch : stretches)
+			{
+				a = min(a, stretch.a);
+				b = max(b, stretch.b);
+			}
+			int c0 = (int)floor(a);
+			columns.assign((int)ceil(b) - c0, 1e30f);
+			for (STRETCH &stretch : stretches)
+				for (int c = (int)floor(stretch.a); c < (int)ceil(stretch.b); c++)
+					columns[c - c0] = min(columns[c - c0], stretch.e);
+
+			// raise the horizon in the columns entirely covered by the line
+			for (int c = (int)ceil(a); c < (int)floor(b); c++)
+			{
+				float &h = m_horizon[c & (TERRAIN_HORIZON_SIZE - 1)];
+				h = max(h, columns[c - c0]);
+			}
+		}
+	}
+}
+
+void C3dglTerrain::render()
+{
+	// check if a shading program is active - the compact format and the displacement cannot be handled by the fixed pipeline
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	if (!pProgram && (m_bCompact || m_bDisplacement))
+		return;
+	updateBuffers();
+	updateLightMap();
+
+	// cull the chunks
+	vector<int> chunks;
+	float planes[6][4], eye[3];
+	cullChunks(chunks, planes, eye);
+	cullHorizon(planes, eye, &chunks, 1);
+	m_nVisibleChunks = m_nRenderedTriangles = 0;
+	if (chunks.empty())
+		return;
+
+	bindVertices(pProgram);
+	drawChunks(pProgram, chunks, 0);
+	unbindVertices(pProgram);
+}
+
+void C3dglTerrain::selectNode(int iNode, const float planes[6][4], const float eye[3], const float ranges[], vector<int> chunks[])
+{
+	NODE &node = m_nodes[iNode];
+	if (!isBoxInFrustum(planes, node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ))
+		return;
+
+	if (node.iChunk < 0)
+	{
+		for (int i = 0; i < 4 && node.children[i] >= 0; i++)
+			selectNode(node.children[i], planes, eye, ranges, chunks);
+		return;
+	}
+
+	// distance from the eye to the nearest point of the chunk
+	float dx = max(max(node.minX - eye[0], eye[0] - node.maxX), 0.0f);
+	float dy = max(max(node.minY - eye[1], eye[1] - node.maxY), 0.0f);
+	float dz = max(max(node.minZ - eye[2], eye[2] - node.maxZ), 0.0f);
+	float dist = sqrt(dx * dx + dy * dy + dz * dz);
+
+	// select the level
+	CHUNK &chunk = m_chunks[node.iChunk];
+	int L = 0;
+	while (L < chunk.nLevels - 1 && dist >= ranges[L])
+		L++;
+
+	chunks[L].push_back(node.iChunk);
+}
+
+void C3dglTerrain::renderLOD()
+{
+	// LOD requires the vertex shader for geomorphing
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	if (!pProgram || m_nodes.empty())
+	{
+		render();
+		return;
+	}
+	updateBuffers();
+	updateLightMap();
+
+	// collect the current transformation
+	float matrixProjection[16], matrixModelView[16], matrix[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, matrixProjection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrixModelView);
+	multMatrix(matrixProjection, matrixModelView, matrix);
+	float planes[6][4];
+	extractFrustum(matrix, planes);
+
+	// eye position in the model coordinates
+	gluInvertMatrix(matrixModelView, matrix);
+	float eye[3] = { matrix[12], matrix[13], matrix[14] };
+
+	// pixels per unit of height error seen from the distance of 1
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	float K = viewport[3] * 0.5f * matrixProjection[5];
+
+	// LOD ranges: level L+1 is used beyond ranges[L], where its error falls below the pixel threshold.
+	// Consecutive ranges are at least two chunk diagonals apart so that adjacent chunks differ by at most one level
+	// and each level has a morphing band at least one chunk diagonal wide.
+	float ranges[TERRAIN_MAX_LOD], morphStart[TERRAIN_MAX_LOD];
+	for (int L = 0; L < m_nLodLevels - 1; L++)
+	{
+		ranges[L] = m_lodMaxError[L + 1] * K / max(m_fPixelError, 0.01f);
+		if (L == 0)
+		{
+			ranges[L] = max(ranges[L], m_fChunkDiagonal);
+			morphStart[L] = ranges[L] * 0.5f;
+		}
+		else
+		{
+			ranges[L] = max(ranges[L], ranges[L - 1] + 2 * m_fChunkDiagonal);
+			morphStart[L] = ranges[L - 1] + m_fChunkDiagonal;
+		}
+	}
+
+	// select chunks and levels
+	vector<int> chunks[TERRAIN_MAX_LOD];
+	m_nVisibleChunks = m_nRenderedTriangles = 0;
+	selectNode(0, planes, eye, ranges, chunks);
+	cullHorizon(planes, eye, chunks, m_nLodLevels);
+
+	bindVertices(pProgram);
+
+	// draw the levels one by one
+	pProgram->SendUniform("lodCameraPos", eye[0], eye[1], eye[2]);
+	pProgram->SendUniform("lodGridOffset", (GLfloat)(m_nSizeX/2), (GLfloat)(m_nSizeZ/2));
+	for (int L = 0; L < m_nLodLevels; L++)
+	{
+		if (chunks[L].empty()) continue;
+		if (L < m_nLodLevels - 1)
+		{
+			pProgram->SendUniform("lodLevel", (GLint)L);
+			pProgram->SendUniform("lodMorphRange", morphStart[L], ranges[L]);
+		}
+		else
+			pProgram->SendUniform("lodLevel", (GLint)-1);		// the coarsest level - nothing to morph into
+		drawChunks(pProgram, chunks[L], L);
+	}
+	pProgram->SendUniform("lodLevel", (GLint)-1);
+
+	unbindVertices(pProgram);
+}
+
+void C3dglTerrain::renderNormals()
+{
+	// no normal vectors to show in the displacement mode
+	if (m_linesBuffer == 0)
+		return;
+	updateBuffers();
+
 	// check if a shading program is active
 	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
 	if (pProgram)
@@ -286,7 +3167,7 @@ void C3dglTerrain::renderNormals()
 		glEnableVertexAttribArray(attribVertex);
 		glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
 		glVertexAttribPointer(attribVertex, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glDrawArrays(GL_LINES, 0, m_nSizeX * m_nSizeZ * 2);
+		glDrawArrays(GL_LINES, 0, m_nVertices * 2);
 		glDisableVertexAttribArray(attribVertex);
 		glEnable(GL_LIGHTING);
 	}
@@ -297,7 +3178,7 @@ void C3dglTerrain::renderNormals()
 		glEnableClientState(GL_VERTEX_ARRAY);
 		glBindBuffer(GL_ARRAY_BUFFER, m_linesBuffer);
 		glVertexPointer(3, GL_FLOAT, 0, 0);
-		glDrawArrays(GL_LINES, 0, m_nSizeX * m_nSizeZ * 2);
+		glDrawArrays(GL_LINES, 0, m_nVertices * 2);
 		glDisableClientState(GL_VERTEX_ARRAY);
 		glEnable(GL_LIGHTING);
 	}
@@ -0,0 +1,262 @@
+#include <sstream>
+#include <vector>
+#include <cmath>
+
+#include "../include/3dglTerrainNoise.h"
+#include "../include/3dglTerrain.h"
+#include "../include/3dglThreadPool.h"
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define TERRAIN_SSE2
+#include <emmintrin.h>
+#endif
+
+using std::vector;
+using namespace _3dgl;
+
+// lattice hash constants: the hash of the corner (ix, iz) mixes ix * HASH_X and iz * HASH_Z,
+// so the next corner along x (or z) is found by adding HASH_X (or HASH_Z)
+#define HASH_X	0x27d4eb2du
+#define HASH_Z	0x165667b1u
+#define HASH_M	0x2c1b3c6du
+
+#define OCTAVE_ROTATION	0.6435f		// rotation between the consecutive octaves (about 37 degrees), so that their lattices do not line up
+
+static unsigned mix(unsigned h)
+{
+	h ^= h >> 15; h *= HASH_M;
+	h ^= h >> 12;
+	return h;
+}
+
+C3dglTerrainNoise::C3dglTerrainNoise()
+{
+	m_nSeed = 1;
+	m_nOctaves = 8;
+	m_fFrequency = 1.0f / 256.0f;
+	m_fLacunarity = 2;
+	m_fGain = 0.5f;
+	m_fBaseHeight = 0;
+	m_fHeight = 40;
+	m_fRidged = 0.5f;
+	m_fErosion = 0.3f;
+	prepare();
+}
+
+void C3dglTerrainNoise::prepare()
+{
+	float fAmp = 1, fFreq = m_fFrequency, fTotal = 0;
+	for (int o = 0; o < m_nOctaves; o++)
+	{
+		m_octaveSeed[o] = mix(mix(m_nSeed) + o * 0x9e3779b9u);
+		m_octaveAmp[o] = fAmp;
+		m_octaveFreq[o] = fFreq;
+		m_octaveCos[o] = cos(o * OCTAVE_ROTATION);
+		m_octaveSin[o] = sin(o * OCTAVE_ROTATION);
+		fTotal += fAmp;
+		fAmp *= m_fGain;
+		fFreq *= m_fLacunarity;
+	}
+	for (int o = 0; o < m_nOctaves; o++)
+		m_octaveAmp[o] /= fTotal;
+}
+
+// Gradient noise of a single octave, with its derivatives.
+// The gradients are the diagonals (+-1, +-1), picked by the two lowest bits of the corner hash.
+// The interpolation is the quintic fade, so the derivatives are continuous.
+static float octave(float px, float pz, unsigned seed, float &dx, float &dz)
+{
+	float fx0 = floor(px), fz0 = floor(pz);
+	float fx = px - fx0, fz = pz - fz0;
+	unsigned hx = (unsigned)(int)fx0 * HASH_X, hz = (unsigned)(int)fz0 * HASH_Z;
+	unsigned ha = mix(hx ^ hz ^ seed);
+	unsigned hb = mix((hx + HASH_X) ^ hz ^ seed);
+	unsigned hc = mix(hx ^ (hz + HASH_Z) ^ seed);
+	unsigned hd = mix((hx + HASH_X) ^ (hz + HASH_Z) ^ seed);
+
+	float gax = (ha & 1) ? -1.0f : 1.0f, gaz = (ha & 2) ? -1.0f : 1.0f;
+	float gbx = (hb & 1) ? -1.0f : 1.0f, gbz = (hb & 2) ? -1.0f : 1.0f;
+	float gcx = (hc & 1) ? -1.0f : 1.0f, gcz = (hc & 2) ? -1.0f : 1.0f;
+	float gdx = (hd & 1) ? -1.0f : 1.0f, gdz = (hd & 2) ? -1.0f : 1.0f;
+
+	float a = gax * fx + gaz * fz;
+	float b = gbx * (fx - 1) + gbz * fz;
+	float c = gcx * fx + gcz * (fz - 1);
+	float d = gdx * (fx - 1) + gdz * (fz - 1);
+
+	float qu = fx * fx * fx * (fx * (fx * 6 - 15) + 10);
+	float qv = fz * fz * fz * (fz * (fz * 6 - 15) + 10);
+	float dqu = 30 * fx * fx * (fx * (fx - 2) + 1);
+	float dqv = 30 * fz * fz * (fz * (fz - 2) + 1);
+
+	float k1 = b - a, k2 = c - a, k3 = a - b - c + d;
+	dx = gax + (gbx - gax) * qu + (gcx - gax) * qv + (gax - gbx - gcx + gdx) * qu * qv + dqu * (k1 + k3 * qv);
+	dz = gaz + (gbz - gaz) * qu + (gcz - gaz) * qv + (gaz - gbz - gcz + gdz) * qu * qv + dqv * (k2 + k3 * qu);
+	return a + k1 * qu + k2 * qv + k3 * qu * qv;
+}
+
+float C3dglTerrainNoise::getHeight(float x, float z)
+{
+	float sum = 0, sdx = 0, sdz = 0;
+	for (int o = 0; o < m_nOctaves; o++)
+	{
+		float co = m_octaveCos[o], si = m_octaveSin[o], f = m_octaveFreq[o];
+		float px = (x * co - z * si) * f, pz = (x * si + z * co) * f;
+		float dx, dz;
+		float n = octave(px, pz, m_octaveSeed[o], dx, dz);
+
+		// the gradient is accumulated in the unrotated space
+		sdx += dx * co + dz * si;
+		sdz += dz * co - dx * si;
+
+		// ridged: 1 - |n| squared, scaled back to [-1, 1]
+		float r = 1 - fabs(n);
+		float ridge = 2 * r * r - 1;
+		n = n + m_fRidged * (ridge - n);
+
+		// erosion: the detail fades out where the slope built up by the previous octaves is steep
+		sum += m_octaveAmp[o] * n / (1 + m_fErosion * (sdx * sdx + sdz * sdz));
+	}
+	sum = sum < -1 ? -1 : sum > 1 ? 1 : sum;
+	return m_fBaseHeight + m_fHeight * sum;
+}
+
+#ifdef TERRAIN_SSE2
+
+// 32-bit multiplication (SSE4.1 _mm_mullo_epi32, built of two SSE2 64-bit multiplications)
+static inline __m128i mullo(__m128i a, __m128i b)
+{
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i mix4(__m128i h)
+{
+	h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+	h = mullo(h, _mm_set1_epi32((int)HASH_M));
+	return _mm_xor_si128(h, _mm_srli_epi32(h, 12));
+}
+
+// floor, with _mm_cvttps_epi32 truncating towards zero
+static inline __m128 floor4(__m128 p, __m128i &i)
+{
+	i = _mm_cvttps_epi32(p);
+	__m128 f = _mm_cvtepi32_ps(i);
+	__m128 mask = _mm_cmpgt_ps(f, p);
+	i = _mm_add_epi32(i, _mm_castps_si128(mask));		// -1 where rounded up
+	return _mm_sub_ps(f, _mm_and_ps(mask, _mm_set1_ps(1)));
+}
+
+// four samples of octave() - the same operations, in the same order
+static inline __m128 octave4(__m128 px, __m128 pz, __m128i seed, __m128 &dx, __m128 &dz)
+{
+	__m128i ix, iz;
+	__m128 fx = _mm_sub_ps(px, floor4(px, ix)), fz = _mm_sub_ps(pz, floor4(pz, iz));
+	__m128i hx = mullo(ix, _mm_set1_epi32((int)HASH_X)), hz = mullo(iz, _mm_set1_epi32((int)HASH_Z));
+	__m128i hx1 = _mm_add_epi32(hx, _mm_set1_epi32((int)HASH_X)), hz1 = _mm_add_epi32(hz, _mm_set1_epi32((int)HASH_Z));
+	__m128i ha = mix4(_mm_xor_si128(_mm_xor_si128(hx, hz), seed));
+	__m128i hb = mix4(_mm_xor_si128(_mm_xor_si128(hx1, hz), seed));
+	__m128i hc = mix4(_mm_xor_si128(_mm_xor_si128(hx, hz1), seed));
+	__m128i hd = mix4(_mm_xor_si128(_mm_xor_si128(hx1, hz1), seed));
+
+	// the gradients: +-1, the hash bits moved to the sign bit
+	__m128i one = _mm_castps_si128(_mm_set1_ps(1)), bit0 = _mm_set1_epi32(1), bit1 = _mm_set1_epi32(2);
+	#define GRAD_X(h)	_mm_castsi128_ps(_mm_xor_si128(one, _mm_slli_epi32(_mm_and_si128(h, bit0), 31)))
+	#define GRAD_Z(h)	_mm_castsi128_ps(_mm_xor_si128(one, _mm_slli_epi32(_mm_and_si128(h, bit1), 30)))
+	__m128 gax = GRAD_X(ha), gaz = GRAD_Z(ha);
+	__m128 gbx = GRAD_X(hb), gbz = GRAD_Z(hb);
+	__m128 gcx = GRAD_X(hc), gcz = GRAD_Z(hc);
+	__m128 gdx = GRAD_X(hd), gdz = GRAD_Z(hd);
+	#undef GRAD_X
+	#undef GRAD_Z
+
+	__m128 c1 = _mm_set1_ps(1);
+	__m128 fx1 = _mm_sub_ps(fx, c1), fz1 = _mm_sub_ps(fz, c1);
+	__m128 a = _mm_add_ps(_mm_mul_ps(gax, fx), _mm_mul_ps(gaz, fz));
+	__m128 b = _mm_add_ps(_mm_mul_ps(gbx, fx1), _mm_mul_ps(gbz, fz));
+	__m128 c = _mm_add_ps(_mm_mul_ps(gcx, fx), _mm_mul_ps(gcz, fz1));
+	__m128 d = _mm_add_ps(_mm_mul_ps(gdx, fx1), _mm_mul_ps(gdz, fz1));
+
+	__m128 c6 = _mm_set1_ps(6), c15 = _mm_set1_ps(15), c10 = _mm_set1_ps(10), c30 = _mm_set1_ps(30), c2 = _mm_set1_ps(2);
+	__m128 fx2 = _mm_mul_ps(fx, fx), fz2 = _mm_mul_ps(fz, fz);
+	__m128 qu = _mm_mul_ps(_mm_mul_ps(fx2, fx), _mm_add_ps(_mm_mul_ps(fx, _mm_sub_ps(_mm_mul_ps(fx, c6), c15)), c10));
+	__m128 qv = _mm_mul_ps(_mm_mul_ps(fz2, fz), _mm_add_ps(_mm_mul_ps(fz, _mm_sub_ps(_mm_mul_ps(fz, c6), c15)), c10));
+	__m128 dqu = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(c30, fx), fx), _mm_add_ps(_mm_mul_ps(fx, _mm_sub_ps(fx, c2)), c1));
+	__m128 dqv = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(c30, fz), fz), _mm_add_ps(_mm_mul_ps(fz, _mm_sub_ps(fz, c2)), c1));
+
+	__m128 k1 = _mm_sub_ps(b, a), k2 = _mm_sub_ps(c, a), k3 = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(a, b), c), d);
+	__m128 quv = _mm_mul_ps(qu, qv);
+	dx = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(gax, _mm_mul_ps(_mm_sub_ps(gbx, gax), qu)), _mm_mul_ps(_mm_sub_ps(gcx, gax), qv)),
+		_mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(gax, gbx), gcx), gdx), quv)), _mm_mul_ps(dqu, _mm_add_ps(k1, _mm_mul_ps(k3, qv))));
+	dz = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(gaz, _mm_mul_ps(_mm_sub_ps(gbz, gaz), qu)), _mm_mul_ps(_mm_sub_ps(gcz, gaz), qv)),
+		_mm_mul_ps(_mm_add_ps(_mm_sub_ps(_mm_sub_ps(gaz, gbz), gcz), gdz), quv)), _mm_mul_ps(dqv, _mm_add_ps(k2, _mm_mul_ps(k3, qu))));
+	return _mm_add_ps(_mm_add_ps(_mm_add_ps(a, _mm_mul_ps(k1, qu)), _mm_mul_ps(k2, qv)), _mm_mul_ps(k3, quv));
+}
+
+#endif
+
+// heights of n points (x, z0 + j) - four at a time with SSE2, the remainder with getHeight
+void C3dglTerrainNoise::generateRow(float x, float z0, int n, float *pHeights)
+{
+	int j = 0;
+#ifdef TERRAIN_SSE2
+	__m128 vx = _mm_set1_ps(x);
+	__m128 ridged = _mm_set1_ps(m_fRidged), erosion = _mm_set1_ps(m_fErosion);
+	__m128 c1 = _mm_set1_ps(1), c2 = _mm_set1_ps(2);
+	__m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	for (; j + 4 <= n; j += 4)
+	{
+		__m128 vz = _mm_add_ps(_mm_set1_ps(z0), _mm_setr_ps((float)j, (float)(j + 1), (float)(j + 2), (float)(j + 3)));
+		__m128 sum = _mm_setzero_ps(), sdx = _mm_setzero_ps(), sdz = _mm_setzero_ps();
+		for (int o = 0; o < m_nOctaves; o++)
+		{
+			__m128 co = _mm_set1_ps(m_octaveCos[o]), si = _mm_set1_ps(m_octaveSin[o]), f = _mm_set1_ps(m_octaveFreq[o]);
+			__m128 px = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(vx, co), _mm_mul_ps(vz, si)), f);
+			__m128 pz = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(vx, si), _mm_mul_ps(vz, co)), f);
+			__m128 dx, dz;
+			__m128 v = octave4(px, pz, _mm_set1_epi32((int)m_octaveSeed[o]), dx, dz);
+
+			sdx = _mm_add_ps(sdx, _mm_add_ps(_mm_mul_ps(dx, co), _mm_mul_ps(dz, si)));
+			sdz = _mm_add_ps(sdz, _mm_sub_ps(_mm_mul_ps(dz, co), _mm_mul_ps(dx, si)));
+
+			__m128 r = _mm_sub_ps(c1, _mm_and_ps(v, absMask));
+			__m128 ridge = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(c2, r), r), c1);
+			v = _mm_add_ps(v, _mm_mul_ps(ridged, _mm_sub_ps(ridge, v)));
+
+			__m128 damp = _mm_add_ps(c1, _mm_mul_ps(erosion, _mm_add_ps(_mm_mul_ps(sdx, sdx), _mm_mul_ps(sdz, sdz))));
+			sum = _mm_add_ps(sum, _mm_div_ps(_mm_mul_ps(_mm_set1_ps(m_octaveAmp[o]), v), damp));
+		}
+		sum = _mm_min_ps(_mm_max_ps(sum, _mm_set1_ps(-1)), c1);
+		_mm_storeu_ps(pHeights + j, _mm_add_ps(_mm_set1_ps(m_fBaseHeight), _mm_mul_ps(_mm_set1_ps(m_fHeight), sum)));
+	}
+#endif
+	for (; j < n; j++)
+		pHeights[j] = getHeight(x, z0 + j);
+}
+
+void C3dglTerrainNoise::generate(int x0, int z0, int nSizeX, int nSizeZ, float *pHeights, C3dglThreadPool *pThreadPool)
+{
+	if (!pThreadPool)
+		pThreadPool = C3dglThreadPool::getDefault();
+	pThreadPool->parallelFor(nSizeX, [=](int i0, int i1)
+	{
+		for (int i = i0; i < i1; i++)
+			generateRow((float)(x0 + i), (float)z0, nSizeZ, pHeights + (size_t)i * nSizeZ);
+	}, 16);
+}
+
+bool C3dglTerrainNoise::createTerrain(C3dglTerrain *pTerrain, int nSizeX, int nSizeZ)
+{
+	if (nSizeX < 2 || nSizeZ < 2)
+		return logError("terrain too small");
+
+	vector<float> heights((size_t)nSizeX * nSizeZ);
+	generate(-nSizeX/2, -nSizeZ/2, nSizeX, nSizeZ, &heights[0], pTerrain->getThreadPool());
+
+	std::ostringstream info;
+	info << "procedural terrain generated: " << nSizeX << " x " << nSizeZ << ", " << m_nOctaves << " octaves, seed " << m_nSeed;
+	logSuccess(info.str());
+
+	return pTerrain->createHeightmap(nSizeX, nSizeZ, &heights[0]);
+}
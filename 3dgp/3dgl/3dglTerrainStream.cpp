@@ -0,0 +1,545 @@
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <Windows.h>
+#include "../include/glee.h"
+#include "../include/3dglShader.h"
+#include "../include/3dglTerrainStream.h"
+#include "../include/3dglTerrainNoise.h"
+#include "../include/3dglThreadPool.h"
+#include "../include/3dglMatInverse.h"
+
+using std::vector;
+using namespace _3dgl;
+
+C3dglTerrainStream::C3dglTerrainStream()
+{
+	m_hFile = m_hMapping = NULL;
+	memset(&m_header, 0, sizeof(m_header));
+	m_nTileStride = 0;
+	m_nSize = m_nSizeX = m_nSizeZ = 0;
+	m_pNoise = NULL;
+	m_nBudget = 256 * 1024 * 1024;
+	m_fViewRadius = 1500;
+	m_nMaxUploads = 4;
+	m_nFrame = 0;
+	m_indexBuffer = 0;
+	m_nIndices = 0;
+	m_nVisibleTiles = m_nLoadedTiles = 0;
+	m_nDecoding = -1;
+	m_bQuit = false;
+}
+
+C3dglTerrainStream::~C3dglTerrainStream()
+{
+	close();
+}
+
+// Tiled Height File
+
+bool C3dglTerrainStream::writeTiledFile(const std::string filename, int nTilesX, int nTilesZ, float fMinHeight, float fMaxHeight,
+	std::function<float(int x, int z)> fnHeight, int nTileSize)
+{
+	std::ofstream file(filename.c_str(), std::ios::binary);
+	if (!file)
+		return false;
+
+	FILE_HEADER header;
+	memcpy(header.magic, "3DTH", 4);
+	header.nVersion = TERRAIN_STREAM_VERSION;
+	header.nTilesX = nTilesX;
+	header.nTilesZ = nTilesZ;
+	header.nTileSize = nTileSize;
+	header.fMinHeight = fMinHeight;
+	header.fHeightScale = fMaxHeight > fMinHeight ? fMaxHeight - fMinHeight : 1;
+
+	// header and tiles are padded to the alignment
+	unsigned nTileBytes = nTileSize * nTileSize * sizeof(unsigned short);
+	unsigned nTileStride = (nTileBytes + TERRAIN_STREAM_ALIGNMENT - 1) / TERRAIN_STREAM_ALIGNMENT * TERRAIN_STREAM_ALIGNMENT;
+	vector<char> padding(TERRAIN_STREAM_ALIGNMENT, 0);
+	file.write((const char*)&header, sizeof(header));
+	file.write(&padding[0], TERRAIN_STREAM_ALIGNMENT - sizeof(header));
+
+	int nCells = nTileSize - 3;		// cells per tile
+	int nSizeX = nTilesX * nCells + 1, nSizeZ = nTilesZ * nCells + 1;
+	vector<unsigned short> tile(nTileSize * nTileSize);
+	for (int tx = 0; tx < nTilesX; tx++)
+		for (int tz = 0; tz < nTilesZ; tz++)
+		{
+			// the apron is clamped to the height map edges
+			for (int i = 0; i < nTileSize; i++)
+				for (int j = 0; j < nTileSize; j++)
+				{
+					int x = max(0, min(nSizeX - 1, tx * nCells + i - 1));
+					int z = max(0, min(nSizeZ - 1, tz * nCells + j - 1));
+					float q = (fnHeight(x, z) - header.fMinHeight) / header.fHeightScale * 65535.0f + 0.5f;
+					tile[i * nTileSize + j] = (unsigned short)max(0.0f, min(65535.0f, q));
+				}
+			file.write((const char*)&tile[0], nTileBytes);
+			file.write(&padding[0], nTileStride - nTileBytes);
+		}
+
+	return !file.fail();
+}
+
+bool C3dglTerrainStream::open(const std::string filename)
+{
+	close();
+	m_filename = filename;
+
+	// open and map the file
+	HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return logError("Cannot open " + filename);
+	m_hFile = hFile;
+	m_hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_hMapping)
+	{
+		close();
+		return logError("Cannot map " + filename);
+	}
+
+	// read the header
+	void *p = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, sizeof(FILE_HEADER));
+	if (!p)
+	{
+		close();
+		return logError("Cannot read " + filename);
+	}
+	memcpy(&m_header, p, sizeof(FILE_HEADER));
+	UnmapViewOfFile(p);
+	if (memcmp(m_header.magic, "3DTH", 4) != 0 || m_header.nVersion != TERRAIN_STREAM_VERSION || m_header.nTileSize < 4)
+	{
+		close();
+		return logError(filename + " is not a tiled height file");
+	}
+
+	m_nTileStride = (m_header.nTileSize * m_header.nTileSize * sizeof(unsigned short) + TERRAIN_STREAM_ALIGNMENT - 1) / TERRAIN_STREAM_ALIGNMENT * TERRAIN_STREAM_ALIGNMENT;
+	return start(filename);
+}
+
+bool C3dglTerrainStream::openProcedural(C3dglTerrainNoise *pNoise, int nTileSize)
+{
+	close();
+	if (!pNoise || nTileSize < 4)
+		return logError("Cannot open the procedural terrain");
+	m_filename = "procedural terrain";
+	m_pNoise = pNoise;
+
+	// the header as if the tiles were in a file - the heights are quantised within the noise bounds
+	memcpy(m_header.magic, "3DTH", 4);
+	m_header.nVersion = TERRAIN_STREAM_VERSION;
+	m_header.nTilesX = m_header.nTilesZ = TERRAIN_STREAM_PROCEDURAL_TILES;
+	m_header.nTileSize = nTileSize;
+	m_header.fMinHeight = pNoise->getMinHeight();
+	m_header.fHeightScale = pNoise->getMaxHeight() > pNoise->getMinHeight() ? pNoise->getMaxHeight() - pNoise->getMinHeight() : 1;
+	m_nTileStride = 0;
+
+	// the default pool must first be used by the main thread (see C3dglThreadPool::getDefault)
+	C3dglThreadPool::getDefault();
+	return start(m_filename);
+}
+
+bool C3dglTerrainStream::start(const std::string name)
+{
+	m_nSize = m_header.nTileSize - 2;
+	m_nSizeX = m_header.nTilesX * (m_nSize - 1) + 1;
+	m_nSizeZ = m_header.nTilesZ * (m_nSize - 1) + 1;
+
+	// shared index buffer: triangle list, row by row - the same triangles as C3dglTerrain
+	vector<unsigned short> indices;
+	indices.reserve((m_nSize - 1) * (m_nSize - 1) * 6);
+	for (int j = 0; j < m_nSize - 1; j++)
+		for (int i = 0; i < m_nSize - 1; i++)
+		{
+			indices.push_back(i * m_nSize + j);
+			indices.push_back(i * m_nSize + j + 1);
+			indices.push_back((i + 1) * m_nSize + j);
+
+			indices.push_back(i * m_nSize + j + 1);
+			indices.push_back((i + 1) * m_nSize + j + 1);
+			indices.push_back((i + 1) * m_nSize + j);
+		}
+	m_nIndices = indices.size();
+	glGenBuffers(1, &m_indexBuffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * indices.size(), &indices[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	// start the loader
+	m_bQuit = false;
+	m_loader = std::thread(&C3dglTerrainStream::loader, this);
+
+	std::ostringstream info;
+	info << name << ": " << m_nSizeX << " x " << m_nSizeZ << " in " << m_header.nTilesX << " x " << m_header.nTilesZ << " tiles";
+	return logSuccess(info.str());
+}
+
+void C3dglTerrainStream::close()
+{
+	// stop the loader
+	if (m_loader.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_bQuit = true;
+		}
+		m_cvRequest.notify_all();
+		m_loader.join();
+	}
+	m_requests.clear();
+	for (DECODED *pDecoded : m_decoded)
+		delete pDecoded;
+	m_decoded.clear();
+	m_nDecoding = -1;
+
+	// release the cache
+	while (!m_tiles.empty())
+		releaseTile(m_tiles.begin()->first);
+	m_uploads.clear();
+	if (!m_freeBuffers.empty())
+		glDeleteBuffers(m_freeBuffers.size(), &m_freeBuffers[0]);
+	m_freeBuffers.clear();
+	if (m_indexBuffer)
+		glDeleteBuffers(1, &m_indexBuffer);
+	m_indexBuffer = 0;
+
+	if (m_hMapping) CloseHandle(m_hMapping);
+	if (m_hFile) CloseHandle(m_hFile);
+	m_hFile = m_hMapping = NULL;
+	m_pNoise = NULL;
+	m_nSizeX = m_nSizeZ = 0;
+}
+
+// Loader Thread
+
+void C3dglTerrainStream::loader()
+{
+	for (;;)
+	{
+		int key;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_bQuit && m_requests.empty())
+				m_cvRequest.wait(lock);
+			if (m_bQuit)
+				return;
+			key = m_nDecoding = m_requests.front();
+			m_requests.pop_front();
+		}
+
+		DECODED *pDecoded = decodeTile(key);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_decoded.push_back(pDecoded);
+		m_nDecoding = -1;
+	}
+}
+
+// maps (or generates) the tile, finds the normals and converts it into the compact vertex format
+C3dglTerrainStream::DECODED *C3dglTerrainStream::decodeTile(int key)
+{
+	DECODED *pDecoded = new DECODED;
+	pDecoded->key = key;
+	pDecoded->minY = pDecoded->maxY = 0;
+
+	int T = m_header.nTileSize;
+	const unsigned short *pTile;
+	vector<unsigned short> generated;
+	if (m_pNoise)
+	{
+		// the same samples as writeTiledFile would store, including the apron
+		int nCells = T - 3;
+		vector<float> heights(T * T);
+		m_pNoise->generate(key / m_header.nTilesZ * nCells - 1 - m_nSizeX/2, key % m_header.nTilesZ * nCells - 1 - m_nSizeZ/2, T, T, &heights[0]);
+		generated.resize(T * T);
+		for (int i = 0; i < T * T; i++)
+		{
+			float q = (heights[i] - m_header.fMinHeight) / m_header.fHeightScale * 65535.0f + 0.5f;
+			generated[i] = (unsigned short)max(0.0f, min(65535.0f, q));
+		}
+		pTile = &generated[0];
+	}
+	else
+	{
+		unsigned long long offset = TERRAIN_STREAM_ALIGNMENT + (unsigned long long)key * m_nTileStride;
+		pTile = (const unsigned short*)MapViewOfFile(m_hMapping, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, T * T * sizeof(unsigned short));
+		if (!pTile)
+			return pDecoded;	// no vertices - the tile is not uploaded, but requested again (see update)
+	}
+
+	pDecoded->heights.resize(m_nSize * m_nSize);
+	pDecoded->vertices.resize(m_nSize * m_nSize);
+	unsigned short qMin = 0xFFFF, qMax = 0;
+	float fScale = m_header.fHeightScale / 65535.0f;
+	for (int i = 0; i < m_nSize; i++)
+	{
+		const unsigned short *p = pTile + (i + 1) * T + 1;		// skip the apron
+		for (int j = 0; j < m_nSize; j++)
+		{
+			unsigned short q = p[j];
+			qMin = min(qMin, q);
+			qMax = max(qMax, q);
+
+			// central differences - the same normals as C3dglTerrain
+			float dy_x = (float)(p[j + T] - p[j - T]) * fScale;
+			float dy_z = (float)(p[j + 1] - p[j - 1]) * fScale;
+			float m = sqrt(dy_x * dy_x + 4 + dy_z * dy_z);
+
+			C3dglTerrain::COMPACT_VERTEX &v = pDecoded->vertices[i * m_nSize + j];
+			v.height = v.morph = q;
+			C3dglTerrain::octEncode(-dy_x / m, 2 / m, -dy_z / m, v.normal);
+			v.pad[0] = v.pad[1] = 0;
+			pDecoded->heights[i * m_nSize + j] = q;
+		}
+	}
+	if (!m_pNoise)
+		UnmapViewOfFile(pTile);
+
+	pDecoded->minY = m_header.fMinHeight + qMin * fScale;
+	pDecoded->maxY = m_header.fMinHeight + qMax * fScale;
+	return pDecoded;
+}
+
+// Cache
+
+void C3dglTerrainStream::uploadTile(TILE &tile, int key)
+{
+	DECODED *pDecoded = tile.pDecoded;
+	tile.pDecoded = NULL;
+	tile.heights.swap(pDecoded->heights);
+	tile.minY = pDecoded->minY;
+	tile.maxY = pDecoded->maxY;
+	tile.state = TILE_RESIDENT;
+	m_lru.push_front(key);
+	tile.lru = m_lru.begin();
+	m_nLoadedTiles++;
+
+	// reuse a vertex buffer of an evicted tile if possible - all the buffers have the same size
+	GLsizeiptr nBytes = sizeof(C3dglTerrain::COMPACT_VERTEX) * m_nSize * m_nSize;
+	const void *pData = &pDecoded->vertices[0];
+	if (!m_freeBuffers.empty())
+	{
+		tile.buffer = m_freeBuffers.back();
+		m_freeBuffers.pop_back();
+		glBindBuffer(GL_ARRAY_BUFFER, tile.buffer);
+		glBufferSubData(GL_ARRAY_BUFFER, 0, nBytes, pData);
+	}
+	else
+	{
+		glGenBuffers(1, &tile.buffer);
+		glBindBuffer(GL_ARRAY_BUFFER, tile.buffer);
+		glBufferData(GL_ARRAY_BUFFER, nBytes, pData, GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	delete pDecoded;
+}
+
+// removes the tile from the cache, whatever its state
+void C3dglTerrainStream::releaseTile(int key)
+{
+	TILE &tile = m_tiles[key];
+	if (tile.state == TILE_RESIDENT)
+	{
+		m_lru.erase(tile.lru);
+		m_freeBuffers.push_back(tile.buffer);
+	}
+	delete tile.pDecoded;
+	m_tiles.erase(key);
+}
+
+void C3dglTerrainStream::update(float x, float z)
+{
+	if (!isOpen())
+		return;
+	m_nFrame++;
+
+	// the wanted tiles: within the view radius, the nearest first, as many as fit into the budget
+	float fTile = (float)(m_nSize - 1);
+	float x0 = x + m_nSizeX/2, z0 = z + m_nSizeZ/2;		// camera position in the height map coordinates
+	int tx0 = max(0, (int)floor((x0 - m_fViewRadius) / fTile)), tx1 = min(m_header.nTilesX - 1, (int)floor((x0 + m_fViewRadius) / fTile));
+	int tz0 = max(0, (int)floor((z0 - m_fViewRadius) / fTile)), tz1 = min(m_header.nTilesZ - 1, (int)floor((z0 + m_fViewRadius) / fTile));
+	vector<std::pair<float, int> > wanted;
+	for (int tx = tx0; tx <= tx1; tx++)
+		for (int tz = tz0; tz <= tz1; tz++)
+		{
+			// distance to the nearest point of the tile
+			float dx = max(max(tx * fTile - x0, x0 - (tx + 1) * fTile), 0.0f);
+			float dz = max(max(tz * fTile - z0, z0 - (tz + 1) * fTile), 0.0f);
+			float d = sqrt(dx * dx + dz * dz);
+			if (d <= m_fViewRadius)
+				wanted.push_back(std::make_pair(d, tx * m_header.nTilesZ + tz));
+		}
+	std::sort(wanted.begin(), wanted.end());
+	size_t nMaxTiles = max((size_t)1, m_nBudget / getTileBytes());
+	if (wanted.size() > nMaxTiles)
+		wanted.resize(nMaxTiles);
+
+	// mark the wanted tiles, the resident ones move to the front of the LRU list
+	for (auto &w : wanted)
+	{
+		auto it = m_tiles.find(w.second);
+		if (it == m_tiles.end())
+		{
+			// a new tile - to be requested
+			TILE tile;
+			tile.state = TILE_REQUESTED;
+			tile.pDecoded = NULL;
+			tile.buffer = 0;
+			tile.minY = tile.maxY = 0;
+			it = m_tiles.insert(std::make_pair(w.second, tile)).first;
+		}
+		TILE &tile = it->second;
+		tile.nFrame = m_nFrame;
+		if (tile.state == TILE_RESIDENT)
+			m_lru.splice(m_lru.begin(), m_lru, tile.lru);
+	}
+
+	// tiles that are no longer wanted are cancelled, unless already resident
+	for (auto it = m_tiles.begin(); it != m_tiles.end(); )
+	{
+		int key = (it++)->first;
+		TILE &tile = m_tiles[key];
+		if (tile.state != TILE_RESIDENT && tile.nFrame != m_nFrame)
+			releaseTile(key);
+	}
+
+	// collect the decoded tiles and replace the requests - the decoded tiles leave the requested state first,
+	// so that they are not requested again
+	vector<DECODED*> decoded;
+	bool bRequests;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		decoded.assign(m_decoded.begin(), m_decoded.end());
+		m_decoded.clear();
+		for (DECODED *pDecoded : decoded)
+		{
+			auto it = m_tiles.find(pDecoded->key);
+			if (!pDecoded->vertices.empty() && it != m_tiles.end() && it->second.state == TILE_REQUESTED)
+			{
+				it->second.state = TILE_DECODED;
+				it->second.pDecoded = pDecoded;
+				m_uploads.push_back(pDecoded->key);
+			}
+		}
+		m_requests.clear();
+		for (auto &w : wanted)
+			if (m_tiles[w.second].state == TILE_REQUESTED && w.second != m_nDecoding)
+				m_requests.push_back(w.second);
+		bRequests = !m_requests.empty();
+	}
+	if (bRequests)
+		m_cvRequest.notify_one();
+
+	// failed - the tile stays requested, and is tried again; or cancelled meanwhile
+	for (DECODED *pDecoded : decoded)
+	{
+		auto it = m_tiles.find(pDecoded->key);
+		if (it == m_tiles.end() || it->second.pDecoded != pDecoded)
+			delete pDecoded;
+	}
+
+	// make room and upload a few decoded tiles
+	for (int nUploads = 0; nUploads < m_nMaxUploads && !m_uploads.empty(); )
+	{
+		int key = m_uploads.front();
+		m_uploads.pop_front();
+		auto it = m_tiles.find(key);
+		if (it == m_tiles.end() || it->second.state != TILE_DECODED)
+			continue;
+		while (m_lru.size() + 1 > nMaxTiles && m_tiles[m_lru.back()].nFrame != m_nFrame)
+			releaseTile(m_lru.back());
+		uploadTile(it->second, key);
+		nUploads++;
+	}
+
+	// the free buffers count to the budget too
+	while (!m_freeBuffers.empty() && getMemoryUsage() > m_nBudget)
+	{
+		glDeleteBuffers(1, &m_freeBuffers.back());
+		m_freeBuffers.pop_back();
+	}
+}
+
+// Rendering
+
+void C3dglTerrainStream::render()
+{
+	// the compact vertex format requires terrain.vert
+	C3dglProgram *pProgram = C3dglProgram::GetCurrentProgram();
+	m_nVisibleTiles = 0;
+	if (!pProgram || !isOpen())
+		return;
+
+	// collect the current transformation
+	float matrixProjection[16], matrixModelView[16], matrix[16];
+	glGetFloatv(GL_PROJECTION_MATRIX, matrixProjection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrixModelView);
+	multMatrix(matrixProjection, matrixModelView, matrix);
+	float planes[6][4];
+	extractFrustum(matrix, planes);
+
+	GLuint attribVertex = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_VERTEX);
+	GLuint attribNormal = pProgram->GetStdAttribLocation(C3dglProgram::ATTR_NORMAL);
+	glEnableVertexAttribArray(attribVertex);
+	glEnableVertexAttribArray(attribNormal);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+	pProgram->SendUniform("compactVertices", (GLint)1);
+	pProgram->SendUniform("compactHeight", m_header.fMinHeight, m_header.fHeightScale);
+	pProgram->SendUniform("compactSizeZ", (GLint)m_nSize);
+
+	for (int key : m_lru)
+	{
+		TILE &tile = m_tiles[key];
+		int x0 = key / m_header.nTilesZ * (m_nSize - 1), z0 = key % m_header.nTilesZ * (m_nSize - 1);
+		float minX = (float)(x0 - m_nSizeX/2), minZ = (float)(z0 - m_nSizeZ/2);
+		if (!isBoxInFrustum(planes, minX, tile.minY, minZ, minX + m_nSize - 1, tile.maxY, minZ + m_nSize - 1))
+			continue;
+
+		// see C3dglTerrain::setVertexPointers
+		glBindBuffer(GL_ARRAY_BUFFER, tile.buffer);
+		glVertexAttribPointer(attribVertex, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(C3dglTerrain::COMPACT_VERTEX), (const GLvoid*)offsetof(C3dglTerrain::COMPACT_VERTEX, height));
+		glVertexAttribPointer(attribNormal, 2, GL_BYTE, GL_TRUE, sizeof(C3dglTerrain::COMPACT_VERTEX), (const GLvoid*)offsetof(C3dglTerrain::COMPACT_VERTEX, normal));
+		pProgram->SendUniform("compactOffset", (GLfloat)(m_nSizeX/2 - x0), (GLfloat)(m_nSizeZ/2 - z0));
+		glDrawElements(GL_TRIANGLES, m_nIndices, GL_UNSIGNED_SHORT, 0);
+		m_nVisibleTiles++;
+	}
+
+	pProgram->SendUniform("compactVertices", (GLint)0);
+	glDisableVertexAttribArray(attribVertex);
+	glDisableVertexAttribArray(attribNormal);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Height Queries
+
+float C3dglTerrainStream::getHeight(int x, int z)
+{
+	x += m_nSizeX/2;
+	z += m_nSizeZ/2;
+	if (x < 0 || x >= m_nSizeX) return 0;
+	if (z < 0 || z >= m_nSizeZ) return 0;
+
+	// the tile - border samples belong to two tiles, either will do
+	int tx = min(x / (m_nSize - 1), m_header.nTilesX - 1);
+	int tz = min(z / (m_nSize - 1), m_header.nTilesZ - 1);
+	auto it = m_tiles.find(tx * m_header.nTilesZ + tz);
+	if (it == m_tiles.end() || it->second.state != TILE_RESIDENT || it->second.heights.empty())
+		return 0;
+	unsigned short q = it->second.heights[(x - tx * (m_nSize - 1)) * m_nSize + z - tz * (m_nSize - 1)];
+	return m_header.fMinHeight + q * m_header.fHeightScale / 65535.0f;
+}
+
+float C3dglTerrainStream::getInterpolatedHeight(float fx, float fz)
+{
+	// the same triangles as in C3dglTerrain
+	int x = (int)floor(fx);
+	int z = (int)floor(fz);
+	fx -= x;
+	fz -= z;
+	if (fx + fz < 1)
+		return getHeight(x, z) + fx * (getHeight(x + 1, z) - getHeight(x, z)) + fz * (getHeight(x, z + 1) - getHeight(x, z));
+	else
+		return getHeight(x + 1, z + 1) + (1 - fx) * (getHeight(x, z + 1) - getHeight(x + 1, z + 1)) + (1 - fz) * (getHeight(x + 1, z) - getHeight(x + 1, z + 1));
+}
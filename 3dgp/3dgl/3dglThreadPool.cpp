@@ -0,0 +1,180 @@
+#include <atomic>
+#include <memory>
+
+#include "../include/3dglThreadPool.h"
+
+using namespace _3dgl;
+
+C3dglThreadPool::C3dglThreadPool(unsigned nThreads)
+{
+	m_bQuit = false;
+	if (nThreads == 0)
+		nThreads = std::thread::hardware_concurrency();
+	for (unsigned i = 1; i < nThreads; i++)		// the calling thread is the first one
+		m_threads.push_back(std::thread(&C3dglThreadPool::worker, this));
+}
+
+C3dglThreadPool::~C3dglThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_bQuit = true;
+	}
+	m_cvTask.notify_all();
+	for (std::thread &thread : m_threads)
+		thread.join();
+}
+
+C3dglThreadPool *C3dglThreadPool::getDefault()
+{
+	// created on the first use - make sure it is first used by the main thread
+	static C3dglThreadPool pool;
+	return &pool;
+}
+
+void C3dglThreadPool::worker()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_bQuit && m_tasks.empty())
+				m_cvTask.wait(lock);
+			if (m_tasks.empty())
+				return;		// quitting
+			task = m_tasks.front();
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+bool C3dglThreadPool::runQueuedTask()
+{
+	std::function<void()> task;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_tasks.empty())
+			return false;
+		task = m_tasks.front();
+		m_tasks.pop_front();
+	}
+	task();
+	return true;
+}
+
+void C3dglThreadPool::parallelFor(int n, std::function<void(int, int)> fn, int nGrain)
+{
+	if (n <= 0)
+		return;
+	if (nGrain <= 0)
+		nGrain = (n + getThreadCount() * 4 - 1) / (getThreadCount() * 4);	// a few ranges per thread, for load balancing
+	int nRanges = (n + nGrain - 1) / nGrain;
+	int nHelpers = (int)m_threads.size() < nRanges - 1 ? (int)m_threads.size() : nRanges - 1;
+	if (nHelpers == 0)
+	{
+		fn(0, n);
+		return;
+	}
+
+	// the ranges are handed out by a shared counter, to the worker threads and the calling thread alike
+	std::atomic<int> nNext(0), nFinished(0);
+	std::function<void()> task = [&]()
+	{
+		for (int i = nNext++; i < nRanges; i = nNext++)
+			fn(i * nGrain, (i + 1) * nGrain < n ? (i + 1) * nGrain : n);
+		nFinished++;
+	};
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (int i = 0; i < nHelpers; i++)
+			m_tasks.push_back(task);
+	}
+	m_cvTask.notify_all();
+	task();
+
+	// wait until all the helper tasks are finished - they refer to the local variables.
+	// Meanwhile, run any queued tasks - so that a parallelFor called from a worker thread cannot deadlock.
+	while (nFinished < nHelpers + 1)
+		if (!runQueuedTask())
+			std::this_thread::yield();
+}
+
+void C3dglThreadPool::parallelForStealing(int n, std::function<void(int, int, int)> fn, int nGrain)
+{
+	if (n <= 0)
+		return;
+	if (nGrain <= 0)
+		nGrain = (n + getThreadCount() * 4 - 1) / (getThreadCount() * 4);
+	int nRanges = (n + nGrain - 1) / nGrain;
+	int nHelpers = (int)m_threads.size() < nRanges - 1 ? (int)m_threads.size() : nRanges - 1;
+	if (nHelpers == 0)
+	{
+		fn(0, n, 0);
+		return;
+	}
+
+	// the shares: [first, last) range indices packed into a single word, so that the owner taking a range
+	// from the front and a thief taking the back half never miss each other's changes
+	int nThreads = nHelpers + 1;
+	std::unique_ptr<std::atomic<unsigned long long>[]> shares(new std::atomic<unsigned long long>[nThreads]);
+	for (int t = 0; t < nThreads; t++)
+		shares[t] = (unsigned long long)(nRanges * (long long)t / nThreads) << 32 | (unsigned)(nRanges * (long long)(t + 1) / nThreads);
+
+	std::atomic<int> nNextThread(1), nFinished(0);
+	std::function<void(int)> run = [&](int t)
+	{
+		for (;;)
+		{
+			// own share
+			unsigned long long share = shares[t];
+			while ((unsigned)(share >> 32) < (unsigned)share)
+			{
+				unsigned i = (unsigned)(share >> 32);
+				if (shares[t].compare_exchange_weak(share, (unsigned long long)(i + 1) << 32 | (unsigned)share))
+				{
+					fn(i * nGrain, (int)(i + 1) * nGrain < n ? (i + 1) * nGrain : n, t);
+					share = shares[t];
+				}
+			}
+
+			// steal the back half of the largest share
+			int iVictim = -1;
+			unsigned nMost = 0;
+			for (int v = 0; v < nThreads; v++)
+			{
+				unsigned long long s = shares[v];
+				unsigned nLeft = (unsigned)s > (unsigned)(s >> 32) ? (unsigned)s - (unsigned)(s >> 32) : 0;
+				if (nLeft > nMost)
+				{
+					nMost = nLeft;
+					iVictim = v;
+				}
+			}
+			if (iVictim < 0)
+				break;		// all done (or being done)
+			unsigned long long s = shares[iVictim];
+			unsigned first = (unsigned)(s >> 32), last = (unsigned)s;
+			if (first >= last)
+				continue;
+			unsigned mid = last - (last - first + 1) / 2;
+			if (shares[iVictim].compare_exchange_strong(s, (unsigned long long)first << 32 | mid))
+				shares[t] = (unsigned long long)mid << 32 | last;
+		}
+		nFinished++;
+	};
+	std::function<void()> task = [&]() { run(nNextThread++); };
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (int i = 0; i < nHelpers; i++)
+			m_tasks.push_back(task);
+	}
+	m_cvTask.notify_all();
+	run(0);
+
+	// wait until all the helper tasks are finished, running any queued tasks meanwhile (see parallelFor)
+	while (nFinished < nHelpers + 1)
+		if (!runQueuedTask())
+			std::this_thread::yield();
+}
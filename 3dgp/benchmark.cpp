@@ -0,0 +1,659 @@
+// Benchmarks - run with: 3dgp -bench <name>
+// The OpenGL context is created before, but the benchmarks only measure the CPU side.
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/3dgl.h"
+#include <Windows.h>
+#include <Psapi.h>
+
+#pragma comment (lib, "psapi.lib")
+
+using namespace std;
+using namespace _3dgl;
+
+// high resolution timer
+class CTimer
+{
+	LARGE_INTEGER m_freq, m_start;
+public:
+	CTimer()		{ QueryPerformanceFrequency(&m_freq); reset(); }
+	void reset()	{ QueryPerformanceCounter(&m_start); }
+	double ms()		{ LARGE_INTEGER t; QueryPerformanceCounter(&t); return (double)(t.QuadPart - m_start.QuadPart) * 1000.0 / (double)m_freq.QuadPart; }
+};
+
+// synthetic height map: a few octaves of sine waves
+static void makeHeights(int nSize, vector<float> &heights)
+{
+	heights.resize(nSize * nSize);
+	for (int x = 0; x < nSize; x++)
+		for (int z = 0; z < nSize; z++)
+			heights[x * nSize + z] = 20 * sin(x * 0.013f) * cos(z * 0.017f) + 5 * sin(x * 0.07f + z * 0.05f) + sin(x * 0.31f) * cos(z * 0.29f);
+}
+
+// heightmap to mesh conversion (C3dglTerrain::buildMesh), single threaded vs the default thread pool
+static void benchMesh()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int sizes[] = { 1025, 2049, 4097 };
+
+	cout << "Mesh builder benchmark (best of 3 runs)" << endl;
+	for (int nSize : sizes)
+	{
+		vector<float> heights;
+		makeHeights(nSize, heights);
+		double fMVertices = (double)nSize * nSize / 1e6;
+		for (C3dglThreadPool *pPool : pools)
+		{
+			double fBest = 1e30;
+			for (int i = 0; i < 3; i++)
+			{
+				C3dglTerrain terrain;
+				terrain.setIndexOrder(C3dglTerrain::ORDER_OPTIMISED);
+				terrain.setThreadPool(pPool);
+				CTimer timer;
+				terrain.buildMesh(nSize, nSize, &heights[0]);
+				fBest = min(fBest, timer.ms());
+			}
+			cout << setw(5) << nSize << " x " << setw(5) << nSize << ", " << setw(2) << pPool->getThreadCount() << " thread(s): "
+				<< fixed << setprecision(1) << setw(8) << fBest << " ms, " << setw(6) << fBest / fMVertices << " ms per megavertex" << endl;
+		}
+	}
+}
+
+// height queries: getInterpolatedHeight one by one vs the batch versions
+static void benchHeights()
+{
+	int nSize = 1025;
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	C3dglTerrain terrain;
+	terrain.buildMesh(nSize, nSize, &heights[0]);
+
+	// random points: spread over the whole map (slightly exceeding it), or clustered in a 64 x 64 area
+	const int N = 1 << 20;
+	vector<float> xs(N), zs(N), out(N), outBatch(N), outNormals(N), normals(N * 3), slopes(N);
+	cout << "Height query benchmark (" << N << " points, best of 5 runs)" << endl;
+	float ranges[] = { (float)nSize + 16, 64.0f };
+	for (float fRange : ranges)
+	{
+		srand(1);
+		for (int i = 0; i < N; i++)
+		{
+			xs[i] = ((float)rand() / RAND_MAX - 0.5f) * fRange;
+			zs[i] = ((float)rand() / RAND_MAX - 0.5f) * fRange;
+		}
+
+		double fBest[3] = { 1e30, 1e30, 1e30 };
+		for (int run = 0; run < 5; run++)
+		{
+			CTimer timer;
+			for (int i = 0; i < N; i++)
+				out[i] = terrain.getInterpolatedHeight(xs[i], zs[i]);
+			fBest[0] = min(fBest[0], timer.ms());
+
+			timer.reset();
+			terrain.getInterpolatedHeights(&xs[0], &zs[0], &outBatch[0], N);
+			fBest[1] = min(fBest[1], timer.ms());
+
+			timer.reset();
+			terrain.getInterpolatedNormals(&xs[0], &zs[0], &outNormals[0], &normals[0], &slopes[0], N);
+			fBest[2] = min(fBest[2], timer.ms());
+		}
+
+		// the heights of both batch versions should agree with the one by one ones (up to the precision of Heron's formula)
+		float fMaxDiff[3] = { 0, 0, 0 };
+		for (int i = 0; i < N; i++)
+		{
+			fMaxDiff[1] = max(fMaxDiff[1], fabs(out[i] - outBatch[i]));
+			fMaxDiff[2] = max(fMaxDiff[2], fabs(out[i] - outNormals[i]));
+		}
+
+		cout << (fRange > 64 ? "whole map:" : "64 x 64 area:") << endl;
+		const char *pNames[] = { "getInterpolatedHeight", "getInterpolatedHeights", "getInterpolatedNormals" };
+		for (int i = 0; i < 3; i++)
+		{
+			cout << setw(24) << pNames[i] << ": " << fixed << setprecision(2) << setw(8) << fBest[i] << " ms, "
+				<< setw(8) << N / fBest[i] / 1000.0 << " Mqueries/s";
+			if (i > 0)
+				cout << ", max difference: " << setprecision(5) << fMaxDiff[i];
+			cout << endl;
+		}
+	}
+}
+
+// ray casts: the min/max pyramid (one by one and batched) vs marching along the ray with getInterpolatedHeight
+static void benchRays()
+{
+	int nSize = 1025;
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	C3dglTerrain terrain;
+	terrain.buildMesh(nSize, nSize, &heights[0]);
+
+	// random rays, from 5 to 45 units above the surface, looking down at 1 to 30 degrees
+	const int N = 1 << 16;
+	const float fMaxDist = 1000, fStep = 0.25f;
+	vector<float> origins(N * 3), dirs(N * 3), out(N), outBatch(N), outMarch(N);
+	srand(1);
+	for (int i = 0; i < N; i++)
+	{
+		float x = ((float)rand() / RAND_MAX - 0.5f) * nSize, z = ((float)rand() / RAND_MAX - 0.5f) * nSize;
+		float a = (float)rand() / RAND_MAX * 6.2832f, b = (1 + (float)rand() / RAND_MAX * 29) * 0.017453f;
+		origins[i * 3] = x; origins[i * 3 + 1] = terrain.getInterpolatedHeight(x, z) + 5 + (float)rand() / RAND_MAX * 40; origins[i * 3 + 2] = z;
+		dirs[i * 3] = cos(a) * cos(b); dirs[i * 3 + 1] = -sin(b); dirs[i * 3 + 2] = sin(a) * cos(b);
+	}
+
+	cout << "Ray cast benchmark (" << N << " rays, best of 3 runs)" << endl;
+	double fBest[3] = { 1e30, 1e30, 1e30 };
+	for (int run = 0; run < 3; run++)
+	{
+		CTimer timer;
+		for (int i = 0; i < N; i++)
+		{
+			const float *o = &origins[i * 3], *d = &dirs[i * 3];
+			outMarch[i] = -1;
+			for (float t = 0; t <= fMaxDist; t += fStep)
+			{
+				float x = o[0] + d[0] * t, z = o[2] + d[2] * t;
+				if (fabs(x) > nSize / 2 || fabs(z) > nSize / 2)
+					break;		// left the map
+				if (o[1] + d[1] * t <= terrain.getInterpolatedHeight(x, z))
+				{
+					outMarch[i] = t;
+					break;
+				}
+			}
+		}
+		fBest[0] = min(fBest[0], timer.ms());
+
+		timer.reset();
+		for (int i = 0; i < N; i++)
+			out[i] = terrain.rayCast(&origins[i * 3], &dirs[i * 3], fMaxDist);
+		fBest[1] = min(fBest[1], timer.ms());
+
+		timer.reset();
+		terrain.rayCastMany(&origins[0], &dirs[0], fMaxDist, &outBatch[0], N);
+		fBest[2] = min(fBest[2], timer.ms());
+	}
+
+	// the marching is only accurate to its step - and may step over thin ridges
+	int nHits = 0, nDisagree = 0;
+	for (int i = 0; i < N; i++)
+	{
+		if (out[i] >= 0) nHits++;
+		if ((out[i] < 0) != (outMarch[i] < 0) || fabs(out[i] - outMarch[i]) > fStep || out[i] != outBatch[i])
+			nDisagree++;
+	}
+
+	const char *pNames[] = { "marching", "rayCast", "rayCastMany" };
+	for (int i = 0; i < 3; i++)
+		cout << setw(12) << pNames[i] << ": " << fixed << setprecision(2) << setw(8) << fBest[i] << " ms, "
+			<< setw(10) << setprecision(0) << N / fBest[i] * 1000.0 << " rays/s" << endl;
+	cout << "hits: " << nHits << ", disagreements with marching: " << nDisagree << endl;
+}
+
+// terrain deformation: modifyHeights and updateBuffers (including the upload) for regions of different sizes,
+// on maps of different sizes - the cost should only depend on the region size
+static void benchEdit()
+{
+	int sizes[] = { 1025, 4097 };
+	int regions[] = { 4, 16, 64, 256 };
+	const int N = 50;
+
+	cout << "Deformation benchmark (compact vertices, average of " << N << " edits)" << endl;
+	for (int nSize : sizes)
+	{
+		vector<float> heights;
+		makeHeights(nSize, heights);
+		C3dglTerrain terrain;
+		terrain.setCompactVertices(true);
+		CTimer timer;
+		terrain.createHeightmap(nSize, nSize, &heights[0]);
+		glFinish();
+		cout << setw(5) << nSize << " x " << setw(5) << nSize << ": full build " << fixed << setprecision(1) << timer.ms() << " ms" << endl;
+
+		for (int nRegion : regions)
+		{
+			// craters and mounds at random positions, each one uploaded separately (one edit per frame)
+			// within the height range of the map - so that the compact vertices are never requantised
+			srand(1);
+			timer.reset();
+			for (int i = 0; i < N; i++)
+			{
+				int x = rand() % (nSize - nRegion) - nSize / 2, z = rand() % (nSize - nRegion) - nSize / 2;
+				float r = nRegion / 2.0f, depth = (i % 2) ? 0.5f : -0.5f;
+				terrain.modifyHeights(x, z, x + nRegion - 1, z + nRegion - 1, [x, z, r, depth](int px, int pz, float h)
+				{
+					float dx = px - x - r, dz = pz - z - r;
+					return max(-20.0f, min(20.0f, h + max(0.0f, 1 - (dx * dx + dz * dz) / (r * r)) * depth));
+				});
+				terrain.updateBuffers();
+			}
+			glFinish();
+			cout << "    " << setw(3) << nRegion << " x " << setw(3) << nRegion << " region: " << setprecision(3) << setw(8) << timer.ms() / N << " ms per edit" << endl;
+		}
+	}
+}
+
+// streaming terrain: a flight across a 32k x 32k tiled height map
+// the cache memory (and the process memory) should stay flat
+static void benchStream()
+{
+	const char *pFilename = "stream_test.3dth";
+	int nTiles = 130;		// 130 tiles of 253 cells = 32891 x 32891 samples
+	C3dglTerrainStream terrain;
+	if (!terrain.open(pFilename) || terrain.getSizeX() != nTiles * 253 + 1)
+	{
+		terrain.close();		// the file is still mapped if it was opened with a wrong size
+		cout << "Generating " << pFilename << "..." << endl;
+		CTimer timer;
+		C3dglTerrainStream::writeTiledFile(pFilename, nTiles, nTiles, -30, 30, [](int x, int z)
+		{
+			return 20 * sin(x * 0.0013f) * cos(z * 0.0017f) + 5 * sin(x * 0.013f + z * 0.011f) + sin(x * 0.071f) * cos(z * 0.067f);
+		});
+		cout << "Generated in " << fixed << setprecision(1) << timer.ms() / 1000 << " s" << endl;
+		if (!terrain.open(pFilename))
+			return;
+	}
+	terrain.setMemoryBudget(128 * 1024 * 1024);
+
+	// fly along the diagonal
+	const int nFrames = 3000;
+	float fHalf = terrain.getSizeX() / 2.0f - 500;
+	CTimer timer;
+	double fMaxUpdate = 0;
+	for (int i = 0; i <= nFrames; i++)
+	{
+		float f = -fHalf + 2 * fHalf * i / nFrames;
+		CTimer timerUpdate;
+		terrain.update(f, f);
+		fMaxUpdate = max(fMaxUpdate, timerUpdate.ms());
+		if (i % 300 == 0)
+		{
+			PROCESS_MEMORY_COUNTERS pmc;
+			GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+			cout << "frame " << setw(4) << i << ": resident tiles " << setw(4) << terrain.getResidentTileCount()
+				<< ", pending " << setw(4) << terrain.getPendingTileCount()
+				<< ", loaded " << setw(5) << terrain.getLoadedTileCount()
+				<< ", cache " << setw(6) << fixed << setprecision(1) << terrain.getMemoryUsage() / 1048576.0 << " MB"
+				<< ", working set " << setw(6) << pmc.WorkingSetSize / 1048576.0 << " MB" << endl;
+		}
+		Sleep(5);
+	}
+	cout << "max update time: " << setprecision(2) << fMaxUpdate << " ms" << endl;
+}
+
+// height layouts: linear (x-major) vs tiled heights on a 4k map, random points vs coherent walks
+// the walks imitate objects moving over the terrain - each query is close to the previous one, but walks cross the rows
+static void benchLayout()
+{
+	int nSize = 4097;
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	C3dglTerrain terrains[2];
+	C3dglTerrain::HEIGHT_LAYOUT layouts[] = { C3dglTerrain::LAYOUT_LINEAR, C3dglTerrain::LAYOUT_TILED };
+	for (int i = 0; i < 2; i++)
+	{
+		terrains[i].setDisplacement(true);		// no vertex buffers needed
+		terrains[i].setHeightLayout(layouts[i]);
+		terrains[i].buildMesh(nSize, nSize, &heights[0]);
+	}
+
+	// random points over the whole map
+	const int N = 1 << 22;
+	vector<float> xs(N), zs(N), out(N);
+	srand(1);
+	for (int i = 0; i < N; i++)
+	{
+		xs[i] = ((float)rand() / RAND_MAX - 0.5f) * (nSize - 1);
+		zs[i] = ((float)rand() / RAND_MAX - 0.5f) * (nSize - 1);
+	}
+
+	// coherent walks: 1024 walkers in random directions, 4096 steps of 0.5 unit each, bouncing off the edges
+	const int nWalkers = 1024, nSteps = N / nWalkers;
+	vector<float> wx(N), wz(N);
+	float fHalf = (nSize - 1) / 2.0f;
+	for (int w = 0; w < nWalkers; w++)
+	{
+		float x = xs[w], z = zs[w];
+		float a = (float)rand() / RAND_MAX * 6.2832f, dx = 0.5f * cos(a), dz = 0.5f * sin(a);
+		for (int i = 0; i < nSteps; i++)
+		{
+			if (fabs(x + dx) > fHalf) dx = -dx;
+			if (fabs(z + dz) > fHalf) dz = -dz;
+			x += dx; z += dz;
+			wx[w * nSteps + i] = x; wz[w * nSteps + i] = z;
+		}
+	}
+
+	cout << "Height layout benchmark (" << nSize << " x " << nSize << ", " << N << " queries, best of 3 runs)" << endl;
+	const char *pNames[] = { "linear", "tiled" };
+	for (int i = 0; i < 2; i++)
+	{
+		C3dglTerrain &terrain = terrains[i];
+		double fBest[3] = { 1e30, 1e30, 1e30 };
+		for (int run = 0; run < 3; run++)
+		{
+			CTimer timer;
+			for (int j = 0; j < N; j++)
+				out[j] = terrain.getInterpolatedHeight(xs[j], zs[j]);
+			fBest[0] = min(fBest[0], timer.ms());
+
+			timer.reset();
+			for (int j = 0; j < N; j++)
+				out[j] = terrain.getInterpolatedHeight(wx[j], wz[j]);
+			fBest[1] = min(fBest[1], timer.ms());
+
+			timer.reset();
+			terrain.getInterpolatedHeights(&xs[0], &zs[0], &out[0], N);
+			fBest[2] = min(fBest[2], timer.ms());
+		}
+		cout << setw(6) << pNames[i] << " (" << fixed << setprecision(1) << terrain.getHeightDataSize() / 1048576.0 << " MB): "
+			<< "random " << setprecision(2) << setw(7) << N / fBest[0] / 1000.0 << " Mqueries/s, "
+			<< "walk " << setw(7) << N / fBest[1] / 1000.0 << " Mqueries/s, "
+			<< "random batch " << setw(7) << N / fBest[2] / 1000.0 << " Mqueries/s" << endl;
+	}
+}
+
+// decimated mesh (C3dglTerrain::setDecimation): triangles and build time for a few error bounds
+static void benchDecimation()
+{
+	int nSize = 2049;
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	for (float &h : heights)
+		h = max(h, -10.0f);		// a flat lake
+	float errors[] = { 0, 0.1f, 0.25f, 0.5f, 1.0f };
+
+	cout << "Decimated mesh benchmark, " << nSize << " x " << nSize << " (best of 3 runs)" << endl;
+	double fFullTriangles = 2.0 * (nSize - 1) * (nSize - 1);
+	for (float fError : errors)
+	{
+		double fBest = 1e30;
+		unsigned nTriangles = 0;
+		for (int i = 0; i < 3; i++)
+		{
+			C3dglTerrain terrain;
+			terrain.setIndexOrder(C3dglTerrain::ORDER_OPTIMISED);
+			terrain.setDecimation(fError);
+			CTimer timer;
+			terrain.buildMesh(nSize, nSize, &heights[0]);
+			fBest = min(fBest, timer.ms());
+			nTriangles = terrain.getTriangleCount();
+		}
+		cout << "max error " << fixed << setprecision(2) << setw(4) << fError << ": " << setw(9) << nTriangles << " triangles (1/"
+			<< setprecision(1) << setw(4) << fFullTriangles / nTriangles << "), " << setw(8) << fBest << " ms" << endl;
+	}
+}
+
+// light map bake (C3dglTerrain::bakeLightMap), single threaded vs the default thread pool
+static void benchLightMap()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int sizes[] = { 513, 1025, 2049 };
+	float sunDir[3] = { 1.0f, 0.5f, 0.5f };
+
+	cout << "Light map benchmark (best of 3 runs)" << endl;
+	for (int nSize : sizes)
+	{
+		vector<float> heights;
+		makeHeights(nSize, heights);
+		double fMSamples = (double)nSize * nSize / 1e6;
+		for (C3dglThreadPool *pPool : pools)
+		{
+			C3dglTerrain terrain;
+			terrain.setThreadPool(pPool);
+			terrain.buildMesh(nSize, nSize, &heights[0]);
+			double fBest = 1e30;
+			for (int i = 0; i < 3; i++)
+			{
+				CTimer timer;
+				terrain.bakeLightMap(sunDir);
+				fBest = min(fBest, timer.ms());
+			}
+			cout << setw(5) << nSize << " x " << setw(5) << nSize << ", " << setw(2) << pPool->getThreadCount() << " thread(s): "
+				<< fixed << setprecision(1) << setw(8) << fBest << " ms, " << setw(6) << fBest / fMSamples << " ms per megasample" << endl;
+		}
+	}
+}
+
+// procedural terrain (C3dglTerrainNoise): scalar getHeight vs SSE2 generate, single threaded vs the default thread pool,
+// then the procedural streaming terrain flying far away from the origin
+static void benchNoise()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int sizes[] = { 513, 1025, 2049 };
+	C3dglTerrainNoise noise;
+
+	cout << "Procedural terrain benchmark (" << noise.getOctaves() << " octaves, best of 3 runs)" << endl;
+	for (int nSize : sizes)
+	{
+		vector<float> heights(nSize * nSize);
+		double fMSamples = (double)nSize * nSize / 1e6;
+
+		double fBest = 1e30;
+		for (int i = 0; i < 3; i++)
+		{
+			CTimer timer;
+			for (int x = 0; x < nSize; x++)
+				for (int z = 0; z < nSize; z++)
+					heights[x * nSize + z] = noise.getHeight((float)(x - nSize/2), (float)(z - nSize/2));
+			fBest = min(fBest, timer.ms());
+		}
+		cout << setw(5) << nSize << " x " << setw(5) << nSize << ", scalar,      1 thread(s): "
+			<< fixed << setprecision(1) << setw(8) << fBest << " ms, " << setw(6) << fMSamples * 1000 / fBest << " Msamples/s" << endl;
+
+		for (C3dglThreadPool *pPool : pools)
+		{
+			fBest = 1e30;
+			for (int i = 0; i < 3; i++)
+			{
+				CTimer timer;
+				noise.generate(-nSize/2, -nSize/2, nSize, nSize, &heights[0], pPool);
+				fBest = min(fBest, timer.ms());
+			}
+			cout << setw(5) << nSize << " x " << setw(5) << nSize << ", generate, " << setw(4) << pPool->getThreadCount() << " thread(s): "
+				<< fixed << setprecision(1) << setw(8) << fBest << " ms, " << setw(6) << fMSamples * 1000 / fBest << " Msamples/s" << endl;
+		}
+	}
+
+	// stream the tiles along a straight line, 100000 units long
+	C3dglTerrainStream terrain;
+	if (!terrain.openProcedural(&noise))
+		return;
+	terrain.setMemoryBudget(128 * 1024 * 1024);
+	const int nFrames = 2000;
+	CTimer timer;
+	double fMaxUpdate = 0;
+	for (int i = 0; i <= nFrames; i++)
+	{
+		CTimer timerUpdate;
+		terrain.update(100000.0f * i / nFrames, 0);
+		fMaxUpdate = max(fMaxUpdate, timerUpdate.ms());
+		Sleep(5);
+	}
+	cout << "streaming: " << terrain.getLoadedTileCount() << " tiles generated in " << fixed << setprecision(1) << timer.ms() / 1000 << " s, "
+		<< terrain.getPendingTileCount() << " pending, max update time: " << setprecision(2) << fMaxUpdate << " ms" << endl;
+}
+
+// navigation grid (C3dglNavGrid) on a 4k map: the build and random path queries, single threaded vs the default thread pool
+static void benchNav()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int nSize = 4097;
+	const int N = 4000;
+
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	C3dglTerrain terrain;
+	terrain.buildMesh(nSize, nSize, &heights[0]);
+
+	vector<C3dglNavGrid::QUERY> queries(N);
+	srand(1);
+	for (C3dglNavGrid::QUERY &q : queries)
+	{
+		q.x0 = (float)(rand() % nSize - nSize/2);
+		q.z0 = (float)(rand() % nSize - nSize/2);
+		q.x1 = (float)(rand() % nSize - nSize/2);
+		q.z1 = (float)(rand() % nSize - nSize/2);
+	}
+
+	cout << "Navigation benchmark (" << nSize << " x " << nSize << ", " << N << " random paths)" << endl;
+	for (C3dglThreadPool *pPool : pools)
+	{
+		C3dglNavGrid nav;
+		terrain.setThreadPool(pPool);
+		CTimer timer;
+		nav.build(&terrain, 0.7f, -12);
+		double fBuild = timer.ms();
+
+		vector<vector<float> > paths;
+		timer.reset();
+		int nFound = nav.findPaths(&queries[0], N, paths, pPool);
+		double fQueries = timer.ms();
+		cout << setw(2) << pPool->getThreadCount() << " thread(s): build " << fixed << setprecision(1) << setw(7) << fBuild << " ms, "
+			<< nFound << " paths found in " << setw(7) << fQueries << " ms, " << setw(7) << N * 1000.0 / fQueries << " paths/s" << endl;
+	}
+}
+
+// CPU particles (C3dglCPUParticles): about a million particles, without and with the terrain collisions,
+// single threaded vs the default thread pool
+static void benchParticles()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int nSize = 1025;
+
+	vector<float> heights;
+	makeHeights(nSize, heights);
+	C3dglTerrain terrain;
+	terrain.buildMesh(nSize, nSize, &heights[0]);
+
+	// a wide box over the whole map, the particles falling onto it and sliding along the surface
+	C3dglParticles::EMITTER emitter;
+	emitter.fRate = 200000;
+	emitter.pos[0] = emitter.pos[2] = -500.0f; emitter.pos[1] = 30;
+	emitter.size[0] = emitter.size[2] = 1000.0f; emitter.size[1] = 20;
+	emitter.fSpread = 1.5f;
+	emitter.fMinSpeed = 0.5f; emitter.fMaxSpeed = 2.0f;
+	emitter.fMinLifetime = 4.0f; emitter.fMaxLifetime = 6.0f;
+	const int nFrames = 120;
+
+	cout << "CPU particle benchmark (" << emitter.fRate << " particles/s, " << nFrames << " updates at 60 fps)" << endl;
+	for (int bCollision = 0; bCollision < 2; bCollision++)
+		for (C3dglThreadPool *pPool : pools)
+		{
+			C3dglCPUParticles particles;
+			particles.setThreadPool(pPool);
+			particles.create(emitter);
+			particles.setGravity(0, -2.0f, 0);
+			particles.setWind(1.0f, 0, 0.5f, 0.2f);
+			particles.setCollision(&terrain, bCollision ? C3dglParticles::COLLISION_SLIDE : C3dglParticles::COLLISION_NONE);
+
+			// fill up to the steady state first
+			for (int i = 0; i < 60; i++)
+				particles.update(0.1f);
+
+			double fTotal = 0, fParticles = 0;
+			for (int i = 0; i < nFrames; i++)
+			{
+				particles.update(1 / 60.0f);
+				fTotal += particles.getUpdateTime();
+				fParticles += particles.getLiveCount();
+			}
+			cout << (bCollision ? "collisions,    " : "no collisions, ") << setw(2) << pPool->getThreadCount() << " thread(s): "
+				<< setw(8) << particles.getLiveCount() << " particles, " << fixed << setprecision(2) << setw(7) << fTotal / nFrames << " ms per update, "
+				<< setprecision(0) << setw(7) << fParticles / fTotal / pPool->getThreadCount() << " particles per ms per thread" << endl;
+		}
+}
+
+// particle sort (C3dglParticleSort): the full radix sort and the refinement of the last order (the view turned by
+// a tenth of a degree) vs the particle count, single threaded vs the default thread pool
+static void benchSort()
+{
+	C3dglThreadPool pool1(1);
+	C3dglThreadPool *pools[] = { &pool1, C3dglThreadPool::getDefault() };
+	int counts[] = { 10000, 100000, 1000000, 4000000 };
+
+	cout << "Particle sort benchmark (random points in a 100 x 100 x 100 box, best of 5 runs)" << endl;
+	for (int n : counts)
+	{
+		vector<float> xs(n), ys(n), zs(n);
+		srand(1);
+		for (int i = 0; i < n; i++)
+		{
+			xs[i] = rand() * 100.0f / RAND_MAX - 50;
+			ys[i] = rand() * 100.0f / RAND_MAX - 50;
+			zs[i] = rand() * 100.0f / RAND_MAX - 150;
+		}
+
+		// the view: identity, then rotated about the y axis
+		float a = 0.1f * 3.14159265f / 180;
+		float matrix[16] = { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1 };
+		float matrixTurned[16] = { cos(a), 0, -sin(a), 0,  0, 1, 0, 0,  sin(a), 0, cos(a), 0,  0, 0, 0, 1 };
+
+		for (C3dglThreadPool *pPool : pools)
+		{
+			C3dglParticleSort sorter;
+			sorter.setThreadPool(pPool);
+			sorter.setSortInterval(1000);
+			double fFull = 1e30, fRefine = 1e30;
+			bool bExact = true;
+			for (int i = 0; i < 5; i++)
+			{
+				sorter.sort(&xs[0], &ys[0], &zs[0], n, matrix, false);
+				fFull = min(fFull, sorter.getSortTime());
+				sorter.sort(&xs[0], &ys[0], &zs[0], n, matrixTurned, true);
+				fRefine = min(fRefine, sorter.getSortTime());
+				bExact = bExact && sorter.isSorted();
+			}
+			cout << setw(8) << n << " particles, " << setw(2) << pPool->getThreadCount() << " thread(s): full sort " << fixed << setprecision(2)
+				<< setw(8) << fFull << " ms, " << setw(6) << n / fFull / 1000 << " Mparticles/s; refined " << setw(8) << fRefine << " ms"
+				<< (bExact ? "" : " (gave up: approximate)") << endl;
+		}
+	}
+}
+
+// returns the exit code of the program: 0 if the benchmark was run, 1 if there is no such benchmark
+int runBenchmark(const char *name)
+{
+	if (strcmp(name, "mesh") == 0)
+		benchMesh();
+	else if (strcmp(name, "heights") == 0)
+		benchHeights();
+	else if (strcmp(name, "stream") == 0)
+		benchStream();
+	else if (strcmp(name, "rays") == 0)
+		benchRays();
+	else if (strcmp(name, "edit") == 0)
+		benchEdit();
+	else if (strcmp(name, "layout") == 0)
+		benchLayout();
+	else if (strcmp(name, "decimate") == 0)
+		benchDecimation();
+	else if (strcmp(name, "lightmap") == 0)
+		benchLightMap();
+	else if (strcmp(name, "noise") == 0)
+		benchNoise();
+	else if (strcmp(name, "nav") == 0)
+		benchNav();
+	else if (strcmp(name, "particles") == 0)
+		benchParticles();
+	else if (strcmp(name, "sort") == 0)
+		benchSort();
+	else
+	{
+		cerr << "Unknown benchmark: " << name << endl;
+		cerr << "Available benchmarks: mesh, heights, stream, rays, edit, layout, decimate, lightmap, noise, nav, particles, sort" << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -34,6 +34,15 @@ freely, subject to the following restrictions:
 #include "3dglSkyBox.h"
 #include "3dglBitmap.h"
 #include "3dglMatInverse.h"
+#include "3dglThreadPool.h"
+#include "3dglTerrainStream.h"
+#include "3dglTerrainNoise.h"
+#include "3dglNavGrid.h"
+#include "3dglScatter.h"
+#include "3dglParticles.h"
+#include "3dglCPUParticles.h"
+#include "3dglParticleSort.h"
+#include "3dglOffscreenParticles.h"
 
 // link with AssImp and DevIL libraries
 #pragma comment (lib, "assimp.lib") 
@@ -50,6 +50,7 @@ public:
 
 	bool Load(const std::string fname, unsigned format)	{ return load(fname, format); }
 	bool load(const std::string fname, unsigned format);
+	bool load(const std::string fname, unsigned format, unsigned type);		// format or type 0 to keep those of the image
 	void destroy();
 	void texture(GLuint &textureId);
 
@@ -60,6 +61,11 @@ public:
 	void *GetBits()					{ return getBits(); }
 	void *getBits();
 
+	// pixel format (GL_RGBA, GL_LUMINANCE...), channel type (GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT...) and size
+	unsigned getFormat();
+	unsigned getType();
+	int getBytesPerPixel();
+
 	std::string getName()	{ return "Texture"; }
 };
 
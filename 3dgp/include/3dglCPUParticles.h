@@ -0,0 +1,147 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+CPU particle system - the same simulation as C3dglParticles (emitter, forces, terrain collisions,
+dead particles dropped), run on the CPU: for headless benchmarking and for weak GPUs.
+The particles are kept in structure-of-arrays form (one array per component), updated four at
+a time with SSE2, in ranges split across the thread pool with work stealing. Each update works
+like the GPU version: the live particles are moved and compacted from one set of arrays into
+the other, then the new ones are appended. For rendering, the live particles are streamed into
+an orphaned vertex buffer once per update, in the layout of C3dglParticles::PARTICLE, so they
+are drawn with the same programs (particle.vert) as the GPU particles.
+Usage:
+create to allocate the particles for an emitter (the capacity follows the emission rate)
+setGravity, setWind, setCollision to set the forces and the terrain collisions
+update to advance the simulation, once per frame (no OpenGL calls)
+render to draw the live particles with the current program
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglCPUParticles_h_
+#define __3dglCPUParticles_h_
+
+#include <string>
+#include <vector>
+#include "3dglObject.h"
+#include "3dglParticles.h"
+
+namespace _3dgl
+{
+
+class C3dglTerrain;
+class C3dglThreadPool;
+
+#define CPU_PARTICLES_GRAIN 2048		// particles per range of the thread pool
+
+class C3dglCPUParticles : public C3dglObject
+{
+public:
+	typedef C3dglParticles::EMITTER EMITTER;
+	typedef C3dglParticles::PARTICLE PARTICLE;
+
+	// the particles, one array per component
+	struct SOA
+	{
+		std::vector<float> px, py, pz;
+		std::vector<float> vx, vy, vz;
+		std::vector<float> age, lifetime;
+
+		void resize(unsigned n);
+	};
+
+private:
+	EMITTER m_emitter;
+	float m_gravity[3];
+	float m_wind[3], m_fDrag;
+	C3dglTerrain *m_pTerrain;
+	C3dglParticles::COLLISION m_collision;
+	unsigned m_nSeed;
+	C3dglThreadPool *m_pThreadPool;
+
+	SOA m_soa[2];
+	int m_iCurrent;							// m_soa[m_iCurrent] holds the live particles
+	unsigned m_nCapacity, m_nLive;
+	float m_fEmitDebt;
+	unsigned m_nEmitted;
+	float m_basis[9];						// the emission cone: the axis w, then u and v across it
+	std::vector<unsigned> m_rangeLive;		// live particles left in each range of CPU_PARTICLES_GRAIN by the update
+	std::vector<unsigned> m_rangeOffset;	// where they go in the other arrays
+
+	unsigned m_buffer;						// created by the first render
+	bool m_bUploaded;						// the buffer holds the particles of the last update
+
+	// statistics
+	double m_fUpdateTime;					// ms
+	unsigned m_nUpdated;					// particles processed by the last update
+	unsigned m_nThreads;
+
+	void emit(unsigned i, float &fTime);						// a new particle at i, fTime is the part of the time step it lives
+	void integrate(unsigned i, float fTime);
+	unsigned simulateRange(unsigned i0, unsigned i1, float fTime);	// returns the live particles, compacted in place at i0
+	void upload();
+
+public:
+	C3dglCPUParticles();
+	~C3dglCPUParticles();
+
+	std::string getName()					{ return "CPU Particles"; }
+
+	// allocates the particles for the emitter - the capacity as in C3dglParticles::create; no OpenGL calls
+	bool create(const EMITTER &emitter);
+	void destroy();
+
+	void setEmitter(const EMITTER &emitter)	{ m_emitter = emitter; }
+	EMITTER &getEmitter()					{ return m_emitter; }
+	void setRate(float fRate)				{ m_emitter.fRate = fRate; }
+	void setGravity(float x, float y, float z)	{ m_gravity[0] = x; m_gravity[1] = y; m_gravity[2] = z; }
+	void setWind(float x, float y, float z, float fDrag)	{ m_wind[0] = x; m_wind[1] = y; m_wind[2] = z; m_fDrag = fDrag; }
+	void setCollision(C3dglTerrain *pTerrain, C3dglParticles::COLLISION collision)	{ m_pTerrain = pTerrain; m_collision = collision; }
+	void setSeed(unsigned nSeed)			{ m_nSeed = nSeed; }
+
+	// thread pool - C3dglThreadPool::getDefault() unless set
+	void setThreadPool(C3dglThreadPool *pThreadPool)	{ m_pThreadPool = pThreadPool; }
+	C3dglThreadPool *getThreadPool();
+
+	// advances the simulation by fTime seconds - no OpenGL calls
+	void update(float fTime);
+
+	// draws the live particles as points with the current program, like C3dglParticles::render;
+	// the first render after an update streams the particles into the vertex buffer.
+	// indexBuffer: the order to draw them in (getLiveCount() indices, e.g. C3dglParticleSort::getIndexBuffer), 0 for none
+	void render(unsigned indexBuffer = 0);
+
+	// the particles (for reading), i < getLiveCount()
+	const SOA &getParticles()				{ return m_soa[m_iCurrent]; }
+
+	// statistics
+	unsigned getCapacity()					{ return m_nCapacity; }
+	unsigned getLiveCount()					{ return m_nLive; }
+	double getUpdateTime()					{ return m_fUpdateTime; }		// the last update, in ms
+	double getThroughput()					{ return m_fUpdateTime > 0 ? m_nUpdated / m_fUpdateTime / m_nThreads : 0; }	// particles per ms per thread
+};
+
+}; // namespace _3dgl
+
+#endif
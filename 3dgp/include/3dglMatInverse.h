@@ -8,6 +8,7 @@ Function: kuMatrixInverse
 Calculates the inverse for the given transformation matrix.
 Input:  pSrc - transformation matrix
 Output: pDest - inverse matrix
+Also: matrix multiplication and view frustum culling helpers.
 ----------------------------------------------------------------------------------
 This software is provided 'as-is', without any express or implied
 warranty. In no event will the authors be held liable for any damages
@@ -35,4 +36,9 @@ freely, subject to the following restrictions:
 
 bool gluInvertMatrix(const float m[16], float invOut[16]);
 
+// view frustum helpers
+void multMatrix(const float a[16], const float b[16], float out[16]);
+void extractFrustum(const float m[16], float planes[6][4]);
+bool isBoxInFrustum(const float planes[6][4], float minX, float minY, float minZ, float maxX, float maxY, float maxZ);
+
 #endif
\ No newline at end of file
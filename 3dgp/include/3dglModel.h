@@ -98,6 +98,7 @@ class C3dglModel : public C3dglObject
 		void create(const aiMesh *pMesh);
 		void destroy();
 		void render();
+		void renderInstanced(unsigned attribInstance, unsigned idInstanceBuffer, unsigned nInstances);
 
 		MATERIAL *getMaterial()		{ return m_pOwner ? m_pOwner->getMaterial(m_nMaterialIndex) : NULL; }
 		MATERIAL *createNewMaterial();
@@ -180,6 +181,13 @@ public:
 	void render(unsigned iNode);			// render one of the main nodes
 	void renderNode(aiNode *pNode);			// render a node
 
+	// instanced rendering: nInstances copies of the model in a single draw call per mesh
+	// the per-instance transforms (column-major 4x4 matrices, 16 floats each) are read from idInstanceBuffer by the
+	// mat4 attribute "aInstance" of the current program, the node transforms are sent as the "matrixNode" uniform
+	// and the current model-view matrix as the view (see basic.vert); returns the number of draw calls
+	unsigned renderInstanced(unsigned idInstanceBuffer, unsigned nInstances);
+	unsigned renderNodeInstanced(aiNode *pNode, const aiMatrix4x4 &parent, unsigned attribInstance, unsigned idInstanceBuffer, unsigned nInstances);
+
 	// retrieves the transform associated with the given node. If (bRecursive) the transform is recursively combined with parental transform(s)
 	void getNodeTransform(aiNode *pNode, float pMatrix[16], bool bRecursive = true);
 	
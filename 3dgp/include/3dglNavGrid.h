@@ -0,0 +1,143 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Navigation grid - path finding over a terrain.
+The grid points of the height map are walkable unless too steep or under the water.
+Paths are found with hierarchical A*: the grid is divided into square clusters, and the
+walkable crossings of the cluster borders make an abstract graph, with the paths between
+the crossings of each cluster found and stored when the grid is built. A path query links
+the start and the goal to the crossings of their clusters (A* limited to the cluster),
+searches the abstract graph and joins the stored paths, so that long paths cost little
+more than short ones.
+Usage:
+build to build the grid from a loaded terrain, on the terrain thread pool
+findPath to find a single path
+findPaths to find many paths at once, in parallel on the thread pool
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglNavGrid_h_
+#define __3dglNavGrid_h_
+
+#include <string>
+#include <vector>
+#include <map>
+#include "3dglObject.h"
+#include "3dglTerrain.h"
+
+namespace _3dgl
+{
+
+class C3dglThreadPool;
+
+class C3dglNavGrid : public C3dglObject
+{
+public:
+	// path query, in the terrain model coordinates
+	struct QUERY
+	{
+		float x0, z0;		// from
+		float x1, z1;		// to
+	};
+
+private:
+	// abstract node: a walkable grid point next to a cluster border, with a walkable neighbour across the border
+	struct NODE
+	{
+		int x, z;			// height map coordinates
+		int iCluster;
+		int iComponent;		// connected component of the abstract graph
+	};
+	struct EDGE
+	{
+		int iNode;
+		float fCost;
+		int iPath, nSteps;	// the path within the cluster: m_moves[iPath] .. m_moves[iPath + nSteps - 1]; iPath = -1 for the border crossings
+		bool bReversed;		// the moves are stored for the opposite edge - read backwards, in the opposite directions
+	};
+	struct SEARCH;			// working memory of a query (see the cpp file)
+
+	C3dglTerrain *m_pTerrain;
+	int m_nSizeX, m_nSizeZ;
+
+	// the grid points, cluster by cluster: each cluster is a block of (m_nClusterSize + 2)^2 cells, x-major,
+	// including a copy of the neighbouring grid points around it, so that the searches never leave the block
+	enum { CELL_WALKABLE = 1, CELL_INSIDE = 2 };		// CELL_INSIDE: the grid point belongs to the cluster
+	std::vector<unsigned char> m_cells;
+	int m_nClusterSize;
+	int m_nClustersX, m_nClustersZ;
+	std::vector<std::vector<int> > m_clusterNodes;	// nodes of each cluster; cluster index = cx * m_nClustersZ + cz
+	std::vector<NODE> m_nodes;
+	std::vector<int> m_edgeStart;			// the edges of the node i are m_edges[m_edgeStart[i]] .. m_edges[m_edgeStart[i + 1] - 1]
+	std::vector<EDGE> m_edges;
+	std::vector<unsigned char> m_moves;		// the paths of the edges, one neighbour (0 - 7, see the cpp file) per step
+
+	int getCluster(int x, int z)			{ return x / m_nClusterSize * m_nClustersZ + z / m_nClusterSize; }
+	size_t getCell(int iCluster, int x, int z)	// the cell of the grid point (x, z) in the block of the cluster
+	{
+		int nStride = m_nClusterSize + 2;
+		return (size_t)iCluster * nStride * nStride + (x - iCluster / m_nClustersZ * m_nClusterSize + 1) * nStride + z - iCluster % m_nClustersZ * m_nClusterSize + 1;
+	}
+	bool walkable(int x, int z)				{ return (unsigned)x < (unsigned)m_nSizeX && (unsigned)z < (unsigned)m_nSizeZ && (m_cells[getCell(getCluster(x, z), x, z)] & CELL_WALKABLE) != 0; }
+
+	void addEntrances(int cx, int cz, bool bAlongX, std::vector<std::pair<int, EDGE> > &edges, std::map<int, int> &nodeIndex);
+	int addNode(int x, int z, std::map<int, int> &nodeIndex);
+	float gridSearch(SEARCH &s, int iCluster, int sx, int sz, int gx, int gz);
+	void gridMoves(SEARCH &s, int gx, int gz, std::vector<unsigned char> &moves);
+	void appendPath(int x, int z, const unsigned char *pMoves, int nSteps, bool bReversed, std::vector<int> &points);
+	bool findPath(SEARCH &s, const QUERY &query, std::vector<float> &path);
+
+public:
+	C3dglNavGrid();
+	~C3dglNavGrid();
+
+	std::string getName()					{ return "Navigation Grid"; }
+
+	// builds the grid: the grid points steeper than fMaxSlope (the tangent of the slope angle) or lower than fWaterLevel
+	// are blocked; nClusterSize is the size of the clusters of the hierarchical search, in grid points
+	bool build(C3dglTerrain *pTerrain, float fMaxSlope, float fWaterLevel, int nClusterSize = 64);
+	void destroy();
+
+	bool isWalkable(float x, float z);		// the nearest grid point, model coordinates
+
+	// finds a path between two points (rounded to the nearest grid points); the path is a list of the grid points,
+	// 3 floats each (x, y, z in the model coordinates), starting at the first point and ending at the last one;
+	// returns false (and an empty path) if there is no path
+	bool findPath(float x0, float z0, float x1, float z1, std::vector<float> &path);
+
+	// finds the paths for n queries, in parallel on the thread pool (the terrain thread pool if NULL);
+	// paths[i] is the path of pQueries[i], empty if there is no path; returns the number of the paths found
+	int findPaths(const QUERY *pQueries, int n, std::vector<std::vector<float> > &paths, C3dglThreadPool *pThreadPool = NULL);
+
+	// statistics
+	int getSizeX()							{ return m_nSizeX; }
+	int getSizeZ()							{ return m_nSizeZ; }
+	unsigned getNodeCount()					{ return m_nodes.size(); }
+	unsigned getEdgeCount()					{ return m_edges.size(); }
+};
+
+}; // namespace _3dgl
+
+#endif
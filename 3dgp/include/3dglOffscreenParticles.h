@@ -0,0 +1,111 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Offscreen particles - the alpha blended particles rendered at a reduced resolution (half or
+a quarter of the screen size in each direction) and composited over the scene, to save the
+fill rate of large particles.
+begin copies the scene depth into a texture, and downsamples it into the depth buffer of the
+offscreen target (particle_depth.frag: the farthest depth of each block, so that the particles
+are not hidden by the edges they are only partly behind); the particles are then rendered as
+usual, with the point sizes scaled by getPointScale (the pointScale uniform of the particle
+shaders). end upsamples the particles over the scene (particle_composite.frag): bilinear,
+except at the depth edges, where the low resolution pixel nearest in depth is taken.
+Both programs are made of fullscreen.vert with the fragment shader (no vertex attributes).
+The particles must be blended with GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, and not write the depth.
+Usage:
+create with the downsampling and the composition programs
+setFactor to select the resolution: 2 for a half, 4 for a quarter
+begin, then render the particles, then end - once per frame, after the scene
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglOffscreenParticles_h_
+#define __3dglOffscreenParticles_h_
+
+#include <string>
+#include "3dglObject.h"
+
+namespace _3dgl
+{
+
+class C3dglProgram;
+
+class C3dglOffscreenParticles : public C3dglObject
+{
+	C3dglProgram *m_pDepthProgram;			// particle_depth.frag
+	C3dglProgram *m_pCompositeProgram;		// particle_composite.frag
+	int m_nFactor;
+	float m_fNear, m_fFar;
+
+	// the targets, for the screen size m_nWidth x m_nHeight
+	int m_nWidth, m_nHeight;
+	int m_nLowWidth, m_nLowHeight;
+	unsigned m_depthTexture;				// full resolution copy of the scene depth
+	unsigned m_colorTexture, m_lowDepthTexture;
+	unsigned m_framebuffer;
+
+	// the state saved by begin
+	bool m_bActive;
+	int m_viewport[4];
+	int m_prevFramebuffer;
+	int m_blend[4];							// src rgb, dst rgb, src alpha, dst alpha
+	C3dglProgram *m_pPrevProgram;
+
+	bool allocate(int nWidth, int nHeight);
+	void destroyTargets();
+
+public:
+	C3dglOffscreenParticles();
+	~C3dglOffscreenParticles();
+
+	std::string getName()					{ return "Offscreen Particles"; }
+
+	// the programs are not owned; the targets are allocated by begin, for the current viewport
+	bool create(C3dglProgram *pDepthProgram, C3dglProgram *pCompositeProgram, int nFactor = 2);
+	void destroy();
+
+	// the resolution: the screen size divided by nFactor (1 - full resolution, yet offscreen)
+	void setFactor(int nFactor);
+	int getFactor()							{ return m_nFactor; }
+	float getPointScale()					{ return 1.0f / m_nFactor; }	// for the pointScale uniform of the particle shaders
+
+	// the clipping planes of the projection - to compare the depths (default: 0.1, 1000)
+	void setClipPlanes(float fNear, float fFar)	{ m_fNear = fNear; m_fFar = fFar; }
+
+	// begin redirects the rendering into the offscreen target (the viewport at the reduced resolution),
+	// with the scene depth - returns false (and nothing changed) if the target could not be created;
+	// end restores the framebuffer and the viewport, and composites the particles over the scene
+	bool begin();
+	void end();
+
+	// statistics
+	int getWidth()							{ return m_nLowWidth; }
+	int getHeight()							{ return m_nLowHeight; }
+	size_t getMemorySize()					{ return (size_t)m_nWidth * m_nHeight * 4 + (size_t)m_nLowWidth * m_nLowHeight * (8 + 4); }
+};
+
+}; // namespace _3dgl
+
+#endif
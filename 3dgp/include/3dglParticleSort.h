@@ -0,0 +1,118 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Particle sort - back to front order of alpha blended particles.
+The points are sorted by their view space depth, with a parallel radix sort on the thread
+pool (the depths turned into 32-bit integer keys, 8 bits per pass; the passes in which all
+the keys share the same digit are skipped). The order is uploaded into an index buffer, to
+draw the particles with glDrawElements instead of glDrawArrays - the vertex shaders see the
+particle index as gl_VertexID either way.
+When the particles keep their indices from frame to frame (e.g. the closed-form particles),
+the full sort may be done only every few frames: in between, the last order is refined with
+an insertion sort, which costs little while the camera and the particles move smoothly. The
+refinement is limited to a few moves per particle: past that, the order is left approximate
+until the next full sort.
+Usage:
+sort to sort the particles, once per frame
+render to draw the sorted particles with the current program (no vertex attributes)
+getIndexBuffer to draw them otherwise (e.g. C3dglCPUParticles::render)
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglParticleSort_h_
+#define __3dglParticleSort_h_
+
+#include <string>
+#include <vector>
+#include "3dglObject.h"
+
+namespace _3dgl
+{
+
+class C3dglThreadPool;
+
+#define PARTICLE_SORT_GRAIN 16384		// minimum number of particles per range of the thread pool
+
+class C3dglParticleSort : public C3dglObject
+{
+	C3dglThreadPool *m_pThreadPool;
+
+	std::vector<unsigned> m_keys, m_order;			// the sorted keys, and the particle indices in the same order
+	std::vector<unsigned> m_keysTmp, m_orderTmp;
+	std::vector<unsigned> m_histograms;				// 256 counts per range of the radix sort
+	unsigned m_nCount;
+	int m_nInterval, m_nFrames;						// full sort every m_nInterval sorts; sorts since the last full one
+	bool m_bFullSort;								// the last sort was a full one
+	bool m_bSorted;									// the order is exact (the refinement did not give up)
+
+	unsigned m_buffer;
+	bool m_bUploaded;								// the index buffer holds the last order
+
+	double m_fSortTime;								// ms
+
+	void radixSort();								// m_keys[i] of the particle i -> m_keys, m_order sorted
+	bool refine(unsigned nMaxMoves);				// insertion sort of m_keys, m_order - false if it gave up after nMaxMoves
+	void upload();
+
+public:
+	C3dglParticleSort();
+	~C3dglParticleSort();
+
+	std::string getName()					{ return "Particle Sort"; }
+
+	void destroy();
+
+	// sorts n particles back to front: px[i], py[i], pz[i] is the position of the particle i, in the coordinates of
+	// matrixModelView (column-major, as from glGetFloatv); bStable: the particles are the same as in the last sort
+	// (the same indices) - then the last order may be refined instead of the full sort (see setSortInterval)
+	void sort(const float *px, const float *py, const float *pz, unsigned n, const float matrixModelView[16], bool bStable);
+
+	// full sort every nInterval sorts (1: always); in between the last order is refined, if bStable
+	void setSortInterval(int nInterval)		{ m_nInterval = nInterval; }
+	int getSortInterval()					{ return m_nInterval; }
+
+	// thread pool - C3dglThreadPool::getDefault() unless set
+	void setThreadPool(C3dglThreadPool *pThreadPool)	{ m_pThreadPool = pThreadPool; }
+	C3dglThreadPool *getThreadPool();
+
+	// the order: the particle indices, the farthest first
+	const unsigned *getOrder()				{ return m_nCount ? &m_order[0] : NULL; }
+	unsigned getCount()						{ return m_nCount; }
+
+	// index buffer (GL_ELEMENT_ARRAY_BUFFER of GL_UNSIGNED_INT), uploaded on the first use after a sort
+	unsigned getIndexBuffer();
+
+	// draws the sorted particles as points with the current program - for the particles with no vertex attributes
+	void render();
+
+	// statistics
+	double getSortTime()					{ return m_fSortTime; }		// the last sort, in ms (including the depths)
+	bool isFullSort()						{ return m_bFullSort; }
+	bool isSorted()							{ return m_bSorted; }
+};
+
+}; // namespace _3dgl
+
+#endif
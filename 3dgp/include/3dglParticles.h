@@ -0,0 +1,151 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+GPU particle system - the state of the particles (position, velocity, age) is kept in two
+vertex buffers and advanced each frame by transform feedback, from one buffer into the other.
+The update pass emits the new particles at a given rate, integrates the forces (gravity, wind),
+collides the particles with a terrain (its height texture) and drops the dead ones, so that
+the live particles are always packed at the front of the buffer and only they are drawn.
+The number of the live particles is read back with a query one frame later, so the CPU never
+waits for the GPU; the particles rendered are those from before the last update.
+The update program is made of particles.vert and particles.geom, linked with the transform
+feedback varyings given by getFeedbackVaryings; the rendering program is particle.vert with
+any particle fragment shader (attributes: aPosition, aVelocity, aAge, aLifetime).
+Usage:
+create to allocate the buffers for an emitter (the capacity follows the emission rate)
+setGravity, setWind, setCollision to set the forces and the terrain collisions
+update to advance the simulation, once per frame
+render to draw the live particles with the current program
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglParticles_h_
+#define __3dglParticles_h_
+
+#include <string>
+#include "3dglObject.h"
+
+namespace _3dgl
+{
+
+class C3dglProgram;
+class C3dglTerrain;
+
+#define PARTICLES_HEIGHT_UNIT 9		// texture unit used for the height texture in the update pass
+
+class C3dglParticles : public C3dglObject
+{
+public:
+	// emitter: the particles are born in a box, with the velocity in a cone around a direction
+	struct EMITTER
+	{
+		float fRate;						// particles per second
+		float pos[3], size[3];				// the box: pos .. pos + size, in the model coordinates
+		float dir[3];						// direction of the initial velocity
+		float fSpread;						// half-angle of the cone, in radians (the angle from dir is uniform)
+		float fMinSpeed, fMaxSpeed;
+		float fMinLifetime, fMaxLifetime;	// in seconds
+
+		EMITTER() : fRate(100), fSpread(0), fMinSpeed(1), fMaxSpeed(1), fMinLifetime(1), fMaxLifetime(1)
+		{ pos[0] = pos[1] = pos[2] = 0; size[0] = size[1] = size[2] = 0; dir[0] = dir[2] = 0; dir[1] = 1; }
+	};
+
+	// what happens to a particle below the terrain surface
+	enum COLLISION { COLLISION_NONE, COLLISION_KILL, COLLISION_STICK, COLLISION_SLIDE };
+
+	// particle state, as stored in the buffers
+	struct PARTICLE
+	{
+		float pos[3];
+		float vel[3];
+		float fAge, fLifetime;				// in seconds; the particle is dead once fAge >= fLifetime
+	};
+
+private:
+	C3dglProgram *m_pProgram;				// the update program
+	EMITTER m_emitter;
+	float m_gravity[3];						// acceleration
+	float m_wind[3], m_fDrag;				// the velocity approaches the wind velocity at the rate of fDrag per second
+	C3dglTerrain *m_pTerrain;
+	COLLISION m_collision;
+	unsigned m_nSeed;
+
+	unsigned m_buffers[2];
+	unsigned m_query;						// GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN of the last update
+	int m_iCurrent;							// the buffer with the live particles known: m_nLive
+	bool m_bPending;						// an update into the other buffer is in progress
+	unsigned m_nCapacity, m_nLive;
+	float m_fEmitDebt;						// fraction of a particle due to be emitted
+	unsigned m_nEmitted;					// in total - numbers the new particles for the random generator
+
+	void bindAttributes(unsigned buffer);
+	void unbindAttributes();
+
+public:
+	C3dglParticles();
+	~C3dglParticles();
+
+	std::string getName()					{ return "Particles"; }
+
+	// the outputs of particles.geom, to link the update program with (see C3dglProgram::Link)
+	static std::string getFeedbackVaryings()	{ return "outPosition;outVelocity;outAge;outLifetime"; }
+
+	// allocates the buffers for the emitter: the capacity is the rate times the longest lifetime (plus a margin),
+	// not affected by how the particles are spread over time; pProgram is the update program (not owned)
+	bool create(C3dglProgram *pProgram, const EMITTER &emitter);
+	void destroy();
+
+	// the emitter may change at any time (e.g. moved with the camera), as long as the capacity is enough for it
+	void setEmitter(const EMITTER &emitter)	{ m_emitter = emitter; }
+	EMITTER &getEmitter()					{ return m_emitter; }
+	void setRate(float fRate)				{ m_emitter.fRate = fRate; }
+
+	// forces: constant acceleration, and the drag towards the wind velocity
+	void setGravity(float x, float y, float z)	{ m_gravity[0] = x; m_gravity[1] = y; m_gravity[2] = z; }
+	void setWind(float x, float y, float z, float fDrag)	{ m_wind[0] = x; m_wind[1] = y; m_wind[2] = z; m_fDrag = fDrag; }
+
+	// collisions with the terrain surface (read from C3dglTerrain::getHeightTexture; the terrain must use
+	// the same model coordinates as the particles)
+	void setCollision(C3dglTerrain *pTerrain, COLLISION collision)	{ m_pTerrain = pTerrain; m_collision = collision; }
+
+	// random seed - the same seed gives the same particles
+	void setSeed(unsigned nSeed)			{ m_nSeed = nSeed; }
+
+	// advances the simulation by fTime seconds - emits, moves, collides and drops the dead particles
+	void update(float fTime);
+
+	// draws the live particles as points with the current program (attributes at the locations 0 - 3:
+	// aPosition, aVelocity, aAge and aLifetime), with the same model-view matrix as the emitter
+	void render();
+
+	// statistics
+	unsigned getCapacity()					{ return m_nCapacity; }
+	unsigned getLiveCount()					{ return m_nLive; }		// in the last render
+	size_t getBufferSize()					{ return 2 * m_nCapacity * sizeof(PARTICLE); }
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -0,0 +1,142 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Scattered objects - trees, rocks and other models placed in large numbers over a terrain.
+The placements are generated from the terrain heights and slopes and an optional density mask,
+and stored per cell (a square of the terrain chunk size). The cells are culled with the terrain
+(see C3dglTerrain::addObject) and each model type is rendered with a single instanced draw call
+per mesh, with the per-instance transforms in a vertex buffer.
+Rendering requires basic.vert (the aInstance attribute, see C3dglModel::renderInstanced).
+Usage:
+addType to add a model with the rules of its placement (density, height band, slope, scale)
+loadDensityMask to scale the density by a channel of an image stretched over the terrain
+scatter to generate the placements over a loaded terrain, on the terrain thread pool
+render to render the placements in the cells visible in the last terrain render
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglScatter_h_
+#define __3dglScatter_h_
+
+#include <string>
+#include <vector>
+#include "3dglObject.h"
+#include "3dglTerrain.h"
+#include "3dglModel.h"
+
+namespace _3dgl
+{
+
+class C3dglScatter : public C3dglObject
+{
+public:
+	// placement rules of a model type
+	struct RULES
+	{
+		float fDensity;					// candidate placements per 100 square units
+		float fMinHeight, fMaxHeight;	// height band, in the terrain model coordinates
+		float fMaxSlope;				// the steepest slope allowed (the tangent of the slope angle)
+		float fMinScale, fMaxScale;		// random uniform scale
+		float fSink;					// depth below the surface, in the model units (before the scale)
+		bool bAlign;					// true to align the model up axis with the terrain normal, false to keep it vertical
+		int nMaskChannel;				// channel of the density mask (0 - 3, RGBA) scaling the density, -1 to ignore the mask
+
+		RULES() : fDensity(1), fMinHeight(-1e30f), fMaxHeight(1e30f), fMaxSlope(1), fMinScale(1), fMaxScale(1), fSink(0), bAlign(false), nMaskChannel(-1) { }
+	};
+
+private:
+	struct TYPE
+	{
+		C3dglModel *pModel;
+		RULES rules;
+		float fRadius;					// bounding radius of the model, around its origin
+		unsigned buffer;				// per-instance transforms of the visible cells
+		unsigned nBuffered;				// instances in the buffer
+		std::vector<int> bufferedCells;	// cells in the buffer - uploaded again only if they change
+	};
+
+	struct CELL
+	{
+		int idObject;					// terrain object, for culling
+		std::vector<std::vector<float> > transforms;	// per type: 16 floats (column-major 4x4 matrix) per instance
+	};
+
+	std::vector<TYPE> m_types;
+	std::vector<CELL> m_cells;
+	C3dglTerrain *m_pTerrain;
+	int m_nCellSize;
+	int m_nCellsX, m_nCellsZ;
+	unsigned m_nSeed;
+
+	// density mask, RGBA
+	std::vector<unsigned char> m_mask;
+	int m_nMaskWidth, m_nMaskHeight;
+
+	// statistics
+	unsigned m_nInstances;
+	unsigned m_nVisibleCells;
+	unsigned m_nDrawCalls;
+	unsigned m_nRenderedInstances;
+
+	void scatterCell(int iCell);
+	float getMaskDensity(int nChannel, float x, float z);
+
+public:
+	C3dglScatter();
+	~C3dglScatter();
+
+	std::string getName()					{ return "Scatter"; }
+
+	// model types - the model is not owned, and must be loaded before addType is called; returns the type id
+	int addType(C3dglModel *pModel, const RULES &rules);
+	unsigned getTypeCount()					{ return m_types.size(); }
+	void destroy();
+
+	// density mask - the image is stretched over the terrain, x along the width and z along the height, like the height map
+	bool loadDensityMask(const std::string filename);
+
+	// random seed - the same seed gives the same placements
+	void setSeed(unsigned nSeed)			{ m_nSeed = nSeed; }
+	unsigned getSeed()						{ return m_nSeed; }
+
+	// generates the placements over the terrain (no OpenGL calls); the cells are registered as the terrain objects,
+	// so the terrain must not be reloaded, nor its objects removed, while they are in use
+	bool scatter(C3dglTerrain *pTerrain);
+
+	// renders the instances in the cells visible in the last terrain render (render or renderLOD),
+	// with the same model-view matrix as the terrain
+	void render();
+
+	// statistics
+	unsigned getInstanceCount()				{ return m_nInstances; }			// generated, in total
+	unsigned getCellCount()					{ return m_cells.size(); }
+	unsigned getVisibleCellCount()			{ return m_nVisibleCells; }			// in the last render
+	unsigned getDrawCallCount()				{ return m_nDrawCalls; }			// in the last render
+	unsigned getRenderedInstanceCount()		{ return m_nRenderedInstances; }	// in the last render
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -97,7 +97,8 @@ public:
 
 	bool Create();
 	bool Attach(C3dglShader &shader);
-	bool Link(std::string std_attrib_names = "", std::string std_uni_names = "");
+	// feedback_varyings: ';'-separated outputs captured by transform feedback, interleaved into a single buffer
+	bool Link(std::string std_attrib_names = "", std::string std_uni_names = "", std::string feedback_varyings = "");
 	bool Use(bool bValidate = false);
 
 	GLuint GetId()			{ return m_id; }
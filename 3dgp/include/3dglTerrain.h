@@ -8,7 +8,24 @@ Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
 A very simple terrain class.
 Usage:
 loadHeightmap to load the height map and scale its height
-render to render the terrain
+setQuantisedHeights (before loading) to keep the heights in memory as 16-bit values (half the size of floats)
+setHeightLayout (before loading) to keep the heights in 8 x 8 tiles, for faster spatial queries on large maps
+createHeightmap to create the terrain from an array of heights
+getInterpolatedHeights, getInterpolatedNormals to query the surface at many points at once
+rayCast, rayCastMany, isLineOfSight for picking, collisions and visibility tests
+modifyHeights to deform the terrain at run time (the GPU buffers are updated by the next render)
+setMeshCache (before loading) to store the built mesh in a binary cache file next to the height map, for fast restarts
+setThreadPool (before loading) to select the thread pool used to build the mesh
+render to render the terrain (chunks outside the view frustum are skipped)
+renderLOD to render the terrain with distance-dependent level of detail
+setHorizonCulling to skip the chunks and the registered objects hidden behind the nearer terrain (see addObject)
+setCompactVertices (before loading) to store the vertices in the compact, 8 bytes per vertex format
+setDecimation (before loading) to cover flat areas with fewer triangles, within a vertical error bound
+setDisplacement (before loading) to render a shared grid patch displaced by the vertex shader from a height texture
+setHeights to replace the heights of a displaced terrain without rebuilding the mesh
+setIndexOrder (before loading) to select triangle lists, strips or vertex cache optimised lists
+bakeLightMap (after loading) to bake the ambient occlusion and the sun light into a light map read by terrain.frag
+setSunDirection to re-bake the sun light for a new sun direction, a few rows per frame
 renderNormals to render terrain normal vectors
 ----------------------------------------------------------------------------------
 This software is provided 'as-is', without any express or implied
@@ -37,34 +54,455 @@ freely, subject to the following restrictions:
 
 #include <string>
 #include <vector>
+#include <map>
+#include <functional>
+#include "3dglObject.h"
 
 namespace _3dgl
 {
-	
-class C3dglTerrain
+
+#define TERRAIN_MAX_LOD 8
+#define TERRAIN_CACHE_VERSION 4
+#define TERRAIN_DISPLACEMENT_UNIT 7		// texture unit used for the height texture in the displacement mode
+#define TERRAIN_NORMAL_MAP_UNIT 6		// texture unit used for the normal map of the decimated mesh
+#define TERRAIN_LIGHT_MAP_UNIT 8		// texture unit used for the light map
+#define TERRAIN_AO_RADIUS 64			// ambient occlusion: the horizon is searched up to this distance (grid points)
+#define TERRAIN_SHADOW_BIAS 0.05f		// sun light: the shadow rays start this high above the surface
+#define TERRAIN_HORIZON_SIZE 1024		// number of azimuth columns in the horizon buffer
+#define TERRAIN_TILE_BITS 3				// tiled height layout: tiles of 2^3 x 2^3 heights
+
+class C3dglProgram;
+class C3dglThreadPool;
+
+class C3dglTerrain : public C3dglObject
 {
+public:
+	// order of the indices within each chunk
+	enum INDEX_ORDER { ORDER_ROWS, ORDER_STRIPS, ORDER_OPTIMISED };
+
+	// layout of the heights in memory: x-major rows, or square tiles (x-major, each one x-major inside)
+	enum HEIGHT_LAYOUT { LAYOUT_LINEAR, LAYOUT_TILED };
+
+	// compact vertex format: 8 bytes per vertex in a single interleaved buffer
+	// x and z are not stored - they are derived from the vertex index (gl_VertexID) by the vertex shader, and so are the texture coordinates
+	struct COMPACT_VERTEX
+	{
+		unsigned short height;		// height, quantised to 16 bits over the height range of the map
+		unsigned short morph;		// LOD morph target height, quantised the same way
+		signed char normal[2];		// octahedral encoded normal vector
+		signed char pad[2];
+	};
+
+	// octahedral encoding of a unit vector into two signed bytes (decoded by terrain.vert)
+	static void octEncode(float x, float y, float z, signed char out[2]);
+
+private:
+	// a rectangular block of the height map, rendered or skipped as a whole
+	struct CHUNK
+	{
+		int x0, z0;				// first grid point (height map coordinates)
+		int nx, nz;				// size in cells
+		float minY, maxY;		// height range - together with the above forms the AABB
+		unsigned iFirstVertex;	// first vertex of the chunk's own block of vertices (16-bit indices only)
+		unsigned iFirst;		// offset of the first index in the index buffer
+		unsigned nIndices;		// number of indices
+
+		// level of detail: level L skips 2^L-1 of every 2^L grid lines
+		int nLevels;								// number of LOD levels available (1 = full resolution only)
+		unsigned iLodFirst[TERRAIN_MAX_LOD];		// offsets of the first indices for each level (level 0 = iFirst)
+		unsigned nLodIndices[TERRAIN_MAX_LOD];		// numbers of indices for each level
+		float lodError[TERRAIN_MAX_LOD];			// max vertical error (in height units) for each level
+	};
+
+	// CPU copy of the mesh - allocated once, filled in by the thread pool and released after the upload
+	struct MESH
+	{
+		std::vector<float> vertices, normals, texCoords, morph;	// standard vertex format
+		std::vector<COMPACT_VERTEX> compact;					// compact vertex format
+		std::vector<float> lines;								// visualisation of normal vectors
+		std::vector<unsigned> indices;
+		void swap(MESH &m)	{ vertices.swap(m.vertices); normals.swap(m.normals); texCoords.swap(m.texCoords); morph.swap(m.morph); compact.swap(m.compact); lines.swap(m.lines); indices.swap(m.indices); }
+	};
+
+	// mesh cache file sections: the GPU-ready buffers first, then the CPU side data
+	enum CACHE_SECTION { SECTION_VERTICES, SECTION_NORMALS, SECTION_TEXCOORDS, SECTION_MORPH, SECTION_COMPACT, SECTION_LINES, SECTION_INDICES,
+		SECTION_HEIGHTS, SECTION_CHUNKS, SECTION_NODES, SECTION_PYRAMID, SECTION_COUNT };
+
+	// mesh cache file header: the key (up to nSizeX) must match exactly, the rest is the state of the terrain
+	struct CACHE_HEADER
+	{
+		char magic[4];						// "3DTC"
+		unsigned nVersion;					// TERRAIN_CACHE_VERSION
+		unsigned long long nSourceHash;		// hash of the height map file
+		unsigned nLayout;					// sizes of CHUNK and NODE
+		float fScaleHeight;
+		int nChunkSize, nIndexOrder;
+		int bCompact, bDisplacement, bPrimitiveRestart, bQuantisedHeights, nHeightLayout;
+		float fDecimation;
+		int nSizeX, nSizeZ;
+		int nChunkSizeUsed, nChunksX, nChunksZ, nLodLevels;
+		int b16BitIndices;
+		unsigned nVertices;
+		float fMinHeight, fHeightScale, fChunkDiagonal, fACMR;
+		float lodMaxError[TERRAIN_MAX_LOD];
+		unsigned long long offsets[SECTION_COUNT], sizes[SECTION_COUNT];
+	};
+
+	// quadtree node - used to select chunks for LOD rendering
+	struct NODE
+	{
+		float minX, minY, minZ, maxX, maxY, maxZ;	// AABB
+		int iChunk;									// chunk index for leaf nodes, -1 otherwise
+		int children[4];							// child node indices, -1 if not used
+	};
+
 	// height map size (may be rectangular)
 	int m_nSizeX, m_nSizeZ;
 
-	// height map
+	// height map: floats, or 16-bit values quantised over the height range (see setQuantisedHeights)
+	// h = m_fMinHeight + m_fHeightScale * q / 65535; the layout is linear (x-major) or tiled (see setHeightLayout)
+	// read with height(x, z) in any case
 	std::vector<float> m_heights;
+	std::vector<unsigned short> m_quantisedHeights;
+	bool m_bQuantisedHeights;
+	HEIGHT_LAYOUT m_heightLayout;
+	int m_nHeightTilesZ;					// tiled layout: tiles along z
+
+	// rectangular region of the height map (height map coordinates, inclusive)
+	struct REGION { int x0, z0, x1, z1; };
+
+	// deformation: regions edited since the last frame, waiting for the GPU update
+	std::vector<REGION> m_edits;
+
+	// min/max pyramid for ray casts: level k (1, 2, ...) holds the height ranges of the blocks of 2^k x 2^k cells
+	struct RANGE { float minY, maxY; };
+	std::vector<std::vector<RANGE> > m_rayPyramid;		// m_rayPyramid[k - 1] for the level k, x-major
+
+	// chunks
+	int m_nChunkSize;
+	int m_nChunksX, m_nChunksZ;
+	std::vector<CHUNK> m_chunks;
+
+	// level of detail
+	std::vector<NODE> m_nodes;				// quadtree, root node first
+	int m_nLodLevels;						// max number of LOD levels in any chunk
+	float m_lodMaxError[TERRAIN_MAX_LOD];	// max vertical error of each level over all chunks
+	float m_fChunkDiagonal;					// max chunk AABB diagonal - limits how quickly the LOD may change
+	float m_fPixelError;					// screen-space error threshold (in pixels)
+
+	// mesh building
+	MESH m_mesh;
+	unsigned m_nVertices;					// number of vertices (more than the grid points if the chunks have their own blocks of vertices)
+	C3dglThreadPool *m_pThreadPool;
+	bool m_bMeshCache;						// true to use the mesh cache file
+
+	// indices
+	INDEX_ORDER m_indexOrder;
+	bool m_b16BitIndices;					// true if each chunk has its own block of vertices, indexed with 16-bit indices
+	bool m_bPrimitiveRestart;				// true if triangle strips are separated by primitive restarts (not degenerate triangles)
+	float m_fACMR;							// average cache miss ratio of the full resolution mesh
+	std::map<int, std::vector<unsigned> > m_indexPatterns;	// index patterns for each chunk size (used while loading)
+
+	// statistics collected by the last call to render
+	unsigned m_nVisibleChunks;
+	unsigned m_nRenderedTriangles;
+	unsigned m_nHorizonCulledChunks;
+	unsigned m_nVisibleObjects, m_nCulledObjects;
+
+	// decimated mesh: a right-triangulated irregular network in each chunk (see setDecimation)
+	float m_fDecimation;					// vertical error bound, 0 for the full grid
+	std::vector<float> m_diamondErrors;		// error of the diamond centred at each grid point, x-major - kept for the edits
+	std::vector<std::vector<unsigned> > m_chunkIndices;	// triangles of each chunk - kept for the edits
+	unsigned m_nDecimatedTriangles;
+
+	// light map: ambient occlusion and sun light baked from the heights (see bakeLightMap)
+	std::vector<unsigned char> m_lightMapData;	// two channels per grid point, x-major: ambient occlusion, sun light (N.L x visibility)
+	float m_sunDir[3];						// direction towards the sun the light map is baked for (normalised)
+	std::vector<unsigned char> m_sunLight;	// sun light being re-baked for a new sun direction, x-major
+	float m_newSunDir[3];					// the new sun direction
+	int m_nSunRow;							// the next row (x) to re-bake, -1 if no re-bake is in progress
+	int m_nLightMapRows;					// rows re-baked per frame, 0 for all at once
+
+	// vertex format
+	bool m_bCompact;						// true to use the compact vertex format
+	bool m_bDisplacement;					// true to displace a shared grid patch with the height texture
+	float m_fMinHeight, m_fHeightScale;		// quantisation of the compact heights: h = m_fMinHeight + m_fHeightScale * q / 65535
 
 	// buffer names
     unsigned int m_vertexBuffer;
 	unsigned int m_normalBuffer;
 	unsigned m_texCoordBuffer;
+	unsigned m_morphBuffer;
+	unsigned m_compactBuffer;
     unsigned int m_indexBuffer;
     unsigned int m_linesBuffer;
+	unsigned m_heightTexture;				// displacement mode: 16-bit height texture
+	unsigned m_patchBuffer;					// displacement mode: grid patch shared by all the chunks
+	unsigned m_normalMap;					// decimated mesh: full resolution normal map
+	unsigned m_lightMap;					// light map texture
+
+	// vertex array object - built for the program it is first used with (attribute locations depend on the program)
+	unsigned m_vao;
+	C3dglProgram *m_pVaoProgram;
+
+	// the per chunk uniforms (16-bit indices and the displacement mode) - located once per render by bindVertices
+	unsigned m_locCompactOffset, m_locCompactSizeZ, m_locDisplacementOrigin;
+	int m_nSentSizeZ;						// compactSizeZ last sent - the same for all but the border chunks
+
+	// horizon culling: an object registered with addObject
+	struct OBJECT
+	{
+		float minX, minY, minZ, maxX, maxY, maxZ;	// AABB
+		bool bVisible;								// result of the last render
+	};
+
+	// horizon culling: a chunk or an object to be tested, ordered by the distance from the eye
+	struct HORIZON_ITEM
+	{
+		float dMin, dMax;		// horizontal distance from the eye to the nearest and the farthest point of the AABB
+		int iChunk, L;			// chunk and its LOD level, or iChunk = -1 for an object
+		int iObject;
+		bool operator <(const HORIZON_ITEM &item) const	{ return dMin < item.dMin; }
+	};
+
+	bool m_bHorizonCulling;
+	float m_fOccluderRange;					// only the chunks nearer than this are rasterised as occluders (0 = all)
+	std::vector<float> m_horizon;			// tangent of the horizon elevation angle for each azimuth column
+	std::vector<OBJECT> m_objects;
+
+	// find the chunks visible in the current view frustum; returns the frustum planes and the eye position
+	void cullChunks(std::vector<int> &chunks, float planes[6][4], float eye[3]);
+
+	// horizon culling: removes the hidden chunks (chunks[L] - the chunks rendered at the level L) and tests the objects
+	void cullHorizon(const float planes[6][4], const float eye[3], std::vector<int> chunks[], int nLevels);
+	void rasteriseChunk(const float eye[3], const CHUNK &chunk, float fBias);
+	bool isHidden(const float eye[3], float minX, float minZ, float maxX, float maxZ, float maxY, float dMin, float dMax);
+
+	// mesh building steps
+	void uploadMesh(const CACHE_HEADER *pKey = NULL, const std::string cacheFile = "");	// saves the mesh cache if pKey is given
+	void uploadBuffers(const void *pData[], const size_t sizes[]);		// pData, sizes indexed by CACHE_SECTION
+	void uploadHeightTexture(int x0 = 0, int z0 = 0, int x1 = -1, int z1 = -1);	// the whole map or a region
+	void findHeightRange(const float *pHeights, size_t n);
+	size_t layoutHeights();					// returns the number of heights stored, including the padding of the tiles
+	template <class T> void fillPadding(std::vector<T> &heights);	// tiled layout: copies the height (0, 0) into the padding
+	void storeHeights(const float *pHeights);		// copies (or quantises) the heights and finds the height range
+	void requantiseHeights(float fMinHeight, float fHeightScale);	// converts the quantised heights to a new range
+	unsigned layoutChunks();				// returns the total number of indices
+	unsigned countChunkIndices(const CHUNK &chunk, int s);
+	void buildChunkIndices(const CHUNK &chunk, int s, unsigned *pIndices);		// LOD step s (1 = full resolution)
+	void buildChunk(CHUNK &chunk, unsigned *pIndices);		// AABB, indices and errors for all the levels
+	void buildVertices(int x0, int x1, int z0, int z1, unsigned iFirst);
+	void writeNormal(unsigned i, int x, int z, const float *h, const float *hPrev, const float *hNext);
+	void writeVertex(unsigned i, int x, int z, float nx, float ny, float nz);
+	float getMorphHeight(int x, int z);
+
+	// decimated mesh
+	void findDiamondErrors(int x0, int z0, int x1, int z1);
+	float getDiamondError(int x, int z, int d, int type);		// type: hypotenuse along x, along z, diagonal
+	bool isWholeChunk(int cx, int cz);
+	void decimateChunks(const std::vector<int> &chunks);
+	void decimateChunk(int iChunk);
+	float getTriangleError(int ax, int az, int bx, int bz, int cx, int cz);
+	unsigned gatherIndices(std::vector<unsigned> &indices);		// joins the triangles of the chunks, returns the number of indices
+	void uploadIndices();
+	void uploadNormalMap(int x0 = 0, int z0 = 0, int x1 = -1, int z1 = -1);	// the whole map or a region
+
+	// light map
+	unsigned char getAmbientOcclusion(int x, int z);
+	unsigned char getSunLight(int x, int z, const float sun[3]);
+	void bakeLightRegion(const REGION &rect);		// both channels, with the current sun direction
+	int getLightMapReach();							// how far the light map changes around an edit (grid points)
+	void uploadLightMap(int x0 = 0, int z0 = 0, int x1 = -1, int z1 = -1);	// the whole map or a region
+
+	// batch query implementation: normals and slopes may be NULL
+	void sampleSurface(const float *xs, const float *zs, size_t n, float *heights, float *normals, float *slopes);
+
+	// mesh cache
+	bool makeCacheKey(const std::string filename, float scaleHeight, CACHE_HEADER &key);
+	void saveMeshCache(const std::string filename, const CACHE_HEADER &key, const void *pData[], size_t sizes[]);
+	bool loadMeshCache(const std::string filename, const CACHE_HEADER &key);
+
+	// deformation
+	void findChunks(const REGION &rect, std::vector<int> &chunks);
+	void refitNode(int iNode, const REGION &rect);
+	void updateVertices(const REGION &rect, const REGION &block, unsigned iFirst);
+
+	// ray cast implementation
+	void buildRayPyramid();
+	void updateRayPyramid(int cx0, int cz0, int cx1, int cz1);		// cells [cx0..cx1] x [cz0..cz1]
+	static int getPyramidSize(int nCells, int k)	{ return (nCells + (1 << k) - 1) >> k; }	// blocks per side at level k
+	bool intersectCell(const float o[3], const float d[3], int x, int z, float tMin, float tMax, float &t);
+
+	// quantise a height for the compact vertex format and the quantised heights
+	unsigned short quantiseHeight(float h);
+
+	// height at the grid point (x, z) (height map coordinates), in any format and layout
+	size_t heightIndex(int x, int z)
+	{
+		if (m_heightLayout == LAYOUT_LINEAR)
+			return (size_t)x * m_nSizeZ + z;
+		const int nMask = (1 << TERRAIN_TILE_BITS) - 1;
+		return ((size_t)((x >> TERRAIN_TILE_BITS) * m_nHeightTilesZ + (z >> TERRAIN_TILE_BITS)) << (2 * TERRAIN_TILE_BITS)) + ((x & nMask) << TERRAIN_TILE_BITS) + (z & nMask);
+	}
+	float height(int x, int z)				{ size_t i = heightIndex(x, z); return m_bQuantisedHeights ? m_fMinHeight + m_fHeightScale * m_quantisedHeights[i] * (1.0f / 65535) : m_heights[i]; }
+	float fetchHeight(int x, int z)			{ return (unsigned)x < (unsigned)m_nSizeX && (unsigned)z < (unsigned)m_nSizeZ ? height(x, z) : 0; }	// 0 outside the map
+	float clampedHeight(int x, int z)		{ return height(x < 0 ? 0 : x < m_nSizeX ? x : m_nSizeX - 1, z < 0 ? 0 : z < m_nSizeZ ? z : m_nSizeZ - 1); }	// clamped to the map edges
+	const float *getHeightRow(int x, int z0, int z1, std::vector<float> &buf);	// heights at (x, z0..z1), indexed by z; copied into buf unless linear floats
+
+	// set up and release the vertex attributes (pProgram is NULL for the fixed pipeline)
+	void bindVertices(C3dglProgram *pProgram);
+	void unbindVertices(C3dglProgram *pProgram);
+	void setVertexPointers(C3dglProgram *pProgram, int iChunk);		// iChunk = -1 for the whole height map
+	void drawChunks(C3dglProgram *pProgram, const std::vector<int> &chunks, int L);
+
+	// LOD helpers
+	void buildLOD();
+	int buildNode(int cx0, int cz0, int cx1, int cz1);
+	void selectNode(int iNode, const float planes[6][4], const float eye[3], const float ranges[], std::vector<int> chunks[]);
 
 public:
     C3dglTerrain();
 
+	std::string getName()					{ return "Terrain"; }
+
 	float getHeight(int x, int z);
 	float getInterpolatedHeight(float x, float z);
+	int getSizeX()							{ return m_nSizeX; }	// height map size, in samples
+	int getSizeZ()							{ return m_nSizeZ; }
+
+	// batch versions of getInterpolatedHeight: n points (xs[i], zs[i]), SSE2 vectorised
+	// the normals are 3 floats per point; slopes are the gradients (tangents of the slope angles); either may be NULL
+	void getInterpolatedHeights(const float *xs, const float *zs, float *out, size_t n);
+	void getInterpolatedNormals(const float *xs, const float *zs, float *heights, float *normals, float *slopes, size_t n);
+
+	// ray casts against the height map (the mesh triangles, not the area outside the map)
+	// return the distance from the origin to the first hit, up to maxDist, or -1 if none; 0 if the origin is below the surface
+	// the batch version takes 3 floats per ray and runs on the thread pool
+	float rayCast(const float origin[3], const float dir[3], float maxDist = 1e30f);
+	void rayCastMany(const float *origins, const float *dirs, float maxDist, float *out, size_t n);
+	bool isLineOfSight(const float from[3], const float to[3]);
+
+	// deformation: h = fn(x, z, h) for the grid points [x0..x1] x [z0..z1] (model coordinates, like getHeight)
+	// the heights, bounds and ray casts are updated at once; the GPU buffers by updateBuffers, called by render
+	// in the compact and displacement modes, the heights are limited to the height range of the map as loaded
+	void modifyHeights(int x0, int z0, int x1, int z1, std::function<float(int x, int z, float h)> fn);
+	void updateBuffers();		// sends the edits made since the last call to the GPU (and re-bakes the light map around them)
+
+	// light map - baked once the height map is loaded, on the thread pool
+	// the ambient occlusion (the sky visible above the horizon found in 8 directions, up to TERRAIN_AO_RADIUS) and the sun light
+	// (N.L, 0 where a ray cast towards the sun hits the terrain) are stored in a texture read by terrain.frag instead
+	// of computing the directional light and applied to the ambient light; the point lights are still computed per pixel
+	// sunDir is the direction towards the sun in the model coordinates, like lightDir.direction in the shaders
+	bool bakeLightMap(const float sunDir[3]);
+	bool isLightMapBaked()					{ return m_lightMap != 0; }
+
+	// a new sun direction for the light map: only the sun light is re-baked, setLightMapRowsPerFrame rows (x) at a time
+	// by updateLightMap (called by render and renderLOD), and sent to the GPU once complete - the old one is used until then
+	void setSunDirection(const float sunDir[3]);
+	void setLightMapRowsPerFrame(int nRows)	{ m_nLightMapRows = nRows; }	// 0 for all at once
+	int getLightMapRowsPerFrame()			{ return m_nLightMapRows; }
+	bool isLightMapBaking()					{ return m_nSunRow >= 0; }
+	void updateLightMap();
+
+	// quantised heights - must be set before loadHeightmap is called
+	// the heights are held in memory as 16-bit values over the height range of the map (0.0015% of the range
+	// precision) - half the memory of floats; 16-bit height map images are decoded directly into this format
+	void setQuantisedHeights(bool bQuantised)	{ m_bQuantisedHeights = bQuantised; }
+	bool getQuantisedHeights()				{ return m_bQuantisedHeights; }
+
+	// height layout - must be set before loadHeightmap is called
+	// the tiled layout keeps the neighbours in both directions close in memory - faster height queries, ray casts
+	// and normal computation on large maps, where the rows of the linear layout are far apart
+	void setHeightLayout(HEIGHT_LAYOUT layout)	{ m_heightLayout = layout; }
+	HEIGHT_LAYOUT getHeightLayout()			{ return m_heightLayout; }
+
+	// chunk size in cells - must be set before loadHeightmap is called
+	void setChunkSize(int nChunkSize)		{ m_nChunkSize = nChunkSize; }
+	int getChunkSize()						{ return m_nChunkSize; }
+
+	// LOD screen-space error threshold, in pixels
+	void setLODPixelError(float fPixelError)	{ m_fPixelError = fPixelError; }
+	float getLODPixelError()				{ return m_fPixelError; }
+
+	// compact vertex format (8 instead of 32 bytes per vertex) - must be set before loadHeightmap is called
+	// requires a vertex shader that decodes it (see terrain.vert); not available in the fixed pipeline
+	void setCompactVertices(bool bCompact)	{ m_bCompact = bCompact; }
+	bool getCompactVertices()				{ return m_bCompact; }
+
+	// decimated mesh - must be set before loadHeightmap is called
+	// each chunk is triangulated adaptively - flat and gentle areas with few large triangles, steep ones with the full grid -
+	// so that the vertical distance between the mesh and any height map sample stays within fMaxError (0 = the full grid)
+	// a full resolution normal map is baked for terrain.frag, so that the shading keeps the detail of the full grid
+	// the chunk size is rounded down to a power of two; triangle lists are used whatever the index order
+	void setDecimation(float fMaxError)		{ m_fDecimation = fMaxError; }
+	float getDecimation()					{ return m_fDecimation; }
+
+	// displacement mode - must be set before loadHeightmap is called
+	// only a 16-bit height texture and a single (chunk size + 1)^2 grid patch are stored; the vertex shader (see terrain.vert)
+	// reads the heights and computes the normal vectors; the chunk size is limited to 254; not available in the fixed pipeline
+	void setDisplacement(bool bDisplacement)	{ m_bDisplacement = bDisplacement; }
+	bool getDisplacement()					{ return m_bDisplacement; }
+
+	// displacement mode only: replaces the heights with a height map of the same size - only the height texture
+	// and the chunk bounds are updated, the grid patch and the indices are reused
+	bool setHeights(const float *pHeights);
+
+	// height texture: a 16-bit texture of the heights, s along z and t along x, h = getHeightTextureMin() + getHeightTextureScale() * value;
+	// created on demand outside the displacement mode (e.g. for the particle collisions on the GPU) and then kept up to date by updateBuffers
+	unsigned getHeightTexture();
+	float getHeightTextureMin()				{ return m_fMinHeight; }
+	float getHeightTextureScale()			{ return m_fHeightScale; }
+
+	// index order - must be set before loadHeightmap is called
+	// 16-bit indices are used automatically if a chunk has less than 65535 vertices
+	void setIndexOrder(INDEX_ORDER order)	{ m_indexOrder = order; }
+	INDEX_ORDER getIndexOrder()				{ return m_indexOrder; }
+	bool get16BitIndices()					{ return m_b16BitIndices; }
+	float getACMR()							{ return m_fACMR; }		// average cache miss ratio (reported at load time)
+
+	// mesh cache - must be set before loadHeightmap is called
+	// the built mesh is saved to <height map file>.meshcache, and restored from it (memory-mapped and uploaded directly)
+	// as long as the height map file, the scale and the mesh options are the same
+	void setMeshCache(bool bMeshCache)		{ m_bMeshCache = bMeshCache; }
+	bool getMeshCache()						{ return m_bMeshCache; }
+
+	// horizon culling: the chunks in the view frustum are processed front to back; the nearer ones raise a 1D horizon
+	// (the elevation angle seen from the camera in each direction) and the farther ones entirely below it are skipped
+	// the occluder range limits the rasterised chunks to those near the camera (0 = no limit)
+	void setHorizonCulling(bool bHorizonCulling)	{ m_bHorizonCulling = bHorizonCulling; }
+	bool getHorizonCulling()				{ return m_bHorizonCulling; }
+	void setOccluderRange(float fRange)		{ m_fOccluderRange = fRange; }
+	float getOccluderRange()				{ return m_fOccluderRange; }
+
+	// objects tested by render and renderLOD against the view frustum and (with horizon culling) the horizon
+	// the bounds are in the terrain model coordinates; isObjectVisible returns the result of the last render
+	int addObject(const float minXYZ[3], const float maxXYZ[3]);
+	void setObjectBounds(int id, const float minXYZ[3], const float maxXYZ[3]);
+	bool isObjectVisible(int id)			{ return id >= 0 && id < (int)m_objects.size() && m_objects[id].bVisible; }
+	void removeAllObjects()					{ m_objects.clear(); }
+
+	// thread pool used to build the mesh - C3dglThreadPool::getDefault() unless set
+	void setThreadPool(C3dglThreadPool *pThreadPool)	{ m_pThreadPool = pThreadPool; }
+	C3dglThreadPool *getThreadPool();
 
 	bool loadHeightmap(const std::string filename, float scaleHeight);
-    void render();
+	bool createHeightmap(int sizeX, int sizeZ, const float *pHeights);		// heights are x-major: pHeights[x * sizeZ + z]
+	void buildMesh(int sizeX, int sizeZ, const float *pHeights);			// CPU part of createHeightmap, no OpenGL calls (for benchmarking); NULL to use the heights already stored
+    void render();				// full resolution rendering
+	void renderLOD();			// level of detail rendering, with geomorphing performed by the vertex shader
 	void renderNormals();
+
+	// statistics
+	unsigned getChunkCount()				{ return m_chunks.size(); }
+	unsigned getVisibleChunkCount()			{ return m_nVisibleChunks; }
+	unsigned getRenderedTriangleCount()		{ return m_nRenderedTriangles; }
+	unsigned getHorizonCulledChunkCount()	{ return m_nHorizonCulledChunks; }	// in the view frustum but hidden behind the horizon
+	unsigned getVisibleObjectCount()		{ return m_nVisibleObjects; }
+	unsigned getCulledObjectCount()			{ return m_nCulledObjects; }		// outside the view frustum or behind the horizon
+	unsigned getTriangleCount()				{ return m_fDecimation > 0 ? m_nDecimatedTriangles : (m_nSizeX - 1) * (m_nSizeZ - 1) * 2; }
+	unsigned getVertexSize()				{ return m_bDisplacement ? 2 * sizeof(unsigned short) : m_bCompact ? sizeof(COMPACT_VERTEX) : 9 * sizeof(float); }
+	size_t getHeightDataSize()				{ return m_bQuantisedHeights ? m_quantisedHeights.size() * sizeof(unsigned short) : m_heights.size() * sizeof(float); }	// CPU copy of the heights, in bytes
+	size_t getVertexDataSize()				{ return m_nVertices * getVertexSize() + (m_bDisplacement ? m_nSizeX * m_nSizeZ * sizeof(unsigned short) : 0) + (m_normalMap ? m_nSizeX * m_nSizeZ * 2 : 0); }		// vertex buffers, the height texture and the normal map, in bytes
 };
 
 }; // namespace _3dgl
@@ -0,0 +1,112 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Procedural terrain - heights generated from noise instead of a height map image.
+Multi-octave gradient noise (fBm), with a ridged filter (sharp crests and valleys) and
+an erosion-like filter (the detail is damped on the slopes, where the accumulated gradient
+is steep, leaving smooth flanks and rough flat areas). The heights are evaluated four at a time
+with SSE2, the rows on the thread pool.
+Usage:
+setSeed, setOctaves, setFrequency, setHeight... to shape the terrain
+getHeight to evaluate a single point
+generate to evaluate a grid of points
+createTerrain to create a C3dglTerrain from a grid of generated heights (like loadHeightmap)
+C3dglTerrainStream::openProcedural to generate the tiles around the camera on demand
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglTerrainNoise_h_
+#define __3dglTerrainNoise_h_
+
+#include <string>
+#include "3dglObject.h"
+
+namespace _3dgl
+{
+
+class C3dglTerrain;
+class C3dglThreadPool;
+
+#define TERRAIN_NOISE_MAX_OCTAVES	16
+
+class C3dglTerrainNoise : public C3dglObject
+{
+	unsigned m_nSeed;
+	int m_nOctaves;
+	float m_fFrequency;			// of the first octave, in cycles per unit
+	float m_fLacunarity;		// frequency ratio of the consecutive octaves
+	float m_fGain;				// amplitude ratio of the consecutive octaves
+	float m_fBaseHeight, m_fHeight;		// h = fBaseHeight + fHeight * noise, noise in [-1, 1]
+	float m_fRidged;			// 0 = plain fBm, 1 = ridged
+	float m_fErosion;			// damping of the detail by the accumulated gradient, 0 = none
+
+	// per octave: seed, amplitude (normalised so that they sum up to 1) and the coordinate rotation
+	unsigned m_octaveSeed[TERRAIN_NOISE_MAX_OCTAVES];
+	float m_octaveAmp[TERRAIN_NOISE_MAX_OCTAVES];
+	float m_octaveFreq[TERRAIN_NOISE_MAX_OCTAVES];
+	float m_octaveCos[TERRAIN_NOISE_MAX_OCTAVES], m_octaveSin[TERRAIN_NOISE_MAX_OCTAVES];
+
+	void prepare();		// finds the per octave values - called by the setters
+	void generateRow(float x, float z0, int n, float *pHeights);
+
+public:
+	C3dglTerrainNoise();
+
+	std::string getName()					{ return "Terrain Noise"; }
+
+	// parameters
+	void setSeed(unsigned nSeed)			{ m_nSeed = nSeed; prepare(); }
+	unsigned getSeed()						{ return m_nSeed; }
+	void setOctaves(int nOctaves)			{ m_nOctaves = nOctaves < 1 ? 1 : nOctaves > TERRAIN_NOISE_MAX_OCTAVES ? TERRAIN_NOISE_MAX_OCTAVES : nOctaves; prepare(); }
+	int getOctaves()						{ return m_nOctaves; }
+	void setFrequency(float f)				{ m_fFrequency = f; prepare(); }
+	float getFrequency()					{ return m_fFrequency; }
+	void setLacunarity(float f)				{ m_fLacunarity = f; prepare(); }
+	float getLacunarity()					{ return m_fLacunarity; }
+	void setGain(float f)					{ m_fGain = f; prepare(); }
+	float getGain()							{ return m_fGain; }
+	void setHeight(float fBase, float fHeight)	{ m_fBaseHeight = fBase; m_fHeight = fHeight; }
+	float getMinHeight()					{ return m_fBaseHeight - m_fHeight; }	// the bounds of all the heights
+	float getMaxHeight()					{ return m_fBaseHeight + m_fHeight; }
+	void setRidged(float f)					{ m_fRidged = f; }
+	float getRidged()						{ return m_fRidged; }
+	void setErosion(float f)				{ m_fErosion = f; }
+	float getErosion()						{ return m_fErosion; }
+
+	// the height at (x, z) - scalar, the reference for generate
+	float getHeight(float x, float z);
+
+	// heights of the grid points (x0 + i, z0 + j), i < nSizeX, j < nSizeZ, x-major: pHeights[i * nSizeZ + j]
+	// the rows are generated in parallel on the thread pool (C3dglThreadPool::getDefault() if NULL)
+	void generate(int x0, int z0, int nSizeX, int nSizeZ, float *pHeights, C3dglThreadPool *pThreadPool = NULL);
+
+	// creates the terrain (see C3dglTerrain::createHeightmap) from nSizeX x nSizeZ heights centred at (0, 0),
+	// so that the model coordinates of the terrain are the noise coordinates; uses the terrain thread pool
+	bool createTerrain(C3dglTerrain *pTerrain, int nSizeX, int nSizeZ);
+};
+
+}; // namespace _3dgl
+
+#endif
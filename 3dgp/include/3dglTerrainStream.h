@@ -0,0 +1,198 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+Streaming terrain - for height maps too large to be held in memory.
+The height map is stored in a tiled file (see writeTiledFile) and memory-mapped.
+Tiles around the camera are decoded by a background thread, uploaded a few per
+frame and kept in an LRU cache limited by the memory budget.
+The tiles can also be generated procedurally (see C3dglTerrainNoise) instead of read from a file.
+Rendering requires terrain.vert (the tiles use the compact vertex format).
+Usage:
+writeTiledFile to create a tiled height file from any source of heights
+open to open the tiled height file and start the loader thread
+openProcedural to generate the tiles from noise instead, over an effectively unbounded area
+setMemoryBudget, setViewRadius to control the size of the tile cache
+update to stream the tiles around the camera, once per frame
+render to render the resident tiles - as many times per frame as needed (e.g. reflections)
+getInterpolatedHeight to query the heights (only where the tiles are loaded)
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglTerrainStream_h_
+#define __3dglTerrainStream_h_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "3dglObject.h"
+#include "3dglTerrain.h"
+
+namespace _3dgl
+{
+
+class C3dglTerrainNoise;
+
+#define TERRAIN_STREAM_VERSION		1
+#define TERRAIN_STREAM_ALIGNMENT	65536		// file mapping allocation granularity - the header and the tiles start at multiples of it
+#define TERRAIN_STREAM_PROCEDURAL_TILES	2048	// tiles per side of a procedural terrain
+
+class C3dglTerrainStream : public C3dglObject
+{
+	// tiled height file header - the tiles follow it, x-major, each one nTileSize x nTileSize
+	// 16-bit quantised heights (also x-major), including a one sample wide apron around the tile
+	// (for the normal vectors). Adjacent tiles share the border samples.
+	struct FILE_HEADER
+	{
+		char magic[4];				// "3DTH"
+		unsigned nVersion;			// TERRAIN_STREAM_VERSION
+		int nTilesX, nTilesZ;
+		int nTileSize;				// stored samples per side, including the apron
+		float fMinHeight, fHeightScale;		// h = fMinHeight + fHeightScale * q / 65535
+	};
+
+	// tile decoded by the loader thread, waiting for the upload
+	struct DECODED
+	{
+		int key;
+		std::vector<unsigned short> heights;
+		std::vector<C3dglTerrain::COMPACT_VERTEX> vertices;
+		float minY, maxY;
+	};
+
+	// tile in the cache
+	enum TILE_STATE { TILE_REQUESTED, TILE_DECODED, TILE_RESIDENT };
+	struct TILE
+	{
+		TILE_STATE state;
+		DECODED *pDecoded;						// decoded data waiting for the upload
+		std::vector<unsigned short> heights;	// rendered samples (without the apron) - for height queries
+		unsigned buffer;						// vertex buffer
+		float minY, maxY;
+		unsigned nFrame;						// the last frame the tile was wanted in
+		std::list<int>::iterator lru;			// position in the LRU list (resident tiles only)
+	};
+
+	// the file
+	std::string m_filename;
+	void *m_hFile, *m_hMapping;
+	FILE_HEADER m_header;
+	unsigned m_nTileStride;			// bytes per tile in the file
+	int m_nSize;					// rendered samples per tile side (nTileSize - 2)
+	int m_nSizeX, m_nSizeZ;			// height map size
+	C3dglTerrainNoise *m_pNoise;	// procedural terrain - the tiles are generated instead of mapped (no file)
+
+	// the cache
+	std::map<int, TILE> m_tiles;	// key = tx * nTilesZ + tz
+	std::list<int> m_lru;			// resident tiles, the most recently used first
+	std::vector<unsigned> m_freeBuffers;	// vertex buffers of the evicted tiles, for reuse
+	size_t m_nBudget;				// memory budget in bytes
+	float m_fViewRadius;			// tiles within this distance from the camera are streamed in
+	int m_nMaxUploads;				// max tiles uploaded per frame
+	unsigned m_nFrame;
+
+	// rendering
+	unsigned m_indexBuffer;			// shared by all the tiles
+	unsigned m_nIndices;
+
+	// statistics
+	unsigned m_nVisibleTiles;
+	unsigned m_nLoadedTiles;		// total number of tiles loaded since open
+
+	// loader thread
+	std::thread m_loader;
+	std::mutex m_mutex;
+	std::condition_variable m_cvRequest;
+	std::deque<int> m_requests;		// tiles to decode, the most important first
+	std::deque<DECODED*> m_decoded;	// decoded tiles
+	int m_nDecoding;				// the tile being decoded, -1 if none
+	bool m_bQuit;
+	std::deque<int> m_uploads;		// decoded tiles in the order of arrival (main thread only)
+
+	bool start(const std::string name);	// creates the index buffer and starts the loader, once the header is known
+	void loader();
+	DECODED *decodeTile(int key);
+	void uploadTile(TILE &tile, int key);
+	void releaseTile(int key);
+	size_t getTileBytes()				{ return (size_t)m_nSize * m_nSize * (sizeof(C3dglTerrain::COMPACT_VERTEX) + sizeof(unsigned short)); }
+
+public:
+	C3dglTerrainStream();
+	~C3dglTerrainStream();
+
+	std::string getName()					{ return "Streaming Terrain"; }
+
+	// creates a tiled height file: fnHeight(x, z) is called for each sample, x in [0, nTilesX * (nTileSize - 3) + 1), z likewise
+	// the tiles are generated one by one, so the whole height map is never held in memory
+	static bool writeTiledFile(const std::string filename, int nTilesX, int nTilesZ, float fMinHeight, float fMaxHeight,
+		std::function<float(int x, int z)> fnHeight, int nTileSize = 256);
+
+	bool open(const std::string filename);
+
+	// procedural terrain: TERRAIN_STREAM_PROCEDURAL_TILES x TERRAIN_STREAM_PROCEDURAL_TILES tiles generated by the loader thread
+	// (on the default thread pool) around the camera; the noise is not owned and must not be changed while open
+	bool openProcedural(C3dglTerrainNoise *pNoise, int nTileSize = 256);
+
+	void close();
+	bool isOpen()							{ return m_hMapping || m_pNoise; }
+
+	// memory budget (vertex buffers and cached heights), in bytes
+	void setMemoryBudget(size_t nBytes)		{ m_nBudget = nBytes; }
+	size_t getMemoryBudget()				{ return m_nBudget; }
+	size_t getMemoryUsage()					{ return (m_lru.size() + m_freeBuffers.size()) * getTileBytes(); }
+
+	// streaming radius around the camera and the upload rate
+	void setViewRadius(float fRadius)		{ m_fViewRadius = fRadius; }
+	float getViewRadius()					{ return m_fViewRadius; }
+	void setMaxUploadsPerFrame(int n)		{ m_nMaxUploads = n; }
+
+	// requests the tiles around (x, z), uploads the decoded ones and evicts the least recently used ones
+	// call it once per frame, with the camera position
+	void update(float x, float z);
+
+	// renders the resident tiles in the view frustum - no streaming, so it may be called many times per frame
+	void render();
+
+	// height queries - 0 where the tiles are not loaded
+	float getHeight(int x, int z);
+	float getInterpolatedHeight(float x, float z);
+
+	// statistics
+	int getSizeX()							{ return m_nSizeX; }
+	int getSizeZ()							{ return m_nSizeZ; }
+	unsigned getResidentTileCount()			{ return m_lru.size(); }
+	unsigned getVisibleTileCount()			{ return m_nVisibleTiles; }
+	unsigned getLoadedTileCount()			{ return m_nLoadedTiles; }
+	unsigned getPendingTileCount()			{ return m_tiles.size() - m_lru.size(); }	// requested or waiting for the upload
+};
+
+}; // namespace _3dgl
+
+#endif
@@ -0,0 +1,81 @@
+/*********************************************************************************
+3DGL 3D Graphics Library created by Jarek Francik for Kingston University students
+Version 2.2 23/03/15
+
+Copyright (C) 2013-15 Jarek Francik, Kingston University, London, UK
+
+A simple thread pool, used to parallelise the CPU side work of the library.
+Usage:
+parallelFor to process a range of items in parallel, in chunks (e.g. rows of a height map)
+parallelForStealing the same, with each thread working on its own contiguous share and stealing from the others
+getDefault to get the pool shared by the library (one thread per hardware thread)
+----------------------------------------------------------------------------------
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source distribution.
+
+   Jarek Francik
+   jarek@kingston.ac.uk
+*********************************************************************************/
+#ifndef __3dglThreadPool_h_
+#define __3dglThreadPool_h_
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace _3dgl
+{
+
+class C3dglThreadPool
+{
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()> > m_tasks;		// tasks waiting for a worker thread
+	std::mutex m_mutex;
+	std::condition_variable m_cvTask;				// signalled when a task is queued or the pool is closing
+	bool m_bQuit;
+
+	void worker();
+	bool runQueuedTask();	// runs one of the queued tasks in the calling thread, returns false if none
+
+public:
+	C3dglThreadPool(unsigned nThreads = 0);		// number of threads including the calling one, 0 for one per hardware thread
+	~C3dglThreadPool();
+
+	// number of threads taking part in parallelFor, including the calling thread
+	unsigned getThreadCount()				{ return m_threads.size() + 1; }
+
+	// calls fn(first, last) for consecutive ranges [first, last) covering [0, n) - in parallel, including the calling thread
+	// returns when all the ranges are done; nGrain is the size of the ranges, 0 to split the work evenly
+	void parallelFor(int n, std::function<void(int, int)> fn, int nGrain = 0);
+
+	// like parallelFor, but the ranges are first split into one contiguous share per thread; a thread takes the ranges
+	// from the front of its share and, once it is empty, steals the back half of the largest share left - so that
+	// each thread mostly works on neighbouring items, and an uneven work load is still balanced.
+	// fn(first, last, iThread): iThread < getThreadCount() identifies the thread (e.g. for per thread buffers)
+	void parallelForStealing(int n, std::function<void(int, int, int)> fn, int nGrain = 0);
+
+	// the pool shared by the library
+	static C3dglThreadPool *getDefault();
+};
+
+}; // namespace _3dgl
+
+#endif
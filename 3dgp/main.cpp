@@ -1,9 +1,11 @@
 #include <iostream>
+#include <vector>
 #include "include/3dgl.h"
 #include "include/GLee.h"
 #include "include/glut.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <string.h>
 
 using namespace std;
 using namespace _3dgl;
@@ -19,10 +21,25 @@ float currentTime;
 
 //Player control variables
 bool isSnowing = false;
+bool isTerrainLOD = false;
+enum { PARTICLES_CLOSED_FORM, PARTICLES_GPU, PARTICLES_CPU };
+int particleMode = PARTICLES_CLOSED_FORM;	// the closed-form particles, or simulated on the GPU (C3dglParticles) or on the CPU (C3dglCPUParticles)
+bool isParticleSorting = false;				// the smoke and fire drawn back to front (but not the GPU particles)
+bool isReducedParticles = false;			// the particles rendered offscreen at a reduced resolution (C3dglOffscreenParticles)
+
+//Sun direction (the directional light) - the terrain light map is baked for it
+float sunDirection[3] = { 1.0f, 0.5f, 0.5f };
 
 // 3D Models
 C3dglTerrain terrain, water;
 
+// Particle system bounds - hidden behind the hills by the terrain horizon culling
+int idFireObject, idSmokeObject;
+
+// Trees and rocks - scattered over the terrain and rendered instanced
+C3dglModel tree, rock;
+C3dglScatter scatter;
+
 //Skybox
 C3dglSkyBox skybox;
 
@@ -48,36 +65,56 @@ C3dglProgram TerrainProgram;
 C3dglProgram SnowProgram;
 C3dglProgram FireProgram;
 C3dglProgram SmokeProgram;
+C3dglProgram ParticleUpdateProgram;		// simulated particles: the transform feedback update pass
+C3dglProgram GPUSnowProgram;			// simulated particles: particle.vert with the snow, fire and smoke fragment shaders
+C3dglProgram GPUFireProgram;
+C3dglProgram GPUSmokeProgram;
+C3dglProgram ParticleDepthProgram;		// reduced resolution particles: fullscreen.vert with the depth downsampling
+C3dglProgram ParticleCompositeProgram;	// and with the composition over the scene
+
+//Particle Systems
+//The particles have no vertex buffers: their initial positions, velocities and start times
+//are regenerated in the vertex shaders from gl_VertexID, hashed with a per system seed
 
 //Snow Particle System Parameters
-const float SNOWPERIOD = 0.000004f;
+//The flakes fill a small tile, repeated around the camera by the vertex shader (snow.vert);
+//the tile must be larger than the visibility range of the flakes (10 units, see snow.frag)
 const float SNOWLIFETIME = 26.6;
-const int NSNOWFLAKES = SNOWLIFETIME / SNOWPERIOD;
-const int precipitationBoxSize = 160;
-
-//Snow Particle Buffer ids
-GLuint idBufferSnowInitialPos;
-GLuint idBufferSnowVelocity;
-GLuint idBufferSnowStartTime;
+const float SNOWTILESIZE = 24;
+const int NSNOWFLAKES = 13000;		// about the density of the former 6.65M flakes falling over a 320x320 box
+const float SNOWPERIOD = SNOWLIFETIME / NSNOWFLAKES;
 
 //Fire Particle System Parameters
 const float FIREPERIOD = 0.001f;
 const float FIRELIFETIME = 1.2;
 const int NFIREP = FIRELIFETIME / FIREPERIOD;
-
-//Fire Particle Buffer ids
-GLuint idBufferFireInitialPos;
-GLuint idBufferFireVelocity;
-GLuint idBufferFireStartTime;
+const float FIREPOS[3] = { 17.0f, 29.72f, -17.5f };		// corner of the fire area
+const float FIREPOSRANGE[3] = { 0.3f, 0.0f, 0.3f };		// size of the fire area
+const float FIREGRAVITY[3] = { -0.05f, 0.1f, 0.05f };
 
 //Smoke Particle System Parameters
 const float SMOKEPERIOD = 0.0025;
 const float SMOKELIFETIME = 15.0;
 const int NSMOKEP = SMOKELIFETIME / SMOKEPERIOD;
-
-//Smoke Particle Buffer ids
-GLuint idBufferVelocity;
-GLuint idBufferStartTime;
+const float SMOKEPOS[3] = { 17.15f, 29.9f, -17.35f };	// source of the smoke
+const float SMOKEGRAVITY[3] = { -0.01f, 0.1f, 0.01f };
+
+//Simulated Particle Systems - the same looks, but the particles collide with the terrain
+//and the smoke drifts with the wind; the capacities follow the emission rates
+C3dglParticles snowParticles, fireParticles, smokeParticles;
+C3dglCPUParticles cpuSnowParticles, cpuFireParticles, cpuSmokeParticles;	// the same, simulated on the CPU
+const float SNOWRATE = 1400;		// flakes per second over the 24x24 area above the camera - the density of the closed-form snow
+float lastParticleTime = 0;
+
+//Back to front order of the smoke and fire - the closed-form particles are sorted by their positions
+//computed as in the shaders, the CPU simulated ones by their simulated positions
+C3dglParticleSort fireSort, smokeSort;
+const int SORTINTERVAL = 4;			// the closed-form particles are fully sorted every 4 frames, refined in between
+GLuint fireSeed, smokeSeed;			// random seeds of the closed-form fire and smoke
+vector<float> sortX, sortY, sortZ;	// the closed-form particle positions
+
+//Reduced resolution particles - rendered offscreen after the water, then upsampled over the scene
+C3dglOffscreenParticles particlePass;
 
 // Multitexturing specific variables
 float waterLevel = 28.2;
@@ -119,6 +156,22 @@ void SendUniform(string name, double val1, double val2, double val3, bool basic,
 		TerrainProgram.SendUniform(name, val1, val2, val3);
 }
 
+// simulated particles: particle.vert with the fragment shader of a particle system
+bool initParticleProgram(C3dglProgram &program, C3dglShader &fragmentShader)
+{
+	C3dglShader ParticleVertexShader;
+	if (!ParticleVertexShader.Create(GL_VERTEX_SHADER)) return false;
+	if (!ParticleVertexShader.LoadFromFile("shaders/particle.vert")) return false;
+	if (!ParticleVertexShader.Compile()) return false;
+
+	if (!program.Create()) return false;
+	if (!program.Attach(ParticleVertexShader)) return false;
+	if (!program.Attach(fragmentShader)) return false;
+	if (!program.Link()) return false;
+	if (!program.Use(true)) return false;
+	return true;
+}
+
 bool initShaders()
 {
 	// Initialise Shaders
@@ -226,126 +279,239 @@ bool initShaders()
 	if (!SmokeProgram.Attach(SmokeParticleFragmentShader)) return false;
 	if (!SmokeProgram.Link()) return false;
 	if (!SmokeProgram.Use(true)) return false;
-}
 
-void prepareSnowBuffers()
-{
-	cout << "PREPARING SNOW PARTICLE BUFFERS - PLEASE WAIT" << endl;
-	// Prepare the particle buffers
-	std::vector<float> bufferVelocity;
-	std::vector<float> bufferStartTime;
-	std::vector<float> bufferInitialPos;
-	float time = 0;
-	for (int i = 0; i < NSNOWFLAKES; i++)
-	{
-		float v = 2.5 + 0.2f * (float)rand()/(float)RAND_MAX;
+	C3dglShader ParticleUpdateVertexShader;
+	C3dglShader ParticleUpdateGeometryShader;
 
-		bufferVelocity.push_back(-0.5 * v);
-		bufferVelocity.push_back(-v);
-		bufferVelocity.push_back(0.25 * v);  
-		bufferStartTime.push_back(time);
-		time += SNOWPERIOD;
+	// Initialise Shader - Simulated Particles (update pass)
+	if (!ParticleUpdateVertexShader.Create(GL_VERTEX_SHADER)) return false;
+	if (!ParticleUpdateVertexShader.LoadFromFile("shaders/particles.vert")) return false;
+	if (!ParticleUpdateVertexShader.Compile()) return false;
 
-		bufferInitialPos.push_back(-precipitationBoxSize + (precipitationBoxSize - -precipitationBoxSize) * (float)rand()/(float)RAND_MAX);
-		bufferInitialPos.push_back(100);
-		bufferInitialPos.push_back(-precipitationBoxSize + (precipitationBoxSize - -precipitationBoxSize) * (float)rand()/(float)RAND_MAX);
-	}
+	if (!ParticleUpdateGeometryShader.Create(GL_GEOMETRY_SHADER)) return false;
+	if (!ParticleUpdateGeometryShader.LoadFromFile("shaders/particles.geom")) return false;
+	if (!ParticleUpdateGeometryShader.Compile()) return false;
+
+	if (!ParticleUpdateProgram.Create()) return false;
+	if (!ParticleUpdateProgram.Attach(ParticleUpdateVertexShader)) return false;
+	if (!ParticleUpdateProgram.Attach(ParticleUpdateGeometryShader)) return false;
+	if (!ParticleUpdateProgram.Link("", "", C3dglParticles::getFeedbackVaryings())) return false;
+
+	// Initialise Shaders - Simulated Particles (rendering)
+	if (!initParticleProgram(GPUSnowProgram, SnowParticleFragmentShader)) return false;
+	if (!initParticleProgram(GPUFireProgram, FireParticleFragmentShader)) return false;
+	if (!initParticleProgram(GPUSmokeProgram, SmokeParticleFragmentShader)) return false;
 
-	glGenBuffers(1, &idBufferSnowInitialPos);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowInitialPos);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferInitialPos.size(), &bufferInitialPos[0], GL_STATIC_DRAW);
+	C3dglShader FullScreenVertexShader;
+	C3dglShader ParticleDepthFragmentShader;
+	C3dglShader ParticleCompositeFragmentShader;
 
-	glGenBuffers(1, &idBufferSnowVelocity);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowVelocity);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferVelocity.size(), &bufferVelocity[0], GL_STATIC_DRAW);
+	// Initialise Shaders - Reduced Resolution Particles (full screen passes)
+	if (!FullScreenVertexShader.Create(GL_VERTEX_SHADER)) return false;
+	if (!FullScreenVertexShader.LoadFromFile("shaders/fullscreen.vert")) return false;
+	if (!FullScreenVertexShader.Compile()) return false;
 
-	glGenBuffers(1, &idBufferSnowStartTime);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowStartTime);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferStartTime.size(), &bufferStartTime[0], GL_STATIC_DRAW);
+	if (!ParticleDepthFragmentShader.Create(GL_FRAGMENT_SHADER)) return false;
+	if (!ParticleDepthFragmentShader.LoadFromFile("shaders/particle_depth.frag")) return false;
+	if (!ParticleDepthFragmentShader.Compile()) return false;
 
+	if (!ParticleDepthProgram.Create()) return false;
+	if (!ParticleDepthProgram.Attach(FullScreenVertexShader)) return false;
+	if (!ParticleDepthProgram.Attach(ParticleDepthFragmentShader)) return false;
+	if (!ParticleDepthProgram.Link()) return false;
+
+	if (!ParticleCompositeFragmentShader.Create(GL_FRAGMENT_SHADER)) return false;
+	if (!ParticleCompositeFragmentShader.LoadFromFile("shaders/particle_composite.frag")) return false;
+	if (!ParticleCompositeFragmentShader.Compile()) return false;
+
+	if (!ParticleCompositeProgram.Create()) return false;
+	if (!ParticleCompositeProgram.Attach(FullScreenVertexShader)) return false;
+	if (!ParticleCompositeProgram.Attach(ParticleCompositeFragmentShader)) return false;
+	if (!ParticleCompositeProgram.Link()) return false;
+
+	return true;
+}
+
+void prepareSnowParticles()
+{
 	// Setup the particle system
 	SnowProgram.SendUniform("gravity",	 0.0, 0.0, 0.0);
 	SnowProgram.SendUniform("particleLifetime", SNOWLIFETIME);
+	SnowProgram.SendUniform("particlePeriod", SNOWPERIOD);
+	SnowProgram.SendUniform("randomSeed", (GLuint)rand());
+	SnowProgram.SendUniform("tileSize", SNOWTILESIZE);
 }
 
-void prepareFireBuffers()
+void prepareFireParticles()
 {
-	cout << "PREPARING FIRE PARTICLE BUFFERS - PLEASE WAIT" << endl;
-	// Prepare the particle buffers
-	std::vector<float> bufferVelocity;
-	std::vector<float> bufferStartTime;
-	std::vector<float> bufferInitialPos;
-	float time = 0;
-	for (int i = 0; i < NFIREP; i++)
-	{
-		float v = 0.1 + 0.4f * (float)rand()/(float)RAND_MAX;
-
-		bufferVelocity.push_back(0);
-		bufferVelocity.push_back(v);
-		bufferVelocity.push_back(0);
+	// Setup the particle system
+	FireProgram.SendUniform("initialPos", FIREPOS[0], FIREPOS[1], FIREPOS[2]);
+	FireProgram.SendUniform("initialPosRange", FIREPOSRANGE[0], FIREPOSRANGE[1], FIREPOSRANGE[2]);
+	FireProgram.SendUniform("gravity", FIREGRAVITY[0], FIREGRAVITY[1], FIREGRAVITY[2]);
+	FireProgram.SendUniform("particleLifetime", FIRELIFETIME);
+	FireProgram.SendUniform("particlePeriod", FIREPERIOD);
+	fireSeed = (GLuint)rand();
+	FireProgram.SendUniform("randomSeed", fireSeed);
+	fireSort.setSortInterval(SORTINTERVAL);
+}
 
-		bufferStartTime.push_back(time);
-		time += FIREPERIOD;
+void prepareSmokeParticles()
+{
+	// Setup the particle system
+	SmokeProgram.SendUniform("initialPos", SMOKEPOS[0], SMOKEPOS[1], SMOKEPOS[2]);
+	SmokeProgram.SendUniform("gravity", SMOKEGRAVITY[0], SMOKEGRAVITY[1], SMOKEGRAVITY[2]);
+	SmokeProgram.SendUniform("particleLifetime", SMOKELIFETIME);
+	SmokeProgram.SendUniform("particlePeriod", SMOKEPERIOD);
+	smokeSeed = (GLuint)rand();
+	SmokeProgram.SendUniform("randomSeed", smokeSeed);
+	smokeSort.setSortInterval(SORTINTERVAL);
+}
 
-		float fireMinX = 17; float fireMaxX = 17.3; float fireMinZ = -17.5; float FireMaxZ = -17.2;
+void prepareSimulatedParticles()
+{
+	C3dglParticles::EMITTER emitter;
+
+	// snow: emitted over the camera (see updateParticles) while it is snowing, melts on the ground
+	emitter.fRate = SNOWRATE;
+	emitter.size[0] = emitter.size[2] = SNOWTILESIZE; emitter.size[1] = 2;
+	emitter.dir[0] = -0.5; emitter.dir[1] = -1; emitter.dir[2] = 0.25;
+	emitter.fMinSpeed = 2.5f * 1.1456f; emitter.fMaxSpeed = 2.7f * 1.1456f;		// the length of dir
+	emitter.fMinLifetime = emitter.fMaxLifetime = 10;
+	snowParticles.create(&ParticleUpdateProgram, emitter);
+	snowParticles.setCollision(&terrain, C3dglParticles::COLLISION_KILL);
+	snowParticles.setRate(0);
+	cpuSnowParticles.create(emitter);
+	cpuSnowParticles.setCollision(&terrain, C3dglParticles::COLLISION_KILL);
+	cpuSnowParticles.setRate(0);
+	GPUSnowProgram.SendUniform("pointSize", 10.0, 5.0, 10.0, 5.0);
+
+	// fire: the same emitter as the closed-form fire (the acceleration is twice its "gravity": p = p0 + vt + gt^2)
+	emitter = C3dglParticles::EMITTER();
+	emitter.fRate = 1 / FIREPERIOD;
+	emitter.pos[0] = FIREPOS[0]; emitter.pos[1] = FIREPOS[1]; emitter.pos[2] = FIREPOS[2];
+	emitter.size[0] = FIREPOSRANGE[0]; emitter.size[1] = FIREPOSRANGE[1]; emitter.size[2] = FIREPOSRANGE[2];
+	emitter.fMinSpeed = 0.1f; emitter.fMaxSpeed = 0.5f;
+	emitter.fMinLifetime = emitter.fMaxLifetime = FIRELIFETIME;
+	fireParticles.create(&ParticleUpdateProgram, emitter);
+	fireParticles.setGravity(2 * FIREGRAVITY[0], 2 * FIREGRAVITY[1], 2 * FIREGRAVITY[2]);
+	cpuFireParticles.create(emitter);
+	cpuFireParticles.setGravity(2 * FIREGRAVITY[0], 2 * FIREGRAVITY[1], 2 * FIREGRAVITY[2]);
+	GPUFireProgram.SendUniform("pointSize", 100.0, 50.0, 100.0, 50.0);
+
+	// smoke: drifts with the wind, and slides along the hills
+	emitter = C3dglParticles::EMITTER();
+	emitter.fRate = 1 / SMOKEPERIOD;
+	emitter.pos[0] = SMOKEPOS[0]; emitter.pos[1] = SMOKEPOS[1]; emitter.pos[2] = SMOKEPOS[2];
+	emitter.fSpread = (float)M_PI / 1.5f;
+	emitter.fMinSpeed = 0.1f; emitter.fMaxSpeed = 0.2f;
+	emitter.fMinLifetime = emitter.fMaxLifetime = SMOKELIFETIME;
+	smokeParticles.create(&ParticleUpdateProgram, emitter);
+	smokeParticles.setGravity(0, 0.2f, 0);
+	smokeParticles.setWind(-0.3f, 0, 0.3f, 0.1f);
+	smokeParticles.setCollision(&terrain, C3dglParticles::COLLISION_SLIDE);
+	cpuSmokeParticles.create(emitter);
+	cpuSmokeParticles.setGravity(0, 0.2f, 0);
+	cpuSmokeParticles.setWind(-0.3f, 0, 0.3f, 0.1f);
+	cpuSmokeParticles.setCollision(&terrain, C3dglParticles::COLLISION_SLIDE);
+	GPUSmokeProgram.SendUniform("pointSize", 20.0, 10.0, 1000.0, 500.0);
+}
 
-		bufferInitialPos.push_back(fireMinX + (fireMaxX - fireMinX) * (float)rand()/(float)RAND_MAX);
-		bufferInitialPos.push_back(29.72f);
-		bufferInitialPos.push_back(fireMinZ + (FireMaxZ - fireMinZ) * (float)rand()/(float)RAND_MAX);
+// advances the simulated particles - once per frame; the snow is emitted over the camera
+void updateParticles(float cameraPos[3])
+{
+	float t = glutGet(GLUT_ELAPSED_TIME) / 1000.f;
+	float dt = min(t - lastParticleTime, 0.1f);
+	lastParticleTime = t;
+	if (particleMode == PARTICLES_CLOSED_FORM)
+		return;
+
+	C3dglParticles::EMITTER &emitter = particleMode == PARTICLES_GPU ? snowParticles.getEmitter() : cpuSnowParticles.getEmitter();
+	emitter.pos[0] = cameraPos[0] - SNOWTILESIZE / 2;
+	emitter.pos[1] = cameraPos[1] + SNOWTILESIZE / 2;
+	emitter.pos[2] = cameraPos[2] - SNOWTILESIZE / 2;
+	emitter.fRate = isSnowing ? SNOWRATE : 0;
+
+	if (particleMode == PARTICLES_GPU)
+	{
+		snowParticles.update(dt);
+		fireParticles.update(dt);
+		smokeParticles.update(dt);
 	}
+	else
+	{
+		cpuSnowParticles.update(dt);
+		cpuFireParticles.update(dt);
+		cpuSmokeParticles.update(dt);
+	}
+}
 
-	glGenBuffers(1, &idBufferFireInitialPos);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireInitialPos);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferInitialPos.size(), &bufferInitialPos[0], GL_STATIC_DRAW);
-
-	glGenBuffers(1, &idBufferFireVelocity);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireVelocity);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferVelocity.size(), &bufferVelocity[0], GL_STATIC_DRAW);
-
-	glGenBuffers(1, &idBufferFireStartTime);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireStartTime);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferStartTime.size(), &bufferStartTime[0], GL_STATIC_DRAW);
-
-	// Setup the particle system
-	FireProgram.SendUniform("gravity", -0.05, 0.1, 0.05);
-	FireProgram.SendUniform("particleLifetime", FIRELIFETIME);
+// Random number in [0, 1) - the attribute i of the closed-form particle n (as in the particle shaders)
+GLuint particleHash(GLuint x)
+{
+	x ^= x >> 16; x *= 0x7feb352d;
+	x ^= x >> 15; x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+float particleRandom(GLuint n, GLuint seed, GLuint i)
+{
+	return (particleHash(particleHash(n + seed) + i) >> 8) / 16777216.0f;
 }
 
-void prepareSmokeBuffers()
+// sorts the closed-form fire or smoke back to front - the positions at the time t, as in fire.vert and smoke.vert
+void sortClosedFormParticles(C3dglParticleSort &sorter, bool isSmoke, float time, float matrix[16])
 {
-	cout << "PREPARING SMOKE PARTICLE BUFFERS - PLEASE WAIT" << endl;
-	// Prepare the particle buffers
-	std::vector<float> bufferVelocity;
-	std::vector<float> bufferStartTime;
-	float time = 0;
-	for (int i = 0; i < NSMOKEP; i++)
+	int n = isSmoke ? NSMOKEP : NFIREP;
+	GLuint seed = isSmoke ? smokeSeed : fireSeed;
+	float period = isSmoke ? SMOKEPERIOD : FIREPERIOD;
+	float lifetime = isSmoke ? SMOKELIFETIME : FIRELIFETIME;
+	sortX.resize(n); sortY.resize(n); sortZ.resize(n);
+	for (int i = 0; i < n; i++)
 	{
-		float theta = (float)M_PI / 1.5f * (float)rand()/(float)RAND_MAX;
-		float phi = (float)M_PI * 2.f * (float)rand()/(float)RAND_MAX;
-		float x = sin(theta) * cos(phi);
-		float y = cos(theta);
-		float z = sin(theta) * sin(phi);
-		float v = 0.1 + 0.1f * (float)rand()/(float)RAND_MAX;
-
-		bufferVelocity.push_back(x * v);
-		bufferVelocity.push_back(y * v);
-		bufferVelocity.push_back(z * v);
-
-		bufferStartTime.push_back(time);
-		time += SMOKEPERIOD;
+		float t = time - i * period;
+		t -= lifetime * floor(t / lifetime);
+		if (isSmoke)
+		{
+			float theta = (float)M_PI / 1.5f * particleRandom(i, seed, 0);
+			float phi = 2 * (float)M_PI * particleRandom(i, seed, 1);
+			float v = 0.1f + 0.1f * particleRandom(i, seed, 2);
+			sortX[i] = SMOKEPOS[0] + v * sin(theta) * cos(phi) * t + SMOKEGRAVITY[0] * t * t;
+			sortY[i] = SMOKEPOS[1] + v * cos(theta) * t + SMOKEGRAVITY[1] * t * t;
+			sortZ[i] = SMOKEPOS[2] + v * sin(theta) * sin(phi) * t + SMOKEGRAVITY[2] * t * t;
+		}
+		else
+		{
+			sortX[i] = FIREPOS[0] + FIREPOSRANGE[0] * particleRandom(i, seed, 0) + FIREGRAVITY[0] * t * t;
+			sortY[i] = FIREPOS[1] + FIREPOSRANGE[1] * particleRandom(i, seed, 1) + (0.1f + 0.4f * particleRandom(i, seed, 3)) * t + FIREGRAVITY[1] * t * t;
+			sortZ[i] = FIREPOS[2] + FIREPOSRANGE[2] * particleRandom(i, seed, 2) + FIREGRAVITY[2] * t * t;
+		}
 	}
-	glGenBuffers(1, &idBufferVelocity);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferVelocity);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferVelocity.size(), &bufferVelocity[0], GL_STATIC_DRAW);
-
-	glGenBuffers(1, &idBufferStartTime);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferStartTime);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(float) * bufferStartTime.size(), &bufferStartTime[0], GL_STATIC_DRAW);
+	sorter.sort(&sortX[0], &sortY[0], &sortZ[0], n, matrix, true);
+}
 
-	// Setup the particle system
-	SmokeProgram.SendUniform("initialPos",  17.15, 29.9, -17.35);
-	SmokeProgram.SendUniform("gravity",	 -0.01, 0.1, 0.01);
-	SmokeProgram.SendUniform("particleLifetime", SMOKELIFETIME);
+// renders simulated particles with the current model-view matrix - those of the current particle mode;
+// the CPU particles are drawn back to front if pSort is given and the sorting is on
+void renderSimulatedParticles(C3dglProgram &program, C3dglParticles &particles, C3dglCPUParticles &cpuParticles, GLuint idTex, C3dglParticleSort *pSort = NULL)
+{
+	float matrix[16];
+	program.Use();
+	glDepthMask(GL_FALSE);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, idTex);
+	glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+	program.SendUniform("matrixModelView", matrix);
+	if (particleMode == PARTICLES_GPU)
+		particles.render();
+	else if (pSort && isParticleSorting)
+	{
+		// the particles change from frame to frame (compacted) - always the full sort
+		const C3dglCPUParticles::SOA &s = cpuParticles.getParticles();
+		pSort->sort(&s.px[0], &s.py[0], &s.pz[0], cpuParticles.getLiveCount(), matrix, false);
+		cpuParticles.render(pSort->getIndexBuffer());
+	}
+	else
+		cpuParticles.render();
+	glDepthMask(GL_TRUE);
 }
 
 // called before window opened or resized - to setup the Projection Matrix
@@ -368,12 +534,26 @@ void reshape(int w, int h)
 	SnowProgram.SendUniform("matrixProjection", matrix);
 	FireProgram.SendUniform("matrixProjection", matrix);
 	SmokeProgram.SendUniform("matrixProjection", matrix);
+	GPUSnowProgram.SendUniform("matrixProjection", matrix);
+	GPUFireProgram.SendUniform("matrixProjection", matrix);
+	GPUSmokeProgram.SendUniform("matrixProjection", matrix);
 }
 
-void renderObjects()
+// the point sizes of all the particle programs - scaled down for the reduced resolution particles
+void setParticlePointScale(float scale)
 {
-	float matrix[16];
+	SnowProgram.SendUniform("pointScale", scale);
+	FireProgram.SendUniform("pointScale", scale);
+	SmokeProgram.SendUniform("pointScale", scale);
+	GPUSnowProgram.SendUniform("pointScale", scale);
+	GPUFireProgram.SendUniform("pointScale", scale);
+	GPUSmokeProgram.SendUniform("pointScale", scale);
+}
 
+void renderParticles();
+
+void renderObjects(bool bParticles = true)
+{
 	Program.Use();
 
 	SendUniform("materialAmbient", 1.0, 1.0, 1.0, true, false, true);
@@ -395,10 +575,53 @@ void renderObjects()
 	float modelviewMatrix[16];
 	glGetFloatv(GL_MODELVIEW_MATRIX, modelviewMatrix);
 	TerrainProgram.SendUniform("matrixModelView", modelviewMatrix);
-	terrain.render();
+	if (isTerrainLOD)
+		terrain.renderLOD();
+	else
+		terrain.render();
 	glPopMatrix();
 
+	// render the trees and rocks in the cells visible in the terrain render - one instanced draw call per mesh
+	Program.Use();
+	scatter.render();
+
 	if(isSnowing == true)
+	{
+		if(snowOpacity < 1)
+		{
+			//Handles layering snow over the grass when it's snowing
+			snowOpacity += (float)((currentTime - transitionTime) / 10.f);
+			transitionTime = currentTime;
+		}
+	}
+	else
+	{
+		if(snowOpacity > 0)
+		{
+			//Handles fading away the snow over the grass when it's not snowing
+			snowOpacity -= (float)((currentTime - transitionTime) / 10.f);
+			transitionTime = currentTime;
+		}
+	}
+
+	//Sends snow opacity to shader
+	TerrainProgram.SendUniform("snowOpacity", snowOpacity);
+
+	// the particles - unless they are rendered later, at a reduced resolution
+	if (bParticles)
+		renderParticles();
+}
+
+// renders the particles: snow, smoke and fire
+void renderParticles()
+{
+	float matrix[16];
+
+	// simulated snow - still falling for a while once it stops snowing
+	if (particleMode != PARTICLES_CLOSED_FORM)
+		renderSimulatedParticles(GPUSnowProgram, snowParticles, cpuSnowParticles, idTexSnowParticle);
+
+	if(isSnowing == true && particleMode == PARTICLES_CLOSED_FORM)
 	{
 		/////////////////////////////////////
 		// RENDER THE SNOW PARTICLE SYSTEM //
@@ -417,22 +640,14 @@ void renderObjects()
 		glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
 		SnowProgram.SendUniform("matrixModelView", matrix);
 
+		// the snow tile is wrapped around the camera
+		gluInvertMatrix(matrix, matrix);
+		SnowProgram.SendUniform("cameraPos", matrix[12], matrix[13], matrix[14]);
+
 		SnowProgram.SendUniform("time", glutGet(GLUT_ELAPSED_TIME) / 1000.f - 2);
 
-		// render the buffer
-		glEnableVertexAttribArray(0);	// initial position
-		glEnableVertexAttribArray(1);	// velocity
-		glEnableVertexAttribArray(2);	// start time
-		glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowInitialPos);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowVelocity);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-		glBindBuffer(GL_ARRAY_BUFFER, idBufferSnowStartTime);
-		glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
+		// render the particles - no vertex attributes
 		glDrawArrays(GL_POINTS, 0, NSNOWFLAKES);
-		glDisableVertexAttribArray(0);
-		glDisableVertexAttribArray(1);
-		glDisableVertexAttribArray(2);
 
 		// revert to normal
 		glDepthMask(GL_TRUE);
@@ -440,55 +655,40 @@ void renderObjects()
 		///////////////////////////////////////////
 		// END OF SNOW PARTICLE SYSTEM RENDERING //
 		///////////////////////////////////////////
-
-		if(snowOpacity < 1)
-		{
-			//Handles layering snow over the grass when it's snowing
-			snowOpacity += (float)((currentTime - transitionTime) / 10.f);
-			transitionTime = currentTime;
-		}
-	}
-	else
-	{
-		if(snowOpacity > 0)
-		{
-			//Handles fading away the snow over the grass when it's not snowing
-			snowOpacity -= (float)((currentTime - transitionTime) / 10.f);
-			transitionTime = currentTime;
-		}
 	}
 
-	//Sends snow opacity to shader
-	TerrainProgram.SendUniform("snowOpacity", snowOpacity);
-
 	//////////////////////////////////////
 	// RENDER THE SMOKE PARTICLE SYSTEM //
 	//////////////////////////////////////
 
-	SmokeProgram.Use();
-	glDepthMask(GL_FALSE);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, idTexSmokeParticle);
+	if (terrain.isObjectVisible(idSmokeObject) && particleMode != PARTICLES_CLOSED_FORM)
+		renderSimulatedParticles(GPUSmokeProgram, smokeParticles, cpuSmokeParticles, idTexSmokeParticle, &smokeSort);
+	else if (terrain.isObjectVisible(idSmokeObject))
+	{
+		SmokeProgram.Use();
+		glDepthMask(GL_FALSE);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, idTexSmokeParticle);
+
+		glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+		SmokeProgram.SendUniform("matrixModelView", matrix);
+
+		float time = glutGet(GLUT_ELAPSED_TIME) / 1000.f - 2;
+		SmokeProgram.SendUniform("time", time);
+
+		// render the particles - no vertex attributes
+		if (isParticleSorting)
+		{
+			sortClosedFormParticles(smokeSort, true, time, matrix);
+			smokeSort.render();
+		}
+		else
+			glDrawArrays(GL_POINTS, 0, NSMOKEP);
+
+		// revert to normal
+		glDepthMask(GL_TRUE);
+	}
 
-	glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
-	SmokeProgram.SendUniform("matrixModelView", matrix);
-
-	SmokeProgram.SendUniform("time", glutGet(GLUT_ELAPSED_TIME) / 1000.f - 2);
-
-	// render the buffer
-	glEnableVertexAttribArray(0);	// velocity
-	glEnableVertexAttribArray(1);	// start time
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferVelocity);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferStartTime);
-	glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, 0);
-	glDrawArrays(GL_POINTS, 0, NSMOKEP);
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-
-	// revert to normal
-	glDepthMask(GL_TRUE);
-	 
 	////////////////////////////////////////////
 	// END OF SMOKE PARTICLE SYSTEM RENDERING //
 	////////////////////////////////////////////
@@ -497,33 +697,33 @@ void renderObjects()
 	// RENDER THE FIRE PARTICLE SYSTEM //
 	/////////////////////////////////////
 
-	FireProgram.Use();
-	glDepthMask(GL_FALSE);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, idTexFireParticle);
+	if (terrain.isObjectVisible(idFireObject) && particleMode != PARTICLES_CLOSED_FORM)
+		renderSimulatedParticles(GPUFireProgram, fireParticles, cpuFireParticles, idTexFireParticle, &fireSort);
+	else if (terrain.isObjectVisible(idFireObject))
+	{
+		FireProgram.Use();
+		glDepthMask(GL_FALSE);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, idTexFireParticle);
 
-	glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
-	FireProgram.SendUniform("matrixModelView", matrix);
-
-	FireProgram.SendUniform("time", glutGet(GLUT_ELAPSED_TIME) / 1000.f - 2);
-
-	// render the buffer
-	glEnableVertexAttribArray(0);	// initial position
-	glEnableVertexAttribArray(1);	// velocity
-	glEnableVertexAttribArray(2);	// start time
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireInitialPos);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireVelocity);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, idBufferFireStartTime);
-	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, 0, 0);
-	glDrawArrays(GL_POINTS, 0, NFIREP);
-	glDisableVertexAttribArray(0);
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(2);
-
-	// revert to normal
-	glDepthMask(GL_TRUE);
+		glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+		FireProgram.SendUniform("matrixModelView", matrix);
+
+		float time = glutGet(GLUT_ELAPSED_TIME) / 1000.f - 2;
+		FireProgram.SendUniform("time", time);
+
+		// render the particles - no vertex attributes
+		if (isParticleSorting)
+		{
+			sortClosedFormParticles(fireSort, false, time, matrix);
+			fireSort.render();
+		}
+		else
+			glDrawArrays(GL_POINTS, 0, NFIREP);
+
+		// revert to normal
+		glDepthMask(GL_TRUE);
+	}
 
 	///////////////////////////////////////////
 	// END OF FIRE PARTICLE SYSTEM RENDERING //
@@ -609,17 +809,63 @@ bool init()
 	if (!initShaders()) return false;
 
 	// load your 3D models here!
+	terrain.setCompactVertices(true);	// decoded by terrain.vert
+	terrain.setQuantisedHeights(true);	// 16-bit heights in memory
+	terrain.setIndexOrder(C3dglTerrain::ORDER_OPTIMISED);
+	terrain.setDecimation(0.5f);		// flat areas with fewer triangles, lit by the normal map
+	water.setIndexOrder(C3dglTerrain::ORDER_OPTIMISED);
+	terrain.setMeshCache(true);
+	water.setMeshCache(true);
 	if (!terrain.loadHeightmap("models\\heightmap.bmp", 80)) return false;
 	if (!water.loadHeightmap("models\\watermap.bmp", 10)) return false;
+	terrain.setHorizonCulling(true);
+	terrain.bakeLightMap(sunDirection);		// ambient occlusion and sun shadows
+	float fireMin[3] = { 16.0f, 29.5f, -18.5f }, fireMax[3] = { 18.5f, 32.0f, -16.0f };
+	float smokeMin[3] = { 11.5f, 28.0f, -21.0f }, smokeMax[3] = { 21.0f, 56.0f, -11.5f };
+	idFireObject = terrain.addObject(fireMin, fireMax);
+	idSmokeObject = terrain.addObject(smokeMin, smokeMax);
+
+	// scatter the trees and rocks - the density mask has the trees in red and the rocks in green, clear around the camp fire
+	Program.Use();	// the models are loaded with the attribute locations of the basic shader
+	if (!tree.load("models\\tree.obj")) return false;
+	tree.loadMaterials("models\\");
+	if (!rock.load("models\\rock.obj")) return false;
+	rock.loadMaterials("models\\");
+	C3dglScatter::RULES treeRules, rockRules;
+	treeRules.fDensity = 60;
+	treeRules.fMinHeight = waterLevel + 1;
+	treeRules.fMaxHeight = snowLevel;
+	treeRules.fMaxSlope = 0.6f;
+	treeRules.fMinScale = 0.6f;
+	treeRules.fMaxScale = 1.4f;
+	treeRules.fSink = 0.3f;
+	treeRules.nMaskChannel = 0;
+	rockRules.fDensity = 12;
+	rockRules.fMinHeight = waterLevel - 1;
+	rockRules.fMaxSlope = 1.5f;
+	rockRules.fMinScale = 0.4f;
+	rockRules.fMaxScale = 2.0f;
+	rockRules.fSink = 0.15f;
+	rockRules.bAlign = true;
+	rockRules.nMaskChannel = 1;
+	scatter.addType(&tree, treeRules);
+	scatter.addType(&rock, rockRules);
+	scatter.loadDensityMask("models\\scattermask.bmp");
+	scatter.scatter(&terrain);
 
 	//Load Skybox
 	if (!skybox.load("models\\Skybox\\snowy_s1.bmp", "models\\Skybox\\snowy_s2.bmp", "models\\Skybox\\snowy_s3.bmp",
 		"models\\Skybox\\snowy_s4.bmp", "models\\Skybox\\snowy_s6.bmp", "models\\Skybox\\snowy_s5.bmp")) return false;
 
-	//Prepare Particle Buffers
-	prepareSnowBuffers();
-	prepareFireBuffers();
-	prepareSmokeBuffers();
+	//Prepare Particle Systems
+	prepareSnowParticles();
+	prepareFireParticles();
+	prepareSmokeParticles();
+	prepareSimulatedParticles();
+
+	// reduced resolution particles - the clipping planes as in reshape
+	particlePass.setClipPlanes(0.02f, 1000.0f);
+	if (!particlePass.create(&ParticleDepthProgram, &ParticleCompositeProgram, 2)) return false;
 
 	// create & load textures
 	C3dglBitmap bm;
@@ -680,6 +926,9 @@ bool init()
 	SnowProgram.SendUniform("texture0", 0);
 	FireProgram.SendUniform("texture0", 0);
 	SmokeProgram.SendUniform("texture0", 0);
+	GPUSnowProgram.SendUniform("texture0", 0);
+	GPUFireProgram.SendUniform("texture0", 0);
+	GPUSmokeProgram.SendUniform("texture0", 0);
 
 	// setup lights:
 	SendUniform("lightAmbient.on", 1, true, false, true); 
@@ -688,7 +937,7 @@ bool init()
 	SendUniform("lightEmissive.color", 1.0, 1.0, 1.0, true, false, true);
 
 	SendUniform("lightDir.on", 1, true, false, true);	
-	SendUniform("lightDir.direction", 1.0, 0.5, 0.5, true, false, true);	
+	SendUniform("lightDir.direction", sunDirection[0], sunDirection[1], sunDirection[2], true, false, true);	
 	SendUniform("lightDir.diffuse", 0.2, 0.2, 0.2, true, false, true);	
 
 	SendUniform("lightPoint1.on", 1, true, false, true);	
@@ -759,6 +1008,13 @@ bool init()
 	cout << "  WASD or arrow key to navigate" << endl;
 	cout << "  Space/Shift+space to set the camera height over the ground" << endl;
 	cout << "  Use the mouse with the left button down to look around" << endl;
+	cout << "  L to toggle the terrain level of detail" << endl;
+	cout << "  P to switch the particles: closed-form, simulated on the GPU, simulated on the CPU" << endl;
+	cout << "  O to toggle drawing the smoke and fire back to front" << endl;
+	cout << "  R to toggle rendering the particles at a reduced resolution" << endl;
+	cout << "  F to switch the reduced resolution: a half or a quarter" << endl;
+	cout << "  [ / ] to turn the sun" << endl;
+	cout << "  I to print the rendering statistics" << endl;
 	cout << endl;
 
 	currentFlickerTime = glutGet(GLUT_ELAPSED_TIME) / 1000.f;
@@ -822,11 +1078,14 @@ void render()
 	gluInvertMatrix(matrix, matrix);
 	WaterProgram.SendUniform("matrixInvertedView", matrix);
 
+	// advance the simulated particles - the camera position is the translation of the inverted view matrix
+	updateParticles(matrix + 12);
+
 	glActiveTexture(GL_TEXTURE0);
 	WaterProgram.SendUniform("reflectionPower", 0.0);
 
 	//Render non reflective objects
-	renderObjects();
+	renderObjects(!isReducedParticles);
 
 	WaterProgram.Use();
 
@@ -850,6 +1109,17 @@ void render()
 	WaterProgram.SendUniform("reflectionPower", 0.0);
 	glBindTexture(GL_TEXTURE_2D, idTexNone);
 
+	// the particles at a reduced resolution - over the water, too
+	if (isReducedParticles && particlePass.begin())
+	{
+		setParticlePointScale(particlePass.getPointScale());
+		renderParticles();
+		setParticlePointScale(1);
+		particlePass.end();
+	}
+	else if (isReducedParticles)
+		renderParticles();
+
 	Program.Use();
 
 	// essential for double-buffering technique
@@ -883,6 +1153,51 @@ void onKeyDown(unsigned char key, int x, int y)
 				  break;
 			  }
 			  break;
+	case 'p': {
+				  static const char *names[] = { "closed-form", "simulated on the GPU", "simulated on the CPU" };
+				  particleMode = (particleMode + 1) % 3;
+				  cout << "Particles " << names[particleMode] << endl;
+				  break;
+			  }
+	case 'o': isParticleSorting = !isParticleSorting;
+			  cout << "Particle sorting " << (isParticleSorting ? "on" : "off") << endl;
+			  break;
+	case 'r': isReducedParticles = !isReducedParticles;
+			  cout << "Reduced resolution particles " << (isReducedParticles ? "on" : "off") << endl;
+			  break;
+	case 'f': particlePass.setFactor(particlePass.getFactor() == 2 ? 4 : 2);
+			  cout << "Reduced resolution particles at 1/" << particlePass.getFactor() << " of the screen size" << endl;
+			  break;
+	case 'l': isTerrainLOD = !isTerrainLOD;
+			  cout << "Terrain LOD " << (isTerrainLOD ? "on" : "off") << endl;
+			  break;
+	case 'i': cout << "Trees and rocks: " << scatter.getDrawCallCount() << " draw calls, " << scatter.getRenderedInstanceCount() << " of "
+				   << scatter.getInstanceCount() << " instances in " << scatter.getVisibleCellCount() << " of " << scatter.getCellCount() << " cells" << endl;
+			  if (particleMode == PARTICLES_CPU)
+			  {
+				  C3dglCPUParticles *systems[] = { &cpuSnowParticles, &cpuFireParticles, &cpuSmokeParticles };
+				  for (C3dglCPUParticles *p : systems)
+					  cout << "CPU particles: " << p->getLiveCount() << " live, updated in " << p->getUpdateTime() << " ms, "
+						   << p->getThroughput() << " particles per ms per thread" << endl;
+			  }
+			  if (isParticleSorting)
+				  cout << "Particle sorting: smoke " << smokeSort.getCount() << " in " << smokeSort.getSortTime() << " ms, fire "
+					   << fireSort.getCount() << " in " << fireSort.getSortTime() << " ms" << endl;
+			  if (isReducedParticles)
+				  cout << "Reduced resolution particles: " << particlePass.getWidth() << "x" << particlePass.getHeight() << ", "
+					   << particlePass.getMemorySize() / 1024 << " KB of targets" << endl;
+			  break;
+	case '[':
+	case ']': {
+				  //Turn the sun by 15 degrees - the terrain re-bakes its sun light over the next frames
+				  float a = (key == '[' ? -15 : 15) * (float)M_PI / 180;
+				  float x = sunDirection[0] * cos(a) - sunDirection[2] * sin(a);
+				  sunDirection[2] = sunDirection[0] * sin(a) + sunDirection[2] * cos(a);
+				  sunDirection[0] = x;
+				  terrain.setSunDirection(sunDirection);
+				  SendUniform("lightDir.direction", sunDirection[0], sunDirection[1], sunDirection[2], true, false, true);
+			  }
+			  break;
 	case ' ': if ((glutGetModifiers() & GLUT_ACTIVE_SHIFT) == 0)
 				  deltaY = -0.02; 
 			  else
@@ -977,6 +1292,8 @@ void onMotion(int x, int y)
 	glGetFloatv(GL_MODELVIEW_MATRIX, matrixView);
 }
 
+int runBenchmark(const char *name);		// returns the exit code
+
 int main(int argc, char **argv)
 {
 	// init GLUT and create Window
@@ -1000,6 +1317,10 @@ int main(int argc, char **argv)
 	cout << "Renderer: " << glGetString(GL_RENDERER) << endl;
 	cout << "Version: " << glGetString(GL_VERSION) << endl;
 
+	// benchmarks (see benchmark.cpp)
+	if (argc > 2 && strcmp(argv[1], "-bench") == 0)
+		return runBenchmark(argv[2]);
+
 	// init light and everything  not a GLUT or callback function!
 	if (!init())
 	{
@@ -14,9 +14,14 @@ uniform float shininess;
 //Uniform: Fog Density
 uniform float fogDensity;
 
+//Uniforms: Instancing (see C3dglModel::renderInstanced)
+uniform int instancing = 0;		//1 if the model is rendered with the per-instance transforms
+uniform mat4 matrixNode;		//transform of the model node, applied before the instance transform
+
 layout (location = 0) in vec3 aVertex;
 layout (location = 2) in vec3 aNormal;
 layout (location = 3) in vec2 aTexCoord;
+in mat4 aInstance;				//per-instance transform, in the model coordinates (the model-view matrix is the view)
 
 out vec4 color;
 out vec4 position;
@@ -75,12 +80,17 @@ vec4 DirectionalLight(DIRECTIONAL light)
 
 void main(void) 
 {
+	// instancing: the model-view matrix combined with the instance and the node transforms
+	mat4 matrix = matrixModelView;
+	if (instancing == 1)
+		matrix = matrixModelView * aInstance * matrixNode;
+
 	// calculate position
-	position = matrixModelView * vec4(aVertex, 1.0);
+	position = matrix * vec4(aVertex, 1.0);
 	gl_Position = matrixProjection * position;
 
 	// calculate normal
-	normal = normalize(mat3(matrixModelView) * aNormal);
+	normal = normalize(mat3(matrix) * aNormal);
 
 	// calculate texture coordinate
 	texCoord0 = aTexCoord;
@@ -6,27 +6,46 @@ uniform mat4 matrixView;
 uniform mat4 matrixModelView;
 
 // Particle-specific Uniforms
+uniform vec3 initialPos = vec3(0, 0, 0);		// Initial Position (corner of the fire area)
+uniform vec3 initialPosRange = vec3(0, 0, 0);	// Size of the fire area
 uniform vec3 gravity = vec3(0.0, -0.05, 0.0);	// Gravity Acceleration in world coords
 uniform float particleLifetime;					// Max Particle Lifetime
+uniform float particlePeriod;					// Emission period - the "birth" time of a particle is gl_VertexID * particlePeriod
+uniform uint randomSeed;						// Seed of the particle attributes
 uniform float time;								// Animation Time
-
-// Special Vertex Attributes
-layout (location = 0) in vec3 aInitialPos;		// Initial Position
-layout (location = 1) in vec3 aVelocity;		// Particle initial velocity
-layout (location = 2) in float aStartTime;		// Particle "birth" time
+uniform float pointScale = 1;					// Point size scale - less in a reduced resolution pass (see C3dglOffscreenParticles)
 
 // Output Variable (sent to Fragment Shader)
 out float age;									// age of the particle (0..1)
 
+// Random number in [0, 1) - the attribute i of the particle gl_VertexID
+// (no vertex attributes: every particle is regenerated from its index)
+uint hash(uint x)
+{
+	x ^= x >> 16; x *= 0x7feb352du;
+	x ^= x >> 15; x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+float random(uint i)
+{
+	return float(hash(hash(uint(gl_VertexID) + randomSeed) + i) >> 8) / 16777216.0;
+}
+
 void main()
 {
-	float t = mod(time - aStartTime, particleLifetime);
-	vec3 pos = aInitialPos + aVelocity * t + gravity * t * t; 
+	// particle attributes
+	vec3 pos0 = initialPos + initialPosRange * vec3(random(0u), random(1u), random(2u));
+	vec3 velocity = vec3(0, 0.1 + 0.4 * random(3u), 0);
+	float startTime = gl_VertexID * particlePeriod;
+
+	float t = mod(time - startTime, particleLifetime);
+	vec3 pos = pos0 + velocity * t + gravity * t * t; 
 	age = t / particleLifetime;
 
 	// calculate position (normal calculation not applicable here)
 	vec4 position = matrixModelView * vec4(pos, 1.0);
 	gl_Position = matrixProjection * position;
 
-	gl_PointSize = clamp(100 / length(position), 1,50);
+	gl_PointSize = clamp(100 / length(position), 1,50) * pointScale;
 }
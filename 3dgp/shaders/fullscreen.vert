@@ -0,0 +1,12 @@
+#version 330
+
+// Full screen triangle - no vertex attributes: draw 3 vertices (see C3dglOffscreenParticles)
+
+// Output Variable (sent to Fragment Shader)
+out vec2 texCoord;								// 0..1 over the screen
+
+void main()
+{
+	texCoord = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(texCoord * 2 - 1, 0, 1);
+}
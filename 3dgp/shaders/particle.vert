@@ -0,0 +1,35 @@
+#version 330
+
+// Uniforms: Transformation Matrices
+uniform mat4 matrixProjection;
+uniform mat4 matrixView;
+uniform mat4 matrixModelView;
+
+// Particle-specific Uniforms
+uniform vec4 pointSize = vec4(10, 5, 10, 5);	// Point size: k / distance, clamped to max - k and max at birth, then k and max at death
+uniform float pointScale = 1;					// Point size scale - less in a reduced resolution pass (see C3dglOffscreenParticles)
+
+// Particle State (see C3dglParticles)
+layout (location = 0) in vec3 aPosition;
+layout (location = 1) in vec3 aVelocity;
+layout (location = 2) in float aAge;
+layout (location = 3) in float aLifetime;
+
+// Output Variable (sent to Fragment Shader)
+out float age;									// age of the particle (0..1)
+out vec4 position;								// needed to determine the size of a droplet
+
+void main()
+{
+	age = clamp(aAge / aLifetime, 0, 1);
+
+	// calculate position (normal calculation not applicable here)
+	position = matrixModelView * vec4(aPosition, 1.0);
+	gl_Position = matrixProjection * position;
+
+	float d = length(position);
+	float minSize = clamp(pointSize.x / d, 1, pointSize.y);
+	float maxSize = clamp(pointSize.z / d, 1, pointSize.w);
+
+	gl_PointSize = mix(minSize, maxSize, age) * pointScale;
+}
@@ -0,0 +1,62 @@
+#version 330
+
+// Composition of the reduced resolution particle pass (see C3dglOffscreenParticles): the particles
+// are upsampled bilinearly where the four low resolution pixels around are at the depth of the scene
+// pixel; at the depth edges, the one of the 3x3 around nearest in depth is taken instead - so that
+// the particles behind an object do not bleed over its silhouette
+
+uniform sampler2D particleMap;					// Low resolution particles, premultiplied alpha
+uniform sampler2D lowDepthMap;					// Low resolution depth (see particle_depth.frag)
+uniform sampler2D depthMap;						// Full resolution scene depth
+uniform vec2 clipPlanes;						// Near and far clipping planes - to linearise the depths
+uniform float depthThreshold = 0.1;				// Relative difference of depths taken as an edge
+
+in vec2 texCoord;
+out vec4 outColor;
+
+float linearDepth(float d)
+{
+	return clipPlanes.x * clipPlanes.y / (clipPlanes.y - d * (clipPlanes.y - clipPlanes.x));
+}
+
+void main()
+{
+	float depth = linearDepth(texelFetch(depthMap, ivec2(gl_FragCoord.xy), 0).r);
+
+	// the four low resolution pixels around, with their bilinear weights
+	ivec2 size = textureSize(particleMap, 0);
+	vec2 p = texCoord * vec2(size) - 0.5;
+	ivec2 p0 = ivec2(floor(p));
+	vec2 f = p - vec2(p0);
+
+	vec4 bilinear = vec4(0);
+	bool edge = false;
+	for (int i = 0; i < 4; i++)
+	{
+		ivec2 offset = ivec2(i & 1, i >> 1);
+		ivec2 q = clamp(p0 + offset, ivec2(0), size - 1);
+		vec2 w = mix(1 - f, f, vec2(offset));
+		bilinear += texelFetch(particleMap, q, 0) * w.x * w.y;
+		edge = edge || abs(linearDepth(texelFetch(lowDepthMap, q, 0).r) - depth) > depthThreshold * depth;
+	}
+	if (!edge)
+	{
+		outColor = bilinear;
+		return;
+	}
+
+	// at an edge: the pixel nearest in depth, out of the 3x3 around - the four above may all be across the edge
+	ivec2 c = ivec2(texCoord * vec2(size));
+	float nearestDiff = 1e30;
+	for (int y = -1; y <= 1; y++)
+		for (int x = -1; x <= 1; x++)
+		{
+			ivec2 q = clamp(c + ivec2(x, y), ivec2(0), size - 1);
+			float diff = abs(linearDepth(texelFetch(lowDepthMap, q, 0).r) - depth);
+			if (diff < nearestDiff)
+			{
+				nearestDiff = diff;
+				outColor = texelFetch(particleMap, q, 0);
+			}
+		}
+}
@@ -0,0 +1,21 @@
+#version 330
+
+// Depth downsampling for the reduced resolution particle pass (see C3dglOffscreenParticles):
+// each low resolution pixel takes the farthest depth of the full resolution pixels it covers,
+// so that no particle is hidden by an edge it is only partly behind
+
+uniform sampler2D depthMap;						// Full resolution scene depth
+uniform vec2 scale;								// Full resolution pixels per low resolution pixel
+
+void main()
+{
+	ivec2 size = textureSize(depthMap, 0);
+	ivec2 p0 = ivec2(floor((gl_FragCoord.xy - 0.5) * scale));
+	ivec2 p1 = min(ivec2(ceil((gl_FragCoord.xy + 0.5) * scale)), size);
+
+	float depth = 0;
+	for (int y = p0.y; y < p1.y; y++)
+		for (int x = p0.x; x < p1.x; x++)
+			depth = max(depth, texelFetch(depthMap, ivec2(x, y), 0).r);
+	gl_FragDepth = depth;
+}
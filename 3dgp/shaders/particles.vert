@@ -0,0 +1,127 @@
+#version 330
+
+// Particle update pass (transform feedback, see C3dglParticles): one vertex per particle,
+// the live particles first, then the new ones (gl_VertexID >= liveCount)
+
+// Simulation Uniforms
+uniform float deltaTime;					// Time step, in seconds
+uniform int liveCount;						// Live particles in the input buffer
+uniform uint emitIndex;						// Particles emitted so far - numbers the new particles
+uniform uint randomSeed;
+
+// Emitter Uniforms
+uniform vec3 emitterPos;					// The box the particles are born in: emitterPos .. emitterPos + emitterSize
+uniform vec3 emitterSize;
+uniform vec3 emitterDir;					// Direction of the initial velocity
+uniform float emitterSpread;				// Half-angle of the cone around emitterDir, in radians
+uniform vec2 emitterSpeed;					// Min and max initial speed
+uniform vec2 emitterLifetime;				// Min and max lifetime
+
+// Forces
+uniform vec3 gravity;						// Acceleration
+uniform vec3 wind;							// Wind velocity
+uniform float drag;							// Rate at which the particle velocity approaches the wind velocity
+
+// Terrain Collisions
+uniform int collision = 0;					// 0 = none, 1 = kill, 2 = stick, 3 = slide (see C3dglParticles::COLLISION)
+uniform sampler2D heightMap;				// 16-bit heights, s along z and t along x
+uniform vec2 heightRange;					// height offset and range - to dequantise the heights
+
+// Particle State
+layout (location = 0) in vec3 aPosition;
+layout (location = 1) in vec3 aVelocity;
+layout (location = 2) in float aAge;
+layout (location = 3) in float aLifetime;
+
+// Output Variables (sent to the Geometry Shader, which drops the dead particles)
+out vec3 vPosition;
+out vec3 vVelocity;
+out float vAge;
+out float vLifetime;
+
+// Random number in [0, 1) - the attribute i of the new particle n
+uint hash(uint x)
+{
+	x ^= x >> 16; x *= 0x7feb352du;
+	x ^= x >> 15; x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+float random(uint n, uint i)
+{
+	return float(hash(hash(n + randomSeed) + i) >> 8) / 16777216.0;
+}
+
+// Terrain height, bilinear between the grid points (the model x, z are centred on the height map)
+float height(ivec2 g)
+{
+	g = clamp(g, ivec2(0), textureSize(heightMap, 0).yx - 1);
+	return heightRange.x + texelFetch(heightMap, g.yx, 0).r * heightRange.y;
+}
+float terrainHeight(vec2 xz)
+{
+	vec2 g = xz + vec2(textureSize(heightMap, 0).yx / 2);
+	ivec2 g0 = ivec2(floor(g));
+	vec2 f = g - vec2(g0);
+	return mix(mix(height(g0), height(g0 + ivec2(0, 1)), f.y), mix(height(g0 + ivec2(1, 0)), height(g0 + ivec2(1, 1)), f.y), f.x);
+}
+
+void main()
+{
+	vec3 pos = aPosition;
+	vec3 vel = aVelocity;
+	float age = aAge;
+	float lifetime = aLifetime;
+	float dt = deltaTime;
+
+	if (gl_VertexID >= liveCount)
+	{
+		// a new particle: born at a random moment within the time step
+		uint n = emitIndex + uint(gl_VertexID - liveCount);
+		pos = emitterPos + emitterSize * vec3(random(n, 0u), random(n, 1u), random(n, 2u));
+
+		// the direction within the cone: theta from emitterDir, phi around it
+		vec3 w = normalize(emitterDir);
+		vec3 u = normalize(cross(abs(w.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0), w));
+		vec3 v = cross(w, u);
+		float theta = emitterSpread * random(n, 3u);
+		float phi = 6.2831853 * random(n, 4u);
+		vec3 dir = cos(theta) * w + sin(theta) * (cos(phi) * u + sin(phi) * v);
+		vel = dir * mix(emitterSpeed.x, emitterSpeed.y, random(n, 5u));
+
+		age = 0;
+		lifetime = mix(emitterLifetime.x, emitterLifetime.y, random(n, 6u));
+		dt *= random(n, 7u);
+	}
+
+	// integration
+	vel += (gravity + (wind - vel) * drag) * dt;
+	pos += vel * dt;
+	age += dt;
+
+	// terrain collision
+	if (collision != 0)
+	{
+		float h = terrainHeight(pos.xz);
+		if (pos.y < h)
+		{
+			if (collision == 1)
+				age = lifetime;							// killed
+			else if (collision == 2)
+			{
+				pos.y = h;								// stuck until its lifetime ends
+				vel = vec3(0);
+			}
+			else
+			{
+				pos.y = h;								// slides along the surface
+				vel.y = max(vel.y, 0);
+			}
+		}
+	}
+
+	vPosition = pos;
+	vVelocity = vel;
+	vAge = age;
+	vLifetime = lifetime;
+}
@@ -9,19 +9,39 @@ uniform mat4 matrixModelView;
 uniform vec3 initialPos = vec3(0, 0, 0);		// Initial Position (source of the fountain)
 uniform vec3 gravity = vec3(0.0, -0.05, 0.0);	// Gravity Acceleration in world coords
 uniform float particleLifetime;					// Max Particle Lifetime
+uniform float particlePeriod;					// Emission period - the "birth" time of a particle is gl_VertexID * particlePeriod
+uniform uint randomSeed;						// Seed of the particle attributes
 uniform float time;								// Animation Time
-
-// Special Vertex Attributes
-layout (location = 0) in vec3 aVelocity;		// Particle initial velocity
-layout (location = 1) in float aStartTime;		// Particle "birth" time
+uniform float pointScale = 1;					// Point size scale - less in a reduced resolution pass (see C3dglOffscreenParticles)
 
 // Output Variable (sent to Fragment Shader)
 out float age;									// age of the particle (0..1)
 
+// Random number in [0, 1) - the attribute i of the particle gl_VertexID
+// (no vertex attributes: every particle is regenerated from its index)
+uint hash(uint x)
+{
+	x ^= x >> 16; x *= 0x7feb352du;
+	x ^= x >> 15; x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+float random(uint i)
+{
+	return float(hash(hash(uint(gl_VertexID) + randomSeed) + i) >> 8) / 16777216.0;
+}
+
 void main()
 {
-	float t = mod(time - aStartTime, particleLifetime);
-	vec3 pos = initialPos + aVelocity * t + gravity * t * t; 
+	// particle attributes: a random direction up to 120 degrees from the vertical
+	float theta = 3.14159265 / 1.5 * random(0u);
+	float phi = 2 * 3.14159265 * random(1u);
+	float v = 0.1 + 0.1 * random(2u);
+	vec3 velocity = v * vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+	float startTime = gl_VertexID * particlePeriod;
+
+	float t = mod(time - startTime, particleLifetime);
+	vec3 pos = initialPos + velocity * t + gravity * t * t; 
 	age = t / particleLifetime;
 
 	// calculate position (normal calculation not applicable here)
@@ -31,5 +51,5 @@ void main()
 	float minSize = clamp(20 / length(position), 1, 10);
 	float maxSize = clamp(1000 / length(position), 1, 500);
 
-	gl_PointSize = mix(minSize, maxSize, age);
+	gl_PointSize = mix(minSize, maxSize, age) * pointScale;
 }
@@ -17,6 +17,17 @@ uniform vec3 waterColor;
 
 //View Matrix
 uniform mat4 matrixView;
+uniform mat4 matrixModelView;
+
+//Normal Mapping (the decimated mesh)
+uniform int normalMapping = 0;		//1 if the normals are read from the normal map
+uniform sampler2D normalMap;		//x and z of the normal vector, s along z and t along x
+in vec2 gridCoord;					//height map grid coordinates
+vec3 surfaceNormal;					//the normal used for lighting - interpolated or from the normal map
+
+//Light Mapping (baked by the terrain)
+uniform int lightMapping = 0;		//1 if the directional light and the ambient occlusion are read from the light map
+uniform sampler2D lightMap;			//ambient occlusion and sun light (N.L, 0 in shadow), s along z and t along x
 
 // Input Variables (received from Vertex Shader)
 in vec4 color;
@@ -68,12 +79,12 @@ vec4 PointLight(POINT light)
 	vec4 color = vec4(0, 0, 0, 0);
 
 	vec3 L = normalize(matrixView * vec4(light.position,1) - position).xyz;
-	float NdotL = dot(normal, L);
+	float NdotL = dot(surfaceNormal, L);
 	if (NdotL > 0)
 		color += vec4(materialDiffuse * light.diffuse, 1) * NdotL;
 
 	vec3 V = normalize(-position.xyz);
-	vec3 R = reflect(-L, normal);
+	vec3 R = reflect(-L, surfaceNormal);
 	float RdotV = dot(R, V);
 
 	if(NdotL > 0 && RdotV > 0)
@@ -96,7 +107,7 @@ vec4 DirectionalLight(DIRECTIONAL light)
 	// Calculate Directional Light
 	vec4 color = vec4(0, 0, 0, 0);
 	vec3 L = normalize(mat3(matrixView) * light.direction);
-	float NdotL = dot(normal, L);
+	float NdotL = dot(surfaceNormal, L);
 	if (NdotL > 0)
 		color += vec4(materialDiffuse * light.diffuse, 1) * NdotL;
 	return color;
@@ -106,11 +117,29 @@ void main(void)
 {
 	outColor = color;
 
+	//Normal Mapping
+	surfaceNormal = normal;
+	if (normalMapping == 1)
+	{
+		vec2 n = texture(normalMap, (gridCoord.yx + 0.5) / vec2(textureSize(normalMap, 0))).rg * 2 - 1;
+		surfaceNormal = normalize(mat3(matrixModelView) * vec3(n.x, sqrt(max(1 - dot(n, n), 0.0)), n.y));
+	}
+
+	//Light Mapping: the ambient occlusion darkens the ambient light
+	vec2 baked = vec2(1, 0);
+	if (lightMapping == 1)
+	{
+		baked = texture(lightMap, (gridCoord.yx + 0.5) / vec2(textureSize(lightMap, 0))).rg;
+		outColor.rgb *= baked.r;
+	}
+
 	//Point Lights
 	if(lightPoint1.on == 1) 
 		outColor += PointLight(lightPoint1);
 	
-	if (lightDir.on == 1) 
+	if (lightDir.on == 1 && lightMapping == 1)
+		outColor += vec4(materialDiffuse * lightDir.diffuse, 1) * baked.g;
+	else if (lightDir.on == 1) 
 		outColor += DirectionalLight(lightDir);
 
 	//multitexturing
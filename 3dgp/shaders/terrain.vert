@@ -22,8 +22,31 @@ out float snowDepth; //snow depth (positive for under snow end, negative for abo
 //Uniform: Fog Density
 uniform float fogDensity;
 
-layout (location = 0) in vec3 aVertex;
-layout (location = 2) in vec3 aNormal;
+//Uniforms: Level of Detail (geomorphing)
+uniform int lodLevel = -1;		//LOD level of the chunks being rendered, -1 if not morphing
+uniform vec2 lodMorphRange;		//distances where morphing towards the next level starts and ends
+uniform vec3 lodCameraPos;		//camera position in model coordinates
+uniform vec2 lodGridOffset;		//converts model x, z into height map grid coordinates
+
+//Uniforms: Compact Vertex Format
+uniform int compactVertices = 0;	//1 if the vertices are in the compact format
+uniform int compactSizeZ;			//height map size along z - to find the grid position from the vertex index
+uniform vec2 compactOffset;			//converts height map grid coordinates into model x, z
+uniform vec2 compactHeight;			//height offset and range - to dequantise the heights
+
+//Uniforms: Displacement (a shared grid patch displaced with the height texture)
+uniform int displacement = 0;		//1 if the vertices are displaced
+uniform sampler2D displacementMap;	//16-bit heights, s along z and t along x
+uniform ivec2 displacementOrigin;	//grid coordinates of the first vertex of the patch
+uniform vec2 displacementHeight;	//height offset and range - to dequantise the heights
+
+//Uniforms: Normal and Light Mapping (read by the fragment shader)
+uniform vec2 gridOffset;			//converts model x, z into height map grid coordinates
+out vec2 gridCoord;					//height map grid coordinates
+
+layout (location = 0) in vec3 aVertex;	//compact format: normalised height and morph target height; displacement: x, z within the patch
+layout (location = 1) in float aMorphHeight;	//height of the surface at the next coarser level
+layout (location = 2) in vec3 aNormal;	//compact format: octahedral encoded normal
 layout (location = 3) in vec2 aTexCoord;
 
 out vec4 color;
@@ -70,26 +93,96 @@ vec4 AmbientLight(AMBIENT light)
 	return vec4(materialAmbient * light.color, 1);
 }
 
+//Compact Vertex Format: Octahedral Normal Decoding
+vec3 OctDecode(vec2 e)
+{
+	vec3 n = vec3(e.x, 1 - abs(e.x) - abs(e.y), e.y);
+	if (n.y < 0)
+		n.xz = (1 - abs(n.zx)) * vec2(n.x >= 0 ? 1 : -1, n.z >= 0 ? 1 : -1);
+	return normalize(n);
+}
+
+//Displacement: height at the grid point g (clamped to the height map)
+float DisplacementHeight(ivec2 g)
+{
+	g = clamp(g, ivec2(0), textureSize(displacementMap, 0).yx - 1);
+	return displacementHeight.x + texelFetch(displacementMap, g.yx, 0).r * displacementHeight.y;
+}
+
 void main(void) 
 {
+	//decode the vertex
+	vec3 inVertex = aVertex;
+	vec3 inNormal = aNormal;
+	vec2 inTexCoord = aTexCoord;
+	float inMorphHeight = aMorphHeight;
+	if (compactVertices == 1)
+	{
+		//x and z are found from the vertex index, texture coordinates are derived from x and z
+		int x = gl_VertexID / compactSizeZ;
+		int z = gl_VertexID - x * compactSizeZ;
+		inVertex = vec3(float(x) - compactOffset.x, compactHeight.x + aVertex.x * compactHeight.y, float(z) - compactOffset.y);
+		inMorphHeight = compactHeight.x + aVertex.y * compactHeight.y;
+		inNormal = OctDecode(aNormal.xy);
+		inTexCoord = inVertex.xz / 2;
+	}
+	else if (displacement == 1)
+	{
+		//the height and the normal are read from the height texture, the morph target is interpolated from the coarser level
+		ivec2 g = ivec2(aVertex.xy) + displacementOrigin;
+		ivec2 centre = textureSize(displacementMap, 0).yx / 2;
+		inVertex = vec3(vec2(g - centre), DisplacementHeight(g)).xzy;
+		float dx = DisplacementHeight(g + ivec2(1, 0)) - DisplacementHeight(g - ivec2(1, 0));
+		float dz = DisplacementHeight(g + ivec2(0, 1)) - DisplacementHeight(g - ivec2(0, 1));
+		inNormal = normalize(vec3(-dx, 2, -dz));
+		inTexCoord = inVertex.xz / 2;
+		inMorphHeight = inVertex.y;
+		if (lodLevel >= 0)
+		{
+			int s = 1 << lodLevel;
+			bool oddX = g.x % (2 * s) != 0;
+			bool oddZ = g.y % (2 * s) != 0;
+			if (oddX && oddZ)
+				inMorphHeight = (DisplacementHeight(g + ivec2(-s, s)) + DisplacementHeight(g + ivec2(s, -s))) / 2;
+			else if (oddX)
+				inMorphHeight = (DisplacementHeight(g - ivec2(s, 0)) + DisplacementHeight(g + ivec2(s, 0))) / 2;
+			else if (oddZ)
+				inMorphHeight = (DisplacementHeight(g - ivec2(0, s)) + DisplacementHeight(g + ivec2(0, s))) / 2;
+		}
+	}
+
+	//geomorphing: vertices that disappear at the next LOD level gradually move onto the coarser surface
+	vec3 vertex = inVertex;
+	if (lodLevel >= 0)
+	{
+		vec2 grid = inVertex.xz + lodGridOffset;
+		float step = exp2(float(lodLevel + 1));
+		if (mod(grid.x, step) != 0 || mod(grid.y, step) != 0)
+		{
+			float morph = clamp((distance(inVertex, lodCameraPos) - lodMorphRange.x) / (lodMorphRange.y - lodMorphRange.x), 0, 1);
+			vertex.y = mix(inVertex.y, inMorphHeight, morph);
+		}
+	}
+
 	// calculate depth of water
-	waterDepth = waterLevel - aVertex.y;
+	waterDepth = waterLevel - vertex.y;
 
 	//calculate depth of grass
-	grassDepth = grassLevel - aVertex.y;
+	grassDepth = grassLevel - vertex.y;
 
 	//calculate depth of snow
-	snowDepth = snowLevel - aVertex.y;
+	snowDepth = snowLevel - vertex.y;
 
 	// calculate position
-	position = matrixModelView * vec4(aVertex, 1.0);
+	position = matrixModelView * vec4(vertex, 1.0);
 	gl_Position = matrixProjection * position;
 
 	// calculate normal
-	normal = normalize(mat3(matrixModelView) * aNormal);
+	normal = normalize(mat3(matrixModelView) * inNormal);
 
 	// calculate texture coordinate
-	texCoord0 = aTexCoord;
+	texCoord0 = inTexCoord;
+	gridCoord = inVertex.xz + gridOffset;
 
 	//calculate fog factor
 	fogFactor = exp2(-fogDensity * length(position));
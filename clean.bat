@@ -5,4 +5,5 @@ rmdir /S /Q Debug
 rmdir /S /Q Release
 rmdir /S /Q 3dgp\Debug
 rmdir /S /Q 3dgp\Release
+del /Q 3dgp\models\*.meshcache
 echo Done...